@@ -1,361 +1,1404 @@
-#include "fat12.h"
-
-#include <fuse.h>
-#include <stdio.h>
-#include <errno.h>
-#include <sys/types.h>
-#include <dirent.h>
-#include <stdlib.h>
-#include <string.h>
-#include <unistd.h>
-#include <sys/fsuid.h>
-
-/* read_unsigned_le: Reads a little-endian unsigned integer number
-   from buffer, starting at position.
-   
-   Parameters:
-     buffer: memory position of the buffer that contains the number to
-             be read.
-     position: index of the initial position within the buffer where
-               the number is to be found.
-     num_bytes: number of bytes used by the integer number within the
-                buffer. Cannot exceed the size of an int.
-   Returns:
-     The unsigned integer read from the buffer.
- */
-unsigned int read_unsigned_le(const char *buffer, int position, int num_bytes) {
-  long number = 0;
-  while (num_bytes-- > 0) {
-    number = (number << 8) | (buffer[num_bytes + position] & 0xff);
-  }
-  return number;
-}
-
-/* open_volume_file: Opens the specified file and reads the initial
-   FAT12 data contained in the file, including the boot sector, file
-   allocation table and root directory.
-   
-   Parameters:
-     filename: Name of the file containing the volume data.
-   Returns:
-     A pointer to a newly allocated fat12volume data structure with
-     all fields initialized according to the data in the volume file,
-     or NULL if the file is invalid, data is missing, or the file is
-     smaller than necessary.
- */
-fat12volume *open_volume_file(const char *filename) {
-  // open the file,intitialize the buffer 
-  // create space for the buffer, fread the data into the buffer to use
-  FILE * fatd = fopen(filename, "r");
-  char* buff = (char*) malloc(BOOT_SECTOR_SIZE);
-  struct fat12volume *fat = malloc(sizeof(struct fat12volume));
-  fread(buff, BOOT_SECTOR_SIZE, 1, fatd);
-
-  if (buff != NULL){
-
-    fat->volume_file = fatd;
-    
-    fat->sector_size = read_unsigned_le(buff, 11, 2);
-
-    fat->cluster_size = read_unsigned_le(buff, 13, 1);
-
-    fat->reserved_sectors = read_unsigned_le(buff, 14, 2);
-
-    fat->hidden_sectors = read_unsigned_le(buff, 28, 2);
-
-    fat->fat_num_sectors = read_unsigned_le(buff, 22, 2);
-
-    fat->fat_copies = read_unsigned_le(buff, 16 , 1);
-
-    fat->fat_offset = fat->reserved_sectors + fat->rootdir_num_sectors * fat->fat_copies;
-
-    read_sectors(fat, 1, fat->fat_num_sectors, &fat->fat_array);
-
-    fat->rootdir_offset = fat->reserved_sectors + fat->fat_num_sectors * fat->fat_copies;
-
-    fat->rootdir_entries = read_unsigned_le(buff, 17 , 2);
-
-    fat->rootdir_num_sectors  = (fat->rootdir_entries * 32 / fat->sector_size);
-
-    read_sectors(fat, fat->rootdir_offset, fat->rootdir_num_sectors, &fat->rootdir_array);
-
-    fat->cluster_offset = fat->fat_offset + fat->rootdir_num_sectors - (2 * fat->cluster_size/fat->sector_size);
-
-    return fat;
-  }
-
-  return NULL;
-
-}
-
-/* close_volume_file: Frees and closes all resources used by a FAT12 volume.
-   
-   Parameters:
-     volume: pointer to volume to be freed.
- */
-void close_volume_file(fat12volume *volume) {
-  
-  //free buffers before closing volume
-  free(&volume->fat_array);
-  free(&volume->rootdir_array);
-  fclose(volume);
-}
-
-/* read_sectors: Reads one or more contiguous sectors from the volume
-   file, saving the data in a newly allocated memory space. The caller
-   is responsible for freeing the buffer space returned by this
-   function.
-   
-   Parameters:
-     volume: pointer to FAT12 volume data structure.
-     first_sector: number of the first sector to be read.
-     num_sectors: number of sectors to read.
-     buffer: address of a pointer variable that will store the
-             allocated memory space.
-   Returns:
-     In case of success, it returns the number of bytes that were read
-     from the set of sectors. In that case *buffer will point to a
-     malloc'ed space containing the actual data read. If there is no
-     data to read (e.g., num_sectors is zero, or the sector is at the
-     end of the volume file, or read failed), it returns zero, and
-     *buffer will be undefined.
- */
-
-
-int read_sectors(fat12volume *volume, unsigned int first_sector,
-		 unsigned int num_sectors, char **buffer) {
-  
-
-  // initialize the buffer and fread the volume_file into the buffer
-  *buffer = (char*) malloc(num_sectors * volume->sector_size);
-  fseek(volume->volume_file, first_sector * volume->sector_size, SEEK_SET);
-  int ret = fread(*buffer, volume->sector_size, num_sectors, volume->volume_file);
-  rewind(volume->volume_file);
-
-
-  if (*buffer == NULL || num_sectors == 0) {
-    return 0;
-  } else {
-    return ret;
-  }
-}
-
-/* read_cluster: Reads a specific data cluster from the volume file,
-   saving the data in a newly allocated memory space. The caller is
-   responsible for freeing the buffer space returned by this
-   function. Note that, in most cases, the implementation of this
-   function involves a single call to read_sectors with appropriate
-   arguments.
-   
-   Parameters:
-     volume: pointer to FAT12 volume data structure.
-     cluster: number of the cluster to be read (the first data cluster
-              is numbered two).
-     buffer: address of a pointer variable that will store the
-             allocated memory space.
-   Returns:
-     In case of success, it returns the number of bytes that were read
-     from the cluster. In that case *buffer will point to a malloc'ed
-     space containing the actual data read. If there is no data to
-     read (e.g., the cluster is at the end of the volume file), it
-     returns zero, and *buffer will be undefined.
- */
-int read_cluster(fat12volume *volume, unsigned int cluster, char **buffer) {
-
-  /* TO BE COMPLETED BY THE STUDENT */
-  return read_sectors(volume->volume_file, volume->cluster_offset + (volume->cluster_size*volume->sector_size), volume->cluster_size, buffer);
-}
-
-/* get_next_cluster: Finds, in the file allocation table, the number
-   of the cluster that follows the given cluster.
-   
-   Parameters:
-     volume: pointer to FAT12 volume data structure.
-     cluster: number of the cluster to seek.
-   Returns:
-     Number of the cluster that follows the given cluster (i.e., whose
-     data is the sequence to the data of the current cluster). Returns
-     0 if the given cluster is not in use, or a number larger than or
-     equal to 0xff8 if the given cluster is the last cluster in a
-     file.
- */
-unsigned int get_next_cluster(fat12volume *volume, unsigned int cluster) {
-  unsigned char entry[2];
-  uint32_t new_cluster;
-  // if cluster is odd valued, last half of the array 
-    if (cluster % 2){
-      for (int i= 0; i<cluster; i++){
-       entry[0] = &volume[volume->fat_offset + ((cluster/2)*3)];
-       entry[1] = &volume[volume->fat_offset + ((cluster/2)*3) +1];
-       new_cluster = &entry[0];
-       new_cluster = new_cluster>>4;
-      }
-    }
-  // cluster is even in this case, first half of array
-    else{
-      for (int i = 0; i<cluster; i++){
-      entry[0] = &volume[volume->fat_offset + ((cluster/2)*3)];
-      entry[1] = &volume[volume->fat_offset + ((cluster/2)*3) +1];
-      entry[1] = entry[1]&0x0f;
-      new_cluster = &entry[0];
-      }
-   }
-
-  return 0;
-}
-
-/* fill_directory_entry: Reads the directory entry from a
-   FAT12-formatted directory and assigns its attributes to a dir_entry
-   data structure.
-   
-   Parameters:
-     data: pointer to the beginning of the directory entry in FAT12
-           format. This function assumes that this pointer is at least
-           DIR_ENTRY_SIZE long.
-     entry: pointer to a dir_entry structure where the data will be
-            stored.
- */
-void fill_directory_entry(const char *data, dir_entry *entry) {
-
-  /* TO BE COMPLETED BY THE STUDENT */
-  /* OBS: Note that the way that FAT12 represents a year is different
-     than the way used by mktime and 'struct tm' to represent a
-     year. In particular, both represent it as a number of years from
-     a starting year, but the starting year is different between
-     them. Make sure to take this into account when saving data into
-     the entry. */
-
-  int i = 0;
-  while (1) {
-    // at the end of the filename, add a NULL
-    if (i == 11) {
-      entry->filename[i + 1] = NULL;
-      break;
-    }
-    // if we reach spaces, its time to add a dot, and move to the 9th byte (where extension is)
-    if (data[i] == " ") {
-      entry->filename[i] = ".";
-      i = 9;                  
-    }
-    entry->filename[i] = data[i];     // add next char to filename array
-    i++;                              // increment i     
-  }
-
-  int mask_sec = 0x1f;      // hexidecimal value to mask seconds  
-  int mask_min = 0x7e0;     // hexidecimal value to mask minutes     
-  int mask_mon = 0x1e0;     // hexidecimal value to mask months
-  int mask_day = 0x1f;      // hexidecimal value to mask days
-  // jump to the specific bytes the contain the information we need for time
-  int tempTime = read_unsigned_le(data, 22, 2);
-  // jump to the specific bytes the contain the information we need for time
-  int tempDate = read_unsigned_le(data, 24, 2);
-  // update the values of the struct by masking and shifting values to the 
-  // correct spots given in the data
-  struct tm newStruct = {
-    .tm_sec = (tempTime & mask_sec) * 2,
-	  .tm_min = (tempTime & mask_min) >> 5,
-	  .tm_hour = tempTime >> 11,
-	  .tm_mday = (tempDate & mask_day),
-	  .tm_mon = (tempDate & mask_mon) >> 5,
-	  .tm_year = (tempDate >> 9) + 80         // FAT 1980 vs mktime 1900 starts
-  };
-
-  entry->ctime = newStruct;
-  
-  entry->size = read_unsigned_le(data, 28, 4);
-
-  entry->first_cluster = read_unsigned_le(data, 26, 2);
-
-  entry->is_directory = (entry->size == 0) ? 1 : 0; // if size is 0, then it must be a directory
-
-}
-
-/* find_directory_entry: finds the directory entry associated to a
-   specific path.
-   
-   Parameters:
-     volume: Pointer to FAT12 volume data structure.
-     path: Path of the file to be found. Will always start with a
-           forward slash (/). Path components (e.g., subdirectories)
-           will be delimited with "/". A path containing only "/"
-           refers to the root directory of the FAT12 volume.
-     entry: pointer to a dir_entry structure where the data associated
-            to the path will be stored.
-   Returns:
-     In case of success (the provided path corresponds to a valid
-     file/directory in the volume), the function will fill the data
-     structure entry with the data associated to the path and return
-     0. If the path is not a valid file/directory in the volume, the
-     function will return -ENOENT, and the data in entry will be
-     undefined. If the path contains a component (except the last one)
-     that is not a directory, it will return -ENOTDIR, and the data in
-     entry will be undefined.
- */
-int find_directory_entry(fat12volume *volume, const char *path, dir_entry *entry) {
-  
-  /* TO BE COMPLETED BY THE STUDENT */
-  /* OBS: In the specific case where the path corresponds to the root
-     directory ("/"), this function should fill the entry with
-     information for the root directory, but this entry will not be
-     based on a proper entry in the volume, since the root directory
-     is not obtained from such an entry. In particular, the date/time
-     for the root directory can be set to Unix time 0 (1970-01-01 0:00
-     GMT). */
-  // // char* fileEntry = (char*) malloc(DIR_ENTRY_SIZE);
-
-  // *********************************************************************
-  // ***** CODE HERE IS COMMENTED OUT BECAUSE OF A SEGFAULT WE COULD *****
-  // *****  NOT DIAGNOSE BEFORE THE DEADLINE, BUT LEFT COMMENTS FOR  *****
-  // *****     OUR THOUGHT PROCESS AND LOGIC IN THIS FUNCTION        *****
-  // *********************************************************************
-  
-  // // count the number of / to find how many strings in total there are 
-  // int slash_counter = 0;
-  // for (int b = 0; b<strlen(path); b++){
-  //   if (path[b] == "/"){
-  //     slash_counter++;
-  //   }
-  // }
-  
-  // // use strtok to remove the /'s, and put each level into an array
-  // char *po = strtok(path, "/");
-  // char *path_array[slash_counter];
-  // int a = 0;
-  
-  // while (po != NULL){
-  //   path_array[a++] = po;
-  //   po = strtok (NULL, "/");        
-  // }
- 
-  // int i = 0;
-  // int p = 0;
-
-  // while (1) {
-  //   int numEntries = volume->rootdir_entries; // get total num of entries
-
-  //   // if i > num entries, reset i to 0, and if p > path array, file not found
-  //   if (i > numEntries) {
-  //     i = 0;
-  //     if (p > path_array[p]) {
-  //       return -ENOENT;                
-  //     }
-  //     p++;  // otherwise increment p and look into the next subdirectory 
-  //   }        
-                
-  //   fill_directory_entry(volume->rootdir_array[i * DIR_ENTRY_SIZE], entry); // fill directory entry with i indexed rootdir_array
-
-  //   // if the entry filename is the same as the current path, and its not a subdirectory, we have found the correct file, and return 0
-  //   if (entry->filename == path[p]) {
-  //     if (!entry->is_directory) {
-  //       return 0;        
-  //     }
-  //     // otherwise, it is a subdirectory, which means we need to keep looking, so we update the rootdir_array to the next subdirectory
-  //     read_cluster(volume, entry->first_cluster, &volume->rootdir_array);
-  //   }     
-
-  //   i++;  // increment i, so we can look through each rootdir_array entry       
-            
-  // }  
-    return -ENOENT;
-}
-
+#include "fat12.h"
+#include "fat12dcache.h"
+#include "fat12cache.h"
+#include "fat12stats.h"
+#include "fat12trace.h"
+#include "fat12pool.h"
+#include "fat12write.h"
+#include "fat12check.h"
+#include "fat12meta.h"
+
+#include <fuse.h>
+#include <stdio.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <sys/fsuid.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+static int decode_fat(fat12volume *volume);
+
+/* Last identifier assigned to an open volume */
+static unsigned int last_volume_id;
+
+/* read_unsigned_le: Reads a little-endian unsigned integer number
+   from buffer, starting at position.
+   
+   Parameters:
+     buffer: memory position of the buffer that contains the number to
+             be read.
+     position: index of the initial position within the buffer where
+               the number is to be found.
+     num_bytes: number of bytes used by the integer number within the
+                buffer. Cannot exceed the size of an int.
+   Returns:
+     The unsigned integer read from the buffer.
+ */
+unsigned int read_unsigned_le(const char *buffer, int position, int num_bytes) {
+  long number = 0;
+  while (num_bytes-- > 0) {
+    number = (number << 8) | (buffer[num_bytes + position] & 0xff);
+  }
+  return number;
+}
+
+/* pread_full: Reads data from a specific position of a file, retrying
+   after interrupted calls and short reads. Since the file position is
+   neither used nor modified, it is safe to call this function
+   concurrently on the same file descriptor.
+   
+   Parameters:
+     fd: file descriptor to read from.
+     buffer: memory position where the data will be stored.
+     length: number of bytes to read.
+     offset: position in the file of the first byte to be read.
+   Returns:
+     The number of bytes read, which is smaller than length only if
+     the end of the file was reached, or -1 in case of error.
+ */
+static ssize_t pread_full(int fd, char *buffer, size_t length, off_t offset) {
+  size_t done = 0;
+  ssize_t rv;
+
+  while (done < length) {
+    rv = pread(fd, buffer + done, length - done, offset + done);
+    if (rv < 0 && errno == EINTR)
+      continue;
+    if (rv < 0)
+      return -1;
+    if (rv == 0)
+      break;
+    done += rv;
+  }
+  return done;
+}
+
+/* open_volume_file: Opens the specified file and reads the initial
+   FAT12 data contained in the file, including the boot sector, file
+   allocation table and root directory. The volume file is mapped
+   into memory (see open_volume_file_flags).
+   
+   Parameters:
+     filename: Name of the file containing the volume data.
+   Returns:
+     A pointer to a newly allocated fat12volume data structure with
+     all fields initialized according to the data in the volume file,
+     or NULL if the file is invalid, data is missing, or the file is
+     smaller than necessary.
+ */
+fat12volume *open_volume_file(const char *filename) {
+  return open_volume_file_flags(filename, VOLUME_OPEN_MMAP);
+}
+
+/* open_volume_file_flags: Same as open_volume_file, but allows the
+   caller to choose how the volume file is accessed.
+   
+   Parameters:
+     filename: Name of the file containing the volume data.
+     flags: Bitwise OR of zero or more VOLUME_OPEN_* flags. If
+            VOLUME_OPEN_MMAP is set, the whole file is mapped
+            read-only into memory, and sector reads are served from
+            the mapping instead of the file pointer. If the mapping
+            cannot be created the volume silently falls back to
+            regular file reads. If VOLUME_OPEN_LAZY is set, only the
+            boot sector is read; the FAT and root directory are loaded
+            the first time they are needed (see
+            load_volume_metadata). If VOLUME_OPEN_WRITE is set, the
+            file is opened for writing too, and the volume can be
+            modified with the functions in fat12write.h; the mapping
+            (if any) stays read-only, as writes go through the file.
+            If VOLUME_OPEN_CHECK is set, the whole volume is checked
+            with check_volume (which loads its FAT and root directory
+            even if VOLUME_OPEN_LAZY is set). If VOLUME_OPEN_INDEX is
+            set and VOLUME_OPEN_WRITE is not, the metadata of the
+            volume is taken from its metadata index (see
+            meta_attach); if the index cannot be written, the volume
+            is opened as usual.
+   Returns:
+     Same as open_volume_file, and also NULL if the volume was
+     checked and has errors. Note that, for lazily opened volumes,
+     a FAT or root directory that cannot be read is only detected when
+     they are first used.
+ */
+fat12volume *open_volume_file_flags(const char *filename, int flags) {
+  // open the file, read the boot sector into a local buffer
+  int fd = open(filename, (flags & VOLUME_OPEN_WRITE) ? O_RDWR : O_RDONLY);
+  char buff[BOOT_SECTOR_SIZE];
+  struct stat st;
+  fat12volume *fat;
+  size_t data_start, data_clusters;
+  pthread_rwlockattr_t attr;
+  check_result check;
+
+  if (fd < 0)
+    return NULL;
+
+  if (pread_full(fd, buff, BOOT_SECTOR_SIZE, 0) != BOOT_SECTOR_SIZE ||
+      fstat(fd, &st) < 0 ||
+      (fat = calloc(1, sizeof(struct fat12volume))) == NULL) {
+    close(fd);
+    return NULL;
+  }
+
+  pthread_mutex_init(&fat->metadata_lock, NULL);
+  // writers must not starve behind a steady stream of readers
+  pthread_rwlockattr_init(&attr);
+  pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+  pthread_rwlock_init(&fat->update_lock, &attr);
+  pthread_rwlockattr_destroy(&attr);
+  fat->writable = (flags & VOLUME_OPEN_WRITE) ? 1 : 0;
+  fat->volume_fd = fd;
+  fat->volume_size = st.st_size;
+  fat->volume_id = __atomic_add_fetch(&last_volume_id, 1, __ATOMIC_RELAXED);
+
+  if (flags & VOLUME_OPEN_MMAP) {
+    void *map = mmap(NULL, fat->volume_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map != MAP_FAILED) {
+      madvise(map, fat->volume_size, MADV_RANDOM);
+      fat->volume_map = map;
+    }
+  }
+
+  fat->sector_size = read_unsigned_le(buff, 11, 2);
+
+  fat->cluster_size = read_unsigned_le(buff, 13, 1);
+
+  fat->reserved_sectors = read_unsigned_le(buff, 14, 2);
+
+  fat->hidden_sectors = read_unsigned_le(buff, 28, 2);
+
+  fat->fat_num_sectors = read_unsigned_le(buff, 22, 2);
+
+  fat->fat_copies = read_unsigned_le(buff, 16 , 1);
+
+  fat->rootdir_entries = read_unsigned_le(buff, 17 , 2);
+
+  if (fat->sector_size == 0 || fat->cluster_size == 0 ||
+      fat->fat_num_sectors == 0 || fat->fat_copies == 0) {
+    close_volume_file(fat);
+    return NULL;
+  }
+
+  // the first FAT copy follows the reserved sectors
+  fat->fat_offset = fat->reserved_sectors;
+
+  fat->rootdir_offset = fat->fat_offset + fat->fat_num_sectors * fat->fat_copies;
+
+  fat->rootdir_num_sectors = (fat->rootdir_entries * DIR_ENTRY_SIZE + fat->sector_size - 1) / fat->sector_size;
+
+  // data cluster #2 starts right after the root directory
+  fat->cluster_offset = fat->rootdir_offset + fat->rootdir_num_sectors - 2 * fat->cluster_size;
+
+  // two entries are packed in every three bytes of the FAT
+  fat->fat_entries = fat->fat_num_sectors * fat->sector_size * 2 / 3;
+
+  // entries beyond the end of the volume file cannot be valid clusters
+  data_start = fat->rootdir_offset + fat->rootdir_num_sectors;
+  if (fat->volume_size / fat->sector_size > data_start) {
+    data_clusters = 2 + (fat->volume_size / fat->sector_size - data_start) / fat->cluster_size;
+    if (data_clusters < fat->fat_entries)
+      fat->fat_entries = data_clusters;
+  }
+
+  if ((fat->dcache = dcache_create()) == NULL ||
+      (fat->buffers = buffer_pool_create(fat->cluster_size * fat->sector_size)) == NULL) {
+    close_volume_file(fat);
+    return NULL;
+  }
+
+  // a volume whose metadata index cannot be used is read as usual
+  if ((flags & VOLUME_OPEN_INDEX) && !fat->writable)
+    meta_attach(fat, filename);
+
+  if ((!(flags & VOLUME_OPEN_LAZY) && load_volume_metadata(fat) < 0) ||
+      ((flags & VOLUME_OPEN_CHECK) &&
+       (check_volume(fat, CHECK_DEFAULT_THREADS, &check, NULL, NULL) < 0 ||
+	check_has_errors(&check)))) {
+    close_volume_file(fat);
+    return NULL;
+  }
+
+  return fat;
+}
+
+/* load_volume_metadata: Makes sure the FAT (both in its packed form
+   and decoded) and the root directory of a volume are in memory,
+   reading them from the volume file if needed. Volumes opened
+   without VOLUME_OPEN_LAZY are loaded when they are opened; lazily
+   opened ones are loaded by the first function that needs them. It
+   is safe to call this function from several threads at once.
+   
+   Parameters:
+     volume: pointer to FAT12 volume data structure.
+   Returns:
+     0 if the metadata is in memory, -EIO if it could not be read, or
+     -ENOMEM if memory could not be allocated.
+ */
+int load_volume_metadata(fat12volume *volume) {
+
+  int rv = 0;
+
+  if (__atomic_load_n(&volume->metadata_loaded, __ATOMIC_ACQUIRE))
+    return 0;
+
+  pthread_mutex_lock(&volume->metadata_lock);
+  if (!volume->metadata_loaded) {
+    if (read_sectors(volume, volume->fat_offset, volume->fat_num_sectors, &volume->fat_array) !=
+	volume->fat_num_sectors * volume->sector_size) {
+      volume->fat_array = NULL;
+      rv = -EIO;
+    } else if (read_sectors(volume, volume->rootdir_offset, volume->rootdir_num_sectors,
+			    &volume->rootdir_array) !=
+	       volume->rootdir_num_sectors * volume->sector_size) {
+      volume->rootdir_array = NULL;
+      rv = -EIO;
+    } else {
+      rv = decode_fat(volume);
+      if (rv == 0 && volume->writable)
+	rv = init_free_map(volume);
+    }
+    
+    if (rv == 0) {
+      __atomic_store_n(&volume->metadata_loaded, 1, __ATOMIC_RELEASE);
+    } else {
+      free(volume->fat_array);
+      free(volume->rootdir_array);
+      free(volume->fat_next);
+      free(volume->fat_run);
+      free_free_map(volume);
+      volume->fat_array = volume->rootdir_array = NULL;
+      volume->fat_next = volume->fat_run = NULL;
+    }
+  }
+  pthread_mutex_unlock(&volume->metadata_lock);
+  
+  return rv;
+}
+
+/* free_volume_metadata: Frees the in-memory copies of the FAT and
+   root directory of a volume, discarding any pending changes. */
+static void free_volume_metadata(fat12volume *volume) {
+
+  pthread_mutex_lock(&volume->metadata_lock);
+  free(volume->fat_array);
+  free(volume->fat_next);
+  free(volume->fat_run);
+  free_free_map(volume);
+  free(volume->rootdir_array);
+  volume->fat_array = volume->rootdir_array = NULL;
+  volume->fat_next = volume->fat_run = NULL;
+  __atomic_store_n(&volume->metadata_loaded, 0, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&volume->metadata_lock);
+}
+
+/* release_volume_metadata: Frees the in-memory copies of the FAT and
+   root directory of a volume. They will be loaded again by the next
+   function that needs them. Pending changes to a writable volume are
+   written first; if they cannot be written, nothing is released, so
+   neither the changes nor the error (reported by the next
+   sync_volume) are lost. The caller must make sure that no other
+   thread is using the volume at the time.
+   
+   Parameters:
+     volume: pointer to FAT12 volume data structure.
+   Returns:
+     The number of bytes of memory released.
+ */
+size_t release_volume_metadata(fat12volume *volume) {
+
+  size_t size = volume_metadata_size(volume);
+  int rv;
+
+  // the metadata index is only unmapped when the volume is closed
+  if (volume->meta)
+    return 0;
+  if (volume->writable && volume->metadata_loaded && (rv = flush_volume(volume)) < 0) {
+    __atomic_store_n(&volume->write_error, rv, __ATOMIC_RELAXED);
+    return 0;
+  }
+
+  free_volume_metadata(volume);
+  return size;
+}
+
+/* volume_metadata_size: Computes the memory used by the in-memory
+   copies of the FAT and root directory of a volume.
+   
+   Parameters:
+     volume: pointer to FAT12 volume data structure.
+   Returns:
+     The number of bytes used, or zero if the metadata is not loaded.
+ */
+size_t volume_metadata_size(fat12volume *volume) {
+
+  if (!__atomic_load_n(&volume->metadata_loaded, __ATOMIC_ACQUIRE) || volume->meta)
+    return 0;
+  
+  return (size_t) volume->fat_num_sectors * volume->sector_size +
+    (size_t) volume->rootdir_num_sectors * volume->sector_size +
+    (2 * (size_t) volume->fat_entries + 1) * sizeof(uint16_t);
+}
+
+/* lock_volume: Takes the update lock of a writable volume, either
+   shared (to use its metadata, which is then guaranteed not to
+   change) or exclusive (to change it). Volumes that are not writable
+   never change, so nothing is done for them.
+   
+   Parameters:
+     volume: pointer to FAT12 volume data structure.
+     exclusive: non-zero to take the lock exclusively.
+ */
+void lock_volume(fat12volume *volume, int exclusive) {
+
+  if (!volume->writable)
+    return;
+  if (exclusive)
+    pthread_rwlock_wrlock(&volume->update_lock);
+  else
+    pthread_rwlock_rdlock(&volume->update_lock);
+}
+
+/* unlock_volume: Releases the lock taken with lock_volume.
+   
+   Parameters:
+     volume: pointer to FAT12 volume data structure.
+ */
+void unlock_volume(fat12volume *volume) {
+
+  if (volume->writable)
+    pthread_rwlock_unlock(&volume->update_lock);
+}
+
+/* close_volume_file: Frees and closes all resources used by a FAT12
+   volume. Pending changes to a writable volume are written first;
+   callers that must not lose them if they cannot be written should
+   flush the volume (see flush_volume) before closing it.
+   
+   Parameters:
+     volume: pointer to volume to be freed.
+ */
+void close_volume_file(fat12volume *volume) {
+  
+  //free buffers before closing volume (the copies of the metadata
+  //index are unmapped with it)
+  if (!volume->meta) {
+    if (volume->writable && volume->metadata_loaded)
+      flush_volume(volume);
+    free_volume_metadata(volume);
+  }
+  pthread_mutex_destroy(&volume->metadata_lock);
+  pthread_rwlock_destroy(&volume->update_lock);
+  dcache_destroy(volume->dcache);
+  meta_close(volume->meta);
+  buffer_pool_destroy(volume->buffers);
+  if (volume->volume_map)
+    munmap((void *) volume->volume_map, volume->volume_size);
+  close(volume->volume_fd);
+  free(volume->shared_clusters);
+  free(volume);
+}
+
+/* read_sectors: Reads one or more contiguous sectors from the volume
+   file, saving the data in a newly allocated memory space. The caller
+   is responsible for freeing the buffer space returned by this
+   function.
+   
+   Parameters:
+     volume: pointer to FAT12 volume data structure.
+     first_sector: number of the first sector to be read.
+     num_sectors: number of sectors to read.
+     buffer: address of a pointer variable that will store the
+             allocated memory space.
+   Returns:
+     In case of success, it returns the number of bytes that were read
+     from the set of sectors. In that case *buffer will point to a
+     malloc'ed space containing the actual data read. If there is no
+     data to read (e.g., num_sectors is zero, or the sector is at the
+     end of the volume file, or read failed), it returns zero, and
+     *buffer will be undefined.
+ */
+int read_sectors(fat12volume *volume, unsigned int first_sector,
+		 unsigned int num_sectors, char **buffer) {
+  
+  const char *data;
+  uint64_t t = trace_begin();
+  int ret;
+
+  if (num_sectors == 0)
+    return 0;
+
+  *buffer = (char*) malloc(num_sectors * volume->sector_size);
+  if (*buffer == NULL)
+    return 0;
+
+  // mapped volumes are a plain copy out of the mapping
+  if (volume->volume_map) {
+    ret = map_sectors(volume, first_sector, num_sectors, &data);
+    memcpy(*buffer, data, ret);
+  } else {
+    // pread does not move a shared file position, so concurrent
+    // readers cannot interfere with each other
+    ret = pread_full(volume->volume_fd, *buffer, num_sectors * volume->sector_size,
+		     (off_t) first_sector * volume->sector_size);
+  }
+
+  if (ret <= 0) {
+    free(*buffer);
+    ret = 0;
+  } else {
+    stats_add(STATS_VOLUME_READS, 1);
+    stats_add(STATS_VOLUME_BYTES, ret);
+  }
+  trace_end("read_sectors", t);
+  return ret;
+}
+
+/* volume_cache_key: Returns the key under which a cluster of a volume
+   is kept in the cluster cache. Clusters whose contents are shared
+   with other clusters (see fat12dedup.h) are kept under a key common
+   to all of them.
+   
+   Parameters:
+     volume: pointer to FAT12 volume data structure.
+     cluster: number of the cluster.
+     volume_id: pointer to where the volume id of the key is stored.
+   Returns:
+     The cluster number of the key.
+ */
+unsigned int volume_cache_key(fat12volume *volume, unsigned int cluster,
+			      unsigned int *volume_id) {
+
+  if (cluster < volume->shared_entries && volume->shared_clusters[cluster]) {
+    *volume_id = SHARED_VOLUME_ID;
+    return volume->shared_clusters[cluster];
+  }
+  *volume_id = volume->volume_id;
+  return cluster;
+}
+
+/* read_cluster: Reads a specific data cluster from the volume file,
+   saving the data in a newly allocated memory space. The caller is
+   responsible for freeing the buffer space returned by this
+   function. Note that, in most cases, the implementation of this
+   function involves a single call to read_sectors with appropriate
+   arguments.
+   
+   Parameters:
+     volume: pointer to FAT12 volume data structure.
+     cluster: number of the cluster to be read (the first data cluster
+              is numbered two).
+     buffer: address of a pointer variable that will store the
+             allocated memory space.
+   Returns:
+     In case of success, it returns the number of bytes that were read
+     from the cluster. In that case *buffer will point to a malloc'ed
+     space containing the actual data read. If there is no data to
+     read (e.g., the cluster is at the end of the volume file), it
+     returns zero, and *buffer will be undefined.
+ */
+int read_cluster(fat12volume *volume, unsigned int cluster, char **buffer) {
+
+  unsigned int cluster_bytes = volume->cluster_size * volume->sector_size;
+  unsigned int id, key = volume_cache_key(volume, cluster, &id);
+  uint64_t t = trace_begin();
+  int rv;
+
+  stats_add(STATS_CLUSTER_READS, 1);
+  if (volume->cache) {
+    *buffer = malloc(cluster_bytes);
+    if (*buffer == NULL)
+      return 0;
+    if (cluster_cache_get(volume->cache, id, key, 0, cluster_bytes, *buffer)) {
+      trace_end("read_cluster (cached)", t);
+      return cluster_bytes;
+    }
+    free(*buffer);
+  }
+
+  rv = read_sectors(volume, volume->cluster_offset + cluster * volume->cluster_size,
+		    volume->cluster_size, buffer);
+  if (volume->cache && rv == cluster_bytes)
+    cluster_cache_put(volume->cache, id, key, *buffer, rv);
+  trace_end("read_cluster", t);
+  return rv;
+}
+
+/* copy_cluster: Copies part of a data cluster into a buffer provided
+   by the caller. The data is taken from the cluster cache if
+   possible, otherwise from the memory mapping or the volume file.
+   Clusters read from the file are added to the cache, but those read
+   from the mapping only if they are shared with other volumes (see
+   volume_cache_key). Data written to a volume but not written back
+   yet is always returned.
+   
+   Parameters:
+     volume: pointer to FAT12 volume data structure.
+     cluster: number of the cluster to be read (the first data cluster
+              is numbered two).
+     offset: offset of the first byte to be copied within the cluster.
+     length: number of bytes to be copied. offset+length cannot exceed
+             the size of a cluster.
+     buffer: memory position where the data will be copied.
+   Returns:
+     The number of bytes copied (i.e., length) in case of success, or
+     zero if the cluster could not be read.
+ */
+int copy_cluster(fat12volume *volume, unsigned int cluster, unsigned int offset,
+		 unsigned int length, char *buffer) {
+
+  unsigned int cluster_bytes = volume->cluster_size * volume->sector_size;
+  unsigned int first_sector = volume->cluster_offset + cluster * volume->cluster_size;
+  unsigned int id, key = volume_cache_key(volume, cluster, &id);
+  const char *data = NULL;
+  uint64_t t = trace_begin();
+  char *copy;
+  int rv;
+
+  stats_add(STATS_CLUSTER_READS, 1);
+  if (cluster_is_dirty(volume, cluster)) {
+    memcpy(buffer, volume->dirty[cluster] + offset, length);
+    trace_end("copy_cluster (dirty)", t);
+    return length;
+  }
+  if (volume->cache &&
+      cluster_cache_get(volume->cache, id, key, offset, length, buffer)) {
+    trace_end("copy_cluster (cached)", t);
+    return length;
+  }
+  
+  rv = map_sectors(volume, first_sector, volume->cluster_size, &data);
+  if (rv == cluster_bytes) {
+    stats_add(STATS_VOLUME_READS, 1);
+    stats_add(STATS_VOLUME_BYTES, cluster_bytes);
+    memcpy(buffer, data + offset, length);
+    // the mapping is already cached by the kernel, so only clusters
+    // shared with other volumes are worth a copy in the cache
+    if (volume->cache && id == SHARED_VOLUME_ID)
+      cluster_cache_put(volume->cache, id, key, data, rv);
+    trace_end("copy_cluster (mapped)", t);
+    return length;
+  }
+
+  // the whole cluster is read (into a pooled buffer, unless the
+  // caller wants all of it), so it can be cached as well
+  copy = length == cluster_bytes ? buffer : buffer_pool_get(volume->buffers);
+  if (!copy) {
+    trace_end("copy_cluster (error)", t);
+    return 0;
+  }
+  rv = read_data(volume, cluster_position(volume, cluster), cluster_bytes, copy);
+  if (rv == cluster_bytes && copy != buffer)
+    memcpy(buffer, copy + offset, length);
+  if (rv == cluster_bytes && volume->cache)
+    cluster_cache_put(volume->cache, id, key, copy, rv);
+  if (copy != buffer)
+    buffer_pool_put(volume->buffers, copy);
+  if (rv != cluster_bytes) {
+    trace_end("copy_cluster (error)", t);
+    return 0;
+  }
+  trace_end("copy_cluster", t);
+  return length;
+}
+
+/* borrow_cluster: Version of read_cluster that reads the cluster into
+   a buffer borrowed from the buffer pool of the volume, instead of a
+   newly allocated one. The buffer must be given back with
+   return_cluster (even if the cluster could not be read), and not
+   freed.
+   
+   Parameters:
+     volume: pointer to FAT12 volume data structure.
+     cluster: number of the cluster to be read.
+     buffer: address of a pointer variable that will store the
+             borrowed buffer, or NULL if no buffer was available.
+   Returns:
+     The number of bytes read, or zero in case of error.
+ */
+int borrow_cluster(fat12volume *volume, unsigned int cluster, char **buffer) {
+
+  unsigned int cluster_bytes = volume->cluster_size * volume->sector_size;
+
+  *buffer = buffer_pool_get(volume->buffers);
+  if (!*buffer)
+    return 0;
+  return copy_cluster(volume, cluster, 0, cluster_bytes, *buffer);
+}
+
+/* return_cluster: Gives back a buffer obtained with borrow_cluster.
+   
+   Parameters:
+     volume: pointer to FAT12 volume data structure.
+     buffer: buffer being given back. May be NULL.
+ */
+void return_cluster(fat12volume *volume, char *buffer) {
+  buffer_pool_put(volume->buffers, buffer);
+}
+
+/* cluster_position: Computes the position of a data cluster in the
+   volume file.
+   
+   Parameters:
+     volume: pointer to FAT12 volume data structure.
+     cluster: number of the cluster (the first data cluster is
+              numbered two).
+   Returns:
+     The byte offset of the first byte of the cluster.
+ */
+off_t cluster_position(fat12volume *volume, unsigned int cluster) {
+
+  // cluster_offset wraps around when clusters are larger than the
+  // area before them, but the sum is correct for clusters >= 2
+  return (off_t) (volume->cluster_offset + cluster * volume->cluster_size) * volume->sector_size;
+}
+
+/* read_data: Reads an arbitrary range of bytes from the volume file
+   directly into a buffer provided by the caller, without any
+   intermediate allocation. This is used to read runs of contiguous
+   clusters with a single I/O operation.
+   
+   Parameters:
+     volume: pointer to FAT12 volume data structure.
+     position: byte offset of the first byte to be read in the volume.
+     length: number of bytes to read.
+     buffer: memory position where the data will be stored.
+   Returns:
+     The number of bytes read, which is smaller than length if the
+     volume file ends before the requested range, or zero in case of
+     error.
+ */
+int read_data(fat12volume *volume, off_t position, size_t length, char *buffer) {
+
+  uint64_t t = trace_begin();
+  ssize_t rv;
+  
+  if (position >= volume->volume_size)
+    return 0;
+  if (length > volume->volume_size - position)
+    length = volume->volume_size - position;
+
+  if (volume->volume_map) {
+    memcpy(buffer, volume->volume_map + position, length);
+    rv = length;
+  } else {
+    rv = pread_full(volume->volume_fd, buffer, length, position);
+    if (rv < 0)
+      return 0;
+  }
+
+  stats_add(STATS_VOLUME_READS, 1);
+  stats_add(STATS_VOLUME_BYTES, rv);
+  trace_end("read_data", t);
+  return rv;
+}
+
+/* map_sectors: Zero-copy version of read_sectors. Instead of copying
+   the sectors into a new buffer, returns a pointer directly into the
+   memory mapping of the volume file. The data must not be modified
+   or freed, and remains valid until the volume is closed.
+   
+   Parameters:
+     volume: pointer to FAT12 volume data structure.
+     first_sector: number of the first sector to be accessed.
+     num_sectors: number of sectors to access.
+     data: address of a pointer variable that will store the address
+           of the first sector within the mapping.
+   Returns:
+     The number of bytes available at *data, which may be smaller
+     than the requested sectors if the volume file ends before
+     them. Returns zero if there is no data to access, or if the
+     volume is not memory mapped, in which case *data is undefined
+     and the caller should use read_sectors instead.
+ */
+int map_sectors(fat12volume *volume, unsigned int first_sector,
+		unsigned int num_sectors, const char **data) {
+
+  size_t start = (size_t) first_sector * volume->sector_size;
+  size_t length = (size_t) num_sectors * volume->sector_size;
+
+  if (!volume->volume_map || num_sectors == 0 || start >= volume->volume_size)
+    return 0;
+
+  if (length > volume->volume_size - start)
+    length = volume->volume_size - start;
+
+  *data = volume->volume_map + start;
+  return length;
+}
+
+/* map_cluster: Zero-copy version of read_cluster, with the same
+   semantics as map_sectors.
+   
+   Parameters:
+     volume: pointer to FAT12 volume data structure.
+     cluster: number of the cluster to be accessed (the first data
+              cluster is numbered two).
+     data: address of a pointer variable that will store the address
+           of the cluster within the mapping.
+   Returns:
+     The number of bytes available at *data, or zero if the cluster
+     is not available or the volume is not memory mapped.
+ */
+int map_cluster(fat12volume *volume, unsigned int cluster, const char **data) {
+
+  return map_sectors(volume, volume->cluster_offset + cluster * volume->cluster_size,
+		     volume->cluster_size, data);
+}
+
+/* get_next_cluster: Finds, in the file allocation table, the number
+   of the cluster that follows the given cluster.
+   
+   Parameters:
+     volume: pointer to FAT12 volume data structure.
+     cluster: number of the cluster to seek.
+   Returns:
+     Number of the cluster that follows the given cluster (i.e., whose
+     data is the sequence to the data of the current cluster). Returns
+     0 if the given cluster is not in use, or a number larger than or
+     equal to 0xff8 if the given cluster is the last cluster in a
+     file.
+ */
+unsigned int get_next_cluster(fat12volume *volume, unsigned int cluster) {
+
+  uint64_t t = trace_begin();
+  unsigned int next = 0;
+  
+  // the FAT is decoded when it is loaded
+  if (cluster < volume->fat_entries && load_volume_metadata(volume) == 0)
+    next = volume->fat_next[cluster];
+  trace_end("get_next_cluster", t);
+  return next;
+}
+
+/* decode_fat: Unpacks the 12-bit entries of the in-memory FAT copy
+   into a table of 16-bit next-cluster numbers, and computes, for
+   each cluster in use, the length of the run of physically
+   contiguous clusters in the chain starting at that cluster.
+   
+   Parameters:
+     volume: pointer to FAT12 volume data structure, with fat_array
+             already loaded.
+   Returns:
+     0 in case of success, or -ENOMEM if the tables could not be
+     allocated.
+ */
+static int decode_fat(fat12volume *volume) {
+
+  unsigned int cluster, next;
+  
+  volume->fat_next = malloc(volume->fat_entries * sizeof(uint16_t));
+  volume->fat_run = calloc(volume->fat_entries + 1, sizeof(uint16_t));
+  if (!volume->fat_next || !volume->fat_run)
+    return -ENOMEM;
+
+  decode_fat_entries(volume->fat_array, 0, volume->fat_entries, volume->fat_next);
+
+  // runs are computed backwards so each one can extend the next
+  for (cluster = volume->fat_entries; cluster-- > 2; ) {
+    next = volume->fat_next[cluster];
+    if (next == 0)
+      continue;
+    volume->fat_run[cluster] = 1 + (next == cluster + 1 ? volume->fat_run[cluster + 1] : 0);
+  }
+  
+  return 0;
+}
+
+/* get_file_extents: Builds the list of extents (runs of physically
+   contiguous clusters) of the cluster chain starting at a given
+   cluster. Thanks to the run lengths computed when the volume is
+   opened, the chain is traversed one extent at a time instead of
+   one cluster at a time.
+   
+   Parameters:
+     volume: pointer to FAT12 volume data structure.
+     first_cluster: first cluster of the chain (e.g., first_cluster
+                    in a dir_entry).
+     extents: address of a pointer variable that will store a newly
+              allocated array of extents, in file order. The caller
+              is responsible for freeing this array.
+   Returns:
+     The number of extents in the chain. Returns zero if the chain is
+     empty (in which case *extents is NULL), or -ENOMEM if memory
+     could not be allocated. Chains that loop or lead to an invalid
+     cluster are truncated at the offending cluster.
+ */
+int get_file_extents(fat12volume *volume, unsigned int first_cluster,
+		     fat12extent **extents) {
+
+  unsigned int cluster = first_cluster, file_cluster = 0, run;
+  int num_extents = 0, capacity = 0;
+  fat12extent *list = NULL, *grown;
+  uint64_t t = trace_begin();
+
+  *extents = NULL;
+  if (load_volume_metadata(volume) < 0)
+    return -EIO;
+  
+  while (cluster >= 2 && cluster < volume->fat_entries &&
+	 (run = volume->fat_run[cluster]) > 0) {
+
+    // a chain cannot use more clusters than there are in the volume
+    if (file_cluster + run > volume->fat_entries)
+      break;
+    
+    if (num_extents == capacity) {
+      capacity = capacity ? capacity * 2 : 4;
+      grown = realloc(list, capacity * sizeof(fat12extent));
+      if (!grown) {
+	free(list);
+	return -ENOMEM;
+      }
+      list = grown;
+    }
+    
+    list[num_extents].file_cluster = file_cluster;
+    list[num_extents].first_cluster = cluster;
+    list[num_extents].num_clusters = run;
+    num_extents++;
+
+    file_cluster += run;
+    cluster = volume->fat_next[cluster + run - 1];
+  }
+
+  *extents = list;
+  trace_end("get_file_extents", t);
+  return num_extents;
+}
+
+/* find_extent: Finds the extent containing a cluster of a file,
+   using a binary search.
+   
+   Parameters:
+     extents: array of extents, as returned by get_file_extents.
+     num_extents: number of extents in the array.
+     file_cluster: index of the cluster within the file (zero for
+                   the first cluster of the file).
+   Returns:
+     The index of the extent containing the cluster, or -1 if the
+     cluster is beyond the end of the chain.
+ */
+int find_extent(const fat12extent *extents, int num_extents, unsigned int file_cluster) {
+
+  int low = 0, high = num_extents - 1, mid;
+
+  while (low <= high) {
+    mid = (low + high) / 2;
+    if (file_cluster < extents[mid].file_cluster)
+      high = mid - 1;
+    else if (file_cluster >= extents[mid].file_cluster + extents[mid].num_clusters)
+      low = mid + 1;
+    else
+      return mid;
+  }
+  return -1;
+}
+
+/* extent_offset_to_sector: Maps a byte offset within a file to the
+   volume sector that stores it.
+   
+   Parameters:
+     volume: pointer to FAT12 volume data structure.
+     extents: array of extents of the file, as returned by
+              get_file_extents.
+     num_extents: number of extents in the array.
+     offset: byte offset within the file.
+   Returns:
+     The sector number containing the byte at the given offset, or 0
+     if the offset is beyond the end of the cluster chain.
+ */
+unsigned int extent_offset_to_sector(fat12volume *volume, const fat12extent *extents,
+				     int num_extents, off_t offset) {
+
+  unsigned int cluster_bytes = volume->cluster_size * volume->sector_size;
+  unsigned int file_cluster = offset / cluster_bytes;
+  int index = find_extent(extents, num_extents, file_cluster);
+
+  if (index < 0)
+    return 0;
+  
+  return volume->cluster_offset +
+    (extents[index].first_cluster + file_cluster - extents[index].file_cluster) * volume->cluster_size +
+    (offset % cluster_bytes) / volume->sector_size;
+}
+
+/* fill_directory_entry: Reads the directory entry from a
+   FAT12-formatted directory and assigns its attributes to a dir_entry
+   data structure.
+   
+   Parameters:
+     data: pointer to the beginning of the directory entry in FAT12
+           format. This function assumes that this pointer is at least
+           DIR_ENTRY_SIZE long.
+     entry: pointer to a dir_entry structure where the data will be
+            stored.
+ */
+void fill_directory_entry(const char *data, dir_entry *entry) {
+
+  dir_record record;
+
+  fill_directory_record(data, &record, entry->filename);
+  record_to_entry(&record, entry);
+}
+
+/* fill_directory_record: Reads the directory entry from a
+   FAT12-formatted directory into the compact dir_record form. The
+   date and time are kept as stored, and only the name is decoded
+   (in lowercase, where the case bits of the entry say so). The
+   location of the entry is left for the caller to fill in.
+
+   Parameters:
+     data: pointer to the beginning of the directory entry in FAT12
+           format. This function assumes that this pointer is at least
+           DIR_ENTRY_SIZE long.
+     record: pointer to the dir_record structure where the data will
+             be stored.
+     name: buffer of at least 13 bytes where the name is stored. The
+           record refers to this buffer.
+ */
+void fill_directory_record(const char *data, dir_record *record, char *name) {
+
+  int i, length = 0, lower = data[12];
+
+  // copy the name, dropping the space padding
+  for (i = 0; i < 8 && data[i] != ' '; i++)
+    name[length++] = (lower & CASE_LOWER_BASE) ? tolower(data[i]) : data[i];
+  // a leading 0x05 stands for a name that actually starts with 0xe5
+  if (length > 0 && (unsigned char) name[0] == 0x05)
+    name[0] = (char) 0xe5;
+  // if there is an extension, add a dot followed by the extension
+  if (data[8] != ' ') {
+    name[length++] = '.';
+    for (i = 8; i < 11 && data[i] != ' '; i++)
+      name[length++] = (lower & CASE_LOWER_EXT) ? tolower(data[i]) : data[i];
+  }
+  name[length] = '\0';
+
+  record->name = name;
+  record->time = read_unsigned_le(data, 22, 2);
+  record->date = read_unsigned_le(data, 24, 2);
+  record->size = read_unsigned_le(data, 28, 4);
+  record->first_cluster = read_unsigned_le(data, 26, 2) & 0xfff;
+  record->attributes = data[11];
+  record->lfn_entries = 0;
+  record->dir_cluster = record->slot = 0;
+}
+
+/* long_name_reset: Forgets the long name being assembled, if any.
+   
+   Parameters:
+     lfn: long name state.
+ */
+void long_name_reset(long_name *lfn) {
+  lfn->expected = lfn->num_entries = 0;
+}
+
+/* long_name_add: Adds a long name entry to the long name being
+   assembled. The entries of a long name are stored in reverse order
+   right before the entry they belong to: the first one has the
+   highest ordinal, with bit 0x40 set, and the last one has ordinal
+   1. An entry that does not follow the previous one (its ordinal or
+   checksum do not match) drops the name being assembled.
+   
+   Parameters:
+     lfn: long name state.
+     data: pointer to the beginning of the long name entry. This
+           function assumes that this pointer is at least
+           DIR_ENTRY_SIZE long.
+ */
+void long_name_add(long_name *lfn, const char *data) {
+
+  // offsets of the 13 code units within the entry
+  static const unsigned char offsets[LONG_NAME_UNITS] = {
+    1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30
+  };
+  unsigned int ordinal = data[0] & 0x1f;
+  uint16_t *units;
+  int i;
+
+  if (data[0] & 0x40) {
+    // first entry of a new name
+    if (ordinal == 0 || ordinal > LONG_NAME_ENTRIES) {
+      long_name_reset(lfn);
+      return;
+    }
+    lfn->num_entries = ordinal;
+    lfn->checksum = data[13];
+  } else if (ordinal == 0 || ordinal != lfn->expected ||
+	     (unsigned char) data[13] != lfn->checksum) {
+    long_name_reset(lfn);
+    return;
+  }
+
+  units = lfn->units + (ordinal - 1) * LONG_NAME_UNITS;
+  for (i = 0; i < LONG_NAME_UNITS; i++)
+    units[i] = read_unsigned_le(data, offsets[i], 2);
+  lfn->expected = ordinal - 1;
+}
+
+/* long_name_finish: Completes the long name of an 8.3 entry, and
+   converts it into UTF-8. The long name is only used if all its
+   entries were found, their checksum matches the 8.3 name, and the
+   name is valid; otherwise the entry has no long name (e.g., it was
+   renamed by a system that only knows 8.3 names, leaving its old
+   long name entries behind). In any case, the long name state is
+   reset for the next entry.
+   
+   Parameters:
+     lfn: long name state.
+     data: pointer to the beginning of the 8.3 directory entry.
+     name: buffer of at least NAME_MAX_BYTES + 1 bytes where the long
+           name is stored.
+   Returns:
+     The number of long name entries of the name, or 0 if the entry
+     has no valid long name.
+ */
+int long_name_finish(long_name *lfn, const char *data, char *name) {
+
+  unsigned int total = lfn->num_entries * LONG_NAME_UNITS, entries = lfn->num_entries;
+  unsigned int limit = total < LONG_NAME_MAX_UNITS ? total : LONG_NAME_MAX_UNITS;
+  unsigned int i, length = 0, c;
+  unsigned char sum = 0;
+
+  if (lfn->expected != 0 || lfn->num_entries == 0)
+    goto none;
+  for (i = 0; i < 11; i++)
+    sum = ((sum & 1) << 7) + (sum >> 1) + (unsigned char) data[i];
+  if (sum != lfn->checksum)
+    goto none;
+
+  // the name ends with a null code unit, unless it fills its entries
+  for (i = 0; i < limit && lfn->units[i] != 0; i++) {
+    c = lfn->units[i];
+    if (c >= 0xd800 && c < 0xdc00 && i + 1 < limit &&
+	lfn->units[i + 1] >= 0xdc00 && lfn->units[i + 1] < 0xe000) {
+      // surrogate pair
+      c = 0x10000 + ((c - 0xd800) << 10) + (lfn->units[++i] - 0xdc00);
+    } else if (c >= 0xd800 && c < 0xe000) {
+      // unpaired surrogate, replaced by U+FFFD
+      c = 0xfffd;
+    } else if (c == '/') {
+      goto none;
+    }
+    if (c < 0x80) {
+      name[length++] = c;
+    } else if (c < 0x800) {
+      name[length++] = 0xc0 | (c >> 6);
+      name[length++] = 0x80 | (c & 0x3f);
+    } else if (c < 0x10000) {
+      name[length++] = 0xe0 | (c >> 12);
+      name[length++] = 0x80 | ((c >> 6) & 0x3f);
+      name[length++] = 0x80 | (c & 0x3f);
+    } else {
+      name[length++] = 0xf0 | (c >> 18);
+      name[length++] = 0x80 | ((c >> 12) & 0x3f);
+      name[length++] = 0x80 | ((c >> 6) & 0x3f);
+      name[length++] = 0x80 | (c & 0x3f);
+    }
+  }
+  if (length == 0 || (i < total && lfn->units[i] != 0))
+    goto none;
+  name[length] = '\0';
+  long_name_reset(lfn);
+  return entries;
+
+ none:
+  long_name_reset(lfn);
+  return 0;
+}
+
+/* record_time: Converts the date and time of a record into a struct
+   tm. The root directory, which has no date, is given Unix time 0
+   (1970-01-01 0:00 GMT).
+   
+   Parameters:
+     record: record whose date and time are converted.
+     tm: pointer to the struct tm where the result is stored.
+ */
+void record_time(const dir_record *record, struct tm *tm) {
+
+  /* OBS: Note that the way that FAT12 represents a year is different
+     than the way used by mktime and 'struct tm' to represent a
+     year. In particular, both represent it as a number of years from
+     a starting year, but the starting year is different between
+     them. Make sure to take this into account when saving data into
+     the entry. */
+
+  time_t epoch = 0;
+  int mask_sec = 0x1f;      // hexidecimal value to mask seconds  
+  int mask_min = 0x7e0;     // hexidecimal value to mask minutes     
+  int mask_mon = 0x1e0;     // hexidecimal value to mask months
+  int mask_day = 0x1f;      // hexidecimal value to mask days
+  int tempTime = record->time;
+  int tempDate = record->date;
+
+  // the root directory has no entry, and is the only record whose
+  // name contains a slash
+  if (record->name[0] == '/') {
+    gmtime_r(&epoch, tm);
+    return;
+  }
+  
+  // update the values of the struct by masking and shifting values to the 
+  // correct spots given in the data
+  struct tm newStruct = {
+    .tm_sec = (tempTime & mask_sec) * 2,
+    .tm_min = (tempTime & mask_min) >> 5,
+    .tm_hour = tempTime >> 11,
+    .tm_mday = (tempDate & mask_day),
+    .tm_mon = ((tempDate & mask_mon) >> 5) - 1,   // FAT months start at 1, tm_mon at 0
+    .tm_year = (tempDate >> 9) + 80,              // FAT 1980 vs mktime 1900 starts
+    .tm_isdst = -1
+  };
+
+  *tm = newStruct;
+}
+
+/* record_to_entry: Expands a record into a full dir_entry, including
+   the conversion of its date and time.
+   
+   Parameters:
+     record: record to be expanded.
+     entry: pointer to the dir_entry structure where the data will be
+            stored.
+ */
+void record_to_entry(const dir_record *record, dir_entry *entry) {
+
+  if (entry->filename != record->name)
+    strcpy(entry->filename, record->name);
+  record_time(record, &entry->ctime);
+  entry->size = record->size;
+  entry->first_cluster = record->first_cluster;
+  entry->is_directory = (record->attributes & ATTR_DIRECTORY) ? 1 : 0;
+}
+
+/* read_directory: Reads the entire contents of a directory (all of
+   its raw 32-byte entries) into a newly allocated buffer. The caller
+   is responsible for freeing the buffer.
+   
+   Parameters:
+     volume: Pointer to FAT12 volume data structure.
+     dir: Entry of the directory to be read. The root directory is
+          identified by a first cluster of zero.
+     buffer: address of a pointer variable that will store the
+             allocated memory space.
+   Returns:
+     In case of success, the number of bytes in the directory, which
+     is a multiple of DIR_ENTRY_SIZE. Returns -ENOTDIR if dir is not a
+     directory, -EIO if one of the clusters of the directory could
+     not be read, or -ENOMEM if memory could not be allocated.
+ */
+int read_directory(fat12volume *volume, const dir_entry *dir, char **buffer) {
+
+  dir_record record = {
+    .first_cluster = dir->first_cluster,
+    .attributes = dir->is_directory ? ATTR_DIRECTORY : 0,
+  };
+  request_arena arena;
+  const char *data;
+  int length;
+
+  arena_init(&arena, NULL, 0);
+  length = scan_directory(volume, &record, &arena, &data);
+  if (length >= 0) {
+    *buffer = malloc(length);
+    if (*buffer)
+      memcpy(*buffer, data, length);
+    else
+      length = -ENOMEM;
+  }
+  arena_release(&arena);
+  
+  return length;
+}
+
+/* scan_directory: Version of read_directory for transient scans of a
+   directory, which avoids any allocation that outlives the scan. The
+   root directory is returned in place, and the clusters of other
+   directories are copied into memory taken from an arena.
+   
+   Parameters:
+     volume: Pointer to FAT12 volume data structure.
+     dir: Record of the directory to be read. The root directory is
+          identified by a first cluster of zero.
+     arena: arena from which the buffer for the directory is taken.
+     data: address of a pointer variable that will store the address
+           of the contents of the directory. The contents must not
+           be modified, and remain valid until the arena is released
+           (as long as the volume is in use).
+   Returns:
+     Same as read_directory.
+ */
+int scan_directory(fat12volume *volume, const dir_record *dir, request_arena *arena,
+		   const char **data) {
+
+  unsigned int cluster_bytes = volume->cluster_size * volume->sector_size;
+  unsigned int cluster, run, c, n, num_clusters = 0;
+  char *buffer;
+
+  if (!(dir->attributes & ATTR_DIRECTORY))
+    return -ENOTDIR;
+  if (load_volume_metadata(volume) < 0)
+    return -EIO;
+
+  // the root directory is kept in memory
+  if (dir->first_cluster == 0) {
+    *data = volume->rootdir_array;
+    return volume->rootdir_entries * DIR_ENTRY_SIZE;
+  }
+
+  // walk the chain run by run to size the buffer; a chain cannot use
+  // more clusters than there are in the volume
+  for (cluster = dir->first_cluster;
+       cluster >= 2 && cluster < volume->fat_entries && (run = volume->fat_run[cluster]) > 0 &&
+	 num_clusters + run <= volume->fat_entries;
+       cluster = volume->fat_next[cluster + run - 1])
+    num_clusters += run;
+  if (num_clusters == 0)
+    return -EIO;
+
+  buffer = arena_alloc(arena, (size_t) num_clusters * cluster_bytes);
+  if (!buffer)
+    return -ENOMEM;
+
+  for (cluster = dir->first_cluster, n = 0; n < num_clusters;
+       cluster = volume->fat_next[cluster + run - 1]) {
+    run = volume->fat_run[cluster];
+    for (c = 0; c < run; c++, n++)
+      if (copy_cluster(volume, cluster + c, 0, cluster_bytes, buffer + n * cluster_bytes) !=
+	  cluster_bytes)
+	return -EIO;
+  }
+
+  *data = buffer;
+  return num_clusters * cluster_bytes;
+}
+
+/* find_directory_entry: finds the directory entry associated to a
+   specific path.
+   
+   Parameters:
+     volume: Pointer to FAT12 volume data structure.
+     path: Path of the file to be found. Will always start with a
+           forward slash (/). Path components (e.g., subdirectories)
+           will be delimited with "/". A path containing only "/"
+           refers to the root directory of the FAT12 volume. Each
+           component may be the long name or the 8.3 name of an
+           entry, in any case (see dir_index_find).
+     entry: pointer to a dir_entry structure where the data associated
+            to the path will be stored.
+   Returns:
+     In case of success (the provided path corresponds to a valid
+     file/directory in the volume), the function will fill the data
+     structure entry with the data associated to the path and return
+     0. If the path is not a valid file/directory in the volume, the
+     function will return -ENOENT, and the data in entry will be
+     undefined. If the path contains a component (except the last one)
+     that is not a directory, it will return -ENOTDIR, and the data in
+     entry will be undefined. If a directory could not be read, it
+     will return -EIO.
+ */
+int find_directory_entry(fat12volume *volume, const char *path, dir_entry *entry) {
+  
+  /* OBS: In the specific case where the path corresponds to the root
+     directory ("/"), this function should fill the entry with
+     information for the root directory, but this entry will not be
+     based on a proper entry in the volume, since the root directory
+     is not obtained from such an entry. In particular, the date/time
+     for the root directory can be set to Unix time 0 (1970-01-01 0:00
+     GMT). */
+
+  dir_record record;
+  int rv;
+
+  rv = find_directory_record(volume, path, &record);
+  if (rv == 0)
+    record_to_entry(&record, entry);
+  return rv;
+}
+
+/* find_directory_record: Version of find_directory_entry that returns
+   the compact record of the entry, without converting its date and
+   time.
+   
+   Parameters:
+     volume: Pointer to FAT12 volume data structure.
+     path: Path of the file to be found, as in find_directory_entry.
+     record: pointer to a dir_record structure where the data
+             associated to the path will be stored. Its name belongs
+             to the dentry cache of the volume, and remains valid
+             until the volume is closed.
+   Returns:
+     Same as find_directory_entry.
+ */
+int find_directory_record(fat12volume *volume, const char *path, dir_record *record) {
+
+  static const dir_record root = {
+    .name = "/",
+    .attributes = ATTR_DIRECTORY,
+  };
+  const char *component = path, *end;
+  const dir_index *index;
+  const dir_record *found;
+  char name[NAME_MAX_BYTES + 1];
+  uint64_t start = stats_now();
+  int rv;
+
+  // repeated lookups of the same path are answered from the cache
+  rv = dcache_lookup_path(volume->dcache, path, record);
+  if (rv <= 0) {
+    stats_add(STATS_LOOKUP_CACHED, 1);
+    stats_record(STATS_LOOKUP, start);
+    trace_end("find_directory_entry (cached)", start);
+    return rv;
+  }
+
+  // start at the root directory, which has no date (see record_time)
+  *record = root;
+
+  while (1) {
+    // skip the slashes before the next component
+    while (*component == '/')
+      component++;
+    if (*component == '\0') {
+      rv = 0;
+      break;
+    }
+    
+    end = strchr(component, '/');
+    if (!end)
+      end = component + strlen(component);
+    if (end - component >= sizeof(name)) {
+      rv = -ENOENT;
+      break;
+    }
+    memcpy(name, component, end - component);
+    name[end - component] = '\0';
+
+    // only directories can have components after them
+    rv = get_directory_index(volume, record, &index);
+    if (rv)
+      break;
+
+    found = dir_index_find(index, name);
+    if (!found) {
+      rv = -ENOENT;
+      break;
+    }
+    *record = *found;
+    component = end;
+  }
+
+  if (rv != -EIO && rv != -ENOMEM)
+    dcache_insert_path(volume->dcache, path, rv, record);
+  stats_record(STATS_LOOKUP, start);
+  trace_end("find_directory_entry", start);
+  return rv;
+}
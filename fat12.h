@@ -1,86 +1,348 @@
-#ifndef _FAT12_H_
-#define _FAT12_H_
-
-#include <stdio.h>
-#include <time.h>
-
-/* Size of the boot sectore of a FAT12 volume, in bytes */
-#define BOOT_SECTOR_SIZE 512
-/* Size of each individual entry in a FAT12 directory, in bytes */
-#define DIR_ENTRY_SIZE 32
-
-/* Data structure used to store data associated to a FAT12 volume */
-typedef struct fat12volume {
-  
-  /* File pointer to volume file */
-  FILE *volume_file;
-
-  /* Sector size in bytes */
-  unsigned int sector_size;
-  /* Cluster size in sectors */
-  unsigned int cluster_size;
-
-  /* Number of reserved sectors in the beginning of the volume
-     (including the boot sector) */
-  unsigned int reserved_sectors;
-  /* Number of hidden sectores in the volume */
-  unsigned int hidden_sectors;
-
-  /* First sector number of the first copy of the File Allocation
-     Table (FAT) */
-  unsigned int fat_offset;
-  /* Number of sectors used by each copy of the FAT */
-  unsigned int fat_num_sectors;
-  /* Number of copies of the FAT found in the volume */
-  unsigned int fat_copies;
-  /* Copy of the entire FAT in memory */
-  char *fat_array;
-
-  /* First sector number of the root directory listing */
-  unsigned int rootdir_offset;
-  /* Maximum number of directory entries in the root directory */
-  unsigned int rootdir_entries;
-  /* Number of sectors used by the root directory */
-  unsigned int rootdir_num_sectors;
-  /* Copy of the entire root directory in memory */
-  char *rootdir_array;
-
-  /* Sector number of the data cluster #0. Note that the first data
-     cluster is cluster #2, so cluster #0's offset corresponds to two
-     clusters before the actual start of the data clusters. */
-  unsigned int cluster_offset;
-  
-} fat12volume;
-
-/* Data structure representing useful information in each entry of a
-   FAT12 directory */
-typedef struct dir_entry {
-
-  /* Name of the file */
-  char filename[13];
-  /* Creation date/time (check 'man 2 mktime' for information about
-     struct tm). Since FAT-12 doesn't distinguish between creation and
-     modification time, we'll use this time for both. */
-  struct tm ctime;
-  /* Size of the file, in bytes */
-  unsigned int size;
-  /* Number of the first cluster containing data for this
-     file. Remaining clusters are found using the File Allocation
-     Table (FAT). */
-  unsigned int first_cluster : 12;
-  /* Flag: 0 if this is a regular file, 1 if it is a directory. */
-  unsigned int is_directory : 1;
-  
-} dir_entry;
-
-fat12volume *open_volume_file(const char *filename);
-void close_volume_file(fat12volume *volume);
-
-int read_sectors(fat12volume *volume, unsigned int first_sector, unsigned int num_sectors, char **buffer);
-int read_cluster(fat12volume *volume, unsigned int cluster, char **buffer);
-
-unsigned int get_next_cluster(fat12volume *volume, unsigned int cluster);
-void fill_directory_entry(const char *data, dir_entry *entry);
-int find_directory_entry(fat12volume *volume, const char *path, dir_entry *entry);
-
-#endif
+#ifndef _FAT12_H_
+#define _FAT12_H_
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <pthread.h>
+#include <time.h>
+
+/* Size of the boot sectore of a FAT12 volume, in bytes */
+#define BOOT_SECTOR_SIZE 512
+/* Size of each individual entry in a FAT12 directory, in bytes */
+#define DIR_ENTRY_SIZE 32
+
+/* Attribute bits of a FAT12 directory entry (byte 11 of the entry) */
+#define ATTR_READ_ONLY 0x01
+#define ATTR_HIDDEN    0x02
+#define ATTR_SYSTEM    0x04
+#define ATTR_VOLUME_ID 0x08
+#define ATTR_DIRECTORY 0x10
+#define ATTR_ARCHIVE   0x20
+/* Combination of attributes that marks a VFAT long file name entry
+   (checked against the low six bits of byte 11) */
+#define ATTR_LONG_NAME 0x0f
+
+/* Long file names: each long name entry holds 13 UTF-16 code units,
+   and a name has at most 255 of them, so it takes at most 20 entries
+   and NAME_MAX_BYTES bytes in UTF-8 (not counting the terminator) */
+#define LONG_NAME_UNITS 13
+#define LONG_NAME_ENTRIES 20
+#define LONG_NAME_MAX_UNITS 255
+#define NAME_MAX_BYTES 765
+
+/* Flags accepted by open_volume_file_flags */
+/* Map the whole volume file into memory, allowing zero-copy access
+   to its sectors through map_sectors and map_cluster */
+#define VOLUME_OPEN_MMAP 0x1
+/* Only read the boot sector when the volume is opened, deferring the
+   FAT and root directory until they are first used */
+#define VOLUME_OPEN_LAZY 0x2
+/* Open the volume file for writing as well, so it can be modified
+   with the functions in fat12write.h */
+#define VOLUME_OPEN_WRITE 0x4
+/* Check the integrity of the volume (see fat12check.h) when it is
+   opened, and refuse to open it if it has errors */
+#define VOLUME_OPEN_CHECK 0x8
+/* Take the FAT, root directory and directory entries of a read-only
+   volume from its metadata index, a file next to the volume file
+   that is mapped into memory, writing it first if it is missing or
+   out of date (see fat12meta.h) */
+#define VOLUME_OPEN_INDEX 0x10
+
+/* Volume id under which the clusters shared by several volumes are
+   kept in the cluster cache (the ids of open volumes start at one) */
+#define SHARED_VOLUME_ID 0
+
+/* Case bits of a directory entry (byte 12 of the entry), set when the
+   name or the extension is to be shown in lowercase */
+#define CASE_LOWER_BASE 0x08
+#define CASE_LOWER_EXT  0x10
+
+/* Cache of path lookups and directory indexes (see fat12dcache.h) */
+typedef struct fat12dcache fat12dcache;
+
+/* Cache of cluster data, possibly shared by several volumes (see
+   fat12cache.h) */
+typedef struct cluster_cache cluster_cache;
+
+/* Pool of fixed-size buffers, and arena for the transient allocations
+   of a request (see fat12pool.h) */
+typedef struct buffer_pool buffer_pool;
+typedef struct request_arena request_arena;
+
+/* File of a writable volume opened for reading or writing (see
+   fat12write.h) */
+typedef struct fat12node fat12node;
+
+/* Metadata index of a volume mapped into memory (see fat12meta.h) */
+typedef struct fat12meta fat12meta;
+
+/* Background engine writing the changes to writable volumes, kept in
+   memory, to their volume files (see fat12writeback.h) */
+typedef struct writeback writeback;
+
+/* Data structure used to store data associated to a FAT12 volume */
+typedef struct fat12volume {
+  
+  /* File descriptor of the volume file. All reads use positional I/O
+     (pread), so the descriptor can be shared by concurrent threads. */
+  int volume_fd;
+  /* Read-only mapping of the entire volume file, or NULL if the
+     volume was not opened with VOLUME_OPEN_MMAP (or mapping failed) */
+  const char *volume_map;
+  /* Size of the volume file, in bytes */
+  size_t volume_size;
+  /* Set if the volume was opened with VOLUME_OPEN_WRITE. Changes to a
+     writable volume are made holding update_lock exclusively, and
+     readers that use its metadata (e.g., directory indexes or the
+     clusters of a file) must hold it shared (see lock_volume). */
+  int writable;
+  pthread_rwlock_t update_lock;
+
+  /* Sector size in bytes */
+  unsigned int sector_size;
+  /* Cluster size in sectors */
+  unsigned int cluster_size;
+
+  /* Number of reserved sectors in the beginning of the volume
+     (including the boot sector) */
+  unsigned int reserved_sectors;
+  /* Number of hidden sectores in the volume */
+  unsigned int hidden_sectors;
+
+  /* First sector number of the first copy of the File Allocation
+     Table (FAT) */
+  unsigned int fat_offset;
+  /* Number of sectors used by each copy of the FAT */
+  unsigned int fat_num_sectors;
+  /* Number of copies of the FAT found in the volume */
+  unsigned int fat_copies;
+  /* Set once the FAT and root directory below are in memory (see
+     load_volume_metadata), and lock used to load them */
+  int metadata_loaded;
+  pthread_mutex_t metadata_lock;
+  /* Copy of the entire FAT in memory */
+  char *fat_array;
+  /* Number of usable entries in the FAT (including the two reserved
+     entries for clusters #0 and #1) */
+  unsigned int fat_entries;
+  /* Decoded FAT, indexed by cluster number: fat_next[c] is the
+     cluster that follows cluster c, as returned by get_next_cluster */
+  uint16_t *fat_next;
+  /* Extent index, indexed by cluster number: fat_run[c] is the number
+     of physically contiguous clusters in the chain starting at c, or
+     0 if c is not in use */
+  uint16_t *fat_run;
+  /* Writable volumes only: bitmap of the clusters that can be
+     allocated, number of such clusters, and cluster where the search
+     for the next free cluster starts */
+  uint64_t *free_map;
+  unsigned int free_clusters;
+  unsigned int next_free;
+  /* Writable volumes only: bitmap of the clusters freed since the
+     last barrier, which cannot be reused until the change that freed
+     them is on disk (see flush_fat) */
+  uint64_t *pending_map;
+  unsigned int pending_clusters;
+  /* Writable volumes only: one flag per sector of the FAT, set when
+     the sector has changed in memory and has to be written to every
+     copy of the FAT */
+  unsigned char *fat_dirty;
+  /* Writable volumes only: data of the clusters written through the
+     write-back engine that is not in the volume file yet, indexed by
+     cluster number (NULL for clusters that are not dirty), and total
+     size of that data, in bytes */
+  char **dirty;
+  size_t dirty_bytes;
+
+  /* Metadata index of the volume, or NULL. When set, fat_array,
+     fat_next, fat_run and rootdir_array point into the index rather
+     than to memory of their own, and stay loaded until the volume is
+     closed. */
+  fat12meta *meta;
+
+  /* First sector number of the root directory listing */
+  unsigned int rootdir_offset;
+  /* Maximum number of directory entries in the root directory */
+  unsigned int rootdir_entries;
+  /* Number of sectors used by the root directory */
+  unsigned int rootdir_num_sectors;
+  /* Copy of the entire root directory in memory */
+  char *rootdir_array;
+
+  /* Sector number of the data cluster #0. Note that the first data
+     cluster is cluster #2, so cluster #0's offset corresponds to two
+     clusters before the actual start of the data clusters. */
+  unsigned int cluster_offset;
+
+  /* Cache of path lookups and directory indexes */
+  fat12dcache *dcache;
+  /* Cache used by read_cluster and copy_cluster, or NULL to always
+     read clusters from the volume file. The cache is not owned by
+     the volume, and is not freed by close_volume_file. */
+  cluster_cache *cache;
+  /* Number identifying this volume in the cluster cache, unique
+     within the process */
+  unsigned int volume_id;
+  /* Class of every cluster whose contents are also found in other
+     clusters (of this or other volumes), indexed by cluster number,
+     or zero for clusters that are not shared; NULL if the volume is
+     not attached to a dedup index (see fat12dedup.h). Shared
+     clusters are cached under SHARED_VOLUME_ID and their class, so
+     they are only cached once for all volumes. */
+  uint32_t *shared_clusters;
+  unsigned int shared_entries;
+  /* Pool of cluster-sized buffers, used by borrow_cluster and for
+     transient copies of clusters */
+  buffer_pool *buffers;
+  /* Files of a writable volume that are currently open, or that
+     were closed with changes the write-back engine has not written
+     yet */
+  fat12node *nodes;
+  /* Write-back engine of a writable volume, or NULL to write all
+     changes to the volume file right away. The next two fields are
+     owned by the engine. */
+  writeback *writeback;
+  struct fat12volume *writeback_next;
+  int writeback_queued;
+  /* First error found by the engine while flushing the volume, to be
+     reported by the next flush or fsync of one of its files */
+  int write_error;
+  
+} fat12volume;
+
+/* Data structure representing a run of physically contiguous
+   clusters in the cluster chain of a file */
+typedef struct fat12extent {
+
+  /* Index of the first cluster of the run within the file (zero for
+     the first cluster of the file) */
+  unsigned int file_cluster;
+  /* Number of the first data cluster of the run in the volume */
+  unsigned int first_cluster;
+  /* Number of clusters in the run */
+  unsigned int num_clusters;
+  
+} fat12extent;
+
+/* Data structure representing useful information in each entry of a
+   FAT12 directory */
+typedef struct dir_entry {
+
+  /* Name of the file: its long name if it has one, or its 8.3 name
+     otherwise */
+  char filename[NAME_MAX_BYTES + 1];
+  /* Creation date/time (check 'man 2 mktime' for information about
+     struct tm). Since FAT-12 doesn't distinguish between creation and
+     modification time, we'll use this time for both. */
+  struct tm ctime;
+  /* Size of the file, in bytes */
+  unsigned int size;
+  /* Number of the first cluster containing data for this
+     file. Remaining clusters are found using the File Allocation
+     Table (FAT). */
+  unsigned int first_cluster : 12;
+  /* Flag: 0 if this is a regular file, 1 if it is a directory. */
+  unsigned int is_directory : 1;
+  
+} dir_entry;
+
+/* Compact form of a directory entry, used by directory indexes and
+   path lookups. It keeps the date and time words as stored in the
+   volume, so they are only converted (with record_time) when they
+   are actually needed, and refers to a name interned elsewhere
+   (e.g., in the index of its directory), so several records fit in
+   a cache line. */
+typedef struct dir_record {
+
+  /* Name of the file (as in dir_entry.filename). The 8.3 name of a
+     file with a long name is only kept by the index of its directory
+     (see dir_index) */
+  const char *name;
+  /* Size of the file, in bytes */
+  uint32_t size;
+  /* Number of the first cluster of the file (zero for the root
+     directory) */
+  uint16_t first_cluster;
+  /* Date and time words of the entry, as stored in the volume (the
+     root directory has no entry, see record_time) */
+  uint16_t date;
+  uint16_t time;
+  /* Attributes of the entry (ATTR_*) */
+  uint8_t attributes;
+  /* Number of long name entries right before the entry, or zero if
+     the file has no long name */
+  uint8_t lfn_entries;
+  /* Location of the entry: first cluster of the directory containing
+     it (zero for the root directory) and position of the entry in
+     that directory, in entries */
+  uint16_t dir_cluster;
+  uint16_t slot;
+  
+} dir_record;
+
+/* Long name being assembled while a directory is scanned, from the
+   long name entries that precede the entry it belongs to (see
+   long_name_add) */
+typedef struct long_name {
+
+  /* Ordinal of the next long name entry expected, or zero if no name
+     is being assembled */
+  unsigned int expected;
+  /* Number of entries of the name, and checksum of the 8.3 name they
+     belong to, as given by the first of them */
+  unsigned int num_entries;
+  unsigned char checksum;
+  /* Code units of the name, in order */
+  uint16_t units[LONG_NAME_ENTRIES * LONG_NAME_UNITS];
+  
+} long_name;
+
+unsigned int read_unsigned_le(const char *buffer, int position, int num_bytes);
+
+fat12volume *open_volume_file(const char *filename);
+fat12volume *open_volume_file_flags(const char *filename, int flags);
+void close_volume_file(fat12volume *volume);
+int load_volume_metadata(fat12volume *volume);
+size_t release_volume_metadata(fat12volume *volume);
+size_t volume_metadata_size(fat12volume *volume);
+void lock_volume(fat12volume *volume, int exclusive);
+void unlock_volume(fat12volume *volume);
+
+int read_sectors(fat12volume *volume, unsigned int first_sector, unsigned int num_sectors, char **buffer);
+unsigned int volume_cache_key(fat12volume *volume, unsigned int cluster,
+			      unsigned int *volume_id);
+int read_cluster(fat12volume *volume, unsigned int cluster, char **buffer);
+int borrow_cluster(fat12volume *volume, unsigned int cluster, char **buffer);
+void return_cluster(fat12volume *volume, char *buffer);
+off_t cluster_position(fat12volume *volume, unsigned int cluster);
+int read_data(fat12volume *volume, off_t position, size_t length, char *buffer);
+int copy_cluster(fat12volume *volume, unsigned int cluster, unsigned int offset,
+		 unsigned int length, char *buffer);
+int map_sectors(fat12volume *volume, unsigned int first_sector, unsigned int num_sectors, const char **data);
+int map_cluster(fat12volume *volume, unsigned int cluster, const char **data);
+
+unsigned int get_next_cluster(fat12volume *volume, unsigned int cluster);
+void decode_fat_entries(const char *fat, unsigned int first, unsigned int count, uint16_t *entries);
+void decode_fat_entries_scalar(const char *fat, unsigned int first, unsigned int count,
+			       uint16_t *entries);
+int get_file_extents(fat12volume *volume, unsigned int first_cluster, fat12extent **extents);
+int find_extent(const fat12extent *extents, int num_extents, unsigned int file_cluster);
+unsigned int extent_offset_to_sector(fat12volume *volume, const fat12extent *extents,
+				     int num_extents, off_t offset);
+void fill_directory_entry(const char *data, dir_entry *entry);
+void fill_directory_record(const char *data, dir_record *record, char *name);
+void long_name_reset(long_name *lfn);
+void long_name_add(long_name *lfn, const char *data);
+int long_name_finish(long_name *lfn, const char *data, char *name);
+void record_time(const dir_record *record, struct tm *tm);
+void record_to_entry(const dir_record *record, dir_entry *entry);
+int read_directory(fat12volume *volume, const dir_entry *dir, char **buffer);
+int scan_directory(fat12volume *volume, const dir_record *dir, request_arena *arena,
+		   const char **data);
+int find_directory_entry(fat12volume *volume, const char *path, dir_entry *entry);
+int find_directory_record(fat12volume *volume, const char *path, dir_record *record);
+
+#endif
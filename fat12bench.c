@@ -0,0 +1,412 @@
+/* nftw is only declared with the X/Open extensions enabled */
+#define _XOPEN_SOURCE 700
+
+#include "fat12.h"
+#include "fat12dcache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <ftw.h>
+#include <sys/stat.h>
+
+/* Default number of repetitions of each library benchmark */
+#define DEFAULT_ITERATIONS 200
+/* Default number of reader threads and duration of the mount benchmark */
+#define DEFAULT_THREADS 4
+#define DEFAULT_SECONDS 5
+
+/* Data structure used to accumulate latency samples of a benchmark */
+typedef struct samples {
+  /* Latency of each sample, in nanoseconds */
+  double *values;
+  unsigned int count, capacity;
+  /* Number of operations covered by all samples (a sample may cover
+     more than one operation, e.g., a full pass over the FAT) */
+  double ops;
+  /* Total time of all samples, in nanoseconds */
+  double total;
+} samples;
+
+/* List of paths of regular files found in a volume or a mount */
+typedef struct file_list {
+  char **paths;
+  off_t *sizes;
+  unsigned int count, capacity;
+} file_list;
+
+/* now_ns: Returns the current monotonic time, in nanoseconds. */
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* add_sample: Records a sample of a benchmark.
+   
+   Parameters:
+     s: samples of the benchmark.
+     ns: duration of the sample, in nanoseconds.
+     ops: number of operations performed during the sample.
+ */
+static void add_sample(samples *s, double ns, double ops) {
+  if (s->count == s->capacity) {
+    s->capacity = s->capacity ? s->capacity * 2 : 256;
+    s->values = realloc(s->values, s->capacity * sizeof(double));
+    if (!s->values) {
+      perror("realloc");
+      exit(1);
+    }
+  }
+  s->values[s->count++] = ns / ops;
+  s->ops += ops;
+  s->total += ns;
+}
+
+static int compare_double(const void *a, const void *b) {
+  double x = *(const double *) a, y = *(const double *) b;
+  return (x > y) - (x < y);
+}
+
+/* report: Prints the throughput and latency percentiles of a
+   benchmark, and frees its samples. Latencies are per operation. */
+static void report(const char *name, samples *s) {
+  if (s->count == 0) {
+    printf("%-28s (no samples)\n", name);
+    return;
+  }
+  qsort(s->values, s->count, sizeof(double), compare_double);
+  printf("%-28s %12.0f ops/s   p50 %10.1f ns   p99 %10.1f ns   (%u samples)\n", name,
+	 s->ops / (s->total / 1e9), s->values[s->count / 2],
+	 s->values[(unsigned int) (s->count * 0.99)], s->count);
+  free(s->values);
+  memset(s, 0, sizeof(samples));
+}
+
+/* add_file: Adds a file to a file list. */
+static void add_file(file_list *list, const char *path, off_t size) {
+  if (list->count == list->capacity) {
+    list->capacity = list->capacity ? list->capacity * 2 : 64;
+    list->paths = realloc(list->paths, list->capacity * sizeof(char *));
+    list->sizes = realloc(list->sizes, list->capacity * sizeof(off_t));
+    if (!list->paths || !list->sizes) {
+      perror("realloc");
+      exit(1);
+    }
+  }
+  list->paths[list->count] = strdup(path);
+  list->sizes[list->count++] = size;
+}
+
+/* list_volume_files: Recursively collects the paths of all regular
+   files in a directory of a volume. */
+static void list_volume_files(fat12volume *volume, const dir_record *dir, const char *path,
+			      file_list *list) {
+  const dir_index *index;
+  char child[1024];
+  unsigned int i;
+
+  if (get_directory_index(volume, dir, &index))
+    return;
+
+  for (i = 0; i < index->num_entries; i++) {
+    const dir_record *entry = &index->entries[i];
+    if (!strcmp(entry->name, ".") || !strcmp(entry->name, ".."))
+      continue;
+    snprintf(child, sizeof(child), "%s/%s", path, entry->name);
+    if (entry->attributes & ATTR_DIRECTORY)
+      list_volume_files(volume, entry, child, list);
+    else
+      add_file(list, child, entry->size);
+  }
+}
+
+/* read_whole_file: Reads all data of a file of the volume, extent by
+   extent, into buffer (which must hold at least the file size
+   rounded up to a cluster).
+   
+   Returns:
+     The number of bytes read, or a negative error code.
+ */
+static long read_whole_file(fat12volume *volume, const dir_entry *entry, char *buffer) {
+  unsigned int cluster_bytes = volume->cluster_size * volume->sector_size;
+  fat12extent *extents;
+  int num_extents, e;
+  long done = 0, length;
+
+  num_extents = get_file_extents(volume, entry->first_cluster, &extents);
+  if (num_extents < 0)
+    return num_extents;
+  
+  for (e = 0; e < num_extents && done < entry->size; e++) {
+    length = (long) extents[e].num_clusters * cluster_bytes;
+    if (length > entry->size - done)
+      length = entry->size - done;
+    if (read_data(volume, cluster_position(volume, extents[e].first_cluster),
+		  length, buffer + done) != length) {
+      free(extents);
+      return -EIO;
+    }
+    done += length;
+  }
+  free(extents);
+  return done;
+}
+
+/* bench_library: Runs the benchmarks of the fat12 library functions
+   on a volume file.
+   
+   Parameters:
+     filename: name of the volume file.
+     iterations: number of repetitions of each benchmark.
+     flags: flags passed to open_volume_file_flags.
+   Returns:
+     0 in case of success, 1 if the volume could not be opened.
+ */
+static int bench_library(const char *filename, unsigned int iterations, int flags) {
+  samples s = { 0 };
+  fat12volume *volume;
+  file_list files = { 0 };
+  dir_record root;
+  dir_entry entry;
+  unsigned int i, f, cluster;
+  volatile unsigned int sink = 0;
+  double start;
+  char *buffer;
+  size_t max_size = 0;
+
+  printf("Volume file: %s (%s)\n\n", filename, (flags & VOLUME_OPEN_MMAP) ? "mmap" : "pread");
+  
+  // open_volume_file, including decoding of the FAT
+  for (i = 0; i < iterations; i++) {
+    start = now_ns();
+    volume = open_volume_file_flags(filename, flags);
+    add_sample(&s, now_ns() - start, 1);
+    if (!volume) {
+      fprintf(stderr, "Provided volume file is invalid or incomplete: %s.\n", filename);
+      return 1;
+    }
+    close_volume_file(volume);
+  }
+  report("open_volume_file", &s);
+
+  volume = open_volume_file_flags(filename, flags);
+
+  // get_next_cluster over the whole FAT, one sample per pass
+  for (i = 0; i < iterations; i++) {
+    start = now_ns();
+    for (cluster = 0; cluster < volume->fat_entries; cluster++)
+      sink += get_next_cluster(volume, cluster);
+    add_sample(&s, now_ns() - start, volume->fat_entries);
+  }
+  report("get_next_cluster (full FAT)", &s);
+
+  // bulk decoding of the whole FAT, scalar and vectorized
+  uint16_t *decoded = malloc(volume->fat_entries * sizeof(uint16_t));
+  for (i = 0; i < iterations; i++) {
+    start = now_ns();
+    decode_fat_entries_scalar(volume->fat_array, 0, volume->fat_entries, decoded);
+    add_sample(&s, now_ns() - start, volume->fat_entries);
+  }
+  report("decode_fat_entries (scalar)", &s);
+  for (i = 0; i < iterations; i++) {
+    start = now_ns();
+    decode_fat_entries(volume->fat_array, 0, volume->fat_entries, decoded);
+    add_sample(&s, now_ns() - start, volume->fat_entries);
+  }
+  report("decode_fat_entries (simd)", &s);
+  free(decoded);
+
+  find_directory_record(volume, "/", &root);
+  list_volume_files(volume, &root, "", &files);
+  close_volume_file(volume);
+  if (files.count == 0) {
+    printf("No files found in the volume.\n");
+    return 0;
+  }
+
+  // cold lookups: every lookup runs on a freshly opened volume
+  for (i = 0; i < iterations; i++) {
+    volume = open_volume_file_flags(filename, flags);
+    f = i % files.count;
+    start = now_ns();
+    find_directory_entry(volume, files.paths[f], &entry);
+    add_sample(&s, now_ns() - start, 1);
+    close_volume_file(volume);
+  }
+  report("find_directory_entry (cold)", &s);
+
+  // hot lookups: all paths are already in the dentry cache
+  volume = open_volume_file_flags(filename, flags);
+  for (f = 0; f < files.count; f++)
+    find_directory_entry(volume, files.paths[f], &entry);
+  for (i = 0; i < iterations; i++) {
+    start = now_ns();
+    for (f = 0; f < files.count; f++)
+      find_directory_entry(volume, files.paths[f], &entry);
+    add_sample(&s, now_ns() - start, files.count);
+  }
+  report("find_directory_entry (hot)", &s);
+
+  // full-file reads, one sample per file
+  for (f = 0; f < files.count; f++)
+    if (files.sizes[f] > max_size)
+      max_size = files.sizes[f];
+  buffer = malloc(max_size + volume->cluster_size * volume->sector_size);
+  double bytes = 0;
+  for (i = 0; i < iterations; i++) {
+    for (f = 0; f < files.count; f++) {
+      find_directory_entry(volume, files.paths[f], &entry);
+      start = now_ns();
+      if (read_whole_file(volume, &entry, buffer) < 0)
+	fprintf(stderr, "Could not read %s.\n", files.paths[f]);
+      add_sample(&s, now_ns() - start, 1);
+      bytes += entry.size;
+    }
+  }
+  printf("%-28s %12.1f MiB/s\n", "full-file reads", bytes / (1 << 20) / (s.total / 1e9));
+  report("full-file reads", &s);
+
+  free(buffer);
+  close_volume_file(volume);
+  for (f = 0; f < files.count; f++)
+    free(files.paths[f]);
+  free(files.paths);
+  free(files.sizes);
+  
+  return 0;
+}
+
+/* Files found by nftw in the mount benchmark */
+static file_list mount_files;
+
+static int collect_mount_file(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+  if (type == FTW_F)
+    add_file(&mount_files, path, st->st_size);
+  return 0;
+}
+
+/* Data structure with the parameters and results of a reader thread
+   in the mount benchmark */
+typedef struct reader {
+  pthread_t thread;
+  unsigned int seed;
+  double deadline;
+  samples reads, stats;
+  double bytes;
+} reader;
+
+/* reader_thread: Reads randomly chosen files of the mount from start
+   to end, and stats randomly chosen files, until the deadline. */
+static void *reader_thread(void *arg) {
+  reader *r = arg;
+  char buffer[128 * 1024];
+  struct stat st;
+  double start;
+  unsigned int f;
+  ssize_t rv;
+  int fd;
+
+  while (now_ns() < r->deadline) {
+    f = rand_r(&r->seed) % mount_files.count;
+    start = now_ns();
+    stat(mount_files.paths[rand_r(&r->seed) % mount_files.count], &st);
+    add_sample(&r->stats, now_ns() - start, 1);
+
+    start = now_ns();
+    fd = open(mount_files.paths[f], O_RDONLY);
+    if (fd < 0)
+      continue;
+    while ((rv = read(fd, buffer, sizeof(buffer))) > 0)
+      r->bytes += rv;
+    close(fd);
+    add_sample(&r->reads, now_ns() - start, 1);
+  }
+  return NULL;
+}
+
+/* bench_mount: Runs parallel readers against a mounted fat12fs.
+   
+   Parameters:
+     mountpoint: directory where fat12fs is mounted.
+     threads: number of reader threads.
+     seconds: duration of the benchmark.
+   Returns:
+     0 in case of success, 1 in case of error.
+ */
+static int bench_mount(const char *mountpoint, unsigned int threads, unsigned int seconds) {
+  reader *readers = calloc(threads, sizeof(reader));
+  samples reads = { 0 }, stats = { 0 };
+  double bytes = 0, start, deadline;
+  unsigned int t, i;
+
+  if (nftw(mountpoint, collect_mount_file, 16, FTW_PHYS) < 0 || mount_files.count == 0) {
+    fprintf(stderr, "No files found in %s.\n", mountpoint);
+    return 1;
+  }
+
+  printf("Mount point: %s (%u files, %u threads, %u s)\n\n", mountpoint,
+	 mount_files.count, threads, seconds);
+  
+  start = now_ns();
+  deadline = start + seconds * 1e9;
+  for (t = 0; t < threads; t++) {
+    readers[t].seed = t + 1;
+    readers[t].deadline = deadline;
+    pthread_create(&readers[t].thread, NULL, reader_thread, &readers[t]);
+  }
+  for (t = 0; t < threads; t++) {
+    pthread_join(readers[t].thread, NULL);
+    for (i = 0; i < readers[t].reads.count; i++)
+      add_sample(&reads, readers[t].reads.values[i], 1);
+    for (i = 0; i < readers[t].stats.count; i++)
+      add_sample(&stats, readers[t].stats.values[i], 1);
+    bytes += readers[t].bytes;
+    free(readers[t].reads.values);
+    free(readers[t].stats.values);
+  }
+
+  // throughput is measured against wall time, not the sum of samples
+  reads.total = stats.total = now_ns() - start;
+  printf("%-28s %12.1f MiB/s\n", "aggregate read bandwidth", bytes / (1 << 20) / (reads.total / 1e9));
+  report("stat", &stats);
+  report("whole-file read", &reads);
+  free(readers);
+  
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+
+  unsigned int iterations = DEFAULT_ITERATIONS;
+  unsigned int threads = DEFAULT_THREADS, seconds = DEFAULT_SECONDS;
+  const char *mountpoint = NULL;
+  int flags = VOLUME_OPEN_MMAP;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:m:t:d:p")) != -1) {
+    switch (opt) {
+    case 'n': iterations = atoi(optarg); break;
+    case 'm': mountpoint = optarg; break;
+    case 't': threads = atoi(optarg); break;
+    case 'd': seconds = atoi(optarg); break;
+    case 'p': flags &= ~VOLUME_OPEN_MMAP; break;
+    default: goto usage;
+    }
+  }
+
+  if (mountpoint && optind == argc && threads > 0)
+    return bench_mount(mountpoint, threads, seconds);
+  if (!mountpoint && optind == argc - 1 && iterations > 0)
+    return bench_library(argv[optind], iterations, flags);
+
+ usage:
+  fprintf(stderr, "Usage: %s [-n iterations] [-p] volume_file\n"
+	  "       %s -m mountpoint [-t threads] [-d seconds]\n", argv[0], argv[0]);
+  return 1;
+}
@@ -0,0 +1,289 @@
+#include "fat12cache.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+/* Cluster stored in the cache */
+typedef struct cache_entry {
+  /* Next entry in the same hash bucket */
+  struct cache_entry *hash_next;
+  /* Neighbours in the LRU list of the shard (most recent first) */
+  struct cache_entry *lru_prev, *lru_next;
+  unsigned int volume_id;
+  unsigned int cluster;
+  unsigned int length;
+  char data[];
+} cache_entry;
+
+/* Independent portion of the cache, with its own lock, hash table,
+   LRU list and share of the memory budget */
+typedef struct cache_shard {
+  pthread_mutex_t lock;
+  unsigned int num_buckets;
+  cache_entry **buckets;
+  cache_entry *lru_head, *lru_tail;
+  size_t budget;
+  size_t bytes;
+  unsigned long entries, hits, misses, evictions;
+} cache_shard;
+
+struct cluster_cache {
+  cache_shard shards[CACHE_SHARDS];
+};
+
+/* cache_hash: Mixes a volume identifier and a cluster number into a
+   hash value used to select both the shard and the bucket. */
+static unsigned int cache_hash(unsigned int volume_id, unsigned int cluster) {
+  unsigned int hash = volume_id * 0x9e3779b1u ^ cluster;
+  hash ^= hash >> 15;
+  hash *= 0x2c1b3c6du;
+  hash ^= hash >> 12;
+  return hash;
+}
+
+/* lru_unlink: Removes an entry from the LRU list of its shard. */
+static void lru_unlink(cache_shard *shard, cache_entry *entry) {
+  if (entry->lru_prev)
+    entry->lru_prev->lru_next = entry->lru_next;
+  else
+    shard->lru_head = entry->lru_next;
+  if (entry->lru_next)
+    entry->lru_next->lru_prev = entry->lru_prev;
+  else
+    shard->lru_tail = entry->lru_prev;
+}
+
+/* lru_push: Inserts an entry at the front (most recently used end)
+   of the LRU list of its shard. */
+static void lru_push(cache_shard *shard, cache_entry *entry) {
+  entry->lru_prev = NULL;
+  entry->lru_next = shard->lru_head;
+  if (shard->lru_head)
+    shard->lru_head->lru_prev = entry;
+  else
+    shard->lru_tail = entry;
+  shard->lru_head = entry;
+}
+
+/* shard_remove: Removes an entry from the shard's hash table and LRU
+   list, and frees it. Must be called with the shard lock held. */
+static void shard_remove(cache_shard *shard, cache_entry *entry, unsigned int bucket) {
+  cache_entry **p;
+
+  for (p = &shard->buckets[bucket]; *p != entry; p = &(*p)->hash_next);
+  *p = entry->hash_next;
+  lru_unlink(shard, entry);
+  shard->bytes -= entry->length;
+  shard->entries--;
+  free(entry);
+}
+
+/* cluster_cache_create: Allocates an empty cluster cache.
+   
+   Parameters:
+     budget: maximum number of bytes of cluster data kept in the
+             cache. The budget is split evenly between the shards.
+   Returns:
+     A pointer to the new cache, or NULL if it could not be allocated.
+ */
+cluster_cache *cluster_cache_create(size_t budget) {
+  cluster_cache *cache = calloc(1, sizeof(cluster_cache));
+  unsigned int s;
+
+  if (!cache)
+    return NULL;
+
+  for (s = 0; s < CACHE_SHARDS; s++) {
+    cache_shard *shard = &cache->shards[s];
+    shard->budget = budget / CACHE_SHARDS;
+    // size the table for clusters of 2 KiB, the usual floppy layout
+    for (shard->num_buckets = 64; shard->num_buckets < shard->budget / 2048; shard->num_buckets *= 2);
+    shard->buckets = calloc(shard->num_buckets, sizeof(cache_entry *));
+    if (!shard->buckets || pthread_mutex_init(&shard->lock, NULL)) {
+      free(shard->buckets);
+      while (s-- > 0) {
+	free(cache->shards[s].buckets);
+	pthread_mutex_destroy(&cache->shards[s].lock);
+      }
+      free(cache);
+      return NULL;
+    }
+  }
+  return cache;
+}
+
+/* cluster_cache_destroy: Frees a cluster cache and all clusters
+   stored in it.
+   
+   Parameters:
+     cache: cache to be freed. May be NULL.
+ */
+void cluster_cache_destroy(cluster_cache *cache) {
+  cache_entry *entry, *next;
+  unsigned int s;
+
+  if (!cache)
+    return;
+
+  for (s = 0; s < CACHE_SHARDS; s++) {
+    for (entry = cache->shards[s].lru_head; entry; entry = next) {
+      next = entry->lru_next;
+      free(entry);
+    }
+    free(cache->shards[s].buckets);
+    pthread_mutex_destroy(&cache->shards[s].lock);
+  }
+  free(cache);
+}
+
+/* cluster_cache_get: Looks up a cluster in the cache and, if found,
+   copies part of its data to the caller's buffer.
+   
+   Parameters:
+     cache: cluster cache.
+     volume_id: identifier of the volume the cluster belongs to.
+     cluster: number of the cluster.
+     offset: offset of the first byte to copy within the cluster.
+     length: number of bytes to copy.
+     buffer: where the data is to be copied.
+   Returns:
+     1 if the cluster was found and the data copied, or 0 if the
+     cluster is not in the cache (or is shorter than offset+length).
+ */
+int cluster_cache_get(cluster_cache *cache, unsigned int volume_id, unsigned int cluster,
+		      unsigned int offset, unsigned int length, char *buffer) {
+  unsigned int hash = cache_hash(volume_id, cluster);
+  cache_shard *shard = &cache->shards[hash % CACHE_SHARDS];
+  cache_entry *entry;
+  int found = 0;
+
+  pthread_mutex_lock(&shard->lock);
+  for (entry = shard->buckets[(hash / CACHE_SHARDS) & (shard->num_buckets - 1)]; entry;
+       entry = entry->hash_next) {
+    if (entry->volume_id == volume_id && entry->cluster == cluster) {
+      if (offset + length <= entry->length) {
+	memcpy(buffer, entry->data + offset, length);
+	// move the cluster to the most recently used end
+	lru_unlink(shard, entry);
+	lru_push(shard, entry);
+	found = 1;
+      }
+      break;
+    }
+  }
+  if (found)
+    shard->hits++;
+  else
+    shard->misses++;
+  pthread_mutex_unlock(&shard->lock);
+
+  return found;
+}
+
+/* cluster_cache_put: Stores a copy of a cluster in the cache,
+   evicting least recently used clusters of the same shard as needed
+   to stay within its budget. If the cluster is already in the cache,
+   its data is replaced.
+   
+   Parameters:
+     cache: cluster cache.
+     volume_id: identifier of the volume the cluster belongs to.
+     cluster: number of the cluster.
+     data: data of the cluster.
+     length: number of bytes in the cluster.
+ */
+void cluster_cache_put(cluster_cache *cache, unsigned int volume_id, unsigned int cluster,
+		       const char *data, unsigned int length) {
+  unsigned int hash = cache_hash(volume_id, cluster);
+  cache_shard *shard = &cache->shards[hash % CACHE_SHARDS];
+  unsigned int bucket = (hash / CACHE_SHARDS) & (shard->num_buckets - 1);
+  cache_entry *entry, *old;
+
+  if (length > shard->budget)
+    return;
+
+  // copy the data before taking the lock
+  entry = malloc(sizeof(cache_entry) + length);
+  if (!entry)
+    return;
+  entry->volume_id = volume_id;
+  entry->cluster = cluster;
+  entry->length = length;
+  memcpy(entry->data, data, length);
+
+  pthread_mutex_lock(&shard->lock);
+  for (old = shard->buckets[bucket]; old; old = old->hash_next) {
+    if (old->volume_id == volume_id && old->cluster == cluster) {
+      shard_remove(shard, old, bucket);
+      break;
+    }
+  }
+  while (shard->bytes + length > shard->budget) {
+    old = shard->lru_tail;
+    shard_remove(shard, old, (cache_hash(old->volume_id, old->cluster) / CACHE_SHARDS) &
+		 (shard->num_buckets - 1));
+    shard->evictions++;
+  }
+  entry->hash_next = shard->buckets[bucket];
+  shard->buckets[bucket] = entry;
+  lru_push(shard, entry);
+  shard->bytes += length;
+  shard->entries++;
+  pthread_mutex_unlock(&shard->lock);
+}
+
+/* cluster_cache_get_stats: Obtains the statistics of a cluster cache.
+   
+   Parameters:
+     cache: cluster cache.
+     stats: pointer to a structure where the statistics, summed over
+            all shards, will be stored.
+ */
+void cluster_cache_get_stats(cluster_cache *cache, cluster_cache_stats *stats) {
+  unsigned int s;
+
+  memset(stats, 0, sizeof(cluster_cache_stats));
+  for (s = 0; s < CACHE_SHARDS; s++) {
+    cache_shard *shard = &cache->shards[s];
+    pthread_mutex_lock(&shard->lock);
+    stats->hits += shard->hits;
+    stats->misses += shard->misses;
+    stats->evictions += shard->evictions;
+    stats->entries += shard->entries;
+    stats->bytes += shard->bytes;
+    pthread_mutex_unlock(&shard->lock);
+  }
+}
+
+/* cluster_cache_update: Patches the cached copy of a cluster after
+   part of it has been written to the volume. Nothing is done if the
+   cluster is not in the cache.
+   
+   Parameters:
+     cache: cluster cache.
+     volume_id: identifier of the volume the cluster belongs to.
+     cluster: number of the cluster.
+     offset: offset of the first byte written within the cluster.
+     length: number of bytes written.
+     data: bytes written.
+ */
+void cluster_cache_update(cluster_cache *cache, unsigned int volume_id, unsigned int cluster,
+			  unsigned int offset, unsigned int length, const char *data) {
+  unsigned int hash = cache_hash(volume_id, cluster);
+  cache_shard *shard = &cache->shards[hash % CACHE_SHARDS];
+  cache_entry *entry;
+
+  pthread_mutex_lock(&shard->lock);
+  for (entry = shard->buckets[(hash / CACHE_SHARDS) & (shard->num_buckets - 1)]; entry;
+       entry = entry->hash_next) {
+    if (entry->volume_id == volume_id && entry->cluster == cluster) {
+      if (offset + length <= entry->length)
+	memcpy(entry->data + offset, data, length);
+      else
+	shard_remove(shard, entry, (hash / CACHE_SHARDS) & (shard->num_buckets - 1));
+      break;
+    }
+  }
+  pthread_mutex_unlock(&shard->lock);
+}
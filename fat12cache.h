@@ -0,0 +1,39 @@
+#ifndef _FAT12CACHE_H_
+#define _FAT12CACHE_H_
+
+#include "fat12.h"
+
+/* Number of independent shards in a cluster cache. Each shard has
+   its own lock and LRU list, so lookups of different clusters rarely
+   contend with each other. */
+#define CACHE_SHARDS 16
+
+/* Default memory budget of a cluster cache, in bytes */
+#define CACHE_DEFAULT_BUDGET (64 << 20)
+
+/* Statistics of a cluster cache, summed over all shards */
+typedef struct cluster_cache_stats {
+  /* Number of lookups that found the cluster in the cache */
+  unsigned long hits;
+  /* Number of lookups that did not find the cluster */
+  unsigned long misses;
+  /* Number of clusters evicted to stay within the budget */
+  unsigned long evictions;
+  /* Number of clusters currently in the cache */
+  unsigned long entries;
+  /* Number of bytes of cluster data currently in the cache */
+  size_t bytes;
+} cluster_cache_stats;
+
+cluster_cache *cluster_cache_create(size_t budget);
+void cluster_cache_destroy(cluster_cache *cache);
+
+int cluster_cache_get(cluster_cache *cache, unsigned int volume_id, unsigned int cluster,
+		      unsigned int offset, unsigned int length, char *buffer);
+void cluster_cache_put(cluster_cache *cache, unsigned int volume_id, unsigned int cluster,
+		       const char *data, unsigned int length);
+void cluster_cache_update(cluster_cache *cache, unsigned int volume_id, unsigned int cluster,
+			  unsigned int offset, unsigned int length, const char *data);
+void cluster_cache_get_stats(cluster_cache *cache, cluster_cache_stats *stats);
+
+#endif
@@ -0,0 +1,499 @@
+#include "fat12check.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+
+/* Directory waiting to be scanned: its path, and the clusters of its
+   chain that were claimed for it (see walk_chain) */
+typedef struct check_task {
+  char *path;
+  unsigned int first_cluster;
+  unsigned int num_clusters;
+} check_task;
+
+/* Queue of directories of a worker. The worker pushes and pops
+   directories at the tail, so it walks its part of the tree depth
+   first, while idle workers steal them from the head, where the
+   directories closest to the root (and thus likely the largest
+   subtrees) are. */
+typedef struct check_deque {
+  pthread_mutex_t lock;
+  check_task *tasks;
+  unsigned int head, tail, capacity;
+} check_deque;
+
+/* Shared state of a check */
+typedef struct check_state {
+  fat12volume *volume;
+  unsigned int num_workers;
+  check_deque *deques;
+  /* Number of directories queued or being scanned; the walk is over
+     once it drops to zero */
+  unsigned int pending;
+  /* Chain that claimed each cluster (0 if none), and last chain
+     number handed out */
+  uint32_t *owner;
+  uint32_t last_chain;
+  check_result *result;
+  check_report_fn report;
+  void *arg;
+  pthread_mutex_t report_lock;
+} check_state;
+
+/* Argument of a worker thread */
+typedef struct check_worker {
+  check_state *state;
+  unsigned int id;
+  pthread_t thread;
+} check_worker;
+
+/* report_problem: Counts a problem (unless counter is NULL) and
+   passes it to the report function of the check, if any. */
+static void report_problem(check_state *state, unsigned int *counter, const char *path,
+			   const char *problem) {
+
+  if (counter)
+    __atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+  if (!state->report)
+    return;
+  pthread_mutex_lock(&state->report_lock);
+  state->report(path, problem, state->arg);
+  pthread_mutex_unlock(&state->report_lock);
+}
+
+/* push_task: Queues a directory in the deque of a worker. */
+static int push_task(check_state *state, unsigned int worker, char *path,
+		     unsigned int first_cluster, unsigned int num_clusters) {
+
+  check_deque *deque = &state->deques[worker];
+  check_task *grown;
+  unsigned int capacity;
+
+  pthread_mutex_lock(&deque->lock);
+  if (deque->tail == deque->capacity) {
+    // reclaim the space left by stolen tasks before growing
+    if (deque->head > 0) {
+      memmove(deque->tasks, deque->tasks + deque->head,
+	      (deque->tail - deque->head) * sizeof(check_task));
+      deque->tail -= deque->head;
+      deque->head = 0;
+    } else {
+      capacity = deque->capacity ? deque->capacity * 2 : 64;
+      grown = realloc(deque->tasks, capacity * sizeof(check_task));
+      if (!grown) {
+	pthread_mutex_unlock(&deque->lock);
+	return -ENOMEM;
+      }
+      deque->tasks = grown;
+      deque->capacity = capacity;
+    }
+  }
+  __atomic_add_fetch(&state->pending, 1, __ATOMIC_RELAXED);
+  deque->tasks[deque->tail++] = (check_task) { path, first_cluster, num_clusters };
+  pthread_mutex_unlock(&deque->lock);
+  return 0;
+}
+
+/* take_task: Takes a directory to scan, from the tail of the deque of
+   a worker or, if it is empty, from the head of another one.
+   
+   Returns:
+     1 if a task was stored in task, 0 if all deques are empty.
+ */
+static int take_task(check_state *state, unsigned int worker, check_task *task) {
+
+  check_deque *deque = &state->deques[worker];
+  unsigned int i;
+
+  pthread_mutex_lock(&deque->lock);
+  if (deque->head < deque->tail) {
+    *task = deque->tasks[--deque->tail];
+    pthread_mutex_unlock(&deque->lock);
+    return 1;
+  }
+  pthread_mutex_unlock(&deque->lock);
+
+  for (i = 1; i < state->num_workers; i++) {
+    deque = &state->deques[(worker + i) % state->num_workers];
+    pthread_mutex_lock(&deque->lock);
+    if (deque->head < deque->tail) {
+      *task = deque->tasks[deque->head++];
+      pthread_mutex_unlock(&deque->lock);
+      return 1;
+    }
+    pthread_mutex_unlock(&deque->lock);
+  }
+  return 0;
+}
+
+/* walk_chain: Follows the cluster chain of a file or directory,
+   claiming each of its clusters for it. A chain stops at the first
+   cluster that is not valid, or that was already claimed, by another
+   chain (a cross link) or by itself (a loop).
+   
+   Parameters:
+     state: state of the check.
+     first_cluster: first cluster of the chain (0 for an empty one).
+     path: path of the file or directory, for the report.
+     complete: set to 1 if the chain ends with an end of chain mark,
+               or 0 if it stops because of a problem.
+   Returns:
+     The number of clusters claimed for the chain.
+ */
+static unsigned int walk_chain(check_state *state, unsigned int first_cluster, const char *path,
+			       int *complete) {
+
+  fat12volume *volume = state->volume;
+  check_result *result = state->result;
+  uint32_t chain = __atomic_add_fetch(&state->last_chain, 1, __ATOMIC_RELAXED), expected;
+  unsigned int cluster = first_cluster, next, count = 0;
+  char problem[96];
+
+  *complete = 0;
+  if (first_cluster == 0) {
+    *complete = 1;
+    return 0;
+  }
+
+  while (1) {
+    if (cluster < 2 || cluster >= volume->fat_entries ||
+	(next = volume->fat_next[cluster]) == 0 || next == 0xff7) {
+      snprintf(problem, sizeof(problem), "chain leads to %s cluster %u",
+	       cluster < 2 || cluster >= volume->fat_entries ? "invalid" :
+	       volume->fat_next[cluster] ? "bad" : "free", cluster);
+      report_problem(state, &result->bad_chains, path, problem);
+      return count;
+    }
+
+    expected = 0;
+    if (!__atomic_compare_exchange_n(&state->owner[cluster], &expected, chain, 0,
+				     __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+      if (expected == chain) {
+	snprintf(problem, sizeof(problem), "chain loops back to cluster %u", cluster);
+	report_problem(state, &result->loops, path, problem);
+      } else {
+	snprintf(problem, sizeof(problem), "chain is cross-linked at cluster %u", cluster);
+	report_problem(state, &result->cross_links, path, problem);
+      }
+      return count;
+    }
+    count++;
+
+    if (next >= 0xff8) {
+      *complete = 1;
+      return count;
+    }
+    cluster = next;
+  }
+}
+
+/* check_entry: Checks the chain of an entry found in a directory, and
+   queues it for scanning if it is a directory.
+   
+   Returns:
+     0 in case of success, or -ENOMEM.
+ */
+static int check_entry(check_state *state, unsigned int worker, const char *parent,
+		       const char *data) {
+
+  fat12volume *volume = state->volume;
+  unsigned int cluster_bytes = volume->cluster_size * volume->sector_size;
+  unsigned int count;
+  uint64_t needed;
+  dir_record record;
+  char name[13], problem[96], *path;
+  int complete, rv = 0;
+
+  fill_directory_record(data, &record, name);
+  path = malloc(strlen(parent) + strlen(name) + 2);
+  if (!path)
+    return -ENOMEM;
+  sprintf(path, "%s/%s", parent, name);
+
+  count = walk_chain(state, record.first_cluster, path, &complete);
+
+  if (record.attributes & ATTR_DIRECTORY) {
+    __atomic_add_fetch(&state->result->directories, 1, __ATOMIC_RELAXED);
+    if (record.first_cluster == 0)
+      report_problem(state, &state->result->bad_chains, path, "directory has no clusters");
+    // a directory whose first cluster belongs to another chain is not
+    // scanned, which also keeps the walk from running in circles
+    if (count > 0 && (rv = push_task(state, worker, path, record.first_cluster, count)) == 0)
+      return 0;
+  } else {
+    __atomic_add_fetch(&state->result->files, 1, __ATOMIC_RELAXED);
+    needed = ((uint64_t) record.size + cluster_bytes - 1) / cluster_bytes;
+    if (complete && count < needed) {
+      snprintf(problem, sizeof(problem), "size is %u bytes, but the chain has %u clusters",
+	       record.size, count);
+      report_problem(state, &state->result->size_mismatches, path, problem);
+    } else if (complete && count > needed) {
+      // a file is extended in the FAT before its entry is written (see
+      // flush_fat), so the clusters past its size are only lost space
+      __atomic_add_fetch(&state->result->lost_clusters, count - needed, __ATOMIC_RELAXED);
+      __atomic_add_fetch(&state->result->lost_chains, 1, __ATOMIC_RELAXED);
+      snprintf(problem, sizeof(problem), "size is %u bytes, but the chain has %u clusters",
+	       record.size, count);
+      report_problem(state, NULL, path, problem);
+    }
+  }
+  free(path);
+  return rv;
+}
+
+/* scan_entries: Checks the entries of a block of a directory.
+   
+   Returns:
+     1 if the end of the directory was found, 0 if the following
+     block must be scanned as well, or -ENOMEM.
+ */
+static int scan_entries(check_state *state, unsigned int worker, const char *path,
+			const char *data, unsigned int num_entries) {
+
+  const char *entry;
+  unsigned int i;
+  int rv;
+
+  for (i = 0; i < num_entries; i++) {
+    entry = data + i * DIR_ENTRY_SIZE;
+    if (entry[0] == 0)
+      return 1;
+    // skip deleted entries, volume labels (and long name entries),
+    // and the . and .. entries of subdirectories
+    if ((unsigned char) entry[0] == 0xe5 || (entry[11] & ATTR_VOLUME_ID) ||
+	!memcmp(entry, ".          ", 11) || !memcmp(entry, "..         ", 11))
+      continue;
+    if ((rv = check_entry(state, worker, path, entry)) < 0)
+      return rv;
+  }
+  return 0;
+}
+
+/* scan_task: Checks all entries of a queued directory. */
+static int scan_task(check_state *state, unsigned int worker, const check_task *task) {
+
+  fat12volume *volume = state->volume;
+  unsigned int cluster_bytes = volume->cluster_size * volume->sector_size;
+  unsigned int cluster = task->first_cluster, n;
+  char problem[96], *data;
+  int rv = 0;
+
+  if (cluster == 0)
+    return scan_entries(state, worker, task->path, volume->rootdir_array,
+			volume->rootdir_entries);
+
+  for (n = 0; n < task->num_clusters && rv == 0; n++, cluster = volume->fat_next[cluster]) {
+    if (borrow_cluster(volume, cluster, &data) != cluster_bytes) {
+      snprintf(problem, sizeof(problem), "cluster %u could not be read", cluster);
+      report_problem(state, &state->result->bad_chains, task->path, problem);
+      return_cluster(volume, data);
+      return 0;
+    }
+    rv = scan_entries(state, worker, task->path, data, cluster_bytes / DIR_ENTRY_SIZE);
+    return_cluster(volume, data);
+  }
+  return rv < 0 ? rv : 0;
+}
+
+/* check_worker_main: Main function of a worker, which scans
+   directories until there are none left. */
+static void *check_worker_main(void *arg) {
+
+  check_worker *worker = arg;
+  check_state *state = worker->state;
+  check_task task;
+
+  while (__atomic_load_n(&state->pending, __ATOMIC_RELAXED) > 0) {
+    if (!take_task(state, worker->id, &task)) {
+      sched_yield();
+      continue;
+    }
+    if (scan_task(state, worker->id, &task) < 0)
+      report_problem(state, &state->result->bad_chains, task.path,
+		     "directory could not be scanned (out of memory)");
+    free(task.path);
+    __atomic_sub_fetch(&state->pending, 1, __ATOMIC_RELAXED);
+  }
+  return NULL;
+}
+
+/* compare_fat_copies: Compares every copy of the FAT, as stored in
+   the volume file, with the first one, sector by sector. */
+static int compare_fat_copies(check_state *state) {
+
+  fat12volume *volume = state->volume;
+  size_t fat_bytes = (size_t) volume->fat_num_sectors * volume->sector_size;
+  size_t total = fat_bytes * volume->fat_copies;
+  unsigned int copy, sector, differ;
+  char problem[96], *copies;
+
+  if (volume->fat_copies < 2)
+    return 0;
+  // the copies are next to each other, so they are read all at once
+  copies = malloc(total);
+  if (!copies)
+    return -ENOMEM;
+  if (read_data(volume, (off_t) volume->fat_offset * volume->sector_size, total, copies) !=
+      total) {
+    report_problem(state, &state->result->fat_mismatches, "", "FAT copies could not be read");
+    free(copies);
+    return 0;
+  }
+
+  for (copy = 1; copy < volume->fat_copies; copy++) {
+    if (!memcmp(copies, copies + copy * fat_bytes, fat_bytes))
+      continue;
+    for (sector = 0, differ = 0; sector < volume->fat_num_sectors; sector++)
+      differ += memcmp(copies + (size_t) sector * volume->sector_size,
+		       copies + copy * fat_bytes + (size_t) sector * volume->sector_size,
+		       volume->sector_size) != 0;
+    state->result->fat_mismatches += differ;
+    snprintf(problem, sizeof(problem), "FAT copy %u differs from the first one in %u sectors",
+	     copy + 1, differ);
+    report_problem(state, NULL, "", problem);
+  }
+  free(copies);
+  return 0;
+}
+
+/* count_lost_clusters: Counts the clusters in use that no chain
+   claimed, and the chains they form (one per lost cluster that no
+   other lost cluster points to), adding them to those found past the
+   end of files. */
+static void count_lost_clusters(check_state *state) {
+
+  fat12volume *volume = state->volume;
+  unsigned int cluster, next, chains = 0, lost = 0;
+  unsigned char *pointed = calloc(volume->fat_entries, 1);
+  char problem[96];
+
+#define IS_LOST(c) (!state->owner[c] && volume->fat_next[c] != 0 && volume->fat_next[c] != 0xff7)
+
+  for (cluster = 2; cluster < volume->fat_entries; cluster++) {
+    if (!IS_LOST(cluster))
+      continue;
+    lost++;
+    next = volume->fat_next[cluster];
+    if (pointed && next >= 2 && next < volume->fat_entries)
+      pointed[next] = 1;
+  }
+  for (cluster = 2; pointed && cluster < volume->fat_entries; cluster++)
+    if (IS_LOST(cluster) && !pointed[cluster])
+      chains++;
+
+#undef IS_LOST
+
+  free(pointed);
+  state->result->lost_clusters += lost;
+  state->result->lost_chains += chains;
+  if (lost > 0) {
+    snprintf(problem, sizeof(problem), "%u lost clusters in %u chains", lost, chains);
+    report_problem(state, NULL, "", problem);
+  }
+}
+
+/* check_volume: Checks the integrity of a volume: compares all copies
+   of the FAT, walks the directory tree with several threads, which
+   share the work by stealing directories from each other, following
+   the chain of every file and directory, and finally looks for lost
+   clusters. Changes to a writable volume that are still in memory
+   are not taken into account, so it should be checked before it is
+   modified.
+   
+   Parameters:
+     volume: pointer to FAT12 volume data structure.
+     threads: number of threads walking the tree (0 for
+              CHECK_DEFAULT_THREADS), including the calling thread.
+     result: where the number of problems of each kind is stored.
+     report: function called for every problem found, or NULL.
+     arg: argument passed to report.
+   Returns:
+     0 if the check was completed (whether problems were found or
+     not, see check_has_errors), -EIO if the FAT or root directory
+     could not be read, or -ENOMEM.
+ */
+int check_volume(fat12volume *volume, unsigned int threads, check_result *result,
+		 check_report_fn report, void *arg) {
+
+  check_state state = { .volume = volume, .result = result, .report = report, .arg = arg };
+  check_worker workers[CHECK_MAX_THREADS];
+  char *root;
+  unsigned int i;
+  int rv;
+
+  memset(result, 0, sizeof(check_result));
+  if (threads == 0)
+    threads = CHECK_DEFAULT_THREADS;
+  if (threads > CHECK_MAX_THREADS)
+    threads = CHECK_MAX_THREADS;
+
+  lock_volume(volume, 0);
+  if ((rv = load_volume_metadata(volume)) < 0) {
+    unlock_volume(volume);
+    return rv;
+  }
+
+  state.owner = calloc(volume->fat_entries, sizeof(uint32_t));
+  state.deques = calloc(threads, sizeof(check_deque));
+  root = strdup("");
+  if (!state.owner || !state.deques || !root) {
+    rv = -ENOMEM;
+    goto out;
+  }
+  pthread_mutex_init(&state.report_lock, NULL);
+  for (i = 0; i < threads; i++)
+    pthread_mutex_init(&state.deques[i].lock, NULL);
+  state.num_workers = threads;
+  if ((rv = push_task(&state, 0, root, 0, 0)) < 0)
+    goto destroy;
+  root = NULL;
+
+  // the calling thread compares the FAT copies while the others start
+  // walking the tree, and then joins them as worker 0
+  for (i = 0; i < threads; i++) {
+    workers[i].state = &state;
+    workers[i].id = i;
+  }
+  for (i = 1; i < threads; i++)
+    if (pthread_create(&workers[i].thread, NULL, check_worker_main, &workers[i]))
+      break;
+  threads = i;
+  rv = compare_fat_copies(&state);
+  check_worker_main(&workers[0]);
+  for (i = 1; i < threads; i++)
+    pthread_join(workers[i].thread, NULL);
+
+  count_lost_clusters(&state);
+
+ destroy:
+  for (i = 0; i < state.num_workers; i++) {
+    pthread_mutex_destroy(&state.deques[i].lock);
+    free(state.deques[i].tasks);
+  }
+  pthread_mutex_destroy(&state.report_lock);
+
+ out:
+  unlock_volume(volume);
+  free(root);
+  free(state.deques);
+  free(state.owner);
+  return rv;
+}
+
+/* check_has_errors: Tells whether the problems found by check_volume
+   make a volume unsafe to use. Lost clusters only waste space, so
+   they are not counted as errors.
+   
+   Parameters:
+     result: result of check_volume.
+   Returns:
+     Non-zero if the volume has errors, zero otherwise.
+ */
+int check_has_errors(const check_result *result) {
+  return result->fat_mismatches || result->bad_chains || result->cross_links ||
+    result->loops || result->size_mismatches;
+}
@@ -0,0 +1,48 @@
+#ifndef _FAT12CHECK_H_
+#define _FAT12CHECK_H_
+
+#include "fat12.h"
+
+/* Default number of threads walking the directory tree of a volume */
+#define CHECK_DEFAULT_THREADS 4
+/* Maximum number of threads walking the directory tree of a volume */
+#define CHECK_MAX_THREADS 64
+
+/* Data structure with the number of problems of each kind found by
+   check_volume */
+typedef struct check_result {
+
+  /* Number of files and directories (other than the root) found */
+  unsigned int files;
+  unsigned int directories;
+  /* Number of sectors, over all copies of the FAT after the first
+     one, that differ from the first copy */
+  unsigned int fat_mismatches;
+  /* Number of chains that start or continue at a cluster that is
+     free, reserved, marked bad or beyond the end of the volume */
+  unsigned int bad_chains;
+  /* Number of chains that run into a cluster of another chain */
+  unsigned int cross_links;
+  /* Number of chains that run into one of their own clusters */
+  unsigned int loops;
+  /* Number of files whose chain is too short for their size */
+  unsigned int size_mismatches;
+  /* Number of clusters in use that belong to no file or directory,
+     or that are past the end of the size of a file, and number of
+     chains they form */
+  unsigned int lost_clusters;
+  unsigned int lost_chains;
+
+} check_result;
+
+/* Function called by check_volume for every problem found, with the
+   path of the file or directory affected (empty for problems of the
+   volume itself) and a description of the problem. Calls are
+   serialized. */
+typedef void (*check_report_fn)(const char *path, const char *problem, void *arg);
+
+int check_volume(fat12volume *volume, unsigned int threads, check_result *result,
+		 check_report_fn report, void *arg);
+int check_has_errors(const check_result *result);
+
+#endif
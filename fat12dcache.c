@@ -0,0 +1,487 @@
+#include "fat12dcache.h"
+#include "fat12pool.h"
+#include "fat12meta.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+
+/* Number of buckets in the path and directory hash tables of the
+   dentry cache */
+#define DCACHE_PATH_BUCKETS 4096
+#define DCACHE_DIR_BUCKETS 256
+
+/* Entry in the path table of the dentry cache. Negative results
+   (-ENOENT, -ENOTDIR) are cached as well, since shells and tools
+   like 'find' look up missing files just as often as existing
+   ones. */
+typedef struct path_entry {
+  struct path_entry *next;
+  unsigned int hash;
+  int result;
+  dir_record record;
+  char path[];
+} path_entry;
+
+/* Dentry cache of a volume: results of full path lookups, plus the
+   name index of every directory read so far. */
+struct fat12dcache {
+  pthread_rwlock_t lock;
+  unsigned int num_paths;
+  path_entry *paths[DCACHE_PATH_BUCKETS];
+  dir_index *dirs[DCACHE_DIR_BUCKETS];
+};
+
+/* name_hash: Computes the FNV-1a hash of a string. */
+static unsigned int name_hash(const char *name) {
+  unsigned int hash = 2166136261u;
+  while (*name)
+    hash = (hash ^ (unsigned char) *name++) * 16777619u;
+  return hash;
+}
+
+/* name_hash_nocase: Computes the FNV-1a hash of a file name, with
+   ASCII letters folded to lowercase, so names that only differ in
+   case have the same hash. */
+static unsigned int name_hash_nocase(const char *name) {
+  unsigned int hash = 2166136261u;
+  while (*name)
+    hash = (hash ^ (unsigned char) tolower((unsigned char) *name++)) * 16777619u;
+  return hash;
+}
+
+/* free_paths: Frees all entries in the path table. Must be called
+   with the write lock held. */
+static void free_paths(fat12dcache *dcache) {
+  path_entry *p, *next;
+  int b;
+  
+  for (b = 0; b < DCACHE_PATH_BUCKETS; b++) {
+    for (p = dcache->paths[b]; p; p = next) {
+      next = p->next;
+      free(p);
+    }
+    dcache->paths[b] = NULL;
+  }
+  dcache->num_paths = 0;
+}
+
+/* free_dir_index: Frees a directory index and all its data. */
+static void free_dir_index(dir_index *index) {
+  free(index->entries);
+  free(index->names);
+  free(index->short_names);
+  free(index->buckets);
+  free(index->next);
+  free(index);
+}
+
+/* dcache_create: Allocates an empty dentry cache.
+   
+   Returns:
+     A pointer to the new cache, or NULL if it could not be allocated.
+ */
+fat12dcache *dcache_create(void) {
+  fat12dcache *dcache = calloc(1, sizeof(fat12dcache));
+
+  if (dcache && pthread_rwlock_init(&dcache->lock, NULL)) {
+    free(dcache);
+    return NULL;
+  }
+  return dcache;
+}
+
+/* dcache_destroy: Frees a dentry cache, including all its path
+   entries and directory indexes.
+   
+   Parameters:
+     dcache: cache to be freed. May be NULL.
+ */
+void dcache_destroy(fat12dcache *dcache) {
+  dir_index *d, *next;
+  int b;
+
+  if (!dcache)
+    return;
+  
+  free_paths(dcache);
+  for (b = 0; b < DCACHE_DIR_BUCKETS; b++) {
+    for (d = dcache->dirs[b]; d; d = next) {
+      next = d->hash_next;
+      free_dir_index(d);
+    }
+  }
+  pthread_rwlock_destroy(&dcache->lock);
+  free(dcache);
+}
+
+/* dcache_lookup_path: Looks up the result of a previous path
+   resolution in the dentry cache.
+   
+   Parameters:
+     dcache: dentry cache of the volume.
+     path: full path being resolved.
+     record: pointer to a dir_record structure where the cached
+             record will be stored, if the cached result is a success.
+   Returns:
+     1 if the path is not in the cache. Otherwise, the cached result
+     of find_directory_entry for the path (0, -ENOENT or -ENOTDIR).
+ */
+int dcache_lookup_path(fat12dcache *dcache, const char *path, dir_record *record) {
+  unsigned int hash = name_hash(path);
+  path_entry *p;
+  int result = 1;
+
+  pthread_rwlock_rdlock(&dcache->lock);
+  for (p = dcache->paths[hash % DCACHE_PATH_BUCKETS]; p; p = p->next) {
+    if (p->hash == hash && !strcmp(p->path, path)) {
+      result = p->result;
+      if (result == 0)
+	*record = p->record;
+      break;
+    }
+  }
+  pthread_rwlock_unlock(&dcache->lock);
+  
+  return result;
+}
+
+/* dcache_insert_path: Saves the result of a path resolution in the
+   dentry cache. Transient errors (e.g., -EIO) should not be cached.
+   
+   Parameters:
+     dcache: dentry cache of the volume.
+     path: full path that was resolved.
+     result: result of find_directory_entry for the path.
+     record: record found for the path. Only used if result is
+             zero. Its name must remain valid as long as the cache
+             (e.g., belong to a directory index or be a literal).
+ */
+void dcache_insert_path(fat12dcache *dcache, const char *path, int result,
+			const dir_record *record) {
+  unsigned int hash = name_hash(path);
+  size_t length = strlen(path) + 1;
+  path_entry *p = malloc(sizeof(path_entry) + length), *q;
+
+  if (!p)
+    return;
+  
+  p->hash = hash;
+  p->result = result;
+  if (result == 0)
+    p->record = *record;
+  memcpy(p->path, path, length);
+
+  pthread_rwlock_wrlock(&dcache->lock);
+  // another thread may have resolved the same path in the meantime
+  for (q = dcache->paths[hash % DCACHE_PATH_BUCKETS]; q; q = q->next) {
+    if (q->hash == hash && !strcmp(q->path, path))
+      break;
+  }
+  if (q) {
+    free(p);
+  } else {
+    if (dcache->num_paths >= DCACHE_MAX_PATHS)
+      free_paths(dcache);
+    p->next = dcache->paths[hash % DCACHE_PATH_BUCKETS];
+    dcache->paths[hash % DCACHE_PATH_BUCKETS] = p;
+    dcache->num_paths++;
+  }
+  pthread_rwlock_unlock(&dcache->lock);
+}
+
+/* hash_names: Builds the name table of a directory index whose
+   entries are already filled in. Returns 0, or -ENOMEM. */
+static int hash_names(dir_index *d) {
+  unsigned int b;
+  int i, n = d->num_entries;
+
+  // keep the load factor of the name table at or below one half
+  // (counting the 8.3 names of entries with a long name)
+  for (d->num_buckets = 8; d->num_buckets < 4 * n; d->num_buckets *= 2);
+  d->buckets = malloc(d->num_buckets * sizeof(int));
+  d->next = malloc((2 * n + 1) * sizeof(int));
+  if (!d->buckets || !d->next)
+    return -ENOMEM;
+  for (b = 0; b < d->num_buckets; b++)
+    d->buckets[b] = -1;
+  // insert backwards so the first of two equal names wins, and the
+  // 8.3 names first so names shown by readdir win over them
+  for (i = n - 1; i >= 0; i--) {
+    if (!d->short_names || !d->short_names[i])
+      continue;
+    b = name_hash_nocase(d->short_names[i]) & (d->num_buckets - 1);
+    d->next[n + i] = d->buckets[b];
+    d->buckets[b] = n + i;
+  }
+  for (i = n - 1; i >= 0; i--) {
+    b = name_hash_nocase(d->entries[i].name) & (d->num_buckets - 1);
+    d->next[i] = d->buckets[b];
+    d->buckets[b] = i;
+  }
+  return 0;
+}
+
+/* build_dir_index: Reads a directory from the volume and builds the
+   name index of its entries. Long names are assembled from their
+   entries in the same pass (see long_name_add).
+   
+   Parameters:
+     volume: pointer to FAT12 volume data structure.
+     dir: record of the directory to be indexed.
+     index: address of a pointer variable that will store the newly
+            allocated index.
+   Returns:
+     0 in case of success, or the error returned by scan_directory,
+     or -ENOMEM.
+ */
+static int build_dir_index(fat12volume *volume, const dir_record *dir, dir_index **index) {
+  char space[ARENA_INLINE_SIZE];
+  request_arena arena;
+  long_name lfn;
+  dir_index *d;
+  dir_record *entry;
+  const char *data;
+  char *names;
+  int length, i, n = 0, names_length = 0, long_names = 0;
+
+  // the raw directory is only needed while the index is built, so
+  // small directories are read into the stack
+  arena_init(&arena, space, sizeof(space));
+  length = scan_directory(volume, dir, &arena, &data);
+  if (length < 0) {
+    arena_release(&arena);
+    return length;
+  }
+
+  d = calloc(1, sizeof(dir_index));
+  if (!d) {
+    arena_release(&arena);
+    return -ENOMEM;
+  }
+  d->first_cluster = dir->first_cluster;
+  
+  // an 8.3 name takes at most 13 bytes, including the terminator,
+  // and a long name entry at most 39 bytes of UTF-8, so names are
+  // gathered in the arena and copied once their size is known
+  d->entries = malloc((length / DIR_ENTRY_SIZE) * sizeof(dir_record) + 1);
+  d->short_names = malloc((length / DIR_ENTRY_SIZE) * sizeof(char *) + 1);
+  names = arena_alloc(&arena, (length / DIR_ENTRY_SIZE) * 40 + 1);
+  if (!d->entries || !d->short_names || !names) {
+    arena_release(&arena);
+    free_dir_index(d);
+    return -ENOMEM;
+  }
+  
+  long_name_reset(&lfn);
+  for (i = 0; i < length && data[i] != 0; i += DIR_ENTRY_SIZE) {
+    if ((unsigned char) data[i] != 0xe5 && (data[i + 11] & 0x3f) == ATTR_LONG_NAME) {
+      long_name_add(&lfn, data + i);
+      continue;
+    }
+    // skip deleted entries and volume labels, which also end any
+    // long name being assembled
+    if ((unsigned char) data[i] == 0xe5 || (data[i + 11] & ATTR_VOLUME_ID)) {
+      long_name_reset(&lfn);
+      continue;
+    }
+    entry = &d->entries[n];
+    fill_directory_record(data + i, entry, names + names_length);
+    names_length += strlen(entry->name) + 1;
+    d->short_names[n] = NULL;
+    entry->lfn_entries = long_name_finish(&lfn, data + i, names + names_length);
+    if (entry->lfn_entries) {
+      d->short_names[n] = entry->name;
+      entry->name = names + names_length;
+      names_length += strlen(entry->name) + 1;
+      long_names++;
+    }
+    entry->dir_cluster = dir->first_cluster;
+    entry->slot = i / DIR_ENTRY_SIZE;
+    n++;
+  }
+  d->num_entries = n;
+
+  // move the names out of the arena, and point the records to them
+  d->names = malloc(names_length + 1);
+  if (!d->names) {
+    arena_release(&arena);
+    free_dir_index(d);
+    return -ENOMEM;
+  }
+  memcpy(d->names, names, names_length);
+  for (i = 0; i < n; i++) {
+    d->entries[i].name = d->names + (d->entries[i].name - names);
+    if (d->short_names[i])
+      d->short_names[i] = d->names + (d->short_names[i] - names);
+  }
+  arena_release(&arena);
+  if (!long_names) {
+    free(d->short_names);
+    d->short_names = NULL;
+  }
+
+  if (hash_names(d) < 0) {
+    free_dir_index(d);
+    return -ENOMEM;
+  }
+  *index = d;
+  return 0;
+}
+
+/* load_dir_index: Version of build_dir_index that takes the entries
+   of the directory from the metadata index of the volume, so the
+   directory is not read. The names of the entries stay in the
+   metadata index.
+   
+   Returns:
+     0 in case of success, 1 if the directory is not in the metadata
+     index, or -ENOMEM.
+ */
+static int load_dir_index(fat12volume *volume, const dir_record *dir, dir_index **index) {
+  const meta_record *records;
+  dir_index *d;
+  int i, n;
+
+  n = meta_find_directory(volume->meta, dir->first_cluster, &records);
+  if (n < 0)
+    return 1;
+
+  d = calloc(1, sizeof(dir_index));
+  if (!d)
+    return -ENOMEM;
+  d->first_cluster = dir->first_cluster;
+  d->num_entries = n;
+  d->entries = malloc(n * sizeof(dir_record) + 1);
+  d->short_names = malloc(n * sizeof(char *) + 1);
+  if (!d->entries || !d->short_names) {
+    free_dir_index(d);
+    return -ENOMEM;
+  }
+  for (i = 0; i < n; i++) {
+    d->entries[i].name = meta_name(volume->meta, records[i].name);
+    d->entries[i].lfn_entries = records[i].lfn_entries;
+    d->short_names[i] = records[i].lfn_entries ?
+      meta_name(volume->meta, records[i].short_name) : NULL;
+    d->entries[i].size = records[i].size;
+    d->entries[i].first_cluster = records[i].first_cluster;
+    d->entries[i].date = records[i].date;
+    d->entries[i].time = records[i].time;
+    d->entries[i].attributes = records[i].attributes;
+    d->entries[i].dir_cluster = records[i].dir_cluster;
+    d->entries[i].slot = records[i].slot;
+  }
+
+  if (hash_names(d) < 0) {
+    free_dir_index(d);
+    return -ENOMEM;
+  }
+  *index = d;
+  return 0;
+}
+
+/* get_directory_index: Obtains the name index of a directory,
+   building it the first time the directory is requested.
+   
+   Parameters:
+     volume: pointer to FAT12 volume data structure.
+     dir: record of the directory.
+     index: address of a pointer variable that will store the
+            index. The index belongs to the dentry cache and must not
+            be modified or freed.
+   Returns:
+     0 in case of success. Returns -ENOTDIR if dir is not a
+     directory, -EIO if the directory could not be read, or -ENOMEM.
+ */
+int get_directory_index(fat12volume *volume, const dir_record *dir, const dir_index **index) {
+  fat12dcache *dcache = volume->dcache;
+  unsigned int bucket = dir->first_cluster % DCACHE_DIR_BUCKETS;
+  dir_index *d, *built;
+  int rv;
+
+  if (!(dir->attributes & ATTR_DIRECTORY))
+    return -ENOTDIR;
+
+  pthread_rwlock_rdlock(&dcache->lock);
+  for (d = dcache->dirs[bucket]; d && d->first_cluster != dir->first_cluster; d = d->hash_next);
+  pthread_rwlock_unlock(&dcache->lock);
+  if (d) {
+    *index = d;
+    return 0;
+  }
+
+  // build the index without holding the lock, as it involves I/O;
+  // directories in the metadata index of the volume need no I/O
+  rv = volume->meta ? load_dir_index(volume, dir, &built) : 1;
+  if (rv > 0)
+    rv = build_dir_index(volume, dir, &built);
+  if (rv)
+    return rv;
+
+  pthread_rwlock_wrlock(&dcache->lock);
+  for (d = dcache->dirs[bucket]; d && d->first_cluster != dir->first_cluster; d = d->hash_next);
+  if (d) {
+    free_dir_index(built);
+  } else {
+    d = built;
+    d->hash_next = dcache->dirs[bucket];
+    dcache->dirs[bucket] = d;
+  }
+  pthread_rwlock_unlock(&dcache->lock);
+
+  *index = d;
+  return 0;
+}
+
+/* dir_index_find: Finds an entry in a directory by name, ignoring
+   the case of ASCII letters, as FAT does. Entries with a long name
+   are also found by their 8.3 name.
+   
+   Parameters:
+     index: index of the directory, as returned by get_directory_index.
+     name: name of the entry (long or 8.3 name).
+   Returns:
+     A pointer to the record within the index, or NULL if the
+     directory has no entry with the given name.
+ */
+const dir_record *dir_index_find(const dir_index *index, const char *name) {
+  int k, n = index->num_entries;
+
+  for (k = index->buckets[name_hash_nocase(name) & (index->num_buckets - 1)]; k >= 0;
+       k = index->next[k]) {
+    if (!strcasecmp(k < n ? index->entries[k].name : index->short_names[k - n], name))
+      return &index->entries[k < n ? k : k - n];
+  }
+  return NULL;
+}
+
+/* dcache_invalidate: Forgets a directory that has changed: its index
+   is freed, to be built again the next time it is needed, and so are
+   all cached path lookups, since any of them may go through the
+   directory. The caller must hold the update lock of the volume
+   exclusively (see lock_volume), so no other thread is using the
+   index.
+   
+   Parameters:
+     dcache: dentry cache of the volume.
+     first_cluster: first cluster of the directory (zero for the root
+                    directory).
+ */
+void dcache_invalidate(fat12dcache *dcache, unsigned int first_cluster) {
+  dir_index **d, *found;
+
+  pthread_rwlock_wrlock(&dcache->lock);
+  for (d = &dcache->dirs[first_cluster % DCACHE_DIR_BUCKETS];
+       *d && (*d)->first_cluster != first_cluster; d = &(*d)->hash_next);
+  if (*d) {
+    found = *d;
+    *d = found->hash_next;
+    free_dir_index(found);
+  }
+  if (dcache->num_paths)
+    free_paths(dcache);
+  pthread_rwlock_unlock(&dcache->lock);
+}
@@ -0,0 +1,58 @@
+#ifndef _FAT12DCACHE_H_
+#define _FAT12DCACHE_H_
+
+#include "fat12.h"
+
+/* Maximum number of paths remembered by the dentry cache. When this
+   limit is reached the path cache is emptied and starts over; the
+   directory indexes are kept. */
+#define DCACHE_MAX_PATHS 8192
+
+/* Data structure used to index the entries of a single directory by
+   name. Indexes are built the first time a directory is read and are
+   never modified afterwards, so they can be used without locking. In
+   writable volumes, the index of a directory that changes is thrown
+   away (see dcache_invalidate), so indexes must only be used while
+   holding the update lock of the volume (see lock_volume). */
+typedef struct dir_index {
+
+  /* First cluster of the directory (zero for the root directory) */
+  unsigned int first_cluster;
+  /* Number of valid entries in the directory (excluding deleted
+     entries and volume labels) */
+  unsigned int num_entries;
+  /* Valid entries of the directory, in the order they are found in
+     the volume */
+  dir_record *entries;
+  /* Names of the entries, which the records point into */
+  char *names;
+  /* 8.3 names of the entries with a long name (NULL for the other
+     entries), whose records have the long name */
+  const char **short_names;
+  /* Hash table of entry names, case-insensitive, with the name of
+     every entry and the 8.3 name of every entry with a long name:
+     key i < num_entries stands for the name of entry i, and key
+     num_entries + i for its 8.3 name. buckets[h] is the first key
+     that hashes to h, and next[k] the key that follows key k in the
+     same bucket, or -1 at the end */
+  unsigned int num_buckets;
+  int *buckets;
+  int *next;
+
+  /* Next index in the same bucket of the dentry cache */
+  struct dir_index *hash_next;
+  
+} dir_index;
+
+fat12dcache *dcache_create(void);
+void dcache_destroy(fat12dcache *dcache);
+
+int dcache_lookup_path(fat12dcache *dcache, const char *path, dir_record *record);
+void dcache_insert_path(fat12dcache *dcache, const char *path, int result,
+			const dir_record *record);
+
+int get_directory_index(fat12volume *volume, const dir_record *dir, const dir_index **index);
+const dir_record *dir_index_find(const dir_index *index, const char *name);
+void dcache_invalidate(fat12dcache *dcache, unsigned int first_cluster);
+
+#endif
@@ -0,0 +1,116 @@
+#include "fat12.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FAT12_SIMD 1
+#else
+#define FAT12_SIMD 0
+#endif
+
+/* decode_fat_entries_scalar: Portable version of decode_fat_entries,
+   decoding one entry at a time. */
+void decode_fat_entries_scalar(const char *fat, unsigned int first, unsigned int count,
+			       uint16_t *entries) {
+  const unsigned char *bytes = (const unsigned char *) fat;
+  unsigned int cluster, position;
+
+  for (cluster = first; cluster < first + count; cluster++) {
+    position = cluster + cluster / 2;
+    if (cluster % 2)
+      *entries++ = (bytes[position] >> 4) | (bytes[position + 1] << 4);
+    else
+      *entries++ = bytes[position] | ((bytes[position + 1] & 0x0f) << 8);
+  }
+}
+
+#if FAT12_SIMD
+
+/* Byte shuffle that spreads 12 packed bytes (8 entries) into eight
+   16-bit lanes: even entries take bytes 3k and 3k+1, odd entries
+   bytes 3k+1 and 3k+2 */
+#define FAT12_SHUFFLE 0, 1, 1, 2, 3, 4, 4, 5, 6, 7, 7, 8, 9, 10, 10, 11
+
+/* decode_fat_entries_ssse3: Decodes eight entries per iteration with
+   SSSE3. first must be even. Returns the number of entries decoded;
+   the caller handles the remainder. */
+__attribute__((target("ssse3")))
+static unsigned int decode_fat_entries_ssse3(const char *fat, unsigned int first,
+					     unsigned int count, uint16_t *entries) {
+  const __m128i shuffle = _mm_setr_epi8(FAT12_SHUFFLE);
+  const __m128i even = _mm_set1_epi32(0x00000fff);
+  const __m128i odd = _mm_set1_epi32((int) 0xffff0000);
+  const char *position = fat + first / 2 * 3;
+  // a 16-byte load must not go past the bytes of the last entry
+  const char *end = fat + (first + count) / 2 * 3;
+  unsigned int done = 0;
+  __m128i v;
+
+  for (; count - done >= 8 && position + 16 <= end; done += 8, position += 12) {
+    v = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) position), shuffle);
+    v = _mm_or_si128(_mm_and_si128(v, even), _mm_and_si128(_mm_srli_epi16(v, 4), odd));
+    _mm_storeu_si128((__m128i *) (entries + done), v);
+  }
+  return done;
+}
+
+/* decode_fat_entries_avx2: Decodes sixteen entries per iteration with
+   AVX2, using the same in-lane shuffle as SSSE3 on two groups of 12
+   bytes. first must be even. Returns the number of entries decoded. */
+__attribute__((target("avx2")))
+static unsigned int decode_fat_entries_avx2(const char *fat, unsigned int first,
+					    unsigned int count, uint16_t *entries) {
+  const __m256i shuffle = _mm256_setr_epi8(FAT12_SHUFFLE, FAT12_SHUFFLE);
+  const __m256i even = _mm256_set1_epi32(0x00000fff);
+  const __m256i odd = _mm256_set1_epi32((int) 0xffff0000);
+  const char *position = fat + first / 2 * 3;
+  const char *end = fat + (first + count) / 2 * 3;
+  unsigned int done = 0;
+  __m256i v;
+
+  for (; count - done >= 16 && position + 28 <= end; done += 16, position += 24) {
+    v = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *) position)),
+				_mm_loadu_si128((const __m128i *) (position + 12)), 1);
+    v = _mm256_shuffle_epi8(v, shuffle);
+    v = _mm256_or_si256(_mm256_and_si256(v, even), _mm256_and_si256(_mm256_srli_epi16(v, 4), odd));
+    _mm256_storeu_si256((__m256i *) (entries + done), v);
+  }
+  return done;
+}
+
+#endif
+
+/* decode_fat_entries: Unpacks a range of 12-bit FAT entries into
+   16-bit numbers, i.e., computes get_next_cluster for every cluster
+   in the range in bulk. Uses AVX2 or SSSE3 shuffles when the CPU
+   supports them, and falls back to a scalar loop otherwise (and for
+   the entries at the edges of the range).
+   
+   Parameters:
+     fat: packed FAT, as stored in the volume (e.g., fat_array).
+     first: number of the first entry to decode.
+     count: number of entries to decode. The FAT must contain at
+            least first+count entries.
+     entries: array where entry first+i will be stored at position i.
+ */
+void decode_fat_entries(const char *fat, unsigned int first, unsigned int count,
+			uint16_t *entries) {
+  unsigned int done = 0;
+
+  if (count == 0)
+    return;
+  
+  // vector loops work on pairs of entries, so start at an even one
+  if (first % 2) {
+    decode_fat_entries_scalar(fat, first, 1, entries);
+    done = 1;
+  }
+  
+#if FAT12_SIMD
+  if (__builtin_cpu_supports("avx2"))
+    done += decode_fat_entries_avx2(fat, first + done, count - done, entries + done);
+  if (__builtin_cpu_supports("ssse3"))
+    done += decode_fat_entries_ssse3(fat, first + done, count - done, entries + done);
+#endif
+
+  decode_fat_entries_scalar(fat, first + done, count - done, entries + done);
+}
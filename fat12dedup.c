@@ -0,0 +1,897 @@
+#include "fat12dedup.h"
+#include "fat12dcache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Round constants of SHA-256 (FIPS 180-4) */
+static const uint32_t sha256_k[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+/* Growable array of fixed-size elements */
+typedef struct dedup_array {
+  void *data;
+  size_t count;
+  size_t capacity;
+} dedup_array;
+
+struct dedup_builder {
+  pthread_mutex_t lock;
+  /* Images added so far (dedup_image), in the order they were added,
+     and their files (dedup_file) and clusters (dedup_cluster), which
+     refer to them by that order */
+  dedup_array images;
+  dedup_array files;
+  dedup_array clusters;
+  /* String table (chars) */
+  dedup_array strings;
+};
+
+/* State of the walk of the tree of one image */
+typedef struct dedup_walk {
+  fat12volume *volume;
+  unsigned int cluster_bytes;
+  /* Buffer for one cluster */
+  char *buffer;
+  /* One flag per cluster, set for the first cluster of every
+     directory already walked */
+  unsigned char *visited;
+  /* Files and clusters found, and strings of the paths of the files,
+     which are only added to the builder once the walk is done */
+  dedup_array files;
+  dedup_array clusters;
+  dedup_array strings;
+} dedup_walk;
+
+/* Clusters shared by several clusters of the index, while the alias
+   table is built */
+typedef struct image_alias {
+  uint32_t image;
+  uint32_t cluster;
+  uint32_t class;
+} image_alias;
+
+/* Image, while the images are sorted by name */
+typedef struct image_order {
+  const char *name;
+  const char *path;
+  uint32_t image;
+} image_order;
+
+/* rotate: Rotates a 32-bit number to the right. */
+static uint32_t rotate(uint32_t x, int bits) {
+  return (x >> bits) | (x << (32 - bits));
+}
+
+/* hash_block: Adds a block of 64 bytes to a hash (the compression
+   function of SHA-256). */
+static void hash_block(dedup_hasher *hasher, const unsigned char *block) {
+  uint32_t w[64], s[8], t1, t2;
+  int i;
+
+  for (i = 0; i < 16; i++)
+    w[i] = (uint32_t) block[4 * i] << 24 | (uint32_t) block[4 * i + 1] << 16 |
+      (uint32_t) block[4 * i + 2] << 8 | block[4 * i + 3];
+  for (; i < 64; i++)
+    w[i] = w[i - 16] + (rotate(w[i - 15], 7) ^ rotate(w[i - 15], 18) ^ (w[i - 15] >> 3)) +
+      w[i - 7] + (rotate(w[i - 2], 17) ^ rotate(w[i - 2], 19) ^ (w[i - 2] >> 10));
+
+  memcpy(s, hasher->state, sizeof(s));
+  for (i = 0; i < 64; i++) {
+    t1 = s[7] + (rotate(s[4], 6) ^ rotate(s[4], 11) ^ rotate(s[4], 25)) +
+      ((s[4] & s[5]) ^ (~s[4] & s[6])) + sha256_k[i] + w[i];
+    t2 = (rotate(s[0], 2) ^ rotate(s[0], 13) ^ rotate(s[0], 22)) +
+      ((s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]));
+    memmove(s + 1, s, 7 * sizeof(uint32_t));
+    s[4] += t1;
+    s[0] = t1 + t2;
+  }
+  for (i = 0; i < 8; i++)
+    hasher->state[i] += s[i];
+}
+
+/* dedup_hash_init: Starts a new hash.
+   
+   Parameters:
+     hasher: state of the hash.
+ */
+void dedup_hash_init(dedup_hasher *hasher) {
+  static const uint32_t initial[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+  };
+
+  memcpy(hasher->state, initial, sizeof(initial));
+  hasher->length = 0;
+  hasher->tail_length = 0;
+}
+
+/* dedup_hash_update: Adds data to a hash. The hash of some data does
+   not depend on the pieces it is given in.
+   
+   Parameters:
+     hasher: state of the hash.
+     data: data to be added.
+     length: length of the data, in bytes.
+ */
+void dedup_hash_update(dedup_hasher *hasher, const void *data, size_t length) {
+  const unsigned char *bytes = data;
+  size_t count;
+
+  hasher->length += length;
+  if (hasher->tail_length) {
+    count = sizeof(hasher->tail) - hasher->tail_length;
+    if (count > length)
+      count = length;
+    memcpy(hasher->tail + hasher->tail_length, bytes, count);
+    hasher->tail_length += count;
+    bytes += count;
+    length -= count;
+    if (hasher->tail_length < sizeof(hasher->tail))
+      return;
+    hash_block(hasher, hasher->tail);
+    hasher->tail_length = 0;
+  }
+
+  for (; length >= sizeof(hasher->tail); bytes += sizeof(hasher->tail),
+	 length -= sizeof(hasher->tail))
+    hash_block(hasher, bytes);
+  memcpy(hasher->tail, bytes, length);
+  hasher->tail_length = length;
+}
+
+/* dedup_hash_final: Finishes a hash.
+   
+   Parameters:
+     hasher: state of the hash, which cannot be used afterwards
+             (except to start a new hash).
+     hash: pointer to where the hash is stored.
+ */
+void dedup_hash_final(dedup_hasher *hasher, dedup_hash *hash) {
+  uint64_t bits = hasher->length * 8;
+  int i;
+
+  // the data is followed by a one bit, zeros, and its length in bits
+  hasher->tail[hasher->tail_length++] = 0x80;
+  if (hasher->tail_length > sizeof(hasher->tail) - 8) {
+    memset(hasher->tail + hasher->tail_length, 0, sizeof(hasher->tail) - hasher->tail_length);
+    hash_block(hasher, hasher->tail);
+    hasher->tail_length = 0;
+  }
+  memset(hasher->tail + hasher->tail_length, 0, sizeof(hasher->tail) - 8 - hasher->tail_length);
+  for (i = 0; i < 8; i++)
+    hasher->tail[sizeof(hasher->tail) - 1 - i] = bits >> (8 * i);
+  hash_block(hasher, hasher->tail);
+
+  // the first 128 bits of the digest, so hashes sort as the digests
+  hash->hi = (uint64_t) hasher->state[0] << 32 | hasher->state[1];
+  hash->lo = (uint64_t) hasher->state[2] << 32 | hasher->state[3];
+}
+
+/* dedup_hash_compare: Compares two hashes, in the order of the
+   tables of the index.
+   
+   Returns:
+     A negative number, zero or a positive number if a is lower than,
+     equal to or greater than b.
+ */
+int dedup_hash_compare(const dedup_hash *a, const dedup_hash *b) {
+  if (a->hi != b->hi)
+    return a->hi < b->hi ? -1 : 1;
+  if (a->lo != b->lo)
+    return a->lo < b->lo ? -1 : 1;
+  return 0;
+}
+
+/* identify: Gets what identifies the contents of the image file of a
+   volume: its size, modification time and boot sector. */
+static int identify(fat12volume *volume, dedup_image *image) {
+  char boot[BOOT_SECTOR_SIZE];
+  dedup_hasher hasher;
+  struct stat st;
+
+  if (fstat(volume->volume_fd, &st) < 0)
+    return -errno;
+  if (read_data(volume, 0, sizeof(boot), boot) != sizeof(boot))
+    return -EIO;
+
+  image->size = st.st_size;
+  image->mtime = (int64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+  dedup_hash_init(&hasher);
+  dedup_hash_update(&hasher, boot, sizeof(boot));
+  dedup_hash_final(&hasher, &image->boot);
+  image->cluster_bytes = volume->cluster_size * volume->sector_size;
+  return 0;
+}
+
+/* dedup_open: Opens an index file, mapping it into memory.
+   
+   Parameters:
+     filename: name of the index file.
+   Returns:
+     The index, or NULL (with errno set) if the file could not be
+     mapped or is not a valid index.
+ */
+dedup_index *dedup_open(const char *filename) {
+  const dedup_header *header;
+  dedup_index *index;
+  struct stat st;
+  void *map;
+  uint32_t i;
+  int fd;
+
+  fd = open(filename, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    return NULL;
+  }
+  if (st.st_size < (off_t) sizeof(dedup_header)) {
+    close(fd);
+    errno = EINVAL;
+    return NULL;
+  }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return NULL;
+
+  // every table must be within the file
+  header = map;
+  if (memcmp(header->magic, DEDUP_MAGIC, sizeof(header->magic)) ||
+      header->version != DEDUP_VERSION ||
+      header->images_offset > (uint64_t) st.st_size ||
+      header->num_images > (st.st_size - header->images_offset) / sizeof(dedup_image) ||
+      header->files_offset > (uint64_t) st.st_size ||
+      header->num_files > (st.st_size - header->files_offset) / sizeof(dedup_file) ||
+      header->clusters_offset > (uint64_t) st.st_size ||
+      header->num_clusters > (st.st_size - header->clusters_offset) / sizeof(dedup_cluster) ||
+      header->aliases_offset > (uint64_t) st.st_size ||
+      header->num_aliases > (st.st_size - header->aliases_offset) / sizeof(dedup_alias) ||
+      header->strings_offset > (uint64_t) st.st_size ||
+      header->strings_size > st.st_size - header->strings_offset ||
+      (header->strings_size && ((const char *) map)[header->strings_offset +
+						   header->strings_size - 1] != '\0')) {
+    munmap(map, st.st_size);
+    errno = EINVAL;
+    return NULL;
+  }
+
+  index = malloc(sizeof(dedup_index));
+  if (!index) {
+    munmap(map, st.st_size);
+    return NULL;
+  }
+  index->map = map;
+  index->size = st.st_size;
+  index->header = header;
+  index->images = (const dedup_image *) (index->map + header->images_offset);
+  index->files = (const dedup_file *) (index->map + header->files_offset);
+  index->clusters = (const dedup_cluster *) (index->map + header->clusters_offset);
+  index->aliases = (const dedup_alias *) (index->map + header->aliases_offset);
+  index->strings = index->map + header->strings_offset;
+
+  for (i = 0; i < header->num_images; i++) {
+    if (index->images[i].first_alias > header->num_aliases ||
+	index->images[i].num_aliases > header->num_aliases - index->images[i].first_alias) {
+      dedup_close(index);
+      errno = EINVAL;
+      return NULL;
+    }
+  }
+
+  return index;
+}
+
+/* dedup_close: Unmaps an index file. Volumes attached to the index
+   keep working, since they have their own copy of their aliases.
+   
+   Parameters:
+     index: index (may be NULL).
+ */
+void dedup_close(dedup_index *index) {
+  if (!index)
+    return;
+  munmap((void *) index->map, index->size);
+  free(index);
+}
+
+/* dedup_string: Returns a string of the string table of an index, or
+   an empty string if the offset is not within the table. */
+const char *dedup_string(const dedup_index *index, uint64_t offset) {
+  if (offset >= index->header->strings_size)
+    return "";
+  return index->strings + offset;
+}
+
+/* dedup_find_files: Finds the files of the index with some contents.
+   
+   Parameters:
+     index: index.
+     hash: hash of the contents of the file.
+     files: pointer to where the first file with that hash is stored
+            (files with the same hash are consecutive).
+   Returns:
+     The number of files with that hash.
+ */
+size_t dedup_find_files(const dedup_index *index, const dedup_hash *hash,
+			const dedup_file **files) {
+  size_t low = 0, high = index->header->num_files, mid, end;
+
+  while (low < high) {
+    mid = low + (high - low) / 2;
+    if (dedup_hash_compare(&index->files[mid].hash, hash) < 0)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  for (end = low; end < index->header->num_files &&
+	 !dedup_hash_compare(&index->files[end].hash, hash); end++);
+
+  *files = &index->files[low];
+  return end - low;
+}
+
+/* dedup_find_clusters: Version of dedup_find_files for the clusters
+   of the index. */
+size_t dedup_find_clusters(const dedup_index *index, const dedup_hash *hash,
+			   const dedup_cluster **clusters) {
+  size_t low = 0, high = index->header->num_clusters, mid, end;
+
+  while (low < high) {
+    mid = low + (high - low) / 2;
+    if (dedup_hash_compare(&index->clusters[mid].hash, hash) < 0)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  for (end = low; end < index->header->num_clusters &&
+	 !dedup_hash_compare(&index->clusters[end].hash, hash); end++);
+
+  *clusters = &index->clusters[low];
+  return end - low;
+}
+
+/* dedup_attach: Lets a volume share, in the cluster cache, the
+   clusters whose contents are also found in other clusters of the
+   index. The volume must have been indexed with the same name, and
+   its image file must not have changed since (same size,
+   modification time and boot sector), since otherwise its clusters
+   may no longer have the indexed contents. Must be called before the
+   volume is used.
+   
+   Parameters:
+     index: index.
+     volume: pointer to FAT12 volume data structure.
+     name: base name of the image file of the volume.
+   Returns:
+     The number of clusters of the volume shared with other clusters.
+     Returns -EROFS if the volume is writable (its clusters may
+     change), -ENOENT if the image is not in the index or has changed
+     since it was indexed, -EIO if the image file could not be read,
+     or -ENOMEM if memory could not be allocated.
+ */
+int dedup_attach(const dedup_index *index, fat12volume *volume, const char *name) {
+  const dedup_image *image = NULL;
+  const dedup_alias *alias;
+  dedup_image identity;
+  uint32_t *shared;
+  size_t low = 0, high = index->header->num_images, mid;
+  uint64_t i;
+  int rv;
+
+  if (volume->writable)
+    return -EROFS;
+  rv = identify(volume, &identity);
+  if (rv < 0)
+    return rv == -EIO ? -EIO : -ENOENT;
+
+  // several images may have the same name, in different directories
+  while (low < high) {
+    mid = low + (high - low) / 2;
+    if (strcmp(dedup_string(index, index->images[mid].name), name) < 0)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  for (; low < index->header->num_images &&
+	 !strcmp(dedup_string(index, index->images[low].name), name); low++) {
+    if (index->images[low].size == identity.size &&
+	index->images[low].mtime == identity.mtime &&
+	index->images[low].cluster_bytes == identity.cluster_bytes &&
+	!dedup_hash_compare(&index->images[low].boot, &identity.boot)) {
+      image = &index->images[low];
+      break;
+    }
+  }
+  if (!image)
+    return -ENOENT;
+
+  shared = calloc(image->fat_entries ? image->fat_entries : 1, sizeof(uint32_t));
+  if (!shared)
+    return -ENOMEM;
+  alias = &index->aliases[image->first_alias];
+  for (i = 0; i < image->num_aliases; i++)
+    if (alias[i].cluster < image->fat_entries)
+      shared[alias[i].cluster] = alias[i].class;
+
+  free(volume->shared_clusters);
+  volume->shared_clusters = shared;
+  volume->shared_entries = image->fat_entries;
+  return image->num_aliases;
+}
+
+/* grow: Makes room for one more element at the end of an array.
+   Returns a pointer to the new element, or NULL if memory could not
+   be allocated. */
+static void *grow(dedup_array *array, size_t size) {
+  size_t capacity;
+  void *data;
+
+  if (array->count == array->capacity) {
+    capacity = array->capacity ? array->capacity * 2 : 64;
+    data = realloc(array->data, capacity * size);
+    if (!data)
+      return NULL;
+    array->data = data;
+    array->capacity = capacity;
+  }
+  return (char *) array->data + array->count++ * size;
+}
+
+/* append: Appends several elements to an array. Returns 0, or
+   -ENOMEM if memory could not be allocated. */
+static int append(dedup_array *array, const void *data, size_t count, size_t size) {
+  size_t capacity = array->capacity ? array->capacity : 64;
+  void *grown;
+
+  while (capacity < array->count + count)
+    capacity *= 2;
+  if (capacity != array->capacity) {
+    grown = realloc(array->data, capacity * size);
+    if (!grown)
+      return -ENOMEM;
+    array->data = grown;
+    array->capacity = capacity;
+  }
+  memcpy((char *) array->data + array->count * size, data, count * size);
+  array->count += count;
+  return 0;
+}
+
+/* hash_chain: Hashes every cluster of a chain, adding the clusters
+   to the walk, and the contents of the file of the chain.
+   
+   Parameters:
+     walk: state of the walk.
+     first_cluster: first cluster of the chain.
+     size: size of the file, in bytes (ignored if hash is NULL).
+     hash: pointer to where the hash of the contents of the file is
+           stored, or NULL for the chain of a directory.
+   Returns:
+     0 in case of success, -EIO if a cluster could not be read or the
+     chain is shorter than the file, or -ENOMEM if memory could not be
+     allocated.
+ */
+static int hash_chain(dedup_walk *walk, unsigned int first_cluster, uint32_t size,
+		      dedup_hash *hash) {
+  fat12extent *extents;
+  dedup_cluster *record;
+  dedup_hasher cluster_hasher, file_hasher;
+  unsigned int cluster, count;
+  uint32_t done = 0;
+  int num_extents, e, rv = 0;
+
+  num_extents = get_file_extents(walk->volume, first_cluster, &extents);
+  if (num_extents < 0)
+    return num_extents;
+
+  dedup_hash_init(&file_hasher);
+  for (e = 0; e < num_extents && rv == 0; e++) {
+    for (cluster = extents[e].first_cluster;
+	 cluster < extents[e].first_cluster + extents[e].num_clusters; cluster++) {
+      if (copy_cluster(walk->volume, cluster, 0, walk->cluster_bytes, walk->buffer) !=
+	  walk->cluster_bytes) {
+	rv = -EIO;
+	break;
+      }
+      if ((record = grow(&walk->clusters, sizeof(dedup_cluster))) == NULL) {
+	rv = -ENOMEM;
+	break;
+      }
+      dedup_hash_init(&cluster_hasher);
+      dedup_hash_update(&cluster_hasher, walk->buffer, walk->cluster_bytes);
+      dedup_hash_final(&cluster_hasher, &record->hash);
+      record->image = 0;
+      record->cluster = cluster;
+
+      if (hash && done < size) {
+	count = size - done < walk->cluster_bytes ? size - done : walk->cluster_bytes;
+	dedup_hash_update(&file_hasher, walk->buffer, count);
+	done += count;
+      }
+    }
+  }
+  free(extents);
+
+  if (rv == 0 && hash) {
+    if (done < size)
+      return -EIO;
+    dedup_hash_final(&file_hasher, hash);
+  }
+  return rv;
+}
+
+/* walk_tree: Hashes the files and directories in a directory of an
+   image, and everything below it.
+   
+   Parameters:
+     walk: state of the walk.
+     dir: record of the directory.
+     path: path of the directory within the image.
+   Returns:
+     The number of files and directories that could not be hashed, or
+     -ENOMEM if memory could not be allocated.
+ */
+static int walk_tree(dedup_walk *walk, const dir_record *dir, const char *path) {
+  fat12volume *volume = walk->volume;
+  const dir_index *index;
+  const dir_record *entry;
+  dedup_file *file;
+  char child[PATH_MAX];
+  size_t length;
+  unsigned int i;
+  int rv, errors = 0;
+
+  if (get_directory_index(volume, dir, &index))
+    return 1;
+
+  for (i = 0; i < index->num_entries; i++) {
+    entry = &index->entries[i];
+    if (!strcmp(entry->name, ".") || !strcmp(entry->name, "..") || !entry->name[0])
+      continue;
+    if (snprintf(child, sizeof(child), "%s/%s", path, entry->name) >=
+	(int) sizeof(child)) {
+      errors++;
+      continue;
+    }
+
+    if (entry->attributes & ATTR_DIRECTORY) {
+      // in a damaged volume, a directory may point into its own
+      // ancestors or into the data of a file
+      if (entry->first_cluster < 2 || entry->first_cluster >= volume->fat_entries ||
+	  walk->visited[entry->first_cluster]) {
+	errors++;
+	continue;
+      }
+      walk->visited[entry->first_cluster] = 1;
+      rv = hash_chain(walk, entry->first_cluster, 0, NULL);
+      if (rv == -ENOMEM)
+	return rv;
+      if (rv < 0)
+	errors++;
+      rv = walk_tree(walk, entry, child);
+      if (rv < 0)
+	return rv;
+      errors += rv;
+    } else {
+      if ((file = grow(&walk->files, sizeof(dedup_file))) == NULL)
+	return -ENOMEM;
+      rv = hash_chain(walk, entry->size ? entry->first_cluster : 0, entry->size, &file->hash);
+      if (rv < 0) {
+	walk->files.count--;
+	if (rv == -ENOMEM)
+	  return rv;
+	errors++;
+	continue;
+      }
+      length = strlen(child) + 1;
+      file->path = walk->strings.count;
+      file->image = 0;
+      file->size = entry->size;
+      if (append(&walk->strings, child, length, 1) < 0)
+	return -ENOMEM;
+    }
+  }
+  return errors;
+}
+
+/* dedup_builder_create: Creates an empty index.
+   
+   Returns:
+     The index being built, or NULL if memory could not be allocated.
+ */
+dedup_builder *dedup_builder_create(void) {
+  dedup_builder *builder = calloc(1, sizeof(dedup_builder));
+
+  if (builder)
+    pthread_mutex_init(&builder->lock, NULL);
+  return builder;
+}
+
+/* dedup_builder_destroy: Frees an index being built.
+   
+   Parameters:
+     builder: index being built (may be NULL).
+ */
+void dedup_builder_destroy(dedup_builder *builder) {
+  if (!builder)
+    return;
+  pthread_mutex_destroy(&builder->lock);
+  free(builder->images.data);
+  free(builder->files.data);
+  free(builder->clusters.data);
+  free(builder->strings.data);
+  free(builder);
+}
+
+/* dedup_builder_add: Hashes every cluster of the files and
+   directories of a volume, and the contents of every file, and adds
+   them to an index being built. Several threads may add different
+   volumes to the same index at once.
+   
+   Parameters:
+     builder: index being built.
+     path: path of the image file of the volume, as shown by queries
+           of the index. Its tail is the name under which the volume
+           is attached to the index (see dedup_attach).
+     volume: pointer to FAT12 volume data structure.
+   Returns:
+     The number of files and directories of the volume that could not
+     be hashed (for instance, because their chain is damaged), which
+     are left out of the index. Returns -EIO if the FAT or root
+     directory could not be read, or -ENOMEM if memory could not be
+     allocated, in which case nothing is added.
+ */
+int dedup_builder_add(dedup_builder *builder, const char *path, fat12volume *volume) {
+  static const dir_record root = {
+    .name = "/",
+    .attributes = ATTR_DIRECTORY,
+  };
+  dedup_walk walk = { .volume = volume };
+  dedup_image image = { 0 };
+  const char *name = strrchr(path, '/');
+  size_t i, base, num_files, num_clusters;
+  int rv, errors;
+
+  if (load_volume_metadata(volume) < 0 || identify(volume, &image) < 0)
+    return -EIO;
+  walk.cluster_bytes = image.cluster_bytes;
+  walk.buffer = malloc(walk.cluster_bytes);
+  walk.visited = calloc(volume->fat_entries, 1);
+  errors = walk.buffer && walk.visited ? walk_tree(&walk, &root, "") : -ENOMEM;
+  free(walk.buffer);
+  free(walk.visited);
+
+  pthread_mutex_lock(&builder->lock);
+  rv = errors;
+  if (rv >= 0) {
+    // the strings of the walk go after the path of the image
+    base = builder->strings.count;
+    num_files = builder->files.count;
+    num_clusters = builder->clusters.count;
+    image.path = base;
+    image.name = base + (name ? name + 1 - path : 0);
+    image.fat_entries = volume->fat_entries;
+    for (i = 0; i < walk.files.count; i++) {
+      ((dedup_file *) walk.files.data)[i].path += base + strlen(path) + 1;
+      ((dedup_file *) walk.files.data)[i].image = builder->images.count;
+    }
+    for (i = 0; i < walk.clusters.count; i++)
+      ((dedup_cluster *) walk.clusters.data)[i].image = builder->images.count;
+
+    if (append(&builder->strings, path, strlen(path) + 1, 1) < 0 ||
+	append(&builder->strings, walk.strings.data, walk.strings.count, 1) < 0 ||
+	append(&builder->files, walk.files.data, walk.files.count, sizeof(dedup_file)) < 0 ||
+	append(&builder->clusters, walk.clusters.data, walk.clusters.count,
+	       sizeof(dedup_cluster)) < 0 ||
+	append(&builder->images, &image, 1, sizeof(dedup_image)) < 0) {
+      // leave the builder as it was
+      builder->strings.count = base;
+      builder->files.count = num_files;
+      builder->clusters.count = num_clusters;
+      rv = -ENOMEM;
+    }
+  }
+  pthread_mutex_unlock(&builder->lock);
+
+  free(walk.files.data);
+  free(walk.clusters.data);
+  free(walk.strings.data);
+  return rv;
+}
+
+/* compare_name: Orders images by name, and then by path. */
+static int compare_name(const void *a, const void *b) {
+  const image_order *x = a, *y = b;
+  int rv = strcmp(x->name, y->name);
+
+  return rv ? rv : strcmp(x->path, y->path);
+}
+
+/* compare_file: Orders files by hash, image and path. */
+static int compare_file(const void *a, const void *b) {
+  const dedup_file *x = a, *y = b;
+  int rv = dedup_hash_compare(&x->hash, &y->hash);
+
+  if (rv)
+    return rv;
+  if (x->image != y->image)
+    return x->image < y->image ? -1 : 1;
+  return (x->path > y->path) - (x->path < y->path);
+}
+
+/* compare_cluster: Orders clusters by hash, image and cluster. */
+static int compare_cluster(const void *a, const void *b) {
+  const dedup_cluster *x = a, *y = b;
+  int rv = dedup_hash_compare(&x->hash, &y->hash);
+
+  if (rv)
+    return rv;
+  if (x->image != y->image)
+    return x->image < y->image ? -1 : 1;
+  return (x->cluster > y->cluster) - (x->cluster < y->cluster);
+}
+
+/* compare_alias: Orders aliases by image and cluster. */
+static int compare_alias(const void *a, const void *b) {
+  const image_alias *x = a, *y = b;
+
+  if (x->image != y->image)
+    return x->image < y->image ? -1 : 1;
+  return (x->cluster > y->cluster) - (x->cluster < y->cluster);
+}
+
+/* dedup_builder_write: Sorts the tables of an index being built and
+   writes it to a file. The file is replaced atomically, so volumes
+   using the previous index (which keeps being mapped) are not
+   affected.
+   
+   Parameters:
+     builder: index being built, which must not be changed anymore.
+     filename: name of the index file.
+   Returns:
+     0 in case of success, or a negative error number.
+ */
+int dedup_builder_write(dedup_builder *builder, const char *filename) {
+  dedup_header header = { .version = DEDUP_VERSION };
+  dedup_image *images = builder->images.data;
+  dedup_file *files = builder->files.data;
+  dedup_cluster *clusters = builder->clusters.data;
+  const char *strings = builder->strings.data;
+  image_order *order = NULL;
+  image_alias *aliases = NULL;
+  dedup_image *sorted = NULL;
+  dedup_alias alias;
+  uint32_t *remap = NULL;
+  char temp[PATH_MAX];
+  size_t i, j, start, count = 0, num_aliases = 0;
+  FILE *out = NULL;
+  int fd, rv = -ENOMEM;
+
+  order = malloc((builder->images.count + 1) * sizeof(image_order));
+  remap = malloc((builder->images.count + 1) * sizeof(uint32_t));
+  sorted = malloc((builder->images.count + 1) * sizeof(dedup_image));
+  if (!order || !remap || !sorted)
+    goto out;
+
+  // images are numbered in the order of their names, so that volumes
+  // are found by name
+  for (i = 0; i < builder->images.count; i++) {
+    order[i].name = strings + images[i].name;
+    order[i].path = strings + images[i].path;
+    order[i].image = i;
+  }
+  qsort(order, builder->images.count, sizeof(image_order), compare_name);
+  for (i = 0; i < builder->images.count; i++) {
+    remap[order[i].image] = i;
+    sorted[i] = images[order[i].image];
+  }
+  for (i = 0; i < builder->files.count; i++)
+    files[i].image = remap[files[i].image];
+  for (i = 0; i < builder->clusters.count; i++)
+    clusters[i].image = remap[clusters[i].image];
+  qsort(files, builder->files.count, sizeof(dedup_file), compare_file);
+  qsort(clusters, builder->clusters.count, sizeof(dedup_cluster), compare_cluster);
+
+  // a cluster reached from several chains of a damaged volume is
+  // only indexed once
+  for (i = 0; i < builder->clusters.count; i++)
+    if (count == 0 || compare_cluster(&clusters[count - 1], &clusters[i]))
+      clusters[count++] = clusters[i];
+  builder->clusters.count = count;
+
+  // every run of clusters with the same hash is a class, and its
+  // clusters are aliases of each other
+  aliases = malloc((count + 1) * sizeof(image_alias));
+  if (!aliases)
+    goto out;
+  for (start = 0; start < count; start = j) {
+    for (j = start + 1; j < count && !dedup_hash_compare(&clusters[j].hash,
+							  &clusters[start].hash); j++);
+    if (j - start < 2)
+      continue;
+    for (i = start; i < j; i++) {
+      aliases[num_aliases].image = clusters[i].image;
+      aliases[num_aliases].cluster = clusters[i].cluster;
+      aliases[num_aliases].class = start + 1;
+      num_aliases++;
+    }
+  }
+  qsort(aliases, num_aliases, sizeof(image_alias), compare_alias);
+  for (i = 0; i < builder->images.count; i++)
+    sorted[i].first_alias = sorted[i].num_aliases = 0;
+  for (i = num_aliases; i-- > 0; ) {
+    sorted[aliases[i].image].first_alias = i;
+    sorted[aliases[i].image].num_aliases++;
+  }
+
+  memcpy(header.magic, DEDUP_MAGIC, sizeof(header.magic));
+  header.num_images = builder->images.count;
+  header.num_files = builder->files.count;
+  header.num_clusters = count;
+  header.num_aliases = num_aliases;
+  header.images_offset = sizeof(dedup_header);
+  header.files_offset = header.images_offset + header.num_images * sizeof(dedup_image);
+  header.clusters_offset = header.files_offset + header.num_files * sizeof(dedup_file);
+  header.aliases_offset = header.clusters_offset + header.num_clusters * sizeof(dedup_cluster);
+  header.strings_offset = header.aliases_offset + header.num_aliases * sizeof(dedup_alias);
+  header.strings_size = builder->strings.count;
+
+  rv = -ENAMETOOLONG;
+  if (snprintf(temp, sizeof(temp), "%s.XXXXXX", filename) >= (int) sizeof(temp))
+    goto out;
+  fd = mkstemp(temp);
+  if (fd < 0 || (out = fdopen(fd, "w")) == NULL) {
+    rv = -errno;
+    if (fd >= 0) {
+      close(fd);
+      unlink(temp);
+    }
+    goto out;
+  }
+  fwrite(&header, sizeof(header), 1, out);
+  fwrite(sorted, sizeof(dedup_image), header.num_images, out);
+  fwrite(files, sizeof(dedup_file), header.num_files, out);
+  fwrite(clusters, sizeof(dedup_cluster), header.num_clusters, out);
+  for (i = 0; i < num_aliases; i++) {
+    alias.cluster = aliases[i].cluster;
+    alias.class = aliases[i].class;
+    fwrite(&alias, sizeof(alias), 1, out);
+  }
+  fwrite(strings, 1, header.strings_size, out);
+  fchmod(fd, 0644);
+  if (fflush(out) || ferror(out) || fsync(fd) < 0) {
+    rv = -errno;
+    fclose(out);
+    unlink(temp);
+    goto out;
+  }
+  fclose(out);
+  rv = rename(temp, filename) < 0 ? -errno : 0;
+  if (rv < 0)
+    unlink(temp);
+
+ out:
+  free(order);
+  free(remap);
+  free(sorted);
+  free(aliases);
+  return rv;
+}
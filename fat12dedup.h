@@ -0,0 +1,134 @@
+#ifndef _FAT12DEDUP_H_
+#define _FAT12DEDUP_H_
+
+#include "fat12.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Magic number and version at the start of an index file */
+#define DEDUP_MAGIC "FAT12DDX"
+#define DEDUP_VERSION 2
+
+/* 128-bit hash of a cluster or of the contents of a file: the first
+   half of its SHA-256 digest. Clusters with the same hash share their
+   cached data without being compared, so the hash must resist
+   collisions crafted in the images of an archive. */
+typedef struct dedup_hash {
+  uint64_t lo;
+  uint64_t hi;
+} dedup_hash;
+
+/* State of a hash computed over data given in pieces */
+typedef struct dedup_hasher {
+  uint32_t state[8];
+  uint64_t length;
+  /* Bytes of an incomplete 64-byte block */
+  unsigned char tail[64];
+  unsigned int tail_length;
+} dedup_hasher;
+
+/* Layout of an index file. All numbers are in host byte order, and
+   every table starts at a multiple of 8 bytes, so the file can be
+   mapped into memory and used in place. Strings are null-terminated
+   and referred to by their offset within the string table. */
+typedef struct dedup_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t num_images;
+  uint64_t num_files;
+  uint64_t num_clusters;
+  uint64_t num_aliases;
+  /* Offsets of the tables below within the file, and size of the
+     string table, in bytes */
+  uint64_t images_offset;
+  uint64_t files_offset;
+  uint64_t clusters_offset;
+  uint64_t aliases_offset;
+  uint64_t strings_offset;
+  uint64_t strings_size;
+} dedup_header;
+
+/* Indexed image, sorted by base name (and then path). The size,
+   modification time and boot sector identify the contents of the
+   image file when it was indexed. */
+typedef struct dedup_image {
+  uint64_t size;
+  /* Modification time, in nanoseconds since the epoch */
+  int64_t mtime;
+  dedup_hash boot;
+  /* Path of the image file as given when it was indexed, and base
+     name of the file (the tail of the path) */
+  uint64_t path;
+  uint64_t name;
+  /* Size of a cluster, in bytes, and number of entries of the FAT
+     (so the clusters of the image are below this number) */
+  uint32_t cluster_bytes;
+  uint32_t fat_entries;
+  /* Aliases of the image (see dedup_alias) */
+  uint64_t first_alias;
+  uint64_t num_aliases;
+} dedup_image;
+
+/* File of an image, sorted by the hash of its contents */
+typedef struct dedup_file {
+  dedup_hash hash;
+  /* Path of the file within the image */
+  uint64_t path;
+  uint32_t image;
+  uint32_t size;
+} dedup_file;
+
+/* Cluster of a file or directory of an image, sorted by hash */
+typedef struct dedup_cluster {
+  dedup_hash hash;
+  uint32_t image;
+  uint32_t cluster;
+} dedup_cluster;
+
+/* Cluster of an image whose contents are also found in some other
+   cluster (of the same image or another one), sorted by image and
+   cluster. Clusters with the same contents have the same class,
+   which is one plus the position in the cluster table of the first
+   cluster with that hash. */
+typedef struct dedup_alias {
+  uint32_t cluster;
+  uint32_t class;
+} dedup_alias;
+
+/* Index file mapped into memory */
+typedef struct dedup_index {
+  const char *map;
+  size_t size;
+  const dedup_header *header;
+  const dedup_image *images;
+  const dedup_file *files;
+  const dedup_cluster *clusters;
+  const dedup_alias *aliases;
+  const char *strings;
+} dedup_index;
+
+/* Index being built, to which images are added by concurrent
+   threads */
+typedef struct dedup_builder dedup_builder;
+
+void dedup_hash_init(dedup_hasher *hasher);
+void dedup_hash_update(dedup_hasher *hasher, const void *data, size_t length);
+void dedup_hash_final(dedup_hasher *hasher, dedup_hash *hash);
+int dedup_hash_compare(const dedup_hash *a, const dedup_hash *b);
+
+dedup_index *dedup_open(const char *filename);
+void dedup_close(dedup_index *index);
+const char *dedup_string(const dedup_index *index, uint64_t offset);
+size_t dedup_find_files(const dedup_index *index, const dedup_hash *hash,
+			const dedup_file **files);
+size_t dedup_find_clusters(const dedup_index *index, const dedup_hash *hash,
+			   const dedup_cluster **clusters);
+int dedup_attach(const dedup_index *index, fat12volume *volume, const char *name);
+
+dedup_builder *dedup_builder_create(void);
+void dedup_builder_destroy(dedup_builder *builder);
+int dedup_builder_add(dedup_builder *builder, const char *path, fat12volume *volume);
+int dedup_builder_write(dedup_builder *builder, const char *filename);
+
+#endif
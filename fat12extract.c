@@ -0,0 +1,431 @@
+/* copy_file_range is only declared with the GNU extensions enabled */
+#define _GNU_SOURCE
+
+#include "fat12.h"
+#include "fat12dcache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+
+/* Default number of threads writing files */
+#define DEFAULT_THREADS 4
+/* Size of the buffer used to copy data when the kernel cannot copy
+   it between the files by itself */
+#define COPY_BUFFER_SIZE (1 << 20)
+
+/* Data structure describing a file or directory to be extracted */
+typedef struct extract_item {
+  /* Path of the file in the output directory */
+  char *path;
+  /* Size and modification time of the file */
+  uint32_t size;
+  time_t mtime;
+  /* Runs of contiguous clusters of the file, planned from the FAT
+     when the tree is enumerated */
+  fat12extent *extents;
+  int num_extents;
+} extract_item;
+
+/* List of files or directories to be extracted */
+typedef struct extract_list {
+  extract_item *items;
+  unsigned int count, capacity;
+} extract_list;
+
+/* Shared state of the threads writing the files */
+typedef struct extract_job {
+  fat12volume *volume;
+  extract_list *files;
+  /* Index of the next file to be written */
+  unsigned int next;
+  /* Number of files that could not be extracted, and number of bytes
+     written */
+  unsigned int errors;
+  uint64_t bytes;
+  /* Cleared once the kernel refuses to copy between the image and an
+     output file, so the following files go straight to the fallback */
+  int use_copy_range;
+  int use_sendfile;
+} extract_job;
+
+/* record_mtime: Returns the modification time of a record, as shown
+   by fat12fs. */
+static time_t record_mtime(const dir_record *record) {
+  struct tm tm;
+
+  record_time(record, &tm);
+  return mktime(&tm);
+}
+
+/* add_item: Adds a file or directory to a list, exiting if memory
+   runs out. */
+static extract_item *add_item(extract_list *list, const char *path, const dir_record *record) {
+  extract_item *item;
+
+  if (list->count == list->capacity) {
+    list->capacity = list->capacity ? list->capacity * 2 : 64;
+    list->items = realloc(list->items, list->capacity * sizeof(extract_item));
+    if (!list->items) {
+      perror("realloc");
+      exit(1);
+    }
+  }
+  item = &list->items[list->count++];
+  memset(item, 0, sizeof(extract_item));
+  item->path = strdup(path);
+  item->size = record->size;
+  item->mtime = record_mtime(record);
+  if (!item->path) {
+    perror("strdup");
+    exit(1);
+  }
+  return item;
+}
+
+/* set_mtime: Sets the access and modification times of an extracted
+   file or directory to the time of its entry. */
+static void set_mtime(int fd, const char *path, const extract_item *item) {
+  struct timespec times[2] = { { item->mtime, 0 }, { item->mtime, 0 } };
+
+  if (fd >= 0)
+    futimens(fd, times);
+  else
+    utimensat(AT_FDCWD, path, times, 0);
+}
+
+/* plan_tree: Enumerates a directory of the volume and everything
+   below it, creating the output directories on the way and planning
+   the extents of every file.
+   
+   Parameters:
+     volume: pointer to FAT12 volume data structure.
+     dir: record of the directory.
+     path: path of the directory in the output directory.
+     files: list where the files found are added.
+     dirs: list where the directories found are added.
+     visited: one flag per cluster, set for the first cluster of
+              every directory already enumerated.
+   Returns:
+     The number of entries that could not be planned.
+ */
+static unsigned int plan_tree(fat12volume *volume, const dir_record *dir, const char *path,
+			      extract_list *files, extract_list *dirs, unsigned char *visited) {
+  const dir_index *index;
+  const dir_record *entry;
+  extract_item *item;
+  char child[PATH_MAX];
+  unsigned int i, errors = 0;
+
+  if (get_directory_index(volume, dir, &index)) {
+    fprintf(stderr, "%s: the directory could not be read.\n", path);
+    return 1;
+  }
+
+  for (i = 0; i < index->num_entries; i++) {
+    entry = &index->entries[i];
+    // names of a damaged volume must not escape the output directory
+    if (!strcmp(entry->name, ".") || !strcmp(entry->name, "..") || !entry->name[0] ||
+	strchr(entry->name, '/'))
+      continue;
+    if (snprintf(child, sizeof(child), "%s/%s", path, entry->name) >= (int) sizeof(child)) {
+      fprintf(stderr, "%s/%s: path too long.\n", path, entry->name);
+      errors++;
+      continue;
+    }
+
+    if (entry->attributes & ATTR_DIRECTORY) {
+      // in a damaged volume, a directory may point into its own
+      // ancestors or into the data of a file
+      if (entry->first_cluster < 2 || entry->first_cluster >= volume->fat_entries ||
+	  visited[entry->first_cluster]) {
+	fprintf(stderr, "%s: invalid or cross-linked directory, skipped.\n", child);
+	errors++;
+	continue;
+      }
+      visited[entry->first_cluster] = 1;
+      if (mkdir(child, 0755) < 0 && errno != EEXIST) {
+	perror(child);
+	errors++;
+	continue;
+      }
+      add_item(dirs, child, entry);
+      errors += plan_tree(volume, entry, child, files, dirs, visited);
+    } else {
+      item = add_item(files, child, entry);
+      item->num_extents = entry->size ? get_file_extents(volume, entry->first_cluster,
+							 &item->extents) : 0;
+      if (item->num_extents < 0) {
+	fprintf(stderr, "%s: out of memory.\n", child);
+	exit(1);
+      }
+    }
+  }
+  return errors;
+}
+
+/* compare_position: Orders files by the position of their first
+   cluster in the volume, so that the threads sweep the image more or
+   less sequentially. Empty files go first. */
+static int compare_position(const void *a, const void *b) {
+  const extract_item *x = a, *y = b;
+  unsigned int p = x->num_extents ? x->extents[0].first_cluster : 0;
+  unsigned int q = y->num_extents ? y->extents[0].first_cluster : 0;
+
+  return (p > q) - (p < q);
+}
+
+/* copy_range: Copies a range of the volume file to a position of an
+   output file, letting the kernel move the data between the files
+   when it can (copy_file_range, then sendfile), and otherwise going
+   through a buffer (filled straight from the memory mapping of the
+   volume, if any).
+   
+   Returns:
+     0 in case of success, or -1 with errno set.
+ */
+static int copy_range(extract_job *job, int out, off_t position, size_t length, off_t offset,
+		      char **buffer) {
+  fat12volume *volume = job->volume;
+  off_t in_offset = position;
+  ssize_t rv;
+  size_t count, done;
+
+  while (length > 0 && __atomic_load_n(&job->use_copy_range, __ATOMIC_RELAXED)) {
+    rv = copy_file_range(volume->volume_fd, &in_offset, out, &offset, length, 0);
+    if (rv > 0) {
+      length -= rv;
+    } else if (rv == 0) {
+      errno = EIO;
+      return -1;
+    } else if (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP) {
+      __atomic_store_n(&job->use_copy_range, 0, __ATOMIC_RELAXED);
+    } else if (errno != EINTR) {
+      return -1;
+    }
+  }
+
+  // sendfile writes at the current position of the output file
+  if (length > 0 && __atomic_load_n(&job->use_sendfile, __ATOMIC_RELAXED) &&
+      lseek(out, offset, SEEK_SET) == offset) {
+    while (length > 0) {
+      rv = sendfile(out, volume->volume_fd, &in_offset, length);
+      if (rv > 0) {
+	length -= rv;
+	offset += rv;
+      } else if (rv == 0) {
+	errno = EIO;
+	return -1;
+      } else if (errno == ENOSYS || errno == EINVAL) {
+	__atomic_store_n(&job->use_sendfile, 0, __ATOMIC_RELAXED);
+	break;
+      } else if (errno != EINTR) {
+	return -1;
+      }
+    }
+  }
+
+  while (length > 0) {
+    if (!*buffer && !(*buffer = malloc(COPY_BUFFER_SIZE)))
+      return -1;
+    count = length < COPY_BUFFER_SIZE ? length : COPY_BUFFER_SIZE;
+    if (read_data(volume, in_offset, count, *buffer) != count) {
+      errno = EIO;
+      return -1;
+    }
+    for (done = 0; done < count; done += rv) {
+      rv = pwrite(out, *buffer + done, count - done, offset + done);
+      if (rv < 0 && errno == EINTR)
+	rv = 0;
+      else if (rv <= 0)
+	return -1;
+    }
+    in_offset += count;
+    offset += count;
+    length -= count;
+  }
+  return 0;
+}
+
+/* extract_file: Writes a planned file to the output directory.
+   
+   Returns:
+     0 in case of success, or -1 if the file could not be extracted
+     completely (a message has been printed).
+ */
+static int extract_file(extract_job *job, const extract_item *item, char **buffer) {
+  fat12volume *volume = job->volume;
+  unsigned int cluster_bytes = volume->cluster_size * volume->sector_size;
+  uint64_t done = 0, length;
+  int out, e;
+
+  out = open(item->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (out < 0) {
+    perror(item->path);
+    return -1;
+  }
+
+  for (e = 0; e < item->num_extents && done < item->size; e++) {
+    length = (uint64_t) item->extents[e].num_clusters * cluster_bytes;
+    if (length > item->size - done)
+      length = item->size - done;
+    if (copy_range(job, out, cluster_position(volume, item->extents[e].first_cluster), length,
+		   done, buffer) < 0) {
+      perror(item->path);
+      close(out);
+      return -1;
+    }
+    done += length;
+  }
+  __atomic_add_fetch(&job->bytes, done, __ATOMIC_RELAXED);
+
+  set_mtime(out, item->path, item);
+  close(out);
+  if (done < item->size) {
+    fprintf(stderr, "%s: the cluster chain is shorter than the file (%lu of %u bytes).\n",
+	    item->path, (unsigned long) done, item->size);
+    return -1;
+  }
+  return 0;
+}
+
+/* extract_thread: Main function of the threads writing the files,
+   which take files from the plan until there are none left. */
+static void *extract_thread(void *arg) {
+  extract_job *job = arg;
+  char *buffer = NULL;
+  unsigned int f;
+
+  while ((f = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->files->count)
+    if (extract_file(job, &job->files->items[f], &buffer) < 0)
+      __atomic_add_fetch(&job->errors, 1, __ATOMIC_RELAXED);
+  free(buffer);
+  return NULL;
+}
+
+/* extract_volume: Extracts a directory of a volume, and everything
+   below it, into a directory of the host.
+   
+   Parameters:
+     filename: name of the volume file.
+     source: path of the directory in the volume.
+     target: output directory (created if it does not exist).
+     threads: number of threads writing files.
+     flags: flags passed to open_volume_file_flags.
+     quiet: if set, the summary is not printed.
+   Returns:
+     0 in case of success, or 1 if something could not be extracted.
+ */
+static int extract_volume(const char *filename, const char *source, const char *target,
+			  unsigned int threads, int flags, int quiet) {
+  extract_list files = { 0 }, dirs = { 0 };
+  extract_job job = { .files = &files, .use_copy_range = 1, .use_sendfile = 1 };
+  struct timespec start, end;
+  pthread_t *workers;
+  unsigned char *visited;
+  dir_record root;
+  unsigned int i, started, errors;
+  double seconds;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  job.volume = open_volume_file_flags(filename, flags);
+  if (!job.volume) {
+    fprintf(stderr, "Provided volume file is invalid or incomplete: %s.\n", filename);
+    return 1;
+  }
+  if (find_directory_record(job.volume, source, &root) < 0 ||
+      !(root.attributes & ATTR_DIRECTORY)) {
+    fprintf(stderr, "%s: no such directory in %s.\n", source, filename);
+    close_volume_file(job.volume);
+    return 1;
+  }
+  if (mkdir(target, 0755) < 0 && errno != EEXIST) {
+    perror(target);
+    close_volume_file(job.volume);
+    return 1;
+  }
+
+  // the tree is enumerated once, and the files are then written in
+  // the order of their data in the volume
+  visited = calloc(job.volume->fat_entries, 1);
+  if (!visited) {
+    perror("calloc");
+    exit(1);
+  }
+  if (root.first_cluster < job.volume->fat_entries)
+    visited[root.first_cluster] = 1;
+  errors = plan_tree(job.volume, &root, target, &files, &dirs, visited);
+  free(visited);
+  qsort(files.items, files.count, sizeof(extract_item), compare_position);
+
+  workers = calloc(threads, sizeof(pthread_t));
+  for (started = 0; workers && started < threads; started++)
+    if (pthread_create(&workers[started], NULL, extract_thread, &job))
+      break;
+  if (started == 0)
+    extract_thread(&job);
+  for (i = 0; i < started; i++)
+    pthread_join(workers[i], NULL);
+  free(workers);
+  errors += job.errors;
+
+  // directories get their times last, deepest first, since creating
+  // their contents changed them
+  for (i = dirs.count; i-- > 0; )
+    set_mtime(-1, dirs.items[i].path, &dirs.items[i]);
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  if (!quiet)
+    printf("%s: %u files, %u directories, %lu bytes in %.3f s (%.1f MiB/s), %u errors\n",
+	   filename, files.count, dirs.count, (unsigned long) job.bytes, seconds,
+	   job.bytes / (double) (1 << 20) / seconds, errors);
+
+  for (i = 0; i < files.count; i++) {
+    free(files.items[i].path);
+    free(files.items[i].extents);
+  }
+  for (i = 0; i < dirs.count; i++)
+    free(dirs.items[i].path);
+  free(files.items);
+  free(dirs.items);
+  close_volume_file(job.volume);
+  return errors ? 1 : 0;
+}
+
+int main(int argc, char *argv[]) {
+
+  unsigned int threads = DEFAULT_THREADS;
+  int flags = VOLUME_OPEN_MMAP, quiet = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "j:pq")) != -1) {
+    switch (opt) {
+    case 'j': threads = atoi(optarg); break;
+    case 'p': flags &= ~VOLUME_OPEN_MMAP; break;
+    case 'q': quiet = 1; break;
+    default: goto usage;
+    }
+  }
+
+  if (threads > 0 && (optind == argc - 2 || optind == argc - 3))
+    return extract_volume(argv[optind], optind == argc - 3 ? argv[optind + 2] : "/",
+			  argv[optind + 1], threads, flags, quiet);
+
+ usage:
+  fprintf(stderr, "Usage: %s [-j threads] [-p] [-q] volume_file output_dir [path]\n"
+	  "  -j threads   threads writing files (default %u)\n"
+	  "  -p           read the volume with pread instead of mapping it\n"
+	  "  -q           do not print a summary\n"
+	  "Extracts the directory path of the volume (default /) into output_dir.\n",
+	  argv[0], DEFAULT_THREADS);
+  return 1;
+}
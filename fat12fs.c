@@ -1,247 +1,1618 @@
-#include "fat12.h"
-
-#include <stdio.h>
-#include <stdlib.h>
-#include <errno.h>
-#include <unistd.h>
-#include <sys/types.h>
-#include <string.h>
-
-/* The FUSE version has to be defined before any call to relevant
-   includes related to FUSE. */
-#ifndef FUSE_USE_VERSION
-#define FUSE_USE_VERSION 26
-#endif
-#include <fuse.h>
-
-#ifndef FATDEBUG
-#define FATDEBUG 0
-#endif
-
-#if FATDEBUG
-#define debug_print(...) fprintf(stderr, __VA_ARGS__)
-#else
-#define debug_print(...) ((void) 0)
-#endif
-
-#define VOLUME ((fat12volume *) fuse_get_context()->private_data)
-
-static void *fat12_init(struct fuse_conn_info *conn);
-static void fat12_destroy(void *private_data);
-static int fat12_getattr(const char *path, struct stat *stbuf);
-static int fat12_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-			 off_t offset, struct fuse_file_info *fi);
-static int fat12_open(const char *path, struct fuse_file_info *fi);
-static int fat12_release(const char *path, struct fuse_file_info *fi);
-static int fat12_read(const char *path, char *buf, size_t size, off_t offset,
-		      struct fuse_file_info *fi);
-
-static const struct fuse_operations fat12_operations = {
-  .init = fat12_init,
-  .destroy = fat12_destroy,
-  .open = fat12_open,
-  .read = fat12_read,
-  .release = fat12_release,
-  .getattr = fat12_getattr,
-  .readdir = fat12_readdir,
-};
-
-int main(int argc, char *argv[]) {
-  
-  char *volumefile = argv[--argc];
-  fat12volume *volume = open_volume_file(volumefile);
-  argv[argc] = NULL;
-  
-  if (!volume) {
-    fprintf(stderr, "Invalid volume file: '%s'.\n", volumefile);
-    exit(1);
-  }
-  
-  fuse_main(argc, argv, &fat12_operations, volume);
-  
-  return 0;
-}
-
-/* fat12_init: Function called when the FUSE file system is mounted.
- */
-static void *fat12_init(struct fuse_conn_info *conn) {
-  
-  debug_print("init()\n");
-  
-  return VOLUME;
-}
-
-/* fat12_destroy: Function called before the FUSE file system is
-   unmounted.
- */
-static void fat12_destroy(void *private_data) {
-  
-  debug_print("destroy()\n");
-  
-  close_volume_file((fat12volume *) private_data);
-}
-
-/* fat12_getattr: Function called when a process requests the metadata
-   of a file. Metadata includes the file type, size, and
-   creation/modification dates, among others (check man 2 fstat).
-   
-   Parameters:
-     path: Path of the file whose metadata is requested.
-     stbuf: Pointer to a struct stat where metadata must be stored.
-   Returns:
-     In case of success, returns 0, and fills the data in stbuf with
-     information about the file. In case of error, it will return one
-     of these error codes:
-       -ENOENT: If the file does not exist;
-       -ENOTDIR: If one of the path components is not a directory.
- */
-static int fat12_getattr(const char *path, struct stat *stbuf) {
-  
-  debug_print("getattr(path=%s)\n", path);
-  
-  /* TO BE COMPLETED BY THE STUDENT */
-  /* Some comments about members in the struct stat definition:
-     -- st_dev, st_ino, st_rdev: FUSE updates them automatically, no
-        need to set them to any value;
-     -- st_nlink: set it to 1;
-     -- st_ctime, st_mtime, st_atime: all can be set with same value;
-     -- st_gid, st_uid: use the result of getgid() and getuid(),
-        respectively;
-     -- st_mode: use 0555 (read/execute permission, but no write);
-     -- st_blksize: the size of a cluster;
-     -- st_blocks: the number of clusters used in this file.
-     -- other members should be updated based on their description in
-        the man page for stat.
-   */
-  return -ENOENT;
-}
-
-/* fat12_readdir: Function called when a process requests the listing
-   of a directory.
-   
-   Parameters:
-     path: Path of the directory whose listing is requested.
-     buf: Pointer that must be passed as first parameter to filler
-          function.
-     filler: Pointer to a function that must be called for every entry
-             in the directory.  Will accept four parameters, in this
-             order: buf (previous parameter), the filename for the
-             entry, a pointer to a struct stat containing the metadata
-             of the file (optional, may be passed NULL), and an offset
-             (see observation below, you can use 0).
-     offset: Not used in this implementation of readdir.
-     fi: Not used in this implementation of readdir.
-
-   Returns:
-     In case of success, returns 0, and calls the filler function for
-     each entry in the provided directory. In case of error, it will
-     return one of these error codes:
-       -ENOENT: If the directory does not exist;
-       -ENOTDIR: If the provided path (or one of the components of
-                 the path) is not a directory;
-       -EIO: If there was an I/O error trying to obtain the data.
- */
-static int fat12_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-                         off_t offset, struct fuse_file_info *fi) {
-  
-  debug_print("readdir(path=%s, offset=%ld)\n", path, (long) offset);
-
-  /* TO BE COMPLETED BY THE STUDENT */
-  /* There are two ways to implement this function. We highly
-     recommend the first one, where you return all entries in the
-     directory at once. In this case, you will call filler for each
-     entry with the last parameter (offset) equal to 0.
-     
-     An alternative implementation involves returning the entries in
-     the directory in batches (e.g., one call for each cluster). In
-     this case you will use the parameter offset and use a non-zero
-     value in the fourth parameter of filler. You are not required to
-     use this type of implementation, and there will be no bonus or
-     extra help for it.
-  */
-  return -ENOENT;
-}
-
-/* fat12_open: Function called when a process opens a file in the file
-   system.
-   
-   Parameters:
-     path: Path of the file being opened.
-     fi: Data structure containing information about the file being
-         opened. Some useful fields include:
-	 flags: Flags for opening the file. Check 'man 2 open' for
-                information about which flags are available.
-	 fh: File handle. The value you set to fi->fh will be
-             passed unmodified to all other file operations involving
-             the same file.
-   Returns:
-     In case of success, returns 0. In case of error, it will return
-     one of these error codes:
-       -ENOENT: If the file does not exist;
-       -ENOTDIR: If one of the components of the path is not a
-                 directory;
-       -EISDIR: If the path corresponds to a directory;
-       -EACCES: If the open operation was for writing, and the file is
-                read-only.
- */
-static int fat12_open(const char *path, struct fuse_file_info *fi) {
-  
-  debug_print("open(path=%s, flags=0%o)\n", path, fi->flags);
-
-  // If opening for writing, returns error
-  if (fi->flags & O_WRONLY || fi->flags & O_RDWR)
-    return -EACCES;
-
-  /* TO BE COMPLETED BY THE STUDENT */
-  return -ENOENT;
-}
-
-/* fat12_release: Function called when a process closes a file in the
-   file system. If the open file is shared between processes, this
-   function is called when the file has been closed by all processes
-   that share it.
-   
-   Parameters:
-     path: Path of the file being closed.
-     fi: Data structure containing information about the file being
-         opened. This is the same structure used in fat12_open.
-   Returns:
-     In case of success, returns 0. There is no expected error case.
- */
-static int fat12_release(const char *path, struct fuse_file_info *fi) {
-  
-  debug_print("release(path=%s)\n", path);
-  
-  /* TO BE COMPLETED BY THE STUDENT */
-  return 0;
-}
-
-/* fat12_read: Function called when a process reads data from a file
-   in the file system.
-   
-   Parameters:
-     path: Path of the open file.
-     buf: Pointer where data is expected to be stored.
-     size: Maximum number of bytes to be read from the file.
-     offset: Byte offset of the first byte to be read from the file.
-     fi: Data structure containing information about the file being
-         opened. This is the same structure used in fat12_open.
-   Returns:
-     In case of success, returns the number of bytes actually read
-     from the file--which may be smaller than size, or even zero, if
-     (and only if) offset+size is beyond the end of the file. In case
-     of error, may return one of these error codes (not all of them
-     are required):
-       -ENOENT: If the file does not exist;
-       -EISDIR: If the path corresponds to a directory;
-       -EIO: If there was an I/O error trying to obtain the data.
- */
-static int fat12_read(const char *path, char *buf, size_t size, off_t offset,
-		      struct fuse_file_info *fi) {
-  
-  debug_print("read(path=%s, size=%zu, offset=%zu)\n", path, size, offset);
-  
-  /* TO BE COMPLETED BY THE STUDENT */
-  return 0;
-}
-
+#include "fat12.h"
+#include "fat12dcache.h"
+#include "fat12cache.h"
+#include "fat12readahead.h"
+#include "fat12volumes.h"
+#include "fat12stats.h"
+#include "fat12trace.h"
+#include "fat12write.h"
+#include "fat12writeback.h"
+#include "fat12dedup.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <pthread.h>
+
+/* The FUSE version has to be defined before any call to relevant
+   includes related to FUSE. */
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 26
+#endif
+#include <fuse.h>
+
+#ifndef FATDEBUG
+#define FATDEBUG 0
+#endif
+
+#if FATDEBUG
+#define debug_print(...) fprintf(stderr, __VA_ARGS__)
+#else
+#define debug_print(...) ((void) 0)
+#endif
+
+/* Options specific to fat12fs, given with -o in the command line */
+typedef struct fat12options {
+  /* Memory budget of the cluster cache, in MiB (0 disables it) */
+  unsigned int cache_size;
+  /* If set, the volume file is read with pread instead of being
+     mapped into memory */
+  int nommap;
+  /* If set, the FAT and root directory are only read from the volume
+     file when they are first needed */
+  int lazy;
+  /* If set, the volumes are opened for writing, and files and
+     directories can be created, changed and removed */
+  int writable;
+  /* If set, the integrity of each volume is checked when it is
+     opened, and volumes with errors are refused. In a directory of
+     images, each image is only checked again if it changes. */
+  int check;
+  /* If set, the metadata of read-only volumes is taken from the
+     metadata index next to each volume file, which is written if it
+     is missing or out of date */
+  int metadata_index;
+  /* Memory limit of the data written to writable volumes and not
+     written back yet, in MiB (0 writes it right away), and interval,
+     in seconds, at which it is written back (0 only writes it back
+     when memory runs short or files are synced) */
+  unsigned int dirty_size;
+  unsigned int flush_interval;
+  /* Index of the images (see fat12index), used to cache identical
+     clusters of read-only volumes only once, or NULL */
+  char *dedup_index;
+  /* Maximum readahead window, in clusters (0 disables readahead) */
+  unsigned int readahead;
+  /* When mounting a directory of images: time, in seconds, after
+     which an unused volume is closed, and memory budget for the FAT
+     and root directory of all open volumes, in MiB */
+  unsigned int idle_timeout;
+  unsigned int metadata_size;
+  /* Interval, in seconds, at which statistics are dumped (0 disables
+     the dump), and file they are appended to (stderr if not given) */
+  unsigned int stats_interval;
+  char *stats_file;
+  /* File where the spans traced while mounted are written when the
+     file system is unmounted (only when built with FATTRACE) */
+  char *trace_file;
+} fat12options;
+
+/* Data structure with the state of the mounted file system, passed
+   to FUSE as private data */
+typedef struct fat12fs {
+
+  /* Mounted volume, or NULL if a directory of images is mounted */
+  fat12volume *volume;
+  /* Volumes of the mounted directory of images, each one shown as a
+     subdirectory of the root, or NULL if a single volume is mounted */
+  volume_table *volumes;
+  /* Cluster cache shared by all volumes, or NULL if disabled */
+  cluster_cache *cache;
+  /* Index the read-only volumes are attached to, or NULL */
+  dedup_index *dedup;
+  /* Command line options */
+  fat12options options;
+  /* Readahead engine, or NULL if readahead is disabled */
+  readahead *ra;
+  /* Write-back engine, or NULL if the volumes are read-only or
+     written through */
+  writeback *wb;
+  /* Thread dumping statistics periodically, if started, and the
+     condition used to stop it */
+  pthread_t stats_thread;
+  int stats_started;
+  int stopping;
+  pthread_mutex_t stats_lock;
+  pthread_cond_t stats_cond;
+  
+} fat12fs;
+
+/* Synthetic read-only file, in the root of the mount, with the
+   statistics of the file system. It is not listed by readdir. */
+#define STATS_PATH "/.fat12stats"
+
+#define FS ((fat12fs *) fuse_get_context()->private_data)
+
+/* Data structure associated to each open file, stored in the fh
+   field of struct fuse_file_info. */
+typedef struct fat12file {
+
+  /* Volume containing the file */
+  fat12volume *volume;
+  /* Directory entry of the open file */
+  dir_record entry;
+  /* Shared state of the file if its volume is writable, in which case
+     the size and clusters of the file are taken from the node rather
+     than from entry and clusters below */
+  fat12node *node;
+  /* Access pattern of the file, used for readahead */
+  readahead_state ra;
+  /* Number of clusters in the cluster chain of the file */
+  unsigned int num_clusters;
+  /* Numbers of all clusters of the file, in file order */
+  unsigned int clusters[];
+  
+} fat12file;
+
+#define FILE_HANDLE(fi) ((fat12file *) (uintptr_t) (fi)->fh)
+
+/* Data structure associated to each open directory */
+typedef struct fat12dir {
+
+  /* Volume containing the directory, or NULL for the root of a
+     mounted directory of images */
+  fat12volume *volume;
+  /* Directory entry of the open directory */
+  dir_record entry;
+  
+} fat12dir;
+
+#define DIR_HANDLE(fi) ((fat12dir *) (uintptr_t) (fi)->fh)
+
+/* Data structure associated to each open handle of STATS_PATH: the
+   statistics at the time it was opened */
+typedef struct fat12statsfile {
+
+  size_t length;
+  char *text;
+  
+} fat12statsfile;
+
+#define STATS_HANDLE(fi) ((fat12statsfile *) (uintptr_t) (fi)->fh)
+
+static void *fat12_init(struct fuse_conn_info *conn);
+static void fat12_destroy(void *private_data);
+static void forget_volume(fat12volume *volume, void *arg);
+static void *stats_thread(void *arg);
+static int timed_getattr(const char *path, struct stat *stbuf);
+static int timed_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+			 off_t offset, struct fuse_file_info *fi);
+static int timed_open(const char *path, struct fuse_file_info *fi);
+static int timed_read(const char *path, char *buf, size_t size, off_t offset,
+		      struct fuse_file_info *fi);
+static int timed_write(const char *path, const char *buf, size_t size, off_t offset,
+		       struct fuse_file_info *fi);
+static int fat12_getattr(const char *path, struct stat *stbuf);
+static int fat12_opendir(const char *path, struct fuse_file_info *fi);
+static int fat12_releasedir(const char *path, struct fuse_file_info *fi);
+static int fat12_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+			 off_t offset, struct fuse_file_info *fi);
+static int fat12_open(const char *path, struct fuse_file_info *fi);
+static int fat12_release(const char *path, struct fuse_file_info *fi);
+static int fat12_flush(const char *path, struct fuse_file_info *fi);
+static int fat12_fsync(const char *path, int datasync, struct fuse_file_info *fi);
+static int fat12_read(const char *path, char *buf, size_t size, off_t offset,
+		      struct fuse_file_info *fi);
+static int fat12_write(const char *path, const char *buf, size_t size, off_t offset,
+		       struct fuse_file_info *fi);
+static int fat12_create(const char *path, mode_t mode, struct fuse_file_info *fi);
+static int fat12_truncate(const char *path, off_t size);
+static int fat12_ftruncate(const char *path, off_t size, struct fuse_file_info *fi);
+static int fat12_unlink(const char *path);
+static int fat12_mkdir(const char *path, mode_t mode);
+static int fat12_rmdir(const char *path);
+static int fat12_rename(const char *from, const char *to);
+static int fat12_utimens(const char *path, const struct timespec tv[2]);
+static int fat12_statfs(const char *path, struct statvfs *stvfs);
+
+static const struct fuse_operations fat12_operations = {
+  .init = fat12_init,
+  .destroy = fat12_destroy,
+  .open = timed_open,
+  .read = timed_read,
+  .release = fat12_release,
+  .flush = fat12_flush,
+  .fsync = fat12_fsync,
+  .getattr = timed_getattr,
+  .opendir = fat12_opendir,
+  .releasedir = fat12_releasedir,
+  .readdir = timed_readdir,
+  .write = timed_write,
+  .create = fat12_create,
+  .truncate = fat12_truncate,
+  .ftruncate = fat12_ftruncate,
+  .unlink = fat12_unlink,
+  .mkdir = fat12_mkdir,
+  .rmdir = fat12_rmdir,
+  .rename = fat12_rename,
+  .utimens = fat12_utimens,
+  .statfs = fat12_statfs,
+};
+
+#define FAT12_OPT(t, p) { t, offsetof(fat12options, p), 0 }
+
+static const struct fuse_opt fat12_opts[] = {
+  FAT12_OPT("cache_size=%u", cache_size),
+  FAT12_OPT("readahead=%u", readahead),
+  FAT12_OPT("dirty_size=%u", dirty_size),
+  FAT12_OPT("flush_interval=%u", flush_interval),
+  FAT12_OPT("dedup_index=%s", dedup_index),
+  FAT12_OPT("idle_timeout=%u", idle_timeout),
+  FAT12_OPT("metadata_size=%u", metadata_size),
+  FAT12_OPT("stats_interval=%u", stats_interval),
+  FAT12_OPT("stats_file=%s", stats_file),
+  FAT12_OPT("trace_file=%s", trace_file),
+  { "nommap", offsetof(fat12options, nommap), 1 },
+  { "lazy", offsetof(fat12options, lazy), 1 },
+  { "writable", offsetof(fat12options, writable), 1 },
+  { "check", offsetof(fat12options, check), 1 },
+  { "metadata_index", offsetof(fat12options, metadata_index), 1 },
+  FUSE_OPT_END
+};
+
+int main(int argc, char *argv[]) {
+  
+  char *volumefile = argv[--argc];
+  cluster_cache *cache = NULL;
+  dedup_index *dedup = NULL;
+  struct stat st;
+  fat12fs fs = {
+    .options = {
+      .cache_size = CACHE_DEFAULT_BUDGET >> 20,
+      .readahead = READAHEAD_DEFAULT_MAX_WINDOW,
+      .dirty_size = WRITEBACK_DEFAULT_DIRTY_LIMIT >> 20,
+      .flush_interval = WRITEBACK_DEFAULT_INTERVAL,
+      .idle_timeout = VOLUMES_DEFAULT_IDLE_TIMEOUT,
+      .metadata_size = VOLUMES_DEFAULT_METADATA_BUDGET >> 20,
+    },
+  };
+  struct fuse_args args;
+  int rv, flags;
+  argv[argc] = NULL;
+
+  args = (struct fuse_args) FUSE_ARGS_INIT(argc, argv);
+  if (fuse_opt_parse(&args, &fs.options, fat12_opts, NULL) < 0)
+    exit(1);
+
+  // a single cache is shared by all volumes of a directory of images
+  if (fs.options.cache_size) {
+    cache = cluster_cache_create((size_t) fs.options.cache_size << 20);
+    if (!cache) {
+      fprintf(stderr, "Could not allocate the cluster cache.\n");
+      exit(1);
+    }
+  }
+  
+  // the index is only of use to volumes sharing the cache
+  if (fs.options.dedup_index && cache) {
+    dedup = dedup_open(fs.options.dedup_index);
+    if (!dedup) {
+      fprintf(stderr, "Invalid dedup index: '%s'.\n", fs.options.dedup_index);
+      exit(1);
+    }
+  }
+
+  flags = (fs.options.nommap ? 0 : VOLUME_OPEN_MMAP) | (fs.options.lazy ? VOLUME_OPEN_LAZY : 0) |
+    (fs.options.writable ? VOLUME_OPEN_WRITE : 0) | (fs.options.check ? VOLUME_OPEN_CHECK : 0) |
+    (fs.options.metadata_index ? VOLUME_OPEN_INDEX : 0);
+  if (stat(volumefile, &st) == 0 && S_ISDIR(st.st_mode)) {
+    // volumes are always opened lazily, so that listing or stat'ing
+    // an image only reads its boot sector
+    fs.volumes = volume_table_create(volumefile, flags | VOLUME_OPEN_LAZY, cache, dedup,
+				     fs.options.idle_timeout,
+				     (size_t) fs.options.metadata_size << 20);
+    if (!fs.volumes) {
+      fprintf(stderr, "Invalid volume directory: '%s'.\n", volumefile);
+      exit(1);
+    }
+  } else {
+    fs.volume = open_volume_file_flags(volumefile, flags);
+    if (!fs.volume) {
+      fprintf(stderr, fs.options.check ? "Invalid or damaged volume file: '%s' (see fat12fsck).\n" :
+	      "Invalid volume file: '%s'.\n", volumefile);
+      exit(1);
+    }
+    fs.volume->cache = cache;
+    if (dedup && !fs.volume->writable)
+      dedup_attach(dedup, fs.volume, strrchr(volumefile, '/') ? strrchr(volumefile, '/') + 1 :
+		   volumefile);
+  }
+  fs.cache = cache;
+  fs.dedup = dedup;
+  
+  rv = fuse_main(args.argc, args.argv, &fat12_operations, &fs);
+  fuse_opt_free_args(&args);
+  
+  return rv;
+}
+
+/* fat12_init: Function called when the FUSE file system is mounted.
+ */
+static void *fat12_init(struct fuse_conn_info *conn) {
+  
+  fat12fs *fs = FS;
+  
+  debug_print("init()\n");
+
+  // threads must be started here, since FUSE forks before calling init
+  if (fs->options.readahead && fs->cache)
+    fs->ra = readahead_create(fs->options.readahead);
+  if (fs->options.writable && fs->options.dirty_size) {
+    fs->wb = writeback_create(fs->options.flush_interval,
+			      (size_t) fs->options.dirty_size << 20);
+    if (!fs->wb)
+      fprintf(stderr, "Could not start the write-back engine; writes will be synchronous.\n");
+  }
+  if (fs->volume && fs->volume->writable)
+    fs->volume->writeback = fs->wb;
+  if (fs->volumes && volume_table_start(fs->volumes, forget_volume, fs, fs->wb) < 0)
+    fprintf(stderr, "Could not start the volume reaper; idle volumes will stay open.\n");
+  pthread_mutex_init(&fs->stats_lock, NULL);
+  pthread_cond_init(&fs->stats_cond, NULL);
+  if (fs->options.stats_interval)
+    fs->stats_started = !pthread_create(&fs->stats_thread, NULL, stats_thread, fs);
+  
+  return fs;
+}
+
+/* fat12_destroy: Function called before the FUSE file system is
+   unmounted.
+ */
+static void fat12_destroy(void *private_data) {
+  
+  fat12fs *fs = private_data;
+  cluster_cache *cache = fs->cache;
+  cluster_cache_stats stats;
+  
+  debug_print("destroy()\n");
+
+  if (fs->stats_started) {
+    pthread_mutex_lock(&fs->stats_lock);
+    fs->stopping = 1;
+    pthread_cond_signal(&fs->stats_cond);
+    pthread_mutex_unlock(&fs->stats_lock);
+    pthread_join(fs->stats_thread, NULL);
+  }
+  pthread_mutex_destroy(&fs->stats_lock);
+  pthread_cond_destroy(&fs->stats_cond);
+
+  // closing the volumes of a table waits for pending readahead and
+  // write-back on them, so the engines must still be running; closing
+  // a volume writes back what is left of its changes
+  volume_table_destroy(fs->volumes);
+  readahead_destroy(fs->ra);
+  if (fs->volume)
+    writeback_forget(fs->wb, fs->volume);
+
+  if (cache) {
+    cluster_cache_get_stats(cache, &stats);
+    debug_print("cluster cache: %lu hits, %lu misses, %lu evictions\n",
+		stats.hits, stats.misses, stats.evictions);
+  }
+  
+  if (fs->volume)
+    close_volume_file(fs->volume);
+  writeback_destroy(fs->wb);
+  cluster_cache_destroy(cache);
+  dedup_close(fs->dedup);
+
+  if (FATTRACE && fs->options.trace_file &&
+      trace_dump(fs->options.trace_file) < 0)
+    fprintf(stderr, "Could not write the trace to '%s'.\n", fs->options.trace_file);
+}
+
+/* print_stats: Prints the statistics of the file system: operation
+   latencies and event counters of all threads, followed by the
+   statistics of the cluster cache and the data waiting to be written
+   back.
+   
+   Parameters:
+     fs: mounted file system.
+     out: stream where the statistics are written.
+ */
+static void print_stats(fat12fs *fs, FILE *out) {
+
+  cluster_cache_stats stats;
+  
+  stats_print(out);
+  if (fs->cache) {
+    cluster_cache_get_stats(fs->cache, &stats);
+    fprintf(out, "cache_hits %lu\ncache_misses %lu\ncache_evictions %lu\n"
+	    "cache_entries %lu\ncache_bytes %zu\n",
+	    stats.hits, stats.misses, stats.evictions, stats.entries, stats.bytes);
+  }
+  if (fs->wb)
+    fprintf(out, "writeback_dirty_bytes %zu\n", writeback_dirty_bytes(fs->wb));
+}
+
+/* render_stats: Prints the statistics of the file system into a
+   newly allocated handle of STATS_PATH.
+   
+   Parameters:
+     fs: mounted file system.
+   Returns:
+     The new handle, or NULL if memory could not be allocated.
+ */
+static fat12statsfile *render_stats(fat12fs *fs) {
+
+  fat12statsfile *file = malloc(sizeof(fat12statsfile));
+  FILE *out;
+
+  if (!file)
+    return NULL;
+  out = open_memstream(&file->text, &file->length);
+  if (!out) {
+    free(file);
+    return NULL;
+  }
+  print_stats(fs, out);
+  if (fclose(out)) {
+    free(file);
+    return NULL;
+  }
+  return file;
+}
+
+/* stats_thread: Main function of the thread that dumps the
+   statistics every stats_interval seconds, each dump preceded by a
+   line with the current time. */
+static void *stats_thread(void *arg) {
+
+  fat12fs *fs = arg;
+  struct timespec deadline;
+  FILE *out;
+
+  pthread_mutex_lock(&fs->stats_lock);
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  while (!fs->stopping) {
+    deadline.tv_sec += fs->options.stats_interval;
+    while (!fs->stopping &&
+	   pthread_cond_timedwait(&fs->stats_cond, &fs->stats_lock, &deadline) != ETIMEDOUT);
+    if (fs->stopping)
+      break;
+
+    out = fs->options.stats_file ? fopen(fs->options.stats_file, "a") : stderr;
+    if (out) {
+      fprintf(out, "# time %ld\n", (long) time(NULL));
+      print_stats(fs, out);
+      if (out == stderr)
+	fflush(out);
+      else
+	fclose(out);
+    }
+  }
+  pthread_mutex_unlock(&fs->stats_lock);
+
+  return NULL;
+}
+
+/* Wrappers of the operations whose latency is measured (and traced,
+   when built with FATTRACE) */
+
+static int timed_getattr(const char *path, struct stat *stbuf) {
+  uint64_t start = stats_now();
+  int rv = fat12_getattr(path, stbuf);
+  stats_record(STATS_GETATTR, start);
+  trace_end("getattr", start);
+  return rv;
+}
+
+static int timed_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+			 off_t offset, struct fuse_file_info *fi) {
+  uint64_t start = stats_now();
+  int rv = fat12_readdir(path, buf, filler, offset, fi);
+  stats_record(STATS_READDIR, start);
+  trace_end("readdir", start);
+  return rv;
+}
+
+static int timed_open(const char *path, struct fuse_file_info *fi) {
+  uint64_t start = stats_now();
+  int rv = fat12_open(path, fi);
+  stats_record(STATS_OPEN, start);
+  trace_end("open", start);
+  return rv;
+}
+
+static int timed_read(const char *path, char *buf, size_t size, off_t offset,
+		      struct fuse_file_info *fi) {
+  uint64_t start = stats_now();
+  int rv = fat12_read(path, buf, size, offset, fi);
+  stats_record(STATS_READ, start);
+  trace_end("read", start);
+  if (rv > 0)
+    stats_add(STATS_BYTES_READ, rv);
+  return rv;
+}
+
+static int timed_write(const char *path, const char *buf, size_t size, off_t offset,
+		       struct fuse_file_info *fi) {
+  uint64_t start = stats_now();
+  int rv = fat12_write(path, buf, size, offset, fi);
+  stats_record(STATS_WRITE, start);
+  trace_end("write", start);
+  if (rv > 0)
+    stats_add(STATS_BYTES_WRITTEN, rv);
+  return rv;
+}
+
+/* forget_volume: Called by the volume table before a volume is
+   closed, or its metadata released, to stop readahead and write-back
+   on it. */
+static void forget_volume(fat12volume *volume, void *arg) {
+
+  fat12fs *fs = arg;
+
+  readahead_forget(fs->ra, volume);
+  writeback_forget(fs->wb, volume);
+}
+
+/* get_volume: Finds the volume containing a path. When a directory
+   of images is mounted, the first component of the path is the name
+   of an image file, and the volume is acquired from the table until
+   put_volume is called.
+   
+   Parameters:
+     fs: mounted file system.
+     path: path within the mounted file system.
+     volume: out parameter, where the volume is returned. Set to NULL
+             if the path is the root of a mounted directory of images.
+     subpath: out parameter, where the path within the volume is
+              returned.
+   Returns:
+     0 in case of success, or a negative error code if the image file
+     does not exist or cannot be opened.
+ */
+static int get_volume(fat12fs *fs, const char *path, fat12volume **volume,
+		      const char **subpath) {
+
+  const char *name = path + 1, *end;
+  int rv;
+
+  *subpath = path;
+  if (!fs->volumes) {
+    *volume = fs->volume;
+    return 0;
+  }
+
+  *volume = NULL;
+  if (*name == '\0')
+    return 0;
+
+  end = strchr(name, '/');
+  if (!end)
+    end = name + strlen(name);
+  rv = volume_table_acquire(fs->volumes, name, end - name, volume);
+  *subpath = *end ? end : "/";
+  return rv;
+}
+
+/* put_volume: Releases a volume obtained with get_volume.
+   
+   Parameters:
+     fs: mounted file system.
+     volume: volume returned by get_volume. May be NULL.
+ */
+static void put_volume(fat12fs *fs, fat12volume *volume) {
+  if (fs->volumes && volume)
+    volume_table_release(fs->volumes, volume);
+}
+
+/* get_writable_volume: Version of get_volume for operations that
+   change a volume.
+   
+   Parameters:
+     fs, path, volume, subpath: same as in get_volume.
+   Returns:
+     0 in case of success, or a negative error code if the image file
+     does not exist or cannot be opened, -EROFS if the volume is not
+     writable, or -EPERM for the root of a mounted directory of
+     images (in which case no volume is acquired).
+ */
+static int get_writable_volume(fat12fs *fs, const char *path, fat12volume **volume,
+			       const char **subpath) {
+
+  int rv = get_volume(fs, path, volume, subpath);
+
+  if (rv)
+    return rv;
+  if (!*volume)
+    return -EPERM;
+  if (!(*volume)->writable) {
+    put_volume(fs, *volume);
+    return -EROFS;
+  }
+  return 0;
+}
+
+/* fill_images_stat: Fills a struct stat with the metadata of a
+   directory shown for the root of a mounted directory of images or
+   for one of its image files.
+   
+   Parameters:
+     st: metadata of the directory or image file.
+     stbuf: Pointer to a struct stat where metadata must be stored.
+ */
+static void fill_images_stat(const struct stat *st, struct stat *stbuf) {
+  memset(stbuf, 0, sizeof(struct stat));
+  stbuf->st_mode = S_IFDIR | 0555;
+  stbuf->st_nlink = 1;
+  stbuf->st_uid = getuid();
+  stbuf->st_gid = getgid();
+  stbuf->st_atime = st->st_atime;
+  stbuf->st_mtime = st->st_mtime;
+  stbuf->st_ctime = st->st_ctime;
+}
+
+/* fill_stat: Fills a struct stat with the metadata of a directory
+   entry, as described in fat12_getattr (entries of writable volumes
+   are shown with write permission for the owner). This is the only
+   place where the date of an entry is converted.
+   
+   Parameters:
+     volume: pointer to FAT12 volume data structure.
+     entry: record of the entry whose metadata is to be reported.
+     stbuf: Pointer to a struct stat where metadata must be stored.
+ */
+static void fill_stat(fat12volume *volume, const dir_record *entry, struct stat *stbuf) {
+
+  unsigned int cluster_bytes = volume->cluster_size * volume->sector_size;
+  struct tm ctime;
+
+  record_time(entry, &ctime);
+  memset(stbuf, 0, sizeof(struct stat));
+  if (entry->attributes & ATTR_DIRECTORY)
+    stbuf->st_mode = S_IFDIR | (volume->writable ? 0755 : 0555);
+  else
+    stbuf->st_mode = S_IFREG | (volume->writable ? 0644 : 0555);
+  stbuf->st_nlink = 1;
+  stbuf->st_uid = getuid();
+  stbuf->st_gid = getgid();
+  stbuf->st_size = entry->size;
+  stbuf->st_blksize = cluster_bytes;
+  stbuf->st_blocks = (entry->size + cluster_bytes - 1) / cluster_bytes;
+  stbuf->st_atime = stbuf->st_mtime = stbuf->st_ctime = mktime(&ctime);
+}
+
+/* fat12_getattr: Function called when a process requests the metadata
+   of a file. Metadata includes the file type, size, and
+   creation/modification dates, among others (check man 2 fstat).
+   
+   Parameters:
+     path: Path of the file whose metadata is requested.
+     stbuf: Pointer to a struct stat where metadata must be stored.
+   Returns:
+     In case of success, returns 0, and fills the data in stbuf with
+     information about the file. In case of error, it will return one
+     of these error codes:
+       -ENOENT: If the file does not exist;
+       -ENOTDIR: If one of the path components is not a directory.
+ */
+static int fat12_getattr(const char *path, struct stat *stbuf) {
+  
+  debug_print("getattr(path=%s)\n", path);
+  
+  /* Some comments about members in the struct stat definition:
+     -- st_dev, st_ino, st_rdev: FUSE updates them automatically, no
+        need to set them to any value;
+     -- st_nlink: set it to 1;
+     -- st_ctime, st_mtime, st_atime: all can be set with same value;
+     -- st_gid, st_uid: use the result of getgid() and getuid(),
+        respectively;
+     -- st_mode: use 0555 (read/execute permission, but no write);
+     -- st_blksize: the size of a cluster;
+     -- st_blocks: the number of clusters used in this file.
+     -- other members should be updated based on their description in
+        the man page for stat.
+   */
+  fat12fs *fs = FS;
+  fat12volume *volume;
+  fat12statsfile *stats;
+  const char *subpath;
+  dir_record entry;
+  struct stat st;
+  int rv;
+
+  if (!strcmp(path, STATS_PATH)) {
+    stats = render_stats(fs);
+    if (!stats)
+      return -ENOMEM;
+    memset(stbuf, 0, sizeof(struct stat));
+    stbuf->st_mode = S_IFREG | 0444;
+    stbuf->st_nlink = 1;
+    stbuf->st_uid = getuid();
+    stbuf->st_gid = getgid();
+    stbuf->st_size = stats->length;
+    stbuf->st_atime = stbuf->st_mtime = stbuf->st_ctime = time(NULL);
+    free(stats->text);
+    free(stats);
+    return 0;
+  }
+  
+  rv = get_volume(fs, path, &volume, &subpath);
+  if (rv)
+    return rv;
+
+  if (!volume) {
+    rv = volume_table_stat(fs->volumes, &st);
+    if (!rv)
+      fill_images_stat(&st, stbuf);
+    return rv;
+  }
+  
+  // an open file of a writable volume may be larger than its entry
+  lock_volume(volume, 0);
+  rv = find_directory_record(volume, subpath, &entry);
+  if (!rv) {
+    refresh_record(volume, &entry);
+    fill_stat(volume, &entry, stbuf);
+  }
+  unlock_volume(volume);
+  
+  put_volume(fs, volume);
+  return rv;
+}
+
+/* fat12_opendir: Function called when a process opens a directory
+   for listing. The entry of the directory is resolved once and kept
+   in fi->fh, so each batch of readdir can find the directory index
+   without resolving the path again.
+   
+   Parameters:
+     path: Path of the directory being opened.
+     fi: Data structure containing information about the directory
+         being opened.
+   Returns:
+     In case of success, returns 0. In case of error, it will return
+     one of these error codes:
+       -ENOENT: If the directory does not exist;
+       -ENOTDIR: If the path (or one of the components of the path) is
+                 not a directory;
+       -ENOMEM: If there is not enough memory for the handle.
+ */
+static int fat12_opendir(const char *path, struct fuse_file_info *fi) {
+
+  debug_print("opendir(path=%s)\n", path);
+
+  fat12fs *fs = FS;
+  fat12dir *dir = malloc(sizeof(fat12dir));
+  const char *subpath;
+  int rv;
+
+  if (!dir)
+    return -ENOMEM;
+
+  // the volume stays acquired until the directory is released
+  rv = get_volume(fs, path, &dir->volume, &subpath);
+  if (!rv && dir->volume) {
+    lock_volume(dir->volume, 0);
+    rv = find_directory_record(dir->volume, subpath, &dir->entry);
+    unlock_volume(dir->volume);
+    if (!rv && !(dir->entry.attributes & ATTR_DIRECTORY))
+      rv = -ENOTDIR;
+    if (rv)
+      put_volume(fs, dir->volume);
+  }
+  if (rv) {
+    free(dir);
+    return rv;
+  }
+  
+  fi->fh = (uintptr_t) dir;
+  return 0;
+}
+
+/* fat12_releasedir: Function called when a process closes a
+   directory opened with fat12_opendir.
+   
+   Parameters:
+     path: Path of the directory being closed.
+     fi: Same structure used in fat12_opendir.
+   Returns:
+     Always returns 0.
+ */
+static int fat12_releasedir(const char *path, struct fuse_file_info *fi) {
+
+  debug_print("releasedir(path=%s)\n", path);
+
+  fat12dir *dir = DIR_HANDLE(fi);
+
+  put_volume(FS, dir->volume);
+  free(dir);
+  fi->fh = 0;
+  return 0;
+}
+
+/* readdir_volume: Lists a directory of a volume, as described in
+   fat12_readdir.
+   
+   Parameters:
+     volume: pointer to FAT12 volume data structure.
+     dir: record of the directory being listed.
+     buf, filler, offset: same as in fat12_readdir.
+   Returns:
+     Same as fat12_readdir.
+ */
+static int readdir_volume(fat12volume *volume, const dir_record *dir, void *buf,
+			  fuse_fill_dir_t filler, off_t offset) {
+
+  /* Entries are returned in batches: the offset passed to filler
+     with each entry is the position of the following entry in the
+     listing (i.e., the number of entries returned so far), and the
+     batch ends when filler reports that its buffer is full. FUSE
+     then calls readdir again with the last offset. The directory is
+     read in a single pass over its clusters, when its index is
+     built, and every entry is returned with its metadata already
+     filled in.
+  */
+  const dir_index *index;
+  dir_record entry = *dir, record;
+  struct stat st;
+  off_t position = 0, dots;
+  int rv;
+  
+  // the index of a writable volume may be rebuilt by any change
+  lock_volume(volume, 0);
+  rv = get_directory_index(volume, &entry, &index);
+  if (rv) {
+    unlock_volume(volume);
+    return rv;
+  }
+
+  // the root directory has no entries for . and .., so they are
+  // added as the first two positions of its listing
+  dots = entry.first_cluster == 0 ? 2 : 0;
+  for (position = offset; position < dots; position++) {
+    fill_stat(volume, &entry, &st);
+    if (filler(buf, position ? ".." : ".", &st, position + 1))
+      break;
+  }
+  
+  for (; position >= dots && position < dots + index->num_entries; position++) {
+    record = index->entries[position - dots];
+    refresh_record(volume, &record);
+    fill_stat(volume, &record, &st);
+    if (filler(buf, record.name, &st, position + 1))
+      break;
+  }
+  
+  unlock_volume(volume);
+  return 0;
+}
+
+/* Arguments of list_image, passed through volume_table_list */
+typedef struct image_filler {
+  void *buf;
+  fuse_fill_dir_t filler;
+} image_filler;
+
+/* list_image: Adds an image file to the listing of the root of a
+   mounted directory of images. */
+static int list_image(const char *name, const struct stat *st, void *arg) {
+  image_filler *images = arg;
+  struct stat stbuf;
+
+  fill_images_stat(st, &stbuf);
+  return images->filler(images->buf, name, &stbuf, 0);
+}
+
+/* readdir_images: Lists the root of a mounted directory of images,
+   where every image file is shown as a directory. The list is
+   returned in a single batch (i.e., with zero offsets), since the
+   directory of images may change between batches.
+   
+   Parameters:
+     fs: mounted file system.
+     buf, filler: same as in fat12_readdir.
+   Returns:
+     Same as fat12_readdir.
+ */
+static int readdir_images(fat12fs *fs, void *buf, fuse_fill_dir_t filler) {
+
+  image_filler images = { buf, filler };
+  struct stat st, stbuf;
+  int rv;
+
+  rv = volume_table_stat(fs->volumes, &st);
+  if (rv)
+    return rv;
+
+  fill_images_stat(&st, &stbuf);
+  if (filler(buf, ".", &stbuf, 0) || filler(buf, "..", &stbuf, 0))
+    return 0;
+  
+  return volume_table_list(fs->volumes, list_image, &images);
+}
+
+/* fat12_readdir: Function called when a process requests the listing
+   of a directory.
+   
+   Parameters:
+     path: Path of the directory whose listing is requested.
+     buf: Pointer that must be passed as first parameter to filler
+          function.
+     filler: Pointer to a function that must be called for every entry
+             in the directory.  Will accept four parameters, in this
+             order: buf (previous parameter), the filename for the
+             entry, a pointer to a struct stat containing the metadata
+             of the file (optional, may be passed NULL), and an offset
+             (see observation below).
+     offset: Offset returned with the last entry of the previous
+             batch, or zero to start from the beginning of the
+             directory.
+     fi: Directory handle set by fat12_opendir.
+
+   Returns:
+     In case of success, returns 0, and calls the filler function for
+     each entry in the provided directory. In case of error, it will
+     return one of these error codes:
+       -ENOENT: If the directory does not exist;
+       -ENOTDIR: If the provided path (or one of the components of
+                 the path) is not a directory;
+       -EIO: If there was an I/O error trying to obtain the data.
+ */
+static int fat12_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                         off_t offset, struct fuse_file_info *fi) {
+  
+  debug_print("readdir(path=%s, offset=%ld)\n", path, (long) offset);
+
+  fat12fs *fs = FS;
+  fat12dir *handle = DIR_HANDLE(fi);
+  fat12volume *volume;
+  const char *subpath;
+  dir_record entry;
+  int rv;
+
+  if (handle) {
+    volume = handle->volume;
+    entry = handle->entry;
+  } else {
+    rv = get_volume(fs, path, &volume, &subpath);
+    if (rv)
+      return rv;
+    if (volume) {
+      lock_volume(volume, 0);
+      rv = find_directory_record(volume, subpath, &entry);
+      unlock_volume(volume);
+      if (rv) {
+	put_volume(fs, volume);
+	return rv;
+      }
+    }
+  }
+
+  if (!volume)
+    return readdir_images(fs, buf, filler);
+
+  rv = readdir_volume(volume, &entry, buf, filler, offset);
+  if (!handle)
+    put_volume(fs, volume);
+  return rv;
+}
+
+/* fat12_open: Function called when a process opens a file in the file
+   system.
+   
+   Parameters:
+     path: Path of the file being opened.
+     fi: Data structure containing information about the file being
+         opened. Some useful fields include:
+	 flags: Flags for opening the file. Check 'man 2 open' for
+                information about which flags are available.
+	 fh: File handle. The value you set to fi->fh will be
+             passed unmodified to all other file operations involving
+             the same file.
+   Returns:
+     In case of success, returns 0. In case of error, it will return
+     one of these error codes:
+       -ENOENT: If the file does not exist;
+       -ENOTDIR: If one of the components of the path is not a
+                 directory;
+       -EISDIR: If the path corresponds to a directory;
+       -EACCES: If the open operation was for writing, and the file is
+                read-only.
+ */
+static int fat12_open(const char *path, struct fuse_file_info *fi) {
+  
+  debug_print("open(path=%s, flags=0%o)\n", path, fi->flags);
+
+  fat12fs *fs = FS;
+  fat12volume *volume;
+  fat12extent *extents;
+  fat12file *file;
+  fat12node *node;
+  const char *subpath;
+  dir_record entry;
+  unsigned int c, n = 0;
+  int rv, e, num_extents, writing = fi->flags & (O_WRONLY | O_RDWR);
+
+  // the statistics are taken when the file is opened, and read
+  // without the page cache since they change all the time
+  if (!strcmp(path, STATS_PATH)) {
+    if (writing)
+      return -EACCES;
+    fi->fh = (uintptr_t) render_stats(fs);
+    fi->direct_io = 1;
+    return fi->fh ? 0 : -ENOMEM;
+  }
+
+  rv = get_volume(fs, path, &volume, &subpath);
+  if (rv)
+    return rv;
+  if (!volume)
+    return -EISDIR;
+
+  // If opening for writing a volume that is not writable, returns error
+  if (writing && !volume->writable) {
+    put_volume(fs, volume);
+    return -EACCES;
+  }
+
+  // all handles of a file of a writable volume share its node
+  if (volume->writable) {
+    rv = open_node(volume, subpath, &node);
+    if (!rv && writing && (fi->flags & O_TRUNC) && (rv = truncate_node(volume, node, 0)) < 0)
+      close_node(volume, node);
+    if (!rv && !(file = malloc(sizeof(fat12file)))) {
+      close_node(volume, node);
+      rv = -ENOMEM;
+    }
+    if (rv) {
+      put_volume(fs, volume);
+      return rv;
+    }
+    file->volume = volume;
+    file->entry = node->record;
+    file->node = node;
+    file->num_clusters = 0;
+    readahead_init_state(&file->ra);
+    fi->fh = (uintptr_t) file;
+    return 0;
+  }
+
+  rv = find_directory_record(volume, subpath, &entry);
+  if (!rv && (entry.attributes & ATTR_DIRECTORY))
+    rv = -EISDIR;
+  if (rv) {
+    put_volume(fs, volume);
+    return rv;
+  }
+
+  // resolve the whole cluster chain once, so reads can seek directly
+  num_extents = get_file_extents(volume, entry.first_cluster, &extents);
+  if (num_extents < 0) {
+    put_volume(fs, volume);
+    return num_extents;
+  }
+
+  file = malloc(sizeof(fat12file) + (num_extents ?
+    (extents[num_extents - 1].file_cluster + extents[num_extents - 1].num_clusters) : 0) *
+		sizeof(unsigned int));
+  if (!file) {
+    free(extents);
+    put_volume(fs, volume);
+    return -ENOMEM;
+  }
+
+  // the volume stays acquired until the file is released
+  file->volume = volume;
+  file->entry = entry;
+  file->node = NULL;
+  readahead_init_state(&file->ra);
+  for (e = 0; e < num_extents; e++)
+    for (c = 0; c < extents[e].num_clusters; c++)
+      file->clusters[n++] = extents[e].first_cluster + c;
+  file->num_clusters = n;
+  free(extents);
+
+  fi->fh = (uintptr_t) file;
+  return 0;
+}
+
+/* fat12_release: Function called when a process closes a file in the
+   file system. If the open file is shared between processes, this
+   function is called when the file has been closed by all processes
+   that share it.
+   
+   Parameters:
+     path: Path of the file being closed.
+     fi: Data structure containing information about the file being
+         opened. This is the same structure used in fat12_open.
+   Returns:
+     In case of success, returns 0. If the file was changed, may return
+     -EIO if its entry could not be written.
+ */
+static int fat12_release(const char *path, struct fuse_file_info *fi) {
+  
+  debug_print("release(path=%s)\n", path);
+  
+  fat12file *file = FILE_HANDLE(fi);
+  int rv = 0;
+
+  if (!strcmp(path, STATS_PATH)) {
+    free(STATS_HANDLE(fi)->text);
+    free(STATS_HANDLE(fi));
+    fi->fh = 0;
+    return 0;
+  }
+  
+  readahead_destroy_state(&file->ra);
+  if (file->node)
+    rv = close_node(file->volume, file->node);
+  put_volume(FS, file->volume);
+  free(file);
+  fi->fh = 0;
+  return rv;
+}
+
+/* fat12_flush: Function called every time a process closes a
+   descriptor of a file (which may happen several times for each
+   open, e.g., after dup or fork). The changes to the file are not
+   written yet, but the write-back engine is asked to write them soon,
+   and errors found while writing the volume in the background are
+   reported.
+   
+   Parameters:
+     path: Path of the file being closed.
+     fi: Data structure containing information about the file being
+         opened. This is the same structure used in fat12_open.
+   Returns:
+     In case of success, returns 0. Returns -EIO if changes to the
+     volume could not be written since the last flush or sync.
+ */
+static int fat12_flush(const char *path, struct fuse_file_info *fi) {
+
+  debug_print("flush(path=%s)\n", path);
+
+  fat12file *file = FILE_HANDLE(fi);
+
+  if (!strcmp(path, STATS_PATH) || !file->node)
+    return 0;
+  writeback_schedule(file->volume->writeback, file->volume);
+  return take_write_error(file->volume);
+}
+
+/* fat12_fsync: Function called when a process synchronizes a file
+   (e.g., fsync or fdatasync). All changes to the volume containing
+   the file are written and made durable, not only those of the file,
+   since its entry may depend on changes to the FAT or to other
+   directories.
+   
+   Parameters:
+     path: Path of the file.
+     datasync: If non-zero, only the data should be synchronized (this
+               makes no difference here).
+     fi: Data structure containing information about the file being
+         opened. This is the same structure used in fat12_open.
+   Returns:
+     In case of success, returns 0. Returns -EIO if the changes could
+     not be written.
+ */
+static int fat12_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+
+  debug_print("fsync(path=%s, datasync=%d)\n", path, datasync);
+
+  fat12file *file = FILE_HANDLE(fi);
+
+  if (!strcmp(path, STATS_PATH) || !file->node)
+    return 0;
+  return sync_volume(file->volume);
+}
+
+/* fat12_read: Function called when a process reads data from a file
+   in the file system.
+   
+   Parameters:
+     path: Path of the open file.
+     buf: Pointer where data is expected to be stored.
+     size: Maximum number of bytes to be read from the file.
+     offset: Byte offset of the first byte to be read from the file.
+     fi: Data structure containing information about the file being
+         opened. This is the same structure used in fat12_open.
+   Returns:
+     In case of success, returns the number of bytes actually read
+     from the file--which may be smaller than size, or even zero, if
+     (and only if) offset+size is beyond the end of the file. In case
+     of error, may return one of these error codes (not all of them
+     are required):
+       -ENOENT: If the file does not exist;
+       -EISDIR: If the path corresponds to a directory;
+       -EIO: If there was an I/O error trying to obtain the data.
+ */
+static int fat12_read(const char *path, char *buf, size_t size, off_t offset,
+		      struct fuse_file_info *fi) {
+  
+  debug_print("read(path=%s, size=%zu, offset=%zu)\n", path, size, offset);
+  
+  fat12fs *fs = FS;
+  fat12file *file = FILE_HANDLE(fi);
+  fat12volume *volume;
+  fat12statsfile *stats;
+  const unsigned int *clusters;
+  unsigned int cluster_bytes, index, skip, count, run, num_clusters, id, key;
+  size_t done = 0, file_size;
+  int rv;
+
+  if (!strcmp(path, STATS_PATH)) {
+    stats = STATS_HANDLE(fi);
+    if (offset >= stats->length)
+      return 0;
+    if (size > stats->length - offset)
+      size = stats->length - offset;
+    memcpy(buf, stats->text + offset, size);
+    return size;
+  }
+
+  volume = file->volume;
+  cluster_bytes = volume->cluster_size * volume->sector_size;
+
+  // the clusters of a file being written may change between reads
+  lock_volume(volume, 0);
+  if (file->node) {
+    file_size = file->node->record.size;
+    clusters = file->node->clusters;
+    num_clusters = file->node->num_clusters;
+  } else {
+    file_size = file->entry.size;
+    clusters = file->clusters;
+    num_clusters = file->num_clusters;
+  }
+
+  if (offset >= file_size) {
+    unlock_volume(volume);
+    return 0;
+  }
+  if (offset + size > file_size)
+    size = file_size - offset;
+
+  // the cluster list lets us start right at the cluster of the offset
+  index = offset / cluster_bytes;
+  skip = offset % cluster_bytes;
+  rv = 0;
+  
+  while (done < size) {
+    if (index >= num_clusters) {
+      rv = -EIO;
+      break;
+    }
+
+    // extend the run while the next clusters are physically
+    // contiguous and still needed to fill the request; clusters not
+    // written back yet must be read one at a time from memory
+    run = 1;
+    while (index + run < num_clusters &&
+	   clusters[index + run] == clusters[index] + run &&
+	   run * cluster_bytes - skip < size - done &&
+	   !cluster_is_dirty(volume, clusters[index]) &&
+	   !cluster_is_dirty(volume, clusters[index + run]))
+      run++;
+    
+    count = run * cluster_bytes - skip;
+    if (count > size - done)
+      count = size - done;
+
+    // a run of several clusters is read with a single I/O straight
+    // into buf, bypassing the cluster cache, unless readahead has
+    // already brought its first cluster into the cache
+    key = volume_cache_key(volume, clusters[index], &id);
+    if (run > 1 && fs->ra &&
+	cluster_cache_get(volume->cache, id, key, skip, cluster_bytes - skip, buf + done)) {
+      count = cluster_bytes - skip;
+      run = 1;
+    } else if (run == 1) {
+      if (copy_cluster(volume, clusters[index], skip, count, buf + done) != count) {
+	rv = -EIO;
+	break;
+      }
+    } else {
+      if (read_data(volume, cluster_position(volume, clusters[index]) + skip,
+		    count, buf + done) != count) {
+	rv = -EIO;
+	break;
+      }
+    }
+
+    done += count;
+    skip = 0;
+    index += run;
+  }
+
+  if (!rv && fs->ra)
+    readahead_access(fs->ra, volume, &file->ra, clusters, num_clusters, offset, done);
+  unlock_volume(volume);
+  
+  return rv ? rv : done;
+}
+
+
+/* fat12_write: Function called when a process writes data to a file
+   in the file system.
+   
+   Parameters:
+     path: Path of the open file.
+     buf: Pointer to the data to be written.
+     size: Number of bytes to write.
+     offset: Byte offset in the file where the data is written.
+     fi: Data structure containing information about the file being
+         opened. This is the same structure used in fat12_open.
+   Returns:
+     In case of success, returns the number of bytes written (size).
+     In case of error, it will return one of these error codes:
+       -EBADF: If the file was not opened for writing;
+       -EFBIG: If the file would be larger than FAT allows;
+       -ENOSPC: If there is no space left in the volume;
+       -EIO: If there was an I/O error trying to write the data.
+ */
+static int fat12_write(const char *path, const char *buf, size_t size, off_t offset,
+		       struct fuse_file_info *fi) {
+
+  debug_print("write(path=%s, size=%zu, offset=%zu)\n", path, size, offset);
+
+  fat12file *file = FILE_HANDLE(fi);
+
+  if (!strcmp(path, STATS_PATH) || !file->node)
+    return -EBADF;
+  return write_node(file->volume, file->node, buf, size, offset);
+}
+
+/* fat12_create: Function called when a process creates and opens a
+   file. The mode is ignored, since FAT has no permissions.
+   
+   Parameters:
+     path: Path of the file being created.
+     mode: Permissions requested for the new file.
+     fi: Same as in fat12_open.
+   Returns:
+     Same as fat12_open, or the errors of create_entry (e.g., -EINVAL
+     if the name is not a valid 8.3 name), or -EROFS if the volume is
+     not writable.
+ */
+static int fat12_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+
+  debug_print("create(path=%s, mode=0%o)\n", path, (unsigned int) mode);
+
+  fat12fs *fs = FS;
+  fat12volume *volume;
+  const char *subpath;
+  int rv;
+
+  rv = get_writable_volume(fs, path, &volume, &subpath);
+  if (rv)
+    return rv;
+  rv = create_entry(volume, subpath, 0);
+  put_volume(fs, volume);
+
+  // without O_EXCL, creating an existing file just opens it
+  if (rv && (rv != -EEXIST || (fi->flags & O_EXCL)))
+    return rv;
+  return fat12_open(path, fi);
+}
+
+/* fat12_truncate: Function called when a process changes the size of
+   a file given its path.
+   
+   Parameters:
+     path: Path of the file.
+     size: New size of the file, in bytes.
+   Returns:
+     0 in case of success, or the errors of open_node and
+     truncate_node, or -EROFS if the volume is not writable.
+ */
+static int fat12_truncate(const char *path, off_t size) {
+
+  debug_print("truncate(path=%s, size=%ld)\n", path, (long) size);
+
+  fat12fs *fs = FS;
+  fat12volume *volume;
+  fat12node *node;
+  const char *subpath;
+  int rv;
+
+  rv = get_writable_volume(fs, path, &volume, &subpath);
+  if (rv)
+    return rv;
+  rv = open_node(volume, subpath, &node);
+  if (!rv) {
+    rv = truncate_node(volume, node, size);
+    if (close_node(volume, node) < 0 && !rv)
+      rv = -EIO;
+  }
+  put_volume(fs, volume);
+  return rv;
+}
+
+/* fat12_ftruncate: Function called when a process changes the size of
+   an open file.
+   
+   Parameters:
+     path: Path of the open file.
+     size: New size of the file, in bytes.
+     fi: Same structure used in fat12_open.
+   Returns:
+     Same as fat12_truncate.
+ */
+static int fat12_ftruncate(const char *path, off_t size, struct fuse_file_info *fi) {
+
+  debug_print("ftruncate(path=%s, size=%ld)\n", path, (long) size);
+
+  fat12file *file = FILE_HANDLE(fi);
+
+  if (!strcmp(path, STATS_PATH) || !file->node)
+    return -EROFS;
+  return truncate_node(file->volume, file->node, size);
+}
+
+/* fat12_unlink: Function called when a process removes a file.
+   
+   Parameters:
+     path: Path of the file.
+   Returns:
+     0 in case of success, or the errors of remove_entry, or -EROFS if
+     the volume is not writable.
+ */
+static int fat12_unlink(const char *path) {
+
+  debug_print("unlink(path=%s)\n", path);
+
+  fat12fs *fs = FS;
+  fat12volume *volume;
+  const char *subpath;
+  int rv;
+
+  rv = get_writable_volume(fs, path, &volume, &subpath);
+  if (rv)
+    return rv;
+  rv = remove_entry(volume, subpath, 0);
+  put_volume(fs, volume);
+  return rv;
+}
+
+/* fat12_mkdir: Function called when a process creates a directory.
+   The mode is ignored, since FAT has no permissions.
+   
+   Parameters:
+     path: Path of the new directory.
+     mode: Permissions requested for the new directory.
+   Returns:
+     0 in case of success, or the errors of create_entry, or -EROFS if
+     the volume is not writable.
+ */
+static int fat12_mkdir(const char *path, mode_t mode) {
+
+  debug_print("mkdir(path=%s, mode=0%o)\n", path, (unsigned int) mode);
+
+  fat12fs *fs = FS;
+  fat12volume *volume;
+  const char *subpath;
+  int rv;
+
+  rv = get_writable_volume(fs, path, &volume, &subpath);
+  if (rv)
+    return rv;
+  rv = create_entry(volume, subpath, ATTR_DIRECTORY);
+  put_volume(fs, volume);
+  return rv;
+}
+
+/* fat12_rmdir: Function called when a process removes a directory.
+   
+   Parameters:
+     path: Path of the directory.
+   Returns:
+     0 in case of success, or the errors of remove_entry, or -EROFS if
+     the volume is not writable.
+ */
+static int fat12_rmdir(const char *path) {
+
+  debug_print("rmdir(path=%s)\n", path);
+
+  fat12fs *fs = FS;
+  fat12volume *volume;
+  const char *subpath;
+  int rv;
+
+  rv = get_writable_volume(fs, path, &volume, &subpath);
+  if (rv)
+    return rv;
+  rv = remove_entry(volume, subpath, 1);
+  put_volume(fs, volume);
+  return rv;
+}
+
+/* fat12_rename: Function called when a process renames or moves a
+   file or directory.
+   
+   Parameters:
+     from: Current path.
+     to: New path.
+   Returns:
+     0 in case of success, or the errors of rename_entry, -EXDEV if
+     the paths are in different volumes, or -EROFS if the volume is
+     not writable.
+ */
+static int fat12_rename(const char *from, const char *to) {
+
+  debug_print("rename(from=%s, to=%s)\n", from, to);
+
+  fat12fs *fs = FS;
+  fat12volume *volume, *target;
+  const char *subpath, *target_subpath;
+  int rv;
+
+  rv = get_writable_volume(fs, from, &volume, &subpath);
+  if (rv)
+    return rv;
+  rv = get_volume(fs, to, &target, &target_subpath);
+  if (!rv) {
+    rv = target == volume ? rename_entry(volume, subpath, target_subpath) : -EXDEV;
+    put_volume(fs, target);
+  }
+  put_volume(fs, volume);
+  return rv;
+}
+
+/* fat12_utimens: Function called when a process changes the access
+   and modification times of a file. Only the modification time is
+   kept, with the precision of FAT (two seconds).
+   
+   Parameters:
+     path: Path of the file or directory.
+     tv: New access and modification times.
+   Returns:
+     0 in case of success, or the errors of touch_entry, or -EROFS if
+     the volume is not writable.
+ */
+static int fat12_utimens(const char *path, const struct timespec tv[2]) {
+
+  debug_print("utimens(path=%s)\n", path);
+
+  fat12fs *fs = FS;
+  fat12volume *volume;
+  const char *subpath;
+  int rv;
+
+  rv = get_writable_volume(fs, path, &volume, &subpath);
+  if (rv)
+    return rv;
+  rv = touch_entry(volume, subpath, tv[1].tv_sec);
+  put_volume(fs, volume);
+  return rv;
+}
+
+/* fat12_statfs: Function called when a process requests the usage of
+   the file system (e.g., df).
+   
+   Parameters:
+     path: Path of any file in the file system.
+     stvfs: Pointer to a struct statvfs where the usage must be stored.
+       Blocks are clusters of the volume containing the path; the
+       root of a mounted directory of images has no blocks.
+   Returns:
+     0 in case of success, or a negative error code if the image file
+     does not exist or cannot be opened.
+ */
+static int fat12_statfs(const char *path, struct statvfs *stvfs) {
+
+  debug_print("statfs(path=%s)\n", path);
+
+  fat12fs *fs = FS;
+  fat12volume *volume;
+  const char *subpath;
+  int rv;
+
+  memset(stvfs, 0, sizeof(struct statvfs));
+  // the limit is in bytes: 255 UTF-16 units of a long name take up
+  // to NAME_MAX_BYTES in UTF-8. Files created or renamed on a
+  // writable volume still need 8.3 names (see format_name), longer
+  // ones fail with -ENAMETOOLONG
+  stvfs->f_namemax = NAME_MAX_BYTES;
+  rv = get_volume(fs, path, &volume, &subpath);
+  if (rv || !volume)
+    return rv;
+
+  lock_volume(volume, 0);
+  stvfs->f_bsize = stvfs->f_frsize = volume->cluster_size * volume->sector_size;
+  stvfs->f_bfree = stvfs->f_bavail = count_free_clusters(volume);
+  stvfs->f_blocks = volume->fat_entries > 2 ? volume->fat_entries - 2 : 0;
+  unlock_volume(volume);
+  if (!volume->writable)
+    stvfs->f_flag = ST_RDONLY;
+  put_volume(fs, volume);
+  return 0;
+}
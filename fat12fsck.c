@@ -0,0 +1,95 @@
+#include "fat12.h"
+#include "fat12check.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Exit status when some volume has errors, and when some volume
+   could not be checked at all (as in fsck) */
+#define EXIT_ERRORS 4
+#define EXIT_FAILED 8
+
+/* print_problem: Report function of check_volume, which prints each
+   problem on a line prefixed with the name of the volume. */
+static void print_problem(const char *path, const char *problem, void *arg) {
+  printf("%s%s%s: %s\n", (const char *) arg, *path ? ": " : "", path, problem);
+}
+
+/* check_file: Checks a volume file and prints a summary of the
+   problems found.
+   
+   Parameters:
+     filename: name of the volume file.
+     threads: number of threads walking the directory tree.
+     flags: flags used to open the volume.
+     quiet: if set, only the summary is printed.
+   Returns:
+     0 if the volume has no errors, EXIT_ERRORS if it has errors, or
+     EXIT_FAILED if it could not be checked.
+ */
+static int check_file(const char *filename, unsigned int threads, int flags, int quiet) {
+
+  fat12volume *volume;
+  check_result result;
+  struct timespec start, end;
+  int rv;
+
+  volume = open_volume_file_flags(filename, flags | VOLUME_OPEN_LAZY);
+  if (!volume) {
+    fprintf(stderr, "%s: invalid or incomplete volume file.\n", filename);
+    return EXIT_FAILED;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  rv = check_volume(volume, threads, &result, quiet ? NULL : print_problem, (void *) filename);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  close_volume_file(volume);
+  if (rv < 0) {
+    fprintf(stderr, "%s: the FAT or root directory could not be read.\n", filename);
+    return EXIT_FAILED;
+  }
+
+  printf("%s: %u files, %u directories, %u FAT sector mismatches, %u bad chains, "
+	 "%u cross-links, %u loops, %u size mismatches, %u lost clusters (%.3f ms)\n",
+	 filename, result.files, result.directories, result.fat_mismatches, result.bad_chains,
+	 result.cross_links, result.loops, result.size_mismatches, result.lost_clusters,
+	 (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+  return check_has_errors(&result) ? EXIT_ERRORS : 0;
+}
+
+int main(int argc, char *argv[]) {
+
+  unsigned int threads = CHECK_DEFAULT_THREADS;
+  int flags = VOLUME_OPEN_MMAP, quiet = 0, status = 0, rv, opt;
+
+  while ((opt = getopt(argc, argv, "j:pq")) != -1) {
+    switch (opt) {
+    case 'j': threads = atoi(optarg); break;
+    case 'p': flags &= ~VOLUME_OPEN_MMAP; break;
+    case 'q': quiet = 1; break;
+    default: goto usage;
+    }
+  }
+  if (optind == argc || threads == 0)
+    goto usage;
+
+  // the worst status of all volumes is returned
+  for (; optind < argc; optind++) {
+    rv = check_file(argv[optind], threads, flags, quiet);
+    if (rv > status)
+      status = rv;
+  }
+  return status;
+
+ usage:
+  fprintf(stderr, "Usage: %s [-j threads] [-p] [-q] volume_file...\n"
+	  "  -j threads   threads walking the directory tree (default %u, maximum %u)\n"
+	  "  -p           read the volume with pread instead of mapping it\n"
+	  "  -q           only print the summary of each volume\n"
+	  "Exits with 0 if no volume has errors, %d if some volume has errors, or %d\n"
+	  "if some volume could not be checked. Lost clusters are not errors.\n",
+	  argv[0], CHECK_DEFAULT_THREADS, CHECK_MAX_THREADS, EXIT_ERRORS, EXIT_FAILED);
+  return EXIT_FAILED;
+}
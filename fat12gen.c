@@ -0,0 +1,405 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+/* Largest number of data clusters a FAT12 volume can have */
+#define MAX_CLUSTERS 4084
+/* Size of each entry in a directory, in bytes */
+#define DIR_ENTRY_SIZE 32
+/* Fixed timestamp used for all generated entries: 2020-01-01 12:00:00 */
+#define GEN_TIME (12 << 11)
+#define GEN_DATE (((2020 - 1980) << 9) | (1 << 5) | 1)
+
+/* Data structure describing the image being generated */
+typedef struct gen_volume {
+
+  /* File descriptor of the image file */
+  int fd;
+  /* Sector size in bytes, and cluster size in sectors */
+  unsigned int sector_size, cluster_size;
+  /* Number of data clusters, and of entries in the root directory */
+  unsigned int num_clusters, root_entries;
+  /* Layout: sectors per FAT copy, first sector of the root directory
+     and first sector of data cluster #2 */
+  unsigned int fat_sectors, root_offset, data_offset;
+  /* In-memory FAT, indexed by cluster number */
+  uint16_t *fat;
+  /* Lowest cluster that may be free (contiguous allocation only) */
+  unsigned int next_free;
+  /* Number of clusters still free */
+  unsigned int free_clusters;
+  /* If set, clusters of each chain are spread over the volume */
+  int fragment;
+  unsigned int seed;
+  
+} gen_volume;
+
+/* Data structure used to fill the contents of a directory before it
+   is written to the image */
+typedef struct dir_builder {
+  /* First cluster of the directory (0 for the root directory) */
+  unsigned int first_cluster;
+  /* Raw entries, and number of entries used so far */
+  char *data;
+  unsigned int count, capacity;
+} dir_builder;
+
+/* write_le: Writes a little-endian unsigned number to a buffer. */
+static void write_le(char *buffer, int position, unsigned int value, int num_bytes) {
+  while (num_bytes-- > 0) {
+    buffer[position++] = value & 0xff;
+    value >>= 8;
+  }
+}
+
+/* gen_write: Writes data at a byte position of the image, exiting
+   in case of error. */
+static void gen_write(gen_volume *gv, const char *data, size_t length, off_t position) {
+  ssize_t rv;
+
+  while (length > 0) {
+    rv = pwrite(gv->fd, data, length, position);
+    if (rv < 0 && errno == EINTR)
+      continue;
+    if (rv <= 0) {
+      perror("pwrite");
+      exit(1);
+    }
+    data += rv;
+    length -= rv;
+    position += rv;
+  }
+}
+
+/* alloc_cluster: Allocates a free cluster. In fragmented mode the
+   search starts at a random cluster, so consecutive clusters of a
+   chain are scattered (and may even go backwards); otherwise the
+   lowest free cluster is used, producing contiguous chains. */
+static unsigned int alloc_cluster(gen_volume *gv) {
+  unsigned int cluster, n;
+
+  if (gv->free_clusters == 0) {
+    fprintf(stderr, "Volume is full: increase the number or size of clusters.\n");
+    exit(1);
+  }
+
+  cluster = gv->fragment ? 2 + rand_r(&gv->seed) % gv->num_clusters : gv->next_free;
+  for (n = 0; gv->fat[cluster] != 0; n++)
+    cluster = cluster + 1 < gv->num_clusters + 2 ? cluster + 1 : 2;
+  if (!gv->fragment)
+    gv->next_free = cluster + 1;
+  
+  gv->fat[cluster] = 0xfff;
+  gv->free_clusters--;
+  return cluster;
+}
+
+/* alloc_chain: Allocates a chain of clusters large enough for the
+   given number of bytes.
+   
+   Returns:
+     The first cluster of the chain, or 0 if length is zero.
+ */
+static unsigned int alloc_chain(gen_volume *gv, size_t length) {
+  unsigned int cluster_bytes = gv->cluster_size * gv->sector_size;
+  unsigned int first = 0, last = 0, cluster;
+  size_t n = (length + cluster_bytes - 1) / cluster_bytes;
+
+  while (n-- > 0) {
+    cluster = alloc_cluster(gv);
+    if (last)
+      gv->fat[last] = cluster;
+    else
+      first = cluster;
+    last = cluster;
+  }
+  return first;
+}
+
+/* write_chain: Writes data to the clusters of a chain, in order. The
+   remainder of the last cluster is filled with zeros. */
+static void write_chain(gen_volume *gv, unsigned int cluster, const char *data, size_t length) {
+  unsigned int cluster_bytes = gv->cluster_size * gv->sector_size;
+  char *padded = calloc(1, cluster_bytes);
+  size_t count;
+
+  while (length > 0 && cluster >= 2 && cluster < 0xff8) {
+    count = length < cluster_bytes ? length : cluster_bytes;
+    memcpy(padded, data, count);
+    memset(padded + count, 0, cluster_bytes - count);
+    gen_write(gv, padded, cluster_bytes,
+	      ((off_t) gv->data_offset + (off_t) (cluster - 2) * gv->cluster_size) * gv->sector_size);
+    data += count;
+    length -= count;
+    cluster = gv->fat[cluster];
+  }
+  free(padded);
+}
+
+/* add_entry: Adds an entry to a directory being built.
+   
+   Parameters:
+     db: directory being built.
+     name: name of the entry in 8.3 format (e.g., "FILE.TXT").
+     attr: attribute byte of the entry.
+     first_cluster: first cluster of the entry's data.
+     size: size of the file (0 for directories).
+ */
+static void add_entry(dir_builder *db, const char *name, int attr,
+		      unsigned int first_cluster, unsigned int size) {
+  char *entry;
+  const char *dot = strcmp(name, ".") && strcmp(name, "..") ? strchr(name, '.') : NULL;
+  size_t base = dot ? (size_t) (dot - name) : strlen(name);
+
+  if (db->count == db->capacity) {
+    fprintf(stderr, "Too many entries for directory.\n");
+    exit(1);
+  }
+  entry = db->data + db->count++ * DIR_ENTRY_SIZE;
+  memset(entry, ' ', 11);
+  memcpy(entry, name, base > 8 ? 8 : base);
+  if (dot)
+    memcpy(entry + 8, dot + 1, strlen(dot + 1) > 3 ? 3 : strlen(dot + 1));
+  entry[11] = attr;
+  memset(entry + 12, 0, 20);
+  write_le(entry, 22, GEN_TIME, 2);
+  write_le(entry, 24, GEN_DATE, 2);
+  write_le(entry, 26, first_cluster, 2);
+  write_le(entry, 28, size, 4);
+}
+
+/* begin_directory: Starts building a subdirectory with room for the
+   given number of entries (plus . and ..). The directory chain is
+   allocated right away, so that its children can refer to it.
+   
+   Parameters:
+     gv: image being generated.
+     db: directory builder to initialize.
+     parent: first cluster of the parent directory (0 for root).
+     num_entries: number of entries to be added, excluding . and ..
+ */
+static void begin_directory(gen_volume *gv, dir_builder *db, unsigned int parent,
+			    unsigned int num_entries) {
+  db->capacity = num_entries + 2;
+  db->count = 0;
+  db->data = calloc(db->capacity, DIR_ENTRY_SIZE);
+  db->first_cluster = alloc_chain(gv, (size_t) db->capacity * DIR_ENTRY_SIZE);
+  add_entry(db, ".", 0x10, db->first_cluster, 0);
+  add_entry(db, "..", 0x10, parent, 0);
+}
+
+/* end_directory: Writes a finished subdirectory to its chain. */
+static void end_directory(gen_volume *gv, dir_builder *db) {
+  write_chain(gv, db->first_cluster, db->data, (size_t) db->capacity * DIR_ENTRY_SIZE);
+  free(db->data);
+}
+
+/* add_file: Creates a file in a directory. The contents of the file
+   are lines with the path of the file and the offset of each line,
+   so any byte of the file can be verified independently. */
+static void add_file(gen_volume *gv, dir_builder *db, const char *path,
+		     const char *name, size_t size) {
+  // the last line may start just before size, and holds the path, a
+  // space, an offset of up to 20 digits, a newline and a terminator
+  char *data = malloc(size + strlen(path) + 32);
+  size_t length = 0;
+  unsigned int first;
+
+  while (length < size)
+    length += sprintf(data + length, "%s %zu\n", path, length);
+  first = alloc_chain(gv, size);
+  write_chain(gv, first, data, size);
+  add_entry(db, name, 0x20, first, size);
+  free(data);
+}
+
+/* write_metadata: Writes the boot sector, all copies of the FAT and
+   the root directory to the image. */
+static void write_metadata(gen_volume *gv, dir_builder *root, unsigned int fat_copies,
+			   unsigned int total_sectors) {
+  char *boot = calloc(1, gv->sector_size);
+  size_t fat_bytes = (size_t) gv->fat_sectors * gv->sector_size;
+  char *fat = calloc(1, fat_bytes);
+  unsigned int cluster, c;
+
+  memcpy(boot, "\xeb\x3c\x90" "FAT12GEN", 11);
+  write_le(boot, 11, gv->sector_size, 2);
+  write_le(boot, 13, gv->cluster_size, 1);
+  write_le(boot, 14, 1, 2);
+  write_le(boot, 16, fat_copies, 1);
+  write_le(boot, 17, gv->root_entries, 2);
+  write_le(boot, 19, total_sectors < 0x10000 ? total_sectors : 0, 2);
+  write_le(boot, 21, 0xf8, 1);
+  write_le(boot, 22, gv->fat_sectors, 2);
+  write_le(boot, 24, 32, 2);
+  write_le(boot, 26, 2, 2);
+  write_le(boot, 32, total_sectors < 0x10000 ? 0 : total_sectors, 4);
+  write_le(boot, 38, 0x29, 1);
+  write_le(boot, 39, gv->seed, 4);
+  memcpy(boot + 43, "GENERATED  FAT12   ", 19);
+  write_le(boot, 510, 0xaa55, 2);
+  gen_write(gv, boot, gv->sector_size, 0);
+
+  // pack the 12-bit entries, two in every three bytes
+  gv->fat[0] = 0xff8;
+  gv->fat[1] = 0xfff;
+  for (cluster = 0; cluster < gv->num_clusters + 2; cluster++) {
+    unsigned int position = cluster + cluster / 2;
+    if (cluster % 2) {
+      fat[position] = (fat[position] & 0x0f) | ((gv->fat[cluster] & 0x0f) << 4);
+      fat[position + 1] = gv->fat[cluster] >> 4;
+    } else {
+      fat[position] = gv->fat[cluster] & 0xff;
+      fat[position + 1] = (fat[position + 1] & 0xf0) | (gv->fat[cluster] >> 8);
+    }
+  }
+  for (c = 0; c < fat_copies; c++)
+    gen_write(gv, fat, fat_bytes, (off_t) (1 + c * gv->fat_sectors) * gv->sector_size);
+
+  gen_write(gv, root->data, (size_t) root->capacity * DIR_ENTRY_SIZE,
+	    (off_t) gv->root_offset * gv->sector_size);
+  
+  free(boot);
+  free(fat);
+}
+
+int main(int argc, char *argv[]) {
+
+  gen_volume gv = {
+    .sector_size = 512, .cluster_size = 4, .num_clusters = MAX_CLUSTERS,
+    .root_entries = 512, .seed = 1,
+  };
+  unsigned int fat_copies = 2, wide = 0, depth = 0, root_files = 0;
+  size_t small_size = 100, big_size = 0;
+  unsigned int total_sectors, root_sectors, i, used;
+  dir_builder root, dir, *levels;
+  char path[1024], name[32];
+  int opt;
+
+  while ((opt = getopt(argc, argv, "S:c:n:r:F:w:d:R:z:b:fs:")) != -1) {
+    switch (opt) {
+    case 'S': gv.sector_size = atoi(optarg); break;
+    case 'c': gv.cluster_size = atoi(optarg); break;
+    case 'n': gv.num_clusters = atoi(optarg); break;
+    case 'r': gv.root_entries = atoi(optarg); break;
+    case 'F': fat_copies = atoi(optarg); break;
+    case 'w': wide = atoi(optarg); break;
+    case 'd': depth = atoi(optarg); break;
+    case 'R': root_files = atoi(optarg); break;
+    case 'z': small_size = strtoul(optarg, NULL, 0); break;
+    case 'b': big_size = strtoul(optarg, NULL, 0); break;
+    case 'f': gv.fragment = 1; break;
+    case 's': gv.seed = atoi(optarg); break;
+    default: goto usage;
+    }
+  }
+  if (optind != argc - 1)
+    goto usage;
+
+  if (gv.sector_size < 512 || gv.sector_size > 4096 || (gv.sector_size & (gv.sector_size - 1)) ||
+      gv.cluster_size < 1 || gv.cluster_size > 128 || (gv.cluster_size & (gv.cluster_size - 1)) ||
+      gv.num_clusters < 1 || gv.num_clusters > MAX_CLUSTERS || fat_copies < 1 ||
+      gv.root_entries < 1 || gv.root_entries > 0xffff ||
+      root_files + 4 > gv.root_entries || depth > 99) {
+    fprintf(stderr, "Invalid volume parameters.\n");
+    return 1;
+  }
+
+  // the root directory always fills whole sectors
+  gv.root_entries = (gv.root_entries * DIR_ENTRY_SIZE / gv.sector_size) * gv.sector_size / DIR_ENTRY_SIZE;
+  root_sectors = gv.root_entries * DIR_ENTRY_SIZE / gv.sector_size;
+  gv.fat_sectors = ((gv.num_clusters + 2) * 3 / 2 + 1 + gv.sector_size - 1) / gv.sector_size;
+  gv.root_offset = 1 + fat_copies * gv.fat_sectors;
+  gv.data_offset = gv.root_offset + root_sectors;
+  total_sectors = gv.data_offset + gv.num_clusters * gv.cluster_size;
+  gv.fat = calloc(gv.num_clusters + 2, sizeof(uint16_t));
+  gv.free_clusters = gv.num_clusters;
+  gv.next_free = 2;
+
+  gv.fd = open(argv[optind], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (gv.fd < 0 || ftruncate(gv.fd, (off_t) total_sectors * gv.sector_size) < 0) {
+    perror(argv[optind]);
+    return 1;
+  }
+
+  root.first_cluster = 0;
+  root.count = 0;
+  root.capacity = gv.root_entries;
+  root.data = calloc(root.capacity, DIR_ENTRY_SIZE);
+
+  // a large (and, with -f, heavily fragmented) file
+  if (big_size)
+    add_file(&gv, &root, "/BIG.DAT", "BIG.DAT", big_size);
+
+  // a directory with thousands of entries
+  if (wide) {
+    begin_directory(&gv, &dir, 0, wide);
+    for (i = 0; i < wide; i++) {
+      sprintf(name, "F%07u.TXT", i);
+      sprintf(path, "/WIDE/%s", name);
+      add_file(&gv, &dir, path, name, small_size);
+    }
+    add_entry(&root, "WIDE", 0x10, dir.first_cluster, 0);
+    end_directory(&gv, &dir);
+  }
+
+  // a chain of nested directories, each with one file
+  if (depth) {
+    levels = calloc(depth, sizeof(dir_builder));
+    strcpy(path, "");
+    for (i = 0; i < depth; i++) {
+      begin_directory(&gv, &levels[i], i ? levels[i - 1].first_cluster : 0, 2);
+      sprintf(name, "D%02u", i + 1);
+      if (i)
+	add_entry(&levels[i - 1], name, 0x10, levels[i].first_cluster, 0);
+      else
+	add_entry(&root, name, 0x10, levels[i].first_cluster, 0);
+      sprintf(path + strlen(path), "/%s", name);
+    }
+    for (i = depth; i-- > 0; ) {
+      sprintf(path + strlen(path), "/LEVEL.TXT");
+      add_file(&gv, &levels[i], path, "LEVEL.TXT", small_size);
+      *strrchr(path, '/') = '\0';
+      *strrchr(path, '/') = '\0';
+      end_directory(&gv, &levels[i]);
+    }
+    free(levels);
+  }
+
+  // files filling the root directory
+  for (i = 0; i < root_files; i++) {
+    sprintf(name, "R%07u.TXT", i);
+    sprintf(path, "/%s", name);
+    add_file(&gv, &root, path, name, small_size);
+  }
+
+  write_metadata(&gv, &root, fat_copies, total_sectors);
+  close(gv.fd);
+
+  used = gv.num_clusters - gv.free_clusters;
+  printf("%s: %u sectors of %u bytes, %u of %u clusters of %u bytes used, %u root entries\n",
+	 argv[optind], total_sectors, gv.sector_size, used, gv.num_clusters,
+	 gv.cluster_size * gv.sector_size, gv.root_entries);
+  return 0;
+
+ usage:
+  fprintf(stderr, "Usage: %s [options] image_file\n"
+	  "  -S bytes     sector size (default 512)\n"
+	  "  -c sectors   sectors per cluster (default 4)\n"
+	  "  -n clusters  number of data clusters (default and maximum %u)\n"
+	  "  -r entries   maximum entries in the root directory (default 512)\n"
+	  "  -F copies    number of FAT copies (default 2)\n"
+	  "  -w files     create /WIDE with this many files\n"
+	  "  -d depth     create /D01/D02/... this many levels deep\n"
+	  "  -R files     create this many files in the root directory\n"
+	  "  -z bytes     size of each small file (default 100)\n"
+	  "  -b bytes     create /BIG.DAT with this size\n"
+	  "  -f           fragment all cluster chains\n"
+	  "  -s seed      random seed for fragmentation (default 1)\n",
+	  argv[0], MAX_CLUSTERS);
+  return 1;
+}
@@ -0,0 +1,258 @@
+#include "fat12.h"
+#include "fat12dedup.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+/* Default number of threads hashing images */
+#define DEFAULT_THREADS 4
+/* Size of the buffer used to hash files of the host */
+#define HASH_BUFFER_SIZE (1 << 20)
+
+/* Shared state of the threads hashing images */
+typedef struct index_job {
+  dedup_builder *builder;
+  char **images;
+  unsigned int num_images;
+  int flags;
+  int quiet;
+  /* Index of the next image to be hashed */
+  unsigned int next;
+  /* Number of images that could not be indexed, and number of files
+     or directories left out of the index */
+  unsigned int failed;
+  unsigned int errors;
+} index_job;
+
+/* index_thread: Main function of the threads hashing images. Each
+   thread takes the next image not taken yet, until there are no
+   images left. */
+static void *index_thread(void *arg) {
+  index_job *job = arg;
+  fat12volume *volume;
+  unsigned int i;
+  int rv;
+
+  while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->num_images) {
+    volume = open_volume_file_flags(job->images[i], job->flags | VOLUME_OPEN_LAZY);
+    if (!volume) {
+      fprintf(stderr, "%s: invalid or incomplete volume file.\n", job->images[i]);
+      __atomic_add_fetch(&job->failed, 1, __ATOMIC_RELAXED);
+      continue;
+    }
+    rv = dedup_builder_add(job->builder, job->images[i], volume);
+    close_volume_file(volume);
+    if (rv < 0) {
+      fprintf(stderr, "%s: %s.\n", job->images[i], strerror(-rv));
+      __atomic_add_fetch(&job->failed, 1, __ATOMIC_RELAXED);
+    } else if (rv > 0) {
+      if (!job->quiet)
+	fprintf(stderr, "%s: %d damaged files or directories left out.\n", job->images[i], rv);
+      __atomic_add_fetch(&job->errors, rv, __ATOMIC_RELAXED);
+    }
+  }
+  return NULL;
+}
+
+/* build_index: Hashes a set of images and writes their index.
+   
+   Parameters:
+     filename: name of the index file.
+     images: names of the image files.
+     num_images: number of image files.
+     threads: number of threads hashing images.
+     flags: flags used to open the volumes.
+     quiet: if set, neither damaged files nor a summary are printed.
+   Returns:
+     0 in case of success, or 1 if some image could not be indexed or
+     the index could not be written.
+ */
+static int build_index(const char *filename, char **images, unsigned int num_images,
+		       unsigned int threads, int flags, int quiet) {
+  index_job job = { .images = images, .num_images = num_images, .flags = flags,
+		    .quiet = quiet };
+  struct timespec start, end;
+  pthread_t *workers;
+  unsigned int i, started;
+  int rv;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  job.builder = dedup_builder_create();
+  if (!job.builder) {
+    perror("dedup_builder_create");
+    return 1;
+  }
+
+  workers = calloc(threads, sizeof(pthread_t));
+  for (started = 0; workers && started < threads; started++)
+    if (pthread_create(&workers[started], NULL, index_thread, &job))
+      break;
+  if (started == 0)
+    index_thread(&job);
+  for (i = 0; i < started; i++)
+    pthread_join(workers[i], NULL);
+  free(workers);
+
+  rv = dedup_builder_write(job.builder, filename);
+  dedup_builder_destroy(job.builder);
+  if (rv < 0) {
+    fprintf(stderr, "%s: %s.\n", filename, strerror(-rv));
+    return 1;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  if (!quiet)
+    printf("%s: %u images indexed, %u failed, %u files or directories left out (%.3f s)\n",
+	   filename, num_images - job.failed, job.failed, job.errors,
+	   (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+  return job.failed ? 1 : 0;
+}
+
+/* query_index: Prints the images, and the paths within them, of the
+   files of the index with the same contents as some files of the
+   host.
+   
+   Returns:
+     0 if all the files were found, or 1 otherwise.
+ */
+static int query_index(const char *filename, char **files, unsigned int num_files) {
+  const dedup_file *found;
+  dedup_index *index;
+  dedup_hasher hasher;
+  dedup_hash hash;
+  char *buffer;
+  size_t count, i;
+  ssize_t length;
+  unsigned int f;
+  int fd, status = 0;
+
+  index = dedup_open(filename);
+  buffer = malloc(HASH_BUFFER_SIZE);
+  if (!index || !buffer) {
+    perror(filename);
+    dedup_close(index);
+    free(buffer);
+    return 1;
+  }
+
+  for (f = 0; f < num_files; f++) {
+    fd = open(files[f], O_RDONLY);
+    if (fd < 0) {
+      perror(files[f]);
+      status = 1;
+      continue;
+    }
+    dedup_hash_init(&hasher);
+    while ((length = read(fd, buffer, HASH_BUFFER_SIZE)) > 0)
+      dedup_hash_update(&hasher, buffer, length);
+    close(fd);
+    if (length < 0) {
+      perror(files[f]);
+      status = 1;
+      continue;
+    }
+    dedup_hash_final(&hasher, &hash);
+
+    count = dedup_find_files(index, &hash, &found);
+    if (count == 0) {
+      printf("%s: not found\n", files[f]);
+      status = 1;
+    }
+    for (i = 0; i < count; i++)
+      if (found[i].image < index->header->num_images)
+	printf("%s: %s:%s\n", files[f],
+	       dedup_string(index, index->images[found[i].image].path),
+	       dedup_string(index, found[i].path));
+  }
+
+  free(buffer);
+  dedup_close(index);
+  return status;
+}
+
+/* print_stats: Prints how much of the data of the images of an index
+   is duplicated. */
+static int print_stats(const char *filename) {
+  const dedup_cluster *clusters;
+  const dedup_file *files;
+  dedup_index *index;
+  uint64_t i, distinct_files = 0, distinct_clusters = 0, shared_bytes = 0;
+
+  index = dedup_open(filename);
+  if (!index) {
+    perror(filename);
+    return 1;
+  }
+
+  files = index->files;
+  for (i = 0; i < index->header->num_files; i++)
+    if (i == 0 || dedup_hash_compare(&files[i - 1].hash, &files[i].hash))
+      distinct_files++;
+  // every cluster after the first one with some contents is cached
+  // under the key of the first one
+  clusters = index->clusters;
+  for (i = 0; i < index->header->num_clusters; i++) {
+    if (i == 0 || dedup_hash_compare(&clusters[i - 1].hash, &clusters[i].hash))
+      distinct_clusters++;
+    else if (clusters[i].image < index->header->num_images)
+      shared_bytes += index->images[clusters[i].image].cluster_bytes;
+  }
+
+  printf("%s: %u images, %lu files (%lu distinct), %lu clusters (%lu distinct, "
+	 "%lu shared), %lu bytes cached once instead of once per cluster\n",
+	 filename, index->header->num_images, (unsigned long) index->header->num_files,
+	 (unsigned long) distinct_files, (unsigned long) index->header->num_clusters,
+	 (unsigned long) distinct_clusters, (unsigned long) index->header->num_aliases,
+	 (unsigned long) shared_bytes);
+  dedup_close(index);
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+
+  unsigned int threads = DEFAULT_THREADS;
+  int flags = VOLUME_OPEN_MMAP, quiet = 0;
+  int opt;
+
+  if (argc < 3)
+    goto usage;
+
+  // options follow the command
+  optind = 2;
+  if (!strcmp(argv[1], "build")) {
+    while ((opt = getopt(argc, argv, "j:pq")) != -1) {
+      switch (opt) {
+      case 'j': threads = atoi(optarg); break;
+      case 'p': flags &= ~VOLUME_OPEN_MMAP; break;
+      case 'q': quiet = 1; break;
+      default: goto usage;
+      }
+    }
+    if (threads > 0 && optind < argc - 1)
+      return build_index(argv[optind], argv + optind + 1, argc - optind - 1, threads,
+			 flags, quiet);
+  } else if (!strcmp(argv[1], "query") && argc > 3) {
+    return query_index(argv[2], argv + 3, argc - 3);
+  } else if (!strcmp(argv[1], "stats") && argc == 3) {
+    return print_stats(argv[2]);
+  }
+
+ usage:
+  fprintf(stderr, "Usage: %s build [-j threads] [-p] [-q] index_file volume_file...\n"
+	  "       %s query index_file file...\n"
+	  "       %s stats index_file\n"
+	  "  -j threads   threads hashing volumes (default %u)\n"
+	  "  -p           read the volumes with pread instead of mapping them\n"
+	  "  -q           do not print damaged files or a summary\n"
+	  "build hashes every file and cluster of the volumes into index_file, which\n"
+	  "fat12fs can use (-o dedup_index=index_file) to cache identical clusters once.\n"
+	  "query prints the volumes, and the paths within them, of the files of the index\n"
+	  "with the same contents as each file. stats shows how much data is duplicated.\n",
+	  argv[0], argv[0], argv[0], DEFAULT_THREADS);
+  return 1;
+}
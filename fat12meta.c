@@ -0,0 +1,459 @@
+#include "fat12meta.h"
+#include "fat12dcache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Identity of a volume file: its size, modification time and the
+   checksum of everything before its first data cluster */
+typedef struct meta_identity {
+  uint64_t size;
+  int64_t mtime;
+  dedup_hash checksum;
+} meta_identity;
+
+/* Tables of a metadata index being written */
+typedef struct meta_tables {
+  meta_directory *directories;
+  unsigned int num_directories, directories_capacity;
+  meta_record *records;
+  unsigned int num_records, records_capacity;
+  char *names;
+  size_t names_size, names_capacity;
+} meta_tables;
+
+/* identify: Gets the identity of the volume file of a volume. */
+static int identify(fat12volume *volume, meta_identity *identity) {
+  size_t length = (size_t) (volume->rootdir_offset + volume->rootdir_num_sectors) *
+    volume->sector_size;
+  dedup_hasher hasher;
+  struct stat st;
+  char *buffer;
+
+  if (fstat(volume->volume_fd, &st) < 0)
+    return -errno;
+  buffer = malloc(length);
+  if (!buffer)
+    return -ENOMEM;
+  if (read_data(volume, 0, length, buffer) != length) {
+    free(buffer);
+    return -EIO;
+  }
+
+  identity->size = st.st_size;
+  identity->mtime = (int64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+  dedup_hash_init(&hasher);
+  dedup_hash_update(&hasher, buffer, length);
+  dedup_hash_final(&hasher, &identity->checksum);
+  free(buffer);
+  return 0;
+}
+
+/* table_fits: Returns whether a table of count elements of a given
+   size, at a given offset, is within a file of a given size. */
+static int table_fits(uint64_t offset, uint64_t count, size_t element, size_t size) {
+  return offset <= size && count <= (size - offset) / element;
+}
+
+/* map_index: Maps a metadata index into memory, if it is valid and
+   describes a volume file with the given identity.
+   
+   Returns:
+     The mapped index, or NULL if the index is missing, invalid or out
+     of date.
+ */
+static fat12meta *map_index(fat12volume *volume, const char *filename,
+			    const meta_identity *identity) {
+  const meta_header *header;
+  fat12meta *meta;
+  struct stat st;
+  void *map;
+  uint32_t i;
+  int fd;
+
+  fd = open(filename, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+  if (fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(meta_header)) {
+    close(fd);
+    return NULL;
+  }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return NULL;
+
+  header = map;
+  if (memcmp(header->magic, META_MAGIC, sizeof(header->magic)) ||
+      header->version != META_VERSION ||
+      header->sector_size != volume->sector_size ||
+      header->cluster_size != volume->cluster_size ||
+      header->fat_num_sectors != volume->fat_num_sectors ||
+      header->fat_entries != volume->fat_entries ||
+      header->rootdir_entries != volume->rootdir_entries ||
+      header->size != identity->size || header->mtime != identity->mtime ||
+      dedup_hash_compare(&header->checksum, &identity->checksum) ||
+      !table_fits(header->fat_offset, header->fat_num_sectors,
+		  header->sector_size, st.st_size) ||
+      !table_fits(header->next_offset, header->fat_entries, sizeof(uint16_t), st.st_size) ||
+      !table_fits(header->run_offset, header->fat_entries + 1, sizeof(uint16_t), st.st_size) ||
+      !table_fits(header->rootdir_offset, volume->rootdir_num_sectors,
+		  header->sector_size, st.st_size) ||
+      !table_fits(header->directories_offset, header->num_directories,
+		  sizeof(meta_directory), st.st_size) ||
+      !table_fits(header->records_offset, header->num_records,
+		  sizeof(meta_record), st.st_size) ||
+      !table_fits(header->names_offset, header->names_size, 1, st.st_size) ||
+      header->names_size == 0 ||
+      ((const char *) map)[header->names_offset + header->names_size - 1] != '\0') {
+    munmap(map, st.st_size);
+    return NULL;
+  }
+
+  meta = malloc(sizeof(fat12meta));
+  if (!meta) {
+    munmap(map, st.st_size);
+    return NULL;
+  }
+  meta->map = map;
+  meta->size = st.st_size;
+  meta->header = header;
+  meta->directories = (const meta_directory *) (meta->map + header->directories_offset);
+  meta->records = (const meta_record *) (meta->map + header->records_offset);
+  meta->names = meta->map + header->names_offset;
+
+  for (i = 0; i < header->num_directories; i++) {
+    if (meta->directories[i].first_record > header->num_records ||
+	meta->directories[i].num_records >
+	header->num_records - meta->directories[i].first_record) {
+      meta_close(meta);
+      return NULL;
+    }
+  }
+  return meta;
+}
+
+/* meta_attach: Makes a volume take its FAT, root directory and
+   directory entries from its metadata index (the volume file name
+   followed by META_SUFFIX), which is written first if it is missing
+   or out of date. Must be called before the volume is used, and only
+   for volumes that are not writable.
+   
+   Parameters:
+     volume: pointer to FAT12 volume data structure.
+     filename: name of the volume file.
+   Returns:
+     0 in case of success, -EROFS if the volume is writable, or the
+     error that prevented the index from being written or mapped, in
+     which case the volume keeps working without it.
+ */
+int meta_attach(fat12volume *volume, const char *filename) {
+  meta_identity identity;
+  char path[PATH_MAX];
+  fat12meta *meta;
+  int rv;
+
+  if (volume->writable)
+    return -EROFS;
+  if (snprintf(path, sizeof(path), "%s%s", filename, META_SUFFIX) >= (int) sizeof(path))
+    return -ENAMETOOLONG;
+  if ((rv = identify(volume, &identity)) < 0)
+    return rv;
+
+  meta = map_index(volume, path, &identity);
+  if (!meta) {
+    if ((rv = meta_write(volume, path)) < 0)
+      return rv;
+    meta = map_index(volume, path, &identity);
+    if (!meta)
+      return -EIO;
+  }
+
+  // the copies read to write the index are not needed anymore; the
+  // directory indexes already built stay in the dentry cache
+  release_volume_metadata(volume);
+  volume->fat_array = (char *) meta->map + meta->header->fat_offset;
+  volume->fat_next = (uint16_t *) (meta->map + meta->header->next_offset);
+  volume->fat_run = (uint16_t *) (meta->map + meta->header->run_offset);
+  volume->rootdir_array = (char *) meta->map + meta->header->rootdir_offset;
+  volume->meta = meta;
+  __atomic_store_n(&volume->metadata_loaded, 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/* meta_close: Unmaps a metadata index.
+   
+   Parameters:
+     meta: metadata index (may be NULL).
+ */
+void meta_close(fat12meta *meta) {
+  if (!meta)
+    return;
+  munmap((void *) meta->map, meta->size);
+  free(meta);
+}
+
+/* meta_find_directory: Finds the entries of a directory in a
+   metadata index.
+   
+   Parameters:
+     meta: metadata index.
+     first_cluster: first cluster of the directory (zero for the root
+                    directory).
+     records: pointer to where the address of the first entry of the
+              directory is stored.
+   Returns:
+     The number of entries of the directory, or -ENOENT if the
+     directory is not in the index.
+ */
+int meta_find_directory(const fat12meta *meta, unsigned int first_cluster,
+			const meta_record **records) {
+  const meta_directory *directories = meta->directories;
+  uint32_t low = 0, high = meta->header->num_directories, mid;
+
+  while (low < high) {
+    mid = low + (high - low) / 2;
+    if (directories[mid].first_cluster < first_cluster)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  if (low == meta->header->num_directories || directories[low].first_cluster != first_cluster)
+    return -ENOENT;
+
+  *records = &meta->records[directories[low].first_record];
+  return directories[low].num_records;
+}
+
+/* meta_name: Returns a name of the name table of a metadata index, or
+   an empty name if the offset is not within the table. */
+const char *meta_name(const fat12meta *meta, uint32_t offset) {
+  if (offset >= meta->header->names_size)
+    return "";
+  return meta->names + offset;
+}
+
+/* add_name: Adds a name to the name table of a metadata index.
+   Returns the offset of the name within the table, or -ENOMEM. */
+static int64_t add_name(meta_tables *tables, const char *name) {
+  size_t length = strlen(name) + 1, offset;
+  void *grown;
+
+  while (tables->names_size + length > tables->names_capacity) {
+    tables->names_capacity = tables->names_capacity ? tables->names_capacity * 2 : 1024;
+    grown = realloc(tables->names, tables->names_capacity);
+    if (!grown)
+      return -ENOMEM;
+    tables->names = grown;
+  }
+  offset = tables->names_size;
+  memcpy(tables->names + offset, name, length);
+  tables->names_size += length;
+  return offset;
+}
+
+/* add_directory: Adds the entries of a directory to the tables of a
+   metadata index. Returns 0, or -ENOMEM. */
+static int add_directory(meta_tables *tables, const dir_index *index) {
+  const dir_record *entry;
+  meta_directory *directory;
+  meta_record *record;
+  int64_t name, short_name;
+  unsigned int i;
+  void *grown;
+
+  if (tables->num_directories == tables->directories_capacity) {
+    tables->directories_capacity = tables->directories_capacity ?
+      tables->directories_capacity * 2 : 16;
+    grown = realloc(tables->directories, tables->directories_capacity * sizeof(meta_directory));
+    if (!grown)
+      return -ENOMEM;
+    tables->directories = grown;
+  }
+  directory = &tables->directories[tables->num_directories++];
+  directory->first_cluster = index->first_cluster;
+  directory->first_record = tables->num_records;
+  directory->num_records = index->num_entries;
+
+  for (i = 0; i < index->num_entries; i++) {
+    entry = &index->entries[i];
+    if (tables->num_records == tables->records_capacity) {
+      tables->records_capacity = tables->records_capacity ? tables->records_capacity * 2 : 64;
+      grown = realloc(tables->records, tables->records_capacity * sizeof(meta_record));
+      if (!grown)
+	return -ENOMEM;
+      tables->records = grown;
+    }
+    name = short_name = add_name(tables, entry->name);
+    if (name >= 0 && index->short_names && index->short_names[i])
+      short_name = add_name(tables, index->short_names[i]);
+    if (name < 0 || short_name < 0)
+      return -ENOMEM;
+
+    record = &tables->records[tables->num_records++];
+    memset(record, 0, sizeof(meta_record));
+    record->name = name;
+    record->short_name = short_name;
+    record->size = entry->size;
+    record->first_cluster = entry->first_cluster;
+    record->date = entry->date;
+    record->time = entry->time;
+    record->dir_cluster = entry->dir_cluster;
+    record->slot = entry->slot;
+    record->attributes = entry->attributes;
+    record->lfn_entries = entry->lfn_entries;
+  }
+  return 0;
+}
+
+/* compare_directory: Orders directories by first cluster. */
+static int compare_directory(const void *a, const void *b) {
+  const meta_directory *x = a, *y = b;
+
+  return (x->first_cluster > y->first_cluster) - (x->first_cluster < y->first_cluster);
+}
+
+/* write_table: Writes a table to an index file, followed by the
+   padding up to the next multiple of 8 bytes. Returns the offset of
+   the table. */
+static uint64_t write_table(FILE *out, uint64_t *offset, const void *data, size_t length) {
+  static const char padding[8];
+  uint64_t start = *offset;
+
+  fwrite(data, 1, length, out);
+  fwrite(padding, 1, (8 - length % 8) % 8, out);
+  *offset += (length + 7) / 8 * 8;
+  return start;
+}
+
+/* meta_write: Writes the metadata index of a volume, reading every
+   directory reachable from its root. The file is replaced atomically,
+   so volumes already using the previous index are not affected.
+   
+   Parameters:
+     volume: pointer to FAT12 volume data structure.
+     filename: name of the metadata index.
+   Returns:
+     0 in case of success, or a negative error number.
+ */
+int meta_write(fat12volume *volume, const char *filename) {
+  static const dir_record root = {
+    .name = "/",
+    .attributes = ATTR_DIRECTORY,
+  };
+  meta_header header = { .version = META_VERSION };
+  meta_tables tables = { 0 };
+  meta_identity identity;
+  const dir_index *index;
+  const meta_record *record;
+  unsigned char *visited;
+  dir_record dir;
+  char temp[PATH_MAX];
+  uint64_t offset = sizeof(meta_header);
+  unsigned int d, i;
+  FILE *out;
+  int fd, rv;
+
+  if ((rv = load_volume_metadata(volume)) < 0 || (rv = identify(volume, &identity)) < 0)
+    return rv;
+  visited = calloc(volume->fat_entries, 1);
+  if (!visited)
+    return -ENOMEM;
+
+  // the directories are walked breadth first, using the table being
+  // built as the queue; in a damaged volume, a directory may point
+  // into its own ancestors or into the data of a file, and is left
+  // out (it is then read from the volume if it is ever used)
+  rv = get_directory_index(volume, &root, &index);
+  if (rv == 0)
+    rv = add_directory(&tables, index);
+  for (d = 0; rv == 0 && d < tables.num_directories; d++) {
+    for (i = 0; rv == 0 && i < tables.directories[d].num_records; i++) {
+      record = &tables.records[tables.directories[d].first_record + i];
+      if (!(record->attributes & ATTR_DIRECTORY) || record->first_cluster < 2 ||
+	  record->first_cluster >= volume->fat_entries || visited[record->first_cluster])
+	continue;
+      visited[record->first_cluster] = 1;
+      dir.name = tables.names + record->name;
+      dir.first_cluster = record->first_cluster;
+      dir.attributes = record->attributes;
+      if (get_directory_index(volume, &dir, &index) == 0)
+	rv = add_directory(&tables, index);
+    }
+  }
+  free(visited);
+  if (rv < 0)
+    goto out;
+  qsort(tables.directories, tables.num_directories, sizeof(meta_directory), compare_directory);
+
+  memcpy(header.magic, META_MAGIC, sizeof(header.magic));
+  header.sector_size = volume->sector_size;
+  header.cluster_size = volume->cluster_size;
+  header.fat_num_sectors = volume->fat_num_sectors;
+  header.fat_entries = volume->fat_entries;
+  header.rootdir_entries = volume->rootdir_entries;
+  header.size = identity.size;
+  header.mtime = identity.mtime;
+  header.checksum = identity.checksum;
+  header.num_directories = tables.num_directories;
+  header.num_records = tables.num_records;
+
+  rv = -ENAMETOOLONG;
+  if (snprintf(temp, sizeof(temp), "%s.XXXXXX", filename) >= (int) sizeof(temp))
+    goto out;
+  fd = mkstemp(temp);
+  if (fd < 0 || (out = fdopen(fd, "w")) == NULL) {
+    rv = -errno;
+    if (fd >= 0) {
+      close(fd);
+      unlink(temp);
+    }
+    goto out;
+  }
+
+  // the header goes last, once the offsets of the tables are known
+  fseek(out, sizeof(meta_header), SEEK_SET);
+  header.fat_offset = write_table(out, &offset, volume->fat_array,
+				  (size_t) volume->fat_num_sectors * volume->sector_size);
+  header.next_offset = write_table(out, &offset, volume->fat_next,
+				   volume->fat_entries * sizeof(uint16_t));
+  header.run_offset = write_table(out, &offset, volume->fat_run,
+				  (volume->fat_entries + 1) * sizeof(uint16_t));
+  header.rootdir_offset = write_table(out, &offset, volume->rootdir_array,
+				      (size_t) volume->rootdir_num_sectors * volume->sector_size);
+  header.directories_offset = write_table(out, &offset, tables.directories,
+					  tables.num_directories * sizeof(meta_directory));
+  header.records_offset = write_table(out, &offset, tables.records,
+				      tables.num_records * sizeof(meta_record));
+  header.names_size = tables.names_size + 1;
+  header.names_offset = offset;
+  fwrite(tables.names, 1, tables.names_size, out);
+  fputc('\0', out);
+  fseek(out, 0, SEEK_SET);
+  fwrite(&header, sizeof(header), 1, out);
+
+  fchmod(fd, 0644);
+  if (fflush(out) || ferror(out) || fsync(fd) < 0) {
+    rv = -(errno ? errno : EIO);
+    fclose(out);
+    unlink(temp);
+    goto out;
+  }
+  fclose(out);
+  rv = rename(temp, filename) < 0 ? -errno : 0;
+  if (rv < 0)
+    unlink(temp);
+
+ out:
+  free(tables.directories);
+  free(tables.records);
+  free(tables.names);
+  return rv;
+}
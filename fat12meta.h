@@ -0,0 +1,100 @@
+#ifndef _FAT12META_H_
+#define _FAT12META_H_
+
+#include "fat12.h"
+#include "fat12dedup.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Magic number and version at the start of a metadata index */
+#define META_MAGIC "FAT12MDX"
+#define META_VERSION 2
+/* Suffix added to the name of a volume file to name its metadata
+   index, which is kept next to it */
+#define META_SUFFIX ".fat12meta"
+
+/* Layout of a metadata index: the FAT (packed and decoded) and root
+   directory of a volume, and the entries of all its directories, so
+   a volume can be used without reading its FAT or any directory.
+   All numbers are in host byte order, and every table starts at a
+   multiple of 8 bytes, so the file is mapped into memory and used in
+   place. */
+typedef struct meta_header {
+  char magic[8];
+  uint32_t version;
+  /* Geometry of the volume, which must match the boot sector */
+  uint32_t sector_size;
+  uint32_t cluster_size;
+  uint32_t fat_num_sectors;
+  uint32_t fat_entries;
+  uint32_t rootdir_entries;
+  /* Size and modification time (in nanoseconds since the epoch) of
+     the volume file, and checksum of everything before its first
+     data cluster (boot sector, FAT copies and root directory), when
+     the index was written */
+  uint64_t size;
+  int64_t mtime;
+  dedup_hash checksum;
+  /* Number of directories (including the root) and of entries in
+     all of them */
+  uint32_t num_directories;
+  uint32_t num_records;
+  /* Offsets of the tables within the file: packed FAT
+     (fat_num_sectors sectors), fat_next (fat_entries entries),
+     fat_run (fat_entries + 1 entries), root directory (as stored in
+     the volume), directories, entries and names (null-terminated) */
+  uint64_t fat_offset;
+  uint64_t next_offset;
+  uint64_t run_offset;
+  uint64_t rootdir_offset;
+  uint64_t directories_offset;
+  uint64_t records_offset;
+  uint64_t names_offset;
+  uint64_t names_size;
+} meta_header;
+
+/* Directory of the volume, sorted by first cluster (zero for the
+   root directory). Its entries are consecutive in the entry table. */
+typedef struct meta_directory {
+  uint32_t first_cluster;
+  uint32_t first_record;
+  uint32_t num_records;
+} meta_directory;
+
+/* Entry of a directory, in the order of its directory (as in
+   dir_index) */
+typedef struct meta_record {
+  /* Offsets of the name and of the 8.3 name within the name table
+     (both the same unless the entry has a long name) */
+  uint32_t name;
+  uint32_t short_name;
+  uint32_t size;
+  uint16_t first_cluster;
+  uint16_t date;
+  uint16_t time;
+  uint16_t dir_cluster;
+  uint16_t slot;
+  uint8_t attributes;
+  uint8_t lfn_entries;
+  uint16_t padding;
+} meta_record;
+
+/* Metadata index mapped into memory */
+typedef struct fat12meta {
+  const char *map;
+  size_t size;
+  const meta_header *header;
+  const meta_directory *directories;
+  const meta_record *records;
+  const char *names;
+} fat12meta;
+
+int meta_attach(fat12volume *volume, const char *filename);
+void meta_close(fat12meta *meta);
+int meta_write(fat12volume *volume, const char *filename);
+int meta_find_directory(const fat12meta *meta, unsigned int first_cluster,
+			const meta_record **records);
+const char *meta_name(const fat12meta *meta, uint32_t offset);
+
+#endif
@@ -0,0 +1,192 @@
+#include "fat12pool.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+
+/* Alignment of buffers and arena allocations */
+#define POOL_ALIGN 64
+
+/* Slab of buffers. The buffers follow the header, each one rounded
+   up to the alignment. */
+typedef struct pool_slab {
+  struct pool_slab *next;
+} pool_slab;
+
+/* Free buffers are linked through their first bytes */
+typedef struct free_buffer {
+  struct free_buffer *next;
+} free_buffer;
+
+struct buffer_pool {
+  pthread_mutex_t lock;
+  size_t buffer_size;
+  size_t stride;
+  free_buffer *free;
+  pool_slab *slabs;
+};
+
+struct arena_chunk {
+  arena_chunk *next;
+};
+
+/* buffer_pool_create: Creates an empty pool of buffers.
+   
+   Parameters:
+     buffer_size: size of every buffer in the pool, in bytes.
+   Returns:
+     A pointer to the new pool, or NULL if it could not be allocated.
+ */
+buffer_pool *buffer_pool_create(size_t buffer_size) {
+  buffer_pool *pool = calloc(1, sizeof(buffer_pool));
+
+  if (!pool)
+    return NULL;
+  pthread_mutex_init(&pool->lock, NULL);
+  pool->buffer_size = buffer_size;
+  pool->stride = (buffer_size + POOL_ALIGN - 1) & ~(size_t) (POOL_ALIGN - 1);
+  return pool;
+}
+
+/* buffer_pool_destroy: Frees a pool and all its slabs. All buffers
+   borrowed from the pool become invalid.
+   
+   Parameters:
+     pool: buffer pool. May be NULL.
+ */
+void buffer_pool_destroy(buffer_pool *pool) {
+  pool_slab *slab, *next;
+
+  if (!pool)
+    return;
+  for (slab = pool->slabs; slab; slab = next) {
+    next = slab->next;
+    free(slab);
+  }
+  pthread_mutex_destroy(&pool->lock);
+  free(pool);
+}
+
+/* buffer_pool_get: Borrows a buffer from a pool, adding a new slab to
+   the pool if there are no free buffers left.
+   
+   Parameters:
+     pool: buffer pool.
+   Returns:
+     A buffer of the size of the pool, which must be returned with
+     buffer_pool_put, or NULL if memory could not be allocated.
+ */
+char *buffer_pool_get(buffer_pool *pool) {
+  free_buffer *buffer;
+  pool_slab *slab;
+  char *first;
+  int i;
+
+  pthread_mutex_lock(&pool->lock);
+  if (!pool->free) {
+    slab = aligned_alloc(POOL_ALIGN, POOL_ALIGN + POOL_SLAB_BUFFERS * pool->stride);
+    if (!slab) {
+      pthread_mutex_unlock(&pool->lock);
+      return NULL;
+    }
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+    first = (char *) slab + POOL_ALIGN;
+    for (i = POOL_SLAB_BUFFERS - 1; i >= 0; i--) {
+      buffer = (free_buffer *) (first + i * pool->stride);
+      buffer->next = pool->free;
+      pool->free = buffer;
+    }
+  }
+  buffer = pool->free;
+  pool->free = buffer->next;
+  pthread_mutex_unlock(&pool->lock);
+
+  return (char *) buffer;
+}
+
+/* buffer_pool_put: Returns a buffer borrowed with buffer_pool_get to
+   its pool.
+   
+   Parameters:
+     pool: buffer pool the buffer was borrowed from.
+     buffer: buffer being returned. May be NULL.
+ */
+void buffer_pool_put(buffer_pool *pool, char *buffer) {
+  free_buffer *node = (free_buffer *) buffer;
+
+  if (!buffer)
+    return;
+  pthread_mutex_lock(&pool->lock);
+  node->next = pool->free;
+  pool->free = node;
+  pthread_mutex_unlock(&pool->lock);
+}
+
+/* arena_init: Initializes an empty arena.
+   
+   Parameters:
+     arena: arena to be initialized.
+     space: memory used for the first allocations (e.g., a local
+            array of ARENA_INLINE_SIZE bytes), or NULL.
+     size: size of space.
+ */
+void arena_init(request_arena *arena, char *space, size_t size) {
+  uintptr_t aligned = ((uintptr_t) space + POOL_ALIGN - 1) & ~(uintptr_t) (POOL_ALIGN - 1);
+
+  arena->space = space;
+  arena->size = space && size > aligned - (uintptr_t) space ? size : 0;
+  arena->used = space ? aligned - (uintptr_t) space : 0;
+  arena->chunks = NULL;
+}
+
+/* arena_alloc: Allocates memory from an arena. The memory is freed
+   when the arena is released.
+   
+   Parameters:
+     arena: arena.
+     size: number of bytes to allocate.
+   Returns:
+     A pointer to the allocated memory, aligned to 64 bytes, or NULL
+     if memory could not be allocated.
+ */
+void *arena_alloc(request_arena *arena, size_t size) {
+  arena_chunk *chunk;
+  size_t rounded = (size + POOL_ALIGN - 1) & ~(size_t) (POOL_ALIGN - 1);
+  void *p;
+
+  if (arena->size - arena->used < rounded) {
+    // allocations are never resized, so each new chunk is sized for
+    // the allocation that did not fit, with room for a few more
+    size_t chunk_size = rounded < ARENA_INLINE_SIZE ? 2 * ARENA_INLINE_SIZE : rounded;
+    chunk = aligned_alloc(POOL_ALIGN, POOL_ALIGN + chunk_size);
+    if (!chunk)
+      return NULL;
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+    arena->space = (char *) chunk;
+    arena->size = POOL_ALIGN + chunk_size;
+    arena->used = POOL_ALIGN;
+  }
+
+  p = arena->space + arena->used;
+  arena->used += rounded;
+  return p;
+}
+
+/* arena_release: Frees all memory allocated from an arena. The arena
+   can be used again after arena_init.
+   
+   Parameters:
+     arena: arena.
+ */
+void arena_release(request_arena *arena) {
+  arena_chunk *chunk, *next;
+
+  for (chunk = arena->chunks; chunk; chunk = next) {
+    next = chunk->next;
+    free(chunk);
+  }
+  arena->chunks = NULL;
+  arena->space = NULL;
+  arena->size = arena->used = 0;
+}
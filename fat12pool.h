@@ -0,0 +1,44 @@
+#ifndef _FAT12POOL_H_
+#define _FAT12POOL_H_
+
+#include <stddef.h>
+#include <pthread.h>
+
+/* Number of buffers carved out of every slab of a buffer pool */
+#define POOL_SLAB_BUFFERS 16
+/* Size of the space for a request arena usually kept in the stack of
+   its user, enough for a root directory of 224 entries */
+#define ARENA_INLINE_SIZE 8192
+
+/* Pool of buffers of a fixed size (e.g., one cluster). Buffers are
+   allocated in slabs and recycled through a free list, so borrowing
+   and returning a buffer never calls malloc or free once the pool has
+   grown to the number of buffers in use at the same time. Slabs are
+   only freed when the pool is destroyed. */
+typedef struct buffer_pool buffer_pool;
+
+/* Chunk of memory of a request arena, allocated when the inline space
+   runs out */
+typedef struct arena_chunk arena_chunk;
+
+/* Arena for the transient allocations of a single request (e.g., the
+   scan of a directory). Allocations are carved out of a space given
+   by the user, typically on the stack, and then out of heap chunks,
+   and are all freed at once by arena_release. */
+typedef struct request_arena {
+  char *space;
+  size_t size;
+  size_t used;
+  arena_chunk *chunks;
+} request_arena;
+
+buffer_pool *buffer_pool_create(size_t buffer_size);
+void buffer_pool_destroy(buffer_pool *pool);
+char *buffer_pool_get(buffer_pool *pool);
+void buffer_pool_put(buffer_pool *pool, char *buffer);
+
+void arena_init(request_arena *arena, char *space, size_t size);
+void *arena_alloc(request_arena *arena, size_t size);
+void arena_release(request_arena *arena);
+
+#endif
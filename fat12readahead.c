@@ -0,0 +1,224 @@
+#include "fat12readahead.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Pending prefetch request: read num_clusters clusters of the chain
+   starting at first_cluster */
+typedef struct readahead_request {
+  fat12volume *volume;
+  unsigned int first_cluster;
+  unsigned int num_clusters;
+} readahead_request;
+
+struct readahead {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  /* Signalled when the thread finishes a request */
+  pthread_cond_t done;
+  int stop;
+  /* Volume of the request being processed, or NULL if idle */
+  fat12volume *active;
+  unsigned int max_window;
+  /* Circular queue of pending requests */
+  unsigned int head, count;
+  readahead_request queue[READAHEAD_QUEUE_SIZE];
+};
+
+/* readahead_thread: Main function of the prefetching thread. Takes
+   requests from the queue and reads the requested clusters with
+   borrow_cluster, which leaves them in the cluster cache of the
+   volume. */
+static void *readahead_thread(void *arg) {
+  readahead *ra = arg;
+  readahead_request request;
+  unsigned int cluster, n;
+  char *buffer;
+
+  pthread_mutex_lock(&ra->lock);
+  while (1) {
+    while (!ra->stop && ra->count == 0)
+      pthread_cond_wait(&ra->cond, &ra->lock);
+    if (ra->stop)
+      break;
+    request = ra->queue[ra->head];
+    ra->head = (ra->head + 1) % READAHEAD_QUEUE_SIZE;
+    ra->count--;
+    ra->active = request.volume;
+    pthread_mutex_unlock(&ra->lock);
+
+    // the chain must not change while it is followed
+    lock_volume(request.volume, 0);
+    cluster = request.first_cluster;
+    for (n = 0; n < request.num_clusters && cluster >= 2 && cluster < request.volume->fat_entries; n++) {
+      borrow_cluster(request.volume, cluster, &buffer);
+      return_cluster(request.volume, buffer);
+      cluster = get_next_cluster(request.volume, cluster);
+    }
+    unlock_volume(request.volume);
+    
+    pthread_mutex_lock(&ra->lock);
+    ra->active = NULL;
+    pthread_cond_broadcast(&ra->done);
+  }
+  pthread_mutex_unlock(&ra->lock);
+  
+  return NULL;
+}
+
+/* readahead_create: Creates a readahead engine and starts its
+   prefetching thread. Note that FUSE may fork when going to the
+   background, so the engine must be created after that (e.g., in the
+   init operation).
+   
+   Parameters:
+     max_window: maximum number of clusters prefetched ahead of the
+                 current position of a sequentially read file.
+   Returns:
+     A pointer to the new engine, or NULL in case of error.
+ */
+readahead *readahead_create(unsigned int max_window) {
+  readahead *ra = calloc(1, sizeof(readahead));
+
+  if (!ra)
+    return NULL;
+  
+  ra->max_window = max_window < READAHEAD_MIN_WINDOW ? READAHEAD_MIN_WINDOW : max_window;
+  pthread_mutex_init(&ra->lock, NULL);
+  pthread_cond_init(&ra->cond, NULL);
+  pthread_cond_init(&ra->done, NULL);
+  if (pthread_create(&ra->thread, NULL, readahead_thread, ra)) {
+    pthread_mutex_destroy(&ra->lock);
+    pthread_cond_destroy(&ra->cond);
+    pthread_cond_destroy(&ra->done);
+    free(ra);
+    return NULL;
+  }
+  return ra;
+}
+
+/* readahead_destroy: Stops the prefetching thread, discarding any
+   pending requests, and frees the engine.
+   
+   Parameters:
+     ra: readahead engine. May be NULL.
+ */
+void readahead_destroy(readahead *ra) {
+  if (!ra)
+    return;
+
+  pthread_mutex_lock(&ra->lock);
+  ra->stop = 1;
+  pthread_cond_signal(&ra->cond);
+  pthread_mutex_unlock(&ra->lock);
+  pthread_join(ra->thread, NULL);
+
+  pthread_mutex_destroy(&ra->lock);
+  pthread_cond_destroy(&ra->cond);
+  pthread_cond_destroy(&ra->done);
+  free(ra);
+}
+
+/* readahead_forget: Discards pending requests for a volume and waits
+   until the prefetching thread is no longer reading from it. Must be
+   called before a volume that has been used with the engine is
+   closed, or its metadata released, once no more requests for it can
+   be issued.
+   
+   Parameters:
+     ra: readahead engine. May be NULL.
+     volume: pointer to FAT12 volume data structure.
+ */
+void readahead_forget(readahead *ra, fat12volume *volume) {
+  unsigned int i, kept = 0;
+
+  if (!ra)
+    return;
+
+  pthread_mutex_lock(&ra->lock);
+  for (i = 0; i < ra->count; i++) {
+    readahead_request *request = &ra->queue[(ra->head + i) % READAHEAD_QUEUE_SIZE];
+    if (request->volume != volume)
+      ra->queue[(ra->head + kept++) % READAHEAD_QUEUE_SIZE] = *request;
+  }
+  ra->count = kept;
+  while (ra->active == volume)
+    pthread_cond_wait(&ra->done, &ra->lock);
+  pthread_mutex_unlock(&ra->lock);
+}
+
+/* readahead_init_state: Initializes the access pattern of a newly
+   opened file. */
+void readahead_init_state(readahead_state *state) {
+  pthread_mutex_init(&state->lock, NULL);
+  state->next_offset = 0;
+  state->window = 0;
+  state->prefetched = 0;
+}
+
+/* readahead_destroy_state: Frees resources used by the access
+   pattern of a file being closed. */
+void readahead_destroy_state(readahead_state *state) {
+  pthread_mutex_destroy(&state->lock);
+}
+
+/* readahead_access: Records a read of an open file and, if the file
+   is being read sequentially, asks the prefetching thread to read
+   the clusters following the current position. The window doubles
+   on every sequential read, up to the maximum of the engine, and
+   collapses as soon as a non-sequential read is seen. Prefetching is
+   triggered once less than half a window remains ahead of the
+   current position.
+   
+   Parameters:
+     ra: readahead engine.
+     volume: pointer to FAT12 volume data structure.
+     state: access pattern of the open file.
+     clusters: numbers of all clusters of the file, in file order.
+     num_clusters: number of clusters of the file.
+     offset: byte offset of the read within the file.
+     size: number of bytes read.
+ */
+void readahead_access(readahead *ra, fat12volume *volume, readahead_state *state,
+		      const unsigned int *clusters, unsigned int num_clusters,
+		      off_t offset, size_t size) {
+  unsigned int cluster_bytes = volume->cluster_size * volume->sector_size;
+  unsigned int next, start, end;
+
+  if (size == 0)
+    return;
+  
+  pthread_mutex_lock(&state->lock);
+  if (offset == state->next_offset) {
+    state->window = state->window ? state->window * 2 : READAHEAD_MIN_WINDOW;
+    if (state->window > ra->max_window)
+      state->window = ra->max_window;
+  } else {
+    state->window = 0;
+    state->prefetched = 0;
+  }
+  state->next_offset = offset + size;
+
+  // first cluster after the ones just read
+  next = (offset + size - 1) / cluster_bytes + 1;
+  start = state->prefetched > next ? state->prefetched : next;
+  end = next + state->window;
+  if (end > num_clusters)
+    end = num_clusters;
+  
+  if (state->window && start < end && start - next < state->window / 2) {
+    pthread_mutex_lock(&ra->lock);
+    if (ra->count < READAHEAD_QUEUE_SIZE) {
+      readahead_request *request = &ra->queue[(ra->head + ra->count) % READAHEAD_QUEUE_SIZE];
+      request->volume = volume;
+      request->first_cluster = clusters[start];
+      request->num_clusters = end - start;
+      ra->count++;
+      state->prefetched = end;
+      pthread_cond_signal(&ra->cond);
+    }
+    pthread_mutex_unlock(&ra->lock);
+  }
+  pthread_mutex_unlock(&state->lock);
+}
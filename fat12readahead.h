@@ -0,0 +1,45 @@
+#ifndef _FAT12READAHEAD_H_
+#define _FAT12READAHEAD_H_
+
+#include "fat12.h"
+
+#include <pthread.h>
+
+/* Initial readahead window, in clusters, once a sequential access
+   pattern is detected */
+#define READAHEAD_MIN_WINDOW 4
+/* Default maximum readahead window, in clusters */
+#define READAHEAD_DEFAULT_MAX_WINDOW 64
+/* Maximum number of pending prefetch requests. Requests issued while
+   the queue is full are dropped, since readahead is only a hint. */
+#define READAHEAD_QUEUE_SIZE 64
+
+/* Background readahead engine, with a single prefetching thread */
+typedef struct readahead readahead;
+
+/* Data structure tracking the access pattern of an open file */
+typedef struct readahead_state {
+
+  pthread_mutex_t lock;
+  /* Offset at which the next read starts if access is sequential */
+  off_t next_offset;
+  /* Current readahead window, in clusters (0 if the last access was
+     not sequential) */
+  unsigned int window;
+  /* Index (within the file) of the first cluster that has not been
+     requested for prefetching yet */
+  unsigned int prefetched;
+  
+} readahead_state;
+
+readahead *readahead_create(unsigned int max_window);
+void readahead_destroy(readahead *ra);
+void readahead_forget(readahead *ra, fat12volume *volume);
+
+void readahead_init_state(readahead_state *state);
+void readahead_destroy_state(readahead_state *state);
+void readahead_access(readahead *ra, fat12volume *volume, readahead_state *state,
+		      const unsigned int *clusters, unsigned int num_clusters,
+		      off_t offset, size_t size);
+
+#endif
@@ -0,0 +1,216 @@
+#include "fat12stats.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+/* Statistics of a single thread. Only the owning thread updates its
+   block, so updates need no locking or atomic read-modify-write;
+   relaxed atomic stores are used only so that readers merging the
+   blocks never see torn values. */
+typedef struct stats_block {
+  struct stats_block *next;
+  struct stats_block **prev;
+  stats_snapshot data;
+} stats_block;
+
+/* Blocks of all live threads, and totals of the threads that have
+   already exited */
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static stats_block *stats_blocks;
+static stats_snapshot stats_retired;
+
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t stats_key;
+static __thread stats_block *stats_local;
+
+static const char *op_names[STATS_NUM_OPS] = {
+  "getattr", "readdir", "open", "read", "lookup", "write",
+};
+
+static const char *counter_names[STATS_NUM_COUNTERS] = {
+  "lookup_cached", "cluster_reads", "volume_reads", "volume_bytes", "bytes_read",
+  "volume_writes", "volume_write_bytes", "fat_flushes", "barriers", "bytes_written",
+};
+
+/* add_snapshot: Adds the statistics in src to dst. */
+static void add_snapshot(stats_snapshot *dst, const stats_snapshot *src) {
+  uint64_t max;
+  int i, b;
+
+  for (i = 0; i < STATS_NUM_COUNTERS; i++)
+    dst->counters[i] += __atomic_load_n(&src->counters[i], __ATOMIC_RELAXED);
+  for (i = 0; i < STATS_NUM_OPS; i++) {
+    dst->op_count[i] += __atomic_load_n(&src->op_count[i], __ATOMIC_RELAXED);
+    dst->op_total_ns[i] += __atomic_load_n(&src->op_total_ns[i], __ATOMIC_RELAXED);
+    max = __atomic_load_n(&src->op_max_ns[i], __ATOMIC_RELAXED);
+    if (max > dst->op_max_ns[i])
+      dst->op_max_ns[i] = max;
+    for (b = 0; b < STATS_BUCKETS; b++)
+      dst->op_buckets[i][b] += __atomic_load_n(&src->op_buckets[i][b], __ATOMIC_RELAXED);
+  }
+}
+
+/* retire_block: Called when a thread exits, to fold its statistics
+   into the totals of exited threads. */
+static void retire_block(void *arg) {
+  stats_block *block = arg;
+
+  pthread_mutex_lock(&stats_lock);
+  add_snapshot(&stats_retired, &block->data);
+  *block->prev = block->next;
+  if (block->next)
+    block->next->prev = block->prev;
+  pthread_mutex_unlock(&stats_lock);
+  free(block);
+}
+
+static void create_key(void) {
+  pthread_key_create(&stats_key, retire_block);
+}
+
+/* local_block: Returns the statistics block of the calling thread,
+   creating it the first time. Returns NULL if it cannot be
+   allocated, in which case the event is not recorded. */
+static stats_block *local_block(void) {
+  stats_block *block = stats_local;
+
+  if (block)
+    return block;
+
+  pthread_once(&stats_once, create_key);
+  block = calloc(1, sizeof(stats_block));
+  if (!block)
+    return NULL;
+
+  pthread_mutex_lock(&stats_lock);
+  block->next = stats_blocks;
+  block->prev = &stats_blocks;
+  if (stats_blocks)
+    stats_blocks->prev = &block->next;
+  stats_blocks = block;
+  pthread_mutex_unlock(&stats_lock);
+
+  pthread_setspecific(stats_key, block);
+  stats_local = block;
+  return block;
+}
+
+/* stats_now: Returns the current time, in nanoseconds, of a
+   monotonic clock, to be used as the start time in stats_record. */
+uint64_t stats_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* stats_add: Adds a value to an event counter of the calling thread.
+   
+   Parameters:
+     counter: counter to be updated.
+     value: value to add.
+ */
+void stats_add(stats_counter counter, uint64_t value) {
+  stats_block *block = local_block();
+
+  if (block)
+    __atomic_store_n(&block->data.counters[counter], block->data.counters[counter] + value,
+		     __ATOMIC_RELAXED);
+}
+
+/* stats_record: Records an operation of the calling thread, and the
+   time it took.
+   
+   Parameters:
+     op: operation being recorded.
+     start: time at which the operation started, as returned by
+            stats_now.
+ */
+void stats_record(stats_op op, uint64_t start) {
+  stats_block *block = local_block();
+  uint64_t ns = stats_now() - start;
+  int bucket = ns ? 63 - __builtin_clzll(ns) : 0;
+
+  if (!block)
+    return;
+
+  __atomic_store_n(&block->data.op_count[op], block->data.op_count[op] + 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&block->data.op_total_ns[op], block->data.op_total_ns[op] + ns,
+		   __ATOMIC_RELAXED);
+  if (ns > block->data.op_max_ns[op])
+    __atomic_store_n(&block->data.op_max_ns[op], ns, __ATOMIC_RELAXED);
+  __atomic_store_n(&block->data.op_buckets[op][bucket], block->data.op_buckets[op][bucket] + 1,
+		   __ATOMIC_RELAXED);
+}
+
+/* stats_get_snapshot: Merges the statistics of all threads, both
+   live and exited.
+   
+   Parameters:
+     snapshot: pointer to the structure where the merged statistics
+               are stored.
+ */
+void stats_get_snapshot(stats_snapshot *snapshot) {
+  stats_block *block;
+
+  memset(snapshot, 0, sizeof(stats_snapshot));
+  pthread_mutex_lock(&stats_lock);
+  add_snapshot(snapshot, &stats_retired);
+  for (block = stats_blocks; block; block = block->next)
+    add_snapshot(snapshot, &block->data);
+  pthread_mutex_unlock(&stats_lock);
+}
+
+/* stats_percentile: Estimates a percentile of the latency of an
+   operation from its histogram.
+   
+   Parameters:
+     snapshot: merged statistics.
+     op: operation.
+     fraction: percentile, between 0 and 1 (e.g., 0.99).
+   Returns:
+     An upper bound of the percentile, in nanoseconds (the upper end
+     of the histogram bucket containing it, capped by the maximum
+     latency seen), or zero if the operation was never recorded.
+ */
+uint64_t stats_percentile(const stats_snapshot *snapshot, stats_op op, double fraction) {
+  uint64_t target = snapshot->op_count[op] * fraction, seen = 0, bound;
+  int b;
+
+  if (snapshot->op_count[op] == 0)
+    return 0;
+
+  for (b = 0; b < STATS_BUCKETS; b++) {
+    seen += snapshot->op_buckets[op][b];
+    if (seen > target)
+      break;
+  }
+
+  bound = b >= STATS_BUCKETS - 1 ? UINT64_MAX : (2ull << b) - 1;
+  return bound < snapshot->op_max_ns[op] ? bound : snapshot->op_max_ns[op];
+}
+
+/* stats_print: Prints the merged statistics of all threads, one
+   "name value" pair per line, so they can be easily scraped.
+   
+   Parameters:
+     out: stream where the statistics are written.
+ */
+void stats_print(FILE *out) {
+  stats_snapshot snapshot;
+  int i;
+
+  stats_get_snapshot(&snapshot);
+  for (i = 0; i < STATS_NUM_OPS; i++) {
+    fprintf(out, "%s_count %llu\n", op_names[i], (unsigned long long) snapshot.op_count[i]);
+    fprintf(out, "%s_total_ns %llu\n", op_names[i], (unsigned long long) snapshot.op_total_ns[i]);
+    fprintf(out, "%s_p50_ns %llu\n", op_names[i],
+	    (unsigned long long) stats_percentile(&snapshot, i, 0.5));
+    fprintf(out, "%s_p99_ns %llu\n", op_names[i],
+	    (unsigned long long) stats_percentile(&snapshot, i, 0.99));
+    fprintf(out, "%s_max_ns %llu\n", op_names[i], (unsigned long long) snapshot.op_max_ns[i]);
+  }
+  for (i = 0; i < STATS_NUM_COUNTERS; i++)
+    fprintf(out, "%s %llu\n", counter_names[i], (unsigned long long) snapshot.counters[i]);
+}
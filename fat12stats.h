@@ -0,0 +1,62 @@
+#ifndef _FAT12STATS_H_
+#define _FAT12STATS_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* Operations whose latency is measured. Latencies are kept in
+   histograms with one bucket per power of two nanoseconds. */
+typedef enum stats_op {
+  STATS_GETATTR,
+  STATS_READDIR,
+  STATS_OPEN,
+  STATS_READ,
+  STATS_LOOKUP,
+  STATS_WRITE,
+  STATS_NUM_OPS
+} stats_op;
+
+#define STATS_BUCKETS 64
+
+/* Event counters */
+typedef enum stats_counter {
+  /* Path lookups answered by the dentry cache */
+  STATS_LOOKUP_CACHED,
+  /* Clusters requested with read_cluster or copy_cluster */
+  STATS_CLUSTER_READS,
+  /* Reads from the volume file (mapped or not), and bytes of the
+     file they touched (whole clusters, for cluster reads) */
+  STATS_VOLUME_READS,
+  STATS_VOLUME_BYTES,
+  /* Bytes returned to processes reading files */
+  STATS_BYTES_READ,
+  /* Writes to the volume file, and bytes written */
+  STATS_VOLUME_WRITES,
+  STATS_VOLUME_WRITE_BYTES,
+  /* Batches of FAT sectors written back, and barriers (fdatasync)
+     issued to order writes to the volume */
+  STATS_FAT_FLUSHES,
+  STATS_BARRIERS,
+  /* Bytes written by processes to files */
+  STATS_BYTES_WRITTEN,
+  STATS_NUM_COUNTERS
+} stats_counter;
+
+/* Merged statistics of all threads */
+typedef struct stats_snapshot {
+  uint64_t counters[STATS_NUM_COUNTERS];
+  uint64_t op_count[STATS_NUM_OPS];
+  uint64_t op_total_ns[STATS_NUM_OPS];
+  uint64_t op_max_ns[STATS_NUM_OPS];
+  uint64_t op_buckets[STATS_NUM_OPS][STATS_BUCKETS];
+} stats_snapshot;
+
+uint64_t stats_now(void);
+void stats_add(stats_counter counter, uint64_t value);
+void stats_record(stats_op op, uint64_t start);
+
+void stats_get_snapshot(stats_snapshot *snapshot);
+uint64_t stats_percentile(const stats_snapshot *snapshot, stats_op op, double fraction);
+void stats_print(FILE *out);
+
+#endif
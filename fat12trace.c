@@ -0,0 +1,107 @@
+#include "fat12trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+/* Span recorded by trace_record. The name must be a string that
+   stays valid until the trace is dumped (normally a literal). */
+typedef struct trace_span {
+  const char *name;
+  uint64_t start;
+  uint64_t duration;
+} trace_span;
+
+/* Ring buffer of spans of a single thread. Only the owning thread
+   writes to it: each span is stored and then published by advancing
+   count with a release store, so trace_dump never needs a lock to
+   read the ring of a running thread. Rings are kept after their
+   thread exits, since their spans are still to be dumped. */
+typedef struct trace_ring {
+  struct trace_ring *next;
+  unsigned int tid;
+  uint64_t count;
+  trace_span spans[TRACE_RING_SIZE];
+} trace_ring;
+
+static trace_ring *trace_rings;
+static unsigned int trace_threads;
+static __thread trace_ring *trace_local;
+
+/* trace_now: Returns the current time, in nanoseconds, of a
+   monotonic clock, to be used as the start time of a span. */
+uint64_t trace_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* trace_record: Records a span of the calling thread, ending now.
+   
+   Parameters:
+     name: name of the traced stage.
+     start: time at which the span started, as returned by trace_now.
+ */
+void trace_record(const char *name, uint64_t start) {
+  trace_ring *ring = trace_local;
+  uint64_t end = trace_now();
+  trace_span *span;
+
+  if (!ring) {
+    ring = calloc(1, sizeof(trace_ring));
+    if (!ring)
+      return;
+    ring->tid = __atomic_add_fetch(&trace_threads, 1, __ATOMIC_RELAXED);
+    // rings are only ever added, at the head of the list
+    ring->next = __atomic_load_n(&trace_rings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&trace_rings, &ring->next, ring, 1,
+					__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    trace_local = ring;
+  }
+
+  span = &ring->spans[ring->count & (TRACE_RING_SIZE - 1)];
+  span->name = name;
+  span->start = start;
+  span->duration = end - start;
+  __atomic_store_n(&ring->count, ring->count + 1, __ATOMIC_RELEASE);
+}
+
+/* trace_dump: Writes the spans of all threads to a file, in the
+   Chrome trace event format (viewable in chrome://tracing or
+   Perfetto). Spans that a thread records while the dump is in
+   progress may appear garbled, so it should preferably be called
+   when the traced code is idle.
+   
+   Parameters:
+     filename: name of the file to write.
+   Returns:
+     The number of spans written, or -1 if the file could not be
+     written.
+ */
+int trace_dump(const char *filename) {
+  FILE *out = fopen(filename, "w");
+  trace_ring *ring;
+  uint64_t count, i;
+  int written = 0;
+
+  if (!out)
+    return -1;
+
+  fprintf(out, "{\"traceEvents\":[");
+  for (ring = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+    count = __atomic_load_n(&ring->count, __ATOMIC_ACQUIRE);
+    for (i = count > TRACE_RING_SIZE ? count - TRACE_RING_SIZE : 0; i < count; i++) {
+      trace_span *span = &ring->spans[i & (TRACE_RING_SIZE - 1)];
+      fprintf(out, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+	      "\"pid\":%d,\"tid\":%u}", written++ ? "," : "", span->name,
+	      span->start / 1000.0, span->duration / 1000.0, (int) getpid(), ring->tid);
+    }
+  }
+  fprintf(out, "\n],\"displayTimeUnit\":\"ns\"}\n");
+
+  if (fclose(out))
+    return -1;
+  return written;
+}
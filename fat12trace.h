@@ -0,0 +1,36 @@
+#ifndef _FAT12TRACE_H_
+#define _FAT12TRACE_H_
+
+#include <stdint.h>
+
+/* Tracing of internal stages, enabled at compile time with
+   -DFATTRACE=1. Each stage is recorded as a timed span:
+
+     uint64_t t = trace_begin();
+     ...
+     trace_end("stage", t);
+
+   When tracing is disabled both macros compile to nothing. Spans are
+   kept in a ring buffer per thread, holding the most recent
+   TRACE_RING_SIZE spans, and can be written out with trace_dump. */
+
+#ifndef FATTRACE
+#define FATTRACE 0
+#endif
+
+/* Number of spans kept per thread (must be a power of two) */
+#define TRACE_RING_SIZE 16384
+
+#if FATTRACE
+#define trace_begin() trace_now()
+#define trace_end(name, start) trace_record(name, start)
+#else
+#define trace_begin() ((uint64_t) 0)
+#define trace_end(name, start) ((void) (start))
+#endif
+
+uint64_t trace_now(void);
+void trace_record(const char *name, uint64_t start);
+int trace_dump(const char *filename);
+
+#endif
@@ -0,0 +1,590 @@
+#include "fat12volumes.h"
+#include "fat12meta.h"
+#include "fat12write.h"
+#include "fat12check.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+
+/* Number of buckets in the hash tables of the volume table */
+#define VOLUMES_BUCKETS 256
+
+/* Open volume in the table. Slots are linked both by image name and
+   by volume id, so operations holding a volume can release it
+   without knowing its name. */
+typedef struct volume_slot {
+  struct volume_slot *name_next;
+  struct volume_slot *id_next;
+  fat12volume *volume;
+  /* Number of operations and handles currently using the volume */
+  unsigned int refs;
+  /* Time (in seconds, from a monotonic clock) of the last release */
+  time_t last_used;
+  /* Set while the volume is being opened, or while the reaper
+     releases its metadata, without the table lock held; the volume
+     cannot be acquired meanwhile. Slots being opened have no volume
+     yet, and are only linked by name. */
+  int busy;
+  /* Time of the last reap that could not write the changes of the
+     volume, so it was neither closed nor released */
+  time_t failed;
+  char name[];
+} volume_slot;
+
+/* Result of checking an image file, kept while the file has the same
+   size and modification time, so images are only checked once even
+   if their volumes are closed and opened again */
+typedef struct checked_image {
+  struct checked_image *next;
+  off_t size;
+  struct timespec mtime;
+  int damaged;
+  char name[];
+} checked_image;
+
+struct volume_table {
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  /* Signalled when the volumes being opened, or those the reaper was
+     closing or releasing, are done */
+  pthread_cond_t reaped;
+  pthread_t thread;
+  int started;
+  int stop;
+  char *directory;
+  int flags;
+  cluster_cache *cache;
+  const dedup_index *dedup;
+  writeback *writeback;
+  unsigned int idle_timeout;
+  size_t metadata_budget;
+  volume_evict_fn evict;
+  void *evict_arg;
+  volume_slot *names[VOLUMES_BUCKETS];
+  volume_slot *ids[VOLUMES_BUCKETS];
+  /* Slots taken out of the table whose volumes the reaper is closing,
+     linked by name_next. Their images cannot be opened again until
+     they are closed. */
+  volume_slot *closing;
+  /* Images already checked, if volumes are opened with
+     VOLUME_OPEN_CHECK */
+  checked_image *checked[VOLUMES_BUCKETS];
+};
+
+/* name_hash: Computes the FNV-1a hash of the first length characters
+   of a string. */
+static unsigned int name_hash(const char *name, size_t length) {
+  unsigned int hash = 2166136261u;
+  while (length--)
+    hash = (hash ^ (unsigned char) *name++) * 16777619u;
+  return hash;
+}
+
+/* is_image_name: Returns whether a file of the directory can be an
+   image. Hidden files (including . and ..) and metadata indexes (see
+   fat12meta.h) are not images, so they are neither listed nor used
+   as volumes. */
+static int is_image_name(const char *name, size_t length) {
+  size_t suffix = strlen(META_SUFFIX);
+
+  return length > 0 && name[0] != '.' &&
+    !(length > suffix && !memcmp(name + length - suffix, META_SUFFIX, suffix));
+}
+
+/* now: Returns the current time, in seconds, of a monotonic clock. */
+static time_t now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
+
+/* find_checked: Finds the result of checking an image file, which
+   must have the given metadata. Must be called with the table lock
+   held. */
+static checked_image *find_checked(volume_table *table, const char *name, size_t length,
+				   const struct stat *st) {
+  checked_image *image;
+
+  for (image = table->checked[name_hash(name, length) % VOLUMES_BUCKETS]; image;
+       image = image->next)
+    if (!strncmp(image->name, name, length) && image->name[length] == '\0')
+      return image->size == st->st_size && image->mtime.tv_sec == st->st_mtim.tv_sec &&
+	image->mtime.tv_nsec == st->st_mtim.tv_nsec ? image : NULL;
+  return NULL;
+}
+
+/* set_checked: Records the result of checking an image file with the
+   given metadata, replacing the previous one. If memory cannot be
+   allocated the result is not recorded. Must be called with the
+   table lock held. */
+static void set_checked(volume_table *table, const char *name, const struct stat *st,
+			int damaged) {
+  checked_image **p, *image;
+
+  for (p = &table->checked[name_hash(name, strlen(name)) % VOLUMES_BUCKETS];
+       *p && strcmp((*p)->name, name); p = &(*p)->next);
+  if (!*p) {
+    if ((image = malloc(sizeof(checked_image) + strlen(name) + 1)) == NULL)
+      return;
+    strcpy(image->name, name);
+    image->next = NULL;
+    *p = image;
+  }
+  (*p)->size = st->st_size;
+  (*p)->mtime = st->st_mtim;
+  (*p)->damaged = damaged;
+}
+
+/* link_slot: Adds a slot to the hash tables of the table (only to
+   the one of names if it has no volume yet). Must be called with the
+   table lock held. */
+static void link_slot(volume_table *table, volume_slot *slot) {
+  unsigned int hash = name_hash(slot->name, strlen(slot->name));
+
+  slot->name_next = table->names[hash % VOLUMES_BUCKETS];
+  table->names[hash % VOLUMES_BUCKETS] = slot;
+  if (slot->volume) {
+    slot->id_next = table->ids[slot->volume->volume_id % VOLUMES_BUCKETS];
+    table->ids[slot->volume->volume_id % VOLUMES_BUCKETS] = slot;
+  }
+}
+
+/* unlink_slot: Removes a slot from the hash tables of the table.
+   Must be called with the table lock held, and only for slots that
+   are not in use. */
+static void unlink_slot(volume_table *table, volume_slot *slot) {
+  volume_slot **p;
+
+  for (p = &table->names[name_hash(slot->name, strlen(slot->name)) % VOLUMES_BUCKETS];
+       *p != slot; p = &(*p)->name_next);
+  *p = slot->name_next;
+  if (slot->volume) {
+    for (p = &table->ids[slot->volume->volume_id % VOLUMES_BUCKETS]; *p != slot;
+	 p = &(*p)->id_next);
+    *p = slot->id_next;
+  }
+}
+
+/* close_slot: Closes the volume of a slot that is no longer in the
+   table and frees the slot. Since closing a writable volume writes
+   its pending changes, it must be called without the table lock
+   held. */
+static void close_slot(volume_table *table, volume_slot *slot) {
+  if (table->evict)
+    table->evict(slot->volume, table->evict_arg);
+  close_volume_file(slot->volume);
+  free(slot);
+}
+
+/* reap: Closes the volumes that have been idle for longer than the
+   idle timeout, and then releases the metadata of the least recently
+   used idle volumes until the metadata of all open volumes fits in
+   the budget. Volumes in use are never touched, so the budget may be
+   exceeded while they are. Writable volumes whose changes cannot be
+   written are kept as they are, so the changes and the error are not
+   lost, and tried again later. Must be called with the table lock
+   held, which is dropped while volumes are closed or released, so
+   other volumes can be acquired meanwhile.
+ */
+static void reap(volume_table *table) {
+  volume_slot *slot, *next, *oldest, *kept = NULL;
+  time_t t = now();
+  size_t total = 0, released;
+  int b, rv;
+
+  for (b = 0; b < VOLUMES_BUCKETS; b++) {
+    for (slot = table->names[b]; slot; slot = next) {
+      next = slot->name_next;
+      if (slot->busy) {
+	continue;
+      } else if (slot->refs == 0 && table->idle_timeout &&
+		 t - slot->last_used >= (time_t) table->idle_timeout) {
+	unlink_slot(table, slot);
+	slot->name_next = table->closing;
+	table->closing = slot;
+      } else {
+	total += volume_metadata_size(slot->volume);
+      }
+    }
+  }
+  if (table->closing) {
+    pthread_mutex_unlock(&table->lock);
+    for (slot = table->closing; slot; slot = next) {
+      next = slot->name_next;
+      if (table->evict)
+	table->evict(slot->volume, table->evict_arg);
+      if ((rv = flush_volume(slot->volume)) < 0) {
+	__atomic_store_n(&slot->volume->write_error, rv, __ATOMIC_RELAXED);
+	slot->name_next = kept;
+	kept = slot;
+      } else {
+	close_volume_file(slot->volume);
+	free(slot);
+      }
+    }
+    pthread_mutex_lock(&table->lock);
+    table->closing = NULL;
+    for (slot = kept; slot; slot = next) {
+      next = slot->name_next;
+      slot->failed = slot->last_used = t;
+      link_slot(table, slot);
+      total += volume_metadata_size(slot->volume);
+    }
+    pthread_cond_broadcast(&table->reaped);
+  }
+
+  while (total > table->metadata_budget) {
+    oldest = NULL;
+    for (b = 0; b < VOLUMES_BUCKETS; b++)
+      for (slot = table->names[b]; slot; slot = slot->name_next)
+	if (slot->refs == 0 && !slot->busy && slot->failed != t &&
+	    volume_metadata_size(slot->volume) &&
+	    (!oldest || slot->last_used < oldest->last_used))
+	  oldest = slot;
+    if (!oldest)
+      break;
+
+    oldest->busy = 1;
+    pthread_mutex_unlock(&table->lock);
+    if (table->evict)
+      table->evict(oldest->volume, table->evict_arg);
+    released = release_volume_metadata(oldest->volume);
+    pthread_mutex_lock(&table->lock);
+    oldest->busy = 0;
+    if (released == 0)
+      oldest->failed = t;
+    pthread_cond_broadcast(&table->reaped);
+    // the volumes acquired meanwhile may have loaded their metadata
+    total = total > released ? total - released : 0;
+  }
+}
+
+/* reaper_thread: Main function of the thread that periodically closes
+   idle volumes. */
+static void *reaper_thread(void *arg) {
+  volume_table *table = arg;
+  struct timespec deadline;
+
+  pthread_mutex_lock(&table->lock);
+  while (!table->stop) {
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec++;
+    pthread_cond_timedwait(&table->wake, &table->lock, &deadline);
+    if (!table->stop)
+      reap(table);
+  }
+  pthread_mutex_unlock(&table->lock);
+
+  return NULL;
+}
+
+/* volume_table_create: Creates an empty table for the image files in
+   a directory. No volume is opened until it is first acquired.
+   
+   Parameters:
+     directory: path of the directory containing the image files.
+     flags: flags passed to open_volume_file_flags for every volume.
+            With VOLUME_OPEN_CHECK, each image is only checked the
+            first time it is opened, and again once its size or
+            modification time change.
+     cache: cluster cache shared by all volumes, or NULL.
+     dedup: index of the images, to which every read-only volume is
+            attached when it is opened so the cache is shared by
+            their identical clusters (see dedup_attach), or NULL.
+     idle_timeout: time, in seconds, after which a volume that is not
+                   in use is closed (0 to keep volumes open).
+     metadata_budget: maximum memory, in bytes, used by the FAT and
+                      root directory of the open volumes. Volumes
+                      should be opened with VOLUME_OPEN_LAZY so their
+                      metadata can be loaded back after it is
+                      released.
+   Returns:
+     A pointer to the new table, or NULL if the directory cannot be
+     opened or memory could not be allocated.
+ */
+volume_table *volume_table_create(const char *directory, int flags, cluster_cache *cache,
+				  const dedup_index *dedup, unsigned int idle_timeout,
+				  size_t metadata_budget) {
+  volume_table *table;
+  DIR *dir = opendir(directory);
+
+  if (!dir)
+    return NULL;
+  closedir(dir);
+
+  table = calloc(1, sizeof(volume_table));
+  if (!table)
+    return NULL;
+  table->directory = strdup(directory);
+  if (!table->directory) {
+    free(table);
+    return NULL;
+  }
+
+  pthread_mutex_init(&table->lock, NULL);
+  pthread_cond_init(&table->wake, NULL);
+  pthread_cond_init(&table->reaped, NULL);
+  table->flags = flags;
+  table->cache = cache;
+  table->dedup = dedup;
+  table->idle_timeout = idle_timeout;
+  table->metadata_budget = metadata_budget;
+  return table;
+}
+
+/* volume_table_start: Starts the thread that closes idle volumes.
+   Note that FUSE may fork when going to the background, so the
+   thread must be started after that (e.g., in the init operation).
+   
+   Parameters:
+     table: volume table.
+     evict: function called right before a volume is closed or its
+            metadata released, or NULL.
+     arg: argument passed to evict.
+     writeback: write-back engine used by the writable volumes opened
+                from now on, or NULL.
+   Returns:
+     0 in case of success, or -1 if the thread could not be started.
+ */
+int volume_table_start(volume_table *table, volume_evict_fn evict, void *arg,
+		       writeback *writeback) {
+  table->evict = evict;
+  table->evict_arg = arg;
+  table->writeback = writeback;
+  if (pthread_create(&table->thread, NULL, reaper_thread, table))
+    return -1;
+  table->started = 1;
+  return 0;
+}
+
+/* volume_table_destroy: Stops the thread that closes idle volumes,
+   closes all volumes and frees the table. The cluster cache is not
+   destroyed.
+   
+   Parameters:
+     table: volume table. May be NULL.
+ */
+void volume_table_destroy(volume_table *table) {
+  volume_slot *slot, *next;
+  checked_image *image, *next_image;
+  int b;
+
+  if (!table)
+    return;
+
+  if (table->started) {
+    pthread_mutex_lock(&table->lock);
+    table->stop = 1;
+    pthread_cond_signal(&table->wake);
+    pthread_mutex_unlock(&table->lock);
+    pthread_join(table->thread, NULL);
+  }
+
+  for (b = 0; b < VOLUMES_BUCKETS; b++) {
+    for (slot = table->names[b]; slot; slot = next) {
+      next = slot->name_next;
+      unlink_slot(table, slot);
+      close_slot(table, slot);
+    }
+    for (image = table->checked[b]; image; image = next_image) {
+      next_image = image->next;
+      free(image);
+    }
+  }
+
+  pthread_mutex_destroy(&table->lock);
+  pthread_cond_destroy(&table->wake);
+  pthread_cond_destroy(&table->reaped);
+  free(table->directory);
+  free(table);
+}
+
+/* volume_table_acquire: Finds the volume of an image file, opening it
+   if needed, and marks it as in use until volume_table_release is
+   called. Opening a volume may take long (it may be checked, or its
+   metadata index built), so it is done without the table lock held,
+   and other threads acquiring the same volume wait for it, like they
+   wait for a volume that the reaper is closing or releasing.
+   
+   Parameters:
+     table: volume table.
+     name: name of the image file within the directory of the table
+           (not necessarily null-terminated).
+     length: length of the name.
+     volume: out parameter, where the volume is returned.
+   Returns:
+     0 in case of success, -ENOENT if there is no such image file,
+     -EIO if the image file is not a valid FAT12 volume, or -ENOMEM
+     if memory could not be allocated.
+ */
+int volume_table_acquire(volume_table *table, const char *name, size_t length,
+			 fat12volume **volume) {
+  unsigned int hash = name_hash(name, length);
+  char path[PATH_MAX];
+  volume_slot *slot;
+  fat12volume *opened;
+  checked_image *checked = NULL;
+  check_result check;
+  struct stat st;
+  int rv = 0, damaged = -1;
+
+  if (!is_image_name(name, length) || length >= NAME_MAX || memchr(name, '/', length))
+    return -ENOENT;
+
+  pthread_mutex_lock(&table->lock);
+  while (1) {
+    for (slot = table->names[hash % VOLUMES_BUCKETS]; slot; slot = slot->name_next)
+      if (!strncmp(slot->name, name, length) && slot->name[length] == '\0')
+	break;
+    if (slot && !slot->busy)
+      break;
+    // an image is not opened again before its old volume is closed,
+    // which may still be writing its changes
+    if (!slot)
+      for (slot = table->closing; slot; slot = slot->name_next)
+	if (!strncmp(slot->name, name, length) && slot->name[length] == '\0')
+	  break;
+    if (!slot)
+      break;
+    pthread_cond_wait(&table->reaped, &table->lock);
+  }
+
+  if (!slot) {
+    if (snprintf(path, sizeof(path), "%s/%.*s", table->directory, (int) length, name) >=
+	(int) sizeof(path) || stat(path, &st) || !S_ISREG(st.st_mode)) {
+      rv = -ENOENT;
+    } else if ((table->flags & VOLUME_OPEN_CHECK) &&
+	       (checked = find_checked(table, name, length, &st)) && checked->damaged) {
+      rv = -EIO;
+    } else if ((slot = malloc(sizeof(volume_slot) + length + 1)) == NULL) {
+      rv = -ENOMEM;
+    } else {
+      // the slot is linked by name while the volume is opened, so the
+      // image is not opened twice
+      memcpy(slot->name, name, length);
+      slot->name[length] = '\0';
+      slot->volume = NULL;
+      slot->refs = 0;
+      slot->busy = 1;
+      slot->failed = 0;
+      link_slot(table, slot);
+      pthread_mutex_unlock(&table->lock);
+
+      // the volume is checked here rather than by
+      // open_volume_file_flags, so the result can be kept
+      opened = open_volume_file_flags(path, table->flags & ~VOLUME_OPEN_CHECK);
+      if (opened && (table->flags & VOLUME_OPEN_CHECK) && !checked &&
+	  (check_volume(opened, CHECK_DEFAULT_THREADS, &check, NULL, NULL) < 0 ||
+	   (damaged = check_has_errors(&check)))) {
+	close_volume_file(opened);
+	opened = NULL;
+      }
+      if (opened) {
+	opened->cache = table->cache;
+	if (opened->writable)
+	  opened->writeback = table->writeback;
+	else if (table->dedup && table->cache)
+	  dedup_attach(table->dedup, opened, slot->name);
+      }
+
+      pthread_mutex_lock(&table->lock);
+      if (damaged >= 0)
+	set_checked(table, slot->name, &st, damaged);
+      unlink_slot(table, slot);
+      if (opened) {
+	slot->volume = opened;
+	slot->busy = 0;
+	slot->last_used = now();
+	link_slot(table, slot);
+      } else {
+	free(slot);
+	slot = NULL;
+	rv = -EIO;
+      }
+      pthread_cond_broadcast(&table->reaped);
+    }
+  }
+
+  if (slot) {
+    slot->refs++;
+    *volume = slot->volume;
+  }
+  pthread_mutex_unlock(&table->lock);
+
+  return rv;
+}
+
+/* volume_table_release: Marks that one user of a volume obtained
+   with volume_table_acquire is done with it. Once a volume has no
+   users it may be closed at any time.
+   
+   Parameters:
+     table: volume table.
+     volume: volume being released.
+ */
+void volume_table_release(volume_table *table, fat12volume *volume) {
+  volume_slot *slot;
+
+  pthread_mutex_lock(&table->lock);
+  for (slot = table->ids[volume->volume_id % VOLUMES_BUCKETS]; slot; slot = slot->id_next) {
+    if (slot->volume == volume) {
+      slot->refs--;
+      slot->last_used = now();
+      break;
+    }
+  }
+  pthread_mutex_unlock(&table->lock);
+}
+
+/* volume_table_stat: Obtains the metadata of the directory of the
+   table.
+   
+   Parameters:
+     table: volume table.
+     st: pointer to a struct stat where the metadata is stored.
+   Returns:
+     0 in case of success, or a negative error code.
+ */
+int volume_table_stat(volume_table *table, struct stat *st) {
+  return stat(table->directory, st) ? -errno : 0;
+}
+
+/* volume_table_list: Lists the image files in the directory of the
+   table. Every regular file is listed, whether or not it has been
+   opened (or is a valid volume).
+   
+   Parameters:
+     table: volume table.
+     fn: function called with the name and metadata of every image
+         file. If it returns a non-zero value the listing stops.
+     arg: argument passed to fn.
+   Returns:
+     0 in case of success, or a negative error code if the directory
+     could not be read.
+ */
+int volume_table_list(volume_table *table, volume_list_fn fn, void *arg) {
+  DIR *dir = opendir(table->directory);
+  struct dirent *d;
+  struct stat st;
+
+  if (!dir)
+    return -errno;
+
+  while ((d = readdir(dir)) != NULL) {
+    if (!is_image_name(d->d_name, strlen(d->d_name)) ||
+	fstatat(dirfd(dir), d->d_name, &st, 0) || !S_ISREG(st.st_mode))
+      continue;
+    if (fn(d->d_name, &st, arg))
+      break;
+  }
+
+  closedir(dir);
+  return 0;
+}
@@ -0,0 +1,43 @@
+#ifndef _FAT12VOLUMES_H_
+#define _FAT12VOLUMES_H_
+
+#include "fat12.h"
+#include "fat12cache.h"
+#include "fat12dedup.h"
+
+#include <sys/stat.h>
+
+/* Default time, in seconds, after which a volume that is not in use
+   is closed (0 keeps volumes open until the table is destroyed) */
+#define VOLUMES_DEFAULT_IDLE_TIMEOUT 60
+/* Default memory budget for the FAT and root directory of all open
+   volumes, in bytes */
+#define VOLUMES_DEFAULT_METADATA_BUDGET (16 << 20)
+
+/* Table of the volumes found in a directory of image files. Volumes
+   are opened the first time they are used, share a single cluster
+   cache, and are closed by a background thread once they have been
+   idle for a while. */
+typedef struct volume_table volume_table;
+
+/* Function called right before a volume is closed, or its metadata
+   is released, by the volume table */
+typedef void (*volume_evict_fn)(fat12volume *volume, void *arg);
+
+/* Function called by volume_table_list for every image file */
+typedef int (*volume_list_fn)(const char *name, const struct stat *st, void *arg);
+
+volume_table *volume_table_create(const char *directory, int flags, cluster_cache *cache,
+				  const dedup_index *dedup, unsigned int idle_timeout,
+				  size_t metadata_budget);
+int volume_table_start(volume_table *table, volume_evict_fn evict, void *arg,
+		       writeback *writeback);
+void volume_table_destroy(volume_table *table);
+
+int volume_table_acquire(volume_table *table, const char *name, size_t length,
+			 fat12volume **volume);
+void volume_table_release(volume_table *table, fat12volume *volume);
+int volume_table_stat(volume_table *table, struct stat *st);
+int volume_table_list(volume_table *table, volume_list_fn fn, void *arg);
+
+#endif
@@ -0,0 +1,1854 @@
+#include "fat12write.h"
+#include "fat12dcache.h"
+#include "fat12cache.h"
+#include "fat12stats.h"
+#include "fat12trace.h"
+#include "fat12pool.h"
+#include "fat12writeback.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+/* Characters that cannot appear in a short file name, besides
+   control characters */
+#define INVALID_NAME_CHARS "\"*+,./:;<=>?[\\]| "
+
+static int test_bit(const uint64_t *map, unsigned int n) {
+  return (map[n / 64] >> (n % 64)) & 1;
+}
+
+static void set_bit(uint64_t *map, unsigned int n) {
+  map[n / 64] |= (uint64_t) 1 << (n % 64);
+}
+
+static void clear_bit(uint64_t *map, unsigned int n) {
+  map[n / 64] &= ~((uint64_t) 1 << (n % 64));
+}
+
+/* write_unsigned_le: Writes a little-endian unsigned integer number
+   into buffer, starting at position (see read_unsigned_le). */
+static void write_unsigned_le(char *buffer, int position, int num_bytes, unsigned int number) {
+  while (num_bytes-- > 0) {
+    buffer[position++] = number & 0xff;
+    number >>= 8;
+  }
+}
+
+/* discard_cluster: Drops the dirty data of a cluster, if any (e.g.,
+   because the cluster has been freed). */
+static void discard_cluster(fat12volume *volume, unsigned int cluster) {
+
+  unsigned int cluster_bytes = volume->cluster_size * volume->sector_size;
+
+  if (volume->dirty[cluster]) {
+    buffer_pool_put(volume->buffers, volume->dirty[cluster]);
+    volume->dirty[cluster] = NULL;
+    volume->dirty_bytes -= cluster_bytes;
+    writeback_account(volume->writeback, -(ssize_t) cluster_bytes);
+  }
+}
+
+/* cluster_is_dirty: Checks whether a cluster of a volume has data in
+   memory that is newer than the volume file, so it must be read with
+   copy_cluster. The caller must hold the update lock of the volume
+   (shared at least).
+   
+   Parameters:
+     volume: pointer to FAT12 volume data structure.
+     cluster: number of the cluster.
+   Returns:
+     Non-zero if the cluster is dirty, zero otherwise.
+ */
+int cluster_is_dirty(fat12volume *volume, unsigned int cluster) {
+  return volume->dirty && cluster < volume->fat_entries && volume->dirty[cluster];
+}
+
+/* init_free_map: Builds the bitmap of free clusters of a writable
+   volume from its decoded FAT. Called when the metadata of the
+   volume is loaded.
+   
+   Parameters:
+     volume: pointer to FAT12 volume data structure, with fat_next
+             already decoded.
+   Returns:
+     0 in case of success, or -ENOMEM.
+ */
+int init_free_map(fat12volume *volume) {
+
+  unsigned int words = (volume->fat_entries + 63) / 64, cluster;
+
+  volume->free_map = calloc(words, sizeof(uint64_t));
+  volume->pending_map = calloc(words, sizeof(uint64_t));
+  volume->fat_dirty = calloc(volume->fat_num_sectors, 1);
+  volume->dirty = calloc(volume->fat_entries, sizeof(char *));
+  if (!volume->free_map || !volume->pending_map || !volume->fat_dirty || !volume->dirty)
+    return -ENOMEM;
+
+  volume->free_clusters = volume->pending_clusters = 0;
+  for (cluster = 2; cluster < volume->fat_entries; cluster++) {
+    if (volume->fat_next[cluster] == 0) {
+      set_bit(volume->free_map, cluster);
+      volume->free_clusters++;
+    }
+  }
+  volume->next_free = 2;
+  return 0;
+}
+
+/* free_free_map: Frees the allocation state of a writable volume
+   built by init_free_map. Any pending change must have been flushed;
+   dirty clusters that could not be written are lost.
+   
+   Parameters:
+     volume: pointer to FAT12 volume data structure.
+ */
+void free_free_map(fat12volume *volume) {
+
+  unsigned int cluster;
+
+  for (cluster = 0; volume->dirty && cluster < volume->fat_entries; cluster++)
+    discard_cluster(volume, cluster);
+  free(volume->dirty);
+  volume->dirty = NULL;
+  free(volume->free_map);
+  free(volume->pending_map);
+  free(volume->fat_dirty);
+  volume->free_map = volume->pending_map = NULL;
+  volume->fat_dirty = NULL;
+  volume->free_clusters = volume->pending_clusters = 0;
+}
+
+/* count_free_clusters: Counts the clusters of a volume that are not
+   in use, including those freed by changes that have not been
+   flushed yet.
+   
+   Parameters:
+     volume: pointer to FAT12 volume data structure.
+   Returns:
+     The number of free clusters.
+ */
+unsigned int count_free_clusters(fat12volume *volume) {
+
+  unsigned int cluster, count = 0;
+
+  if (load_volume_metadata(volume) < 0)
+    return 0;
+  if (volume->free_map)
+    return volume->free_clusters + volume->pending_clusters;
+  for (cluster = 2; cluster < volume->fat_entries; cluster++)
+    if (volume->fat_next[cluster] == 0)
+      count++;
+  return count;
+}
+
+/* write_data: Writes an arbitrary range of bytes to the volume file.
+   This is the counterpart of read_data; note that it does not update
+   the cluster cache.
+   
+   Parameters:
+     volume: pointer to FAT12 volume data structure, opened with
+             VOLUME_OPEN_WRITE.
+     position: byte offset of the first byte to be written.
+     length: number of bytes to write.
+     buffer: data to be written.
+   Returns:
+     The number of bytes written, which is smaller than length if the
+     volume file ends before the requested range, or zero in case of
+     error.
+ */
+int write_data(fat12volume *volume, off_t position, size_t length, const char *buffer) {
+
+  uint64_t t = trace_begin();
+  size_t done = 0;
+  ssize_t rv;
+
+  if (position >= volume->volume_size)
+    return 0;
+  if (length > volume->volume_size - position)
+    length = volume->volume_size - position;
+
+  while (done < length) {
+    rv = pwrite(volume->volume_fd, buffer + done, length - done, position + done);
+    if (rv < 0 && errno == EINTR)
+      continue;
+    if (rv <= 0)
+      return 0;
+    done += rv;
+  }
+
+  stats_add(STATS_VOLUME_WRITES, 1);
+  stats_add(STATS_VOLUME_WRITE_BYTES, done);
+  trace_end("write_data", t);
+  return done;
+}
+
+/* write_cluster_data: Writes part of a data cluster, keeping the
+   cluster cache up to date.
+   
+   Returns:
+     0 in case of success, or -EIO.
+ */
+static int write_cluster_data(fat12volume *volume, unsigned int cluster, unsigned int offset,
+			      unsigned int length, const char *data) {
+
+  if (write_data(volume, cluster_position(volume, cluster) + offset, length, data) != length)
+    return -EIO;
+  if (volume->cache)
+    cluster_cache_update(volume->cache, volume->volume_id, cluster, offset, length, data);
+  return 0;
+}
+
+/* barrier: Waits until all writes issued so far are on disk, so that
+   no write issued afterwards can reach the disk before them.
+   
+   Returns:
+     0 in case of success, or -EIO.
+ */
+static int barrier(fat12volume *volume) {
+
+  stats_add(STATS_BARRIERS, 1);
+  return fdatasync(volume->volume_fd) ? -EIO : 0;
+}
+
+/* set_fat_entry: Changes the entry of a cluster in the in-memory FAT
+   (both packed and decoded), marking the sectors of the FAT that
+   hold it as dirty. Run lengths must be updated afterwards with
+   update_runs.
+   
+   Parameters:
+     volume: pointer to FAT12 volume data structure.
+     cluster: number of the cluster.
+     value: new value of the entry (zero for a free cluster,
+            FAT_END_OF_CHAIN for the last cluster of a chain, or the
+            number of the next cluster).
+ */
+static void set_fat_entry(fat12volume *volume, unsigned int cluster, unsigned int value) {
+
+  unsigned char *bytes = (unsigned char *) volume->fat_array;
+  unsigned int position = cluster + cluster / 2;
+
+  if (cluster % 2) {
+    bytes[position] = (bytes[position] & 0x0f) | ((value << 4) & 0xf0);
+    bytes[position + 1] = value >> 4;
+  } else {
+    bytes[position] = value & 0xff;
+    bytes[position + 1] = (bytes[position + 1] & 0xf0) | ((value >> 8) & 0x0f);
+  }
+  volume->fat_next[cluster] = value;
+  volume->fat_dirty[position / volume->sector_size] = 1;
+  volume->fat_dirty[(position + 1) / volume->sector_size] = 1;
+}
+
+/* update_runs: Recomputes the run lengths (see fat12volume.fat_run)
+   of a range of clusters whose FAT entries have changed, and of the
+   clusters whose runs lead into the range.
+   
+   Parameters:
+     volume: pointer to FAT12 volume data structure.
+     first, last: first and last cluster of the range.
+ */
+static void update_runs(fat12volume *volume, unsigned int first, unsigned int last) {
+
+  unsigned int cluster, next;
+
+  for (cluster = last + 1; cluster-- > 2; ) {
+    next = volume->fat_next[cluster];
+    // clusters before the range only change if they lead into it
+    if (cluster < first && next != cluster + 1)
+      break;
+    volume->fat_run[cluster] = next == 0 ? 0 :
+      1 + (next == cluster + 1 ? volume->fat_run[cluster + 1] : 0);
+  }
+}
+
+/* write_vector: Writes a list of buffers to consecutive positions of
+   the volume file, with as few system calls as possible.
+   
+   Returns:
+     0 in case of success, or -EIO.
+ */
+static int write_vector(fat12volume *volume, off_t position, struct iovec *iov, int count) {
+
+  ssize_t rv;
+
+  while (count > 0) {
+    rv = pwritev(volume->volume_fd, iov, count, position);
+    if (rv < 0 && errno == EINTR)
+      continue;
+    if (rv <= 0)
+      return -EIO;
+    stats_add(STATS_VOLUME_WRITES, 1);
+    stats_add(STATS_VOLUME_WRITE_BYTES, rv);
+    position += rv;
+    // skip what was written, in case the write was short
+    while (count > 0 && (size_t) rv >= iov->iov_len) {
+      rv -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0) {
+      iov->iov_base = (char *) iov->iov_base + rv;
+      iov->iov_len -= rv;
+    }
+  }
+  return 0;
+}
+
+/* write_back: Writes all dirty clusters of a volume to the volume
+   file. Runs of dirty clusters that are contiguous in the volume are
+   written with a single call, and the data is also stored in the
+   cluster cache, since it is likely to be read again.
+   
+   Parameters:
+     volume: pointer to FAT12 volume data structure. The caller must
+             hold its update lock exclusively.
+   Returns:
+     The number of clusters written, or -EIO (in which case the
+     clusters not written are still dirty).
+ */
+static int write_back(fat12volume *volume) {
+
+  unsigned int cluster_bytes = volume->cluster_size * volume->sector_size;
+  unsigned int first, last, c;
+  struct iovec iov[WRITE_BACK_MAX_RUN];
+  uint64_t t = trace_begin();
+  int written = 0;
+
+  if (!volume->dirty_bytes)
+    return 0;
+
+  for (first = 2; first < volume->fat_entries; first = last) {
+    if (!volume->dirty[first]) {
+      last = first + 1;
+      continue;
+    }
+    for (last = first; last < volume->fat_entries && volume->dirty[last] &&
+	   last - first < WRITE_BACK_MAX_RUN; last++) {
+      iov[last - first].iov_base = volume->dirty[last];
+      iov[last - first].iov_len = cluster_bytes;
+    }
+    if (write_vector(volume, cluster_position(volume, first), iov, last - first) < 0)
+      return -EIO;
+
+    for (c = first; c < last; c++) {
+      if (volume->cache)
+	cluster_cache_update(volume->cache, volume->volume_id, c, 0, cluster_bytes,
+			     volume->dirty[c]);
+      discard_cluster(volume, c);
+    }
+    written += last - first;
+  }
+
+  trace_end("write_back", t);
+  return written;
+}
+
+/* flush_fat: Writes the dirty sectors of the in-memory FAT to every
+   copy of the FAT in the volume.
+   
+   Changes are ordered so that the volume is consistent at any point
+   where the writes may stop. Data clusters are written before the FAT
+   marks them as used, and the FAT before any directory entry refers
+   to them. A directory entry that stops referring to clusters is
+   written before the FAT marks them as free, and they are not reused
+   until that entry is on disk. The worst a crash can leave behind is
+   clusters that are in use but not part of any file. Each copy of
+   the FAT is complete on disk before the next one is written, so
+   there is always an intact copy. Dirty clusters are written back
+   first, and then the first barrier here makes everything written so
+   far durable; that is what allows clusters freed since the last
+   flush to be reused.
+   
+   Parameters:
+     volume: pointer to FAT12 volume data structure. The caller must
+             hold its update lock exclusively.
+   Returns:
+     0 in case of success, or -EIO.
+ */
+int flush_fat(fat12volume *volume) {
+
+  unsigned int copy, first, last, words, w, dirty = 0;
+  size_t sector_size = volume->sector_size;
+  uint64_t t = trace_begin();
+  int rv;
+
+  if (!volume->fat_dirty)
+    return 0;
+  if ((rv = write_back(volume)) < 0)
+    return rv;
+  for (first = 0; first < volume->fat_num_sectors; first++)
+    dirty |= volume->fat_dirty[first];
+  if (!dirty && !volume->pending_clusters)
+    return 0;
+
+  // data and directory entries written so far go first
+  if ((rv = barrier(volume)) < 0)
+    return rv;
+  words = (volume->fat_entries + 63) / 64;
+  for (w = 0; w < words; w++) {
+    volume->free_map[w] |= volume->pending_map[w];
+    volume->pending_map[w] = 0;
+  }
+  volume->free_clusters += volume->pending_clusters;
+  volume->pending_clusters = 0;
+
+  // each run of dirty sectors is written with a single write per copy
+  for (copy = 0; dirty && copy < volume->fat_copies; copy++) {
+    for (first = 0; first < volume->fat_num_sectors; first = last) {
+      for (last = first; last < volume->fat_num_sectors && volume->fat_dirty[last]; last++);
+      if (last == first) {
+	last++;
+	continue;
+      }
+      if (write_data(volume,
+		     (off_t) (volume->fat_offset + copy * volume->fat_num_sectors + first) * sector_size,
+		     (last - first) * sector_size, volume->fat_array + first * sector_size) !=
+	  (last - first) * sector_size)
+	return -EIO;
+    }
+    if ((rv = barrier(volume)) < 0)
+      return rv;
+  }
+  memset(volume->fat_dirty, 0, volume->fat_num_sectors);
+
+  stats_add(STATS_FAT_FLUSHES, 1);
+  trace_end("flush_fat", t);
+  return 0;
+}
+
+/* find_free: Finds the first free cluster at or after a given one.
+   
+   Returns:
+     The number of the cluster, or fat_entries if there is none.
+ */
+static unsigned int find_free(fat12volume *volume, unsigned int cluster) {
+
+  unsigned int w = cluster / 64;
+  uint64_t bits;
+
+  if (cluster >= volume->fat_entries)
+    return volume->fat_entries;
+  bits = volume->free_map[w] & (~(uint64_t) 0 << (cluster % 64));
+  while (!bits) {
+    if (++w * 64 >= volume->fat_entries)
+      return volume->fat_entries;
+    bits = volume->free_map[w];
+  }
+  cluster = w * 64 + __builtin_ctzll(bits);
+  return cluster < volume->fat_entries ? cluster : volume->fat_entries;
+}
+
+/* free_run_length: Counts the free clusters starting at a given one,
+   up to a maximum. */
+static unsigned int free_run_length(fat12volume *volume, unsigned int cluster,
+				    unsigned int wanted) {
+
+  unsigned int n = 0;
+
+  while (n < wanted && cluster + n < volume->fat_entries &&
+	 test_bit(volume->free_map, cluster + n))
+    n++;
+  return n;
+}
+
+/* allocate_run: Allocates a run of contiguous free clusters. The
+   cluster given as preferred is used if it is free (so a file that
+   grows stays contiguous); otherwise the free clusters are searched,
+   starting where the last search ended, for the first run as long as
+   requested, or else the longest one. Clusters freed by changes not
+   yet on disk are only used when there are no other free clusters
+   left (after flushing the FAT). The FAT entries of the clusters are
+   left for the caller to set.
+   
+   Parameters:
+     volume: pointer to FAT12 volume data structure.
+     preferred: cluster to try first, or zero.
+     wanted: number of clusters wanted.
+     length: out parameter, where the number of clusters allocated
+             (between 1 and wanted) is returned.
+   Returns:
+     The first cluster of the run, or zero if there are no free
+     clusters.
+ */
+static unsigned int allocate_run(fat12volume *volume, unsigned int preferred, unsigned int wanted,
+				 unsigned int *length) {
+
+  unsigned int start, n, cluster, best = 0, best_length = 0, wrapped = 0;
+
+  if (volume->free_clusters == 0 && volume->pending_clusters > 0 && flush_fat(volume) < 0)
+    return 0;
+  if (volume->free_clusters == 0)
+    return 0;
+
+  if (preferred >= 2 && preferred < volume->fat_entries &&
+      test_bit(volume->free_map, preferred)) {
+    best = preferred;
+    best_length = free_run_length(volume, preferred, wanted);
+  } else {
+    cluster = volume->next_free < 2 ? 2 : volume->next_free;
+    while (1) {
+      start = find_free(volume, cluster);
+      if (start >= volume->fat_entries) {
+	if (wrapped)
+	  break;
+	wrapped = 1;
+	cluster = 2;
+	continue;
+      }
+      if (wrapped && start >= volume->next_free)
+	break;
+      n = free_run_length(volume, start, wanted);
+      if (n > best_length) {
+	best = start;
+	best_length = n;
+      }
+      if (n >= wanted)
+	break;
+      cluster = start + n;
+    }
+    if (!best)
+      return 0;
+  }
+
+  for (n = 0; n < best_length; n++)
+    clear_bit(volume->free_map, best + n);
+  volume->free_clusters -= best_length;
+  volume->next_free = best + best_length;
+  *length = best_length;
+  return best;
+}
+
+/* release_cluster: Frees a cluster that has just been allocated but
+   was never referenced, so it can be used again right away. */
+static void release_cluster(fat12volume *volume, unsigned int cluster) {
+  set_bit(volume->free_map, cluster);
+  volume->free_clusters++;
+}
+
+/* free_clusters: Frees clusters that are no longer referenced by any
+   directory entry in memory. They cannot be reused until the next
+   flush_fat, which makes sure the change is on disk first.
+   
+   Parameters:
+     volume: pointer to FAT12 volume data structure.
+     clusters: numbers of the clusters to be freed.
+     count: number of clusters.
+ */
+static void free_clusters(fat12volume *volume, const unsigned int *clusters, unsigned int count) {
+
+  unsigned int i;
+
+  for (i = 0; i < count; i++) {
+    discard_cluster(volume, clusters[i]);
+    set_fat_entry(volume, clusters[i], 0);
+    update_runs(volume, clusters[i], clusters[i]);
+    set_bit(volume->pending_map, clusters[i]);
+    volume->pending_clusters++;
+  }
+}
+
+/* free_chain: Frees all clusters of a chain (see free_clusters).
+   
+   Parameters:
+     volume: pointer to FAT12 volume data structure.
+     cluster: first cluster of the chain (zero for an empty chain).
+ */
+static void free_chain(fat12volume *volume, unsigned int cluster) {
+
+  unsigned int next, count = 0;
+
+  // a chain cannot have more clusters than the volume
+  while (cluster >= 2 && cluster < volume->fat_entries && volume->fat_next[cluster] != 0 &&
+	 count++ < volume->fat_entries) {
+    next = volume->fat_next[cluster];
+    free_clusters(volume, &cluster, 1);
+    cluster = next;
+  }
+}
+
+/* encode_time: Converts a time into the date and time words of a
+   directory entry (see record_time), clamped to the years that FAT
+   can represent (1980 to 2107). */
+static void encode_time(time_t when, uint16_t *date, uint16_t *time) {
+
+  struct tm tm;
+
+  localtime_r(&when, &tm);
+  if (tm.tm_year < 80) {
+    *date = (1 << 5) | 1;
+    *time = 0;
+  } else if (tm.tm_year > 207) {
+    *date = (127 << 9) | (12 << 5) | 31;
+    *time = (23 << 11) | (59 << 5) | 29;
+  } else {
+    *date = ((tm.tm_year - 80) << 9) | ((tm.tm_mon + 1) << 5) | tm.tm_mday;
+    *time = (tm.tm_hour << 11) | (tm.tm_min << 5) | (tm.tm_sec / 2);
+  }
+}
+
+/* format_part: Converts the base or extension of a file name into
+   its padded form in a directory entry (see format_name). */
+static int format_part(const char *part, size_t length, char *raw, unsigned char *case_bits,
+		       unsigned char lower_bit) {
+
+  int upper = 0, lower = 0;
+  unsigned char c;
+  size_t i;
+
+  for (i = 0; i < length; i++) {
+    c = part[i];
+    if (c < 0x20 || c == 0x7f || strchr(INVALID_NAME_CHARS, c))
+      return -EINVAL;
+    if (c < 0x80 && islower(c)) {
+      lower = 1;
+      c = toupper(c);
+    } else if (c < 0x80 && isupper(c)) {
+      upper = 1;
+    }
+    raw[i] = c;
+  }
+  // only names in a single case can be shown as given
+  if (lower && upper)
+    return -EINVAL;
+  if (lower)
+    *case_bits |= lower_bit;
+  return 0;
+}
+
+/* format_name: Converts a file name into the 11 bytes of the name in
+   a directory entry (8 for the name and 3 for the extension, padded
+   with spaces, in uppercase), plus the case bits needed to show it
+   as given.
+   
+   Parameters:
+     name: file name, in 8.3 format. The name and the extension must
+           each be in a single case.
+     raw: buffer of 11 bytes where the name is stored.
+     case_bits: out parameter, where the case bits are stored.
+   Returns:
+     0 in case of success, -ENAMETOOLONG if the name or extension are
+     too long, or -EINVAL if the name is not a valid 8.3 name.
+ */
+static int format_name(const char *name, char *raw, unsigned char *case_bits) {
+
+  const char *dot = strrchr(name, '.');
+  size_t base = dot ? dot - name : strlen(name), ext = dot ? strlen(dot + 1) : 0;
+  int rv;
+
+  if (base == 0 || (dot && ext == 0))
+    return -EINVAL;
+  if (base > 8 || ext > 3)
+    return -ENAMETOOLONG;
+
+  memset(raw, ' ', 11);
+  *case_bits = 0;
+  if ((rv = format_part(name, base, raw, case_bits, CASE_LOWER_BASE)) < 0 ||
+      (dot && (rv = format_part(dot + 1, ext, raw + 8, case_bits, CASE_LOWER_EXT)) < 0))
+    return rv;
+  // a leading 0xe5 would mark the entry as deleted
+  if ((unsigned char) raw[0] == 0xe5)
+    raw[0] = 0x05;
+  return 0;
+}
+
+/* entry_position: Finds where an entry of a directory is stored.
+   
+   Parameters:
+     volume: pointer to FAT12 volume data structure.
+     dir_cluster: first cluster of the directory (zero for the root
+                  directory).
+     slot: position of the entry in the directory.
+     cluster: out parameter, where the number of the cluster holding
+              the entry is stored (zero for the root directory).
+     offset: out parameter, where the offset of the entry within the
+             cluster (or the root directory) is stored.
+   Returns:
+     0 in case of success, or -EIO if the directory is not that long.
+ */
+static int entry_position(fat12volume *volume, unsigned int dir_cluster, unsigned int slot,
+			  unsigned int *cluster, unsigned int *offset) {
+
+  unsigned int per_cluster = volume->cluster_size * volume->sector_size / DIR_ENTRY_SIZE, n;
+
+  if (dir_cluster == 0) {
+    if (slot >= volume->rootdir_entries)
+      return -EIO;
+    *cluster = 0;
+    *offset = slot * DIR_ENTRY_SIZE;
+    return 0;
+  }
+
+  for (n = slot / per_cluster; n > 0 && dir_cluster >= 2 && dir_cluster < volume->fat_entries; n--)
+    dir_cluster = volume->fat_next[dir_cluster];
+  if (dir_cluster < 2 || dir_cluster >= volume->fat_entries)
+    return -EIO;
+  *cluster = dir_cluster;
+  *offset = (slot % per_cluster) * DIR_ENTRY_SIZE;
+  return 0;
+}
+
+/* read_entry: Reads the raw 32 bytes of an entry of a directory. */
+static int read_entry(fat12volume *volume, unsigned int dir_cluster, unsigned int slot,
+		      char *raw) {
+
+  unsigned int cluster, offset;
+  int rv;
+
+  if ((rv = entry_position(volume, dir_cluster, slot, &cluster, &offset)) < 0)
+    return rv;
+  if (cluster == 0)
+    memcpy(raw, volume->rootdir_array + offset, DIR_ENTRY_SIZE);
+  else if (copy_cluster(volume, cluster, offset, DIR_ENTRY_SIZE, raw) != DIR_ENTRY_SIZE)
+    return -EIO;
+  return 0;
+}
+
+/* write_entry: Writes the raw 32 bytes of an entry of a directory,
+   both to the volume and to its in-memory copies, and forgets the
+   index of the directory. Since an entry never crosses a sector, the
+   write is atomic.
+   
+   Parameters:
+     volume: pointer to FAT12 volume data structure.
+     dir_cluster: first cluster of the directory (zero for the root
+                  directory).
+     slot: position of the entry in the directory.
+     raw: new contents of the entry.
+   Returns:
+     0 in case of success, or -EIO.
+ */
+static int write_entry(fat12volume *volume, unsigned int dir_cluster, unsigned int slot,
+		       const char *raw) {
+
+  unsigned int cluster, offset;
+  int rv;
+
+  if ((rv = entry_position(volume, dir_cluster, slot, &cluster, &offset)) < 0)
+    return rv;
+  if (cluster == 0) {
+    if (write_data(volume, (off_t) volume->rootdir_offset * volume->sector_size + offset,
+		   DIR_ENTRY_SIZE, raw) != DIR_ENTRY_SIZE)
+      return -EIO;
+    memcpy(volume->rootdir_array + offset, raw, DIR_ENTRY_SIZE);
+  } else if ((rv = write_cluster_data(volume, cluster, offset, DIR_ENTRY_SIZE, raw)) < 0) {
+    return rv;
+  }
+  dcache_invalidate(volume->dcache, dir_cluster);
+  return 0;
+}
+
+/* extend_directory: Adds an empty cluster at the end of a directory
+   that has no free entries left. The new cluster is written before
+   the FAT refers to it, but the FAT is not flushed.
+   
+   Parameters:
+     volume: pointer to FAT12 volume data structure.
+     first_cluster: first cluster of the directory (not the root
+                    directory, which cannot grow).
+     slot: out parameter, where the position of the first entry of
+           the new cluster is stored.
+   Returns:
+     0 in case of success, -ENOSPC if there are no free clusters or
+     the directory is too long, or -EIO.
+ */
+static int extend_directory(fat12volume *volume, unsigned int first_cluster, unsigned int *slot) {
+
+  unsigned int cluster_bytes = volume->cluster_size * volume->sector_size;
+  unsigned int last = first_cluster, count = 1, cluster, length;
+  char *zeros;
+  int rv;
+
+  while (volume->fat_next[last] >= 2 && volume->fat_next[last] < volume->fat_entries &&
+	 count < volume->fat_entries) {
+    last = volume->fat_next[last];
+    count++;
+  }
+  if ((count + 1) * (cluster_bytes / DIR_ENTRY_SIZE) > DIR_MAX_ENTRIES)
+    return -ENOSPC;
+
+  cluster = allocate_run(volume, last + 1, 1, &length);
+  if (!cluster)
+    return -ENOSPC;
+  zeros = buffer_pool_get(volume->buffers);
+  if (!zeros) {
+    release_cluster(volume, cluster);
+    return -ENOMEM;
+  }
+  memset(zeros, 0, cluster_bytes);
+  rv = write_cluster_data(volume, cluster, 0, cluster_bytes, zeros);
+  buffer_pool_put(volume->buffers, zeros);
+  if (rv < 0) {
+    release_cluster(volume, cluster);
+    return rv;
+  }
+
+  set_fat_entry(volume, cluster, FAT_END_OF_CHAIN);
+  set_fat_entry(volume, last, cluster);
+  update_runs(volume, cluster, cluster);
+  update_runs(volume, last, last);
+  *slot = count * (cluster_bytes / DIR_ENTRY_SIZE);
+  return 0;
+}
+
+/* remove_long_name: Deletes the long name entries of an entry (see
+   dir_record.lfn_entries), which are right before it in its
+   directory. They are deleted after the entry itself is removed or
+   renamed: until then, their checksum keeps them tied to the entry.
+   
+   Parameters:
+     volume: pointer to FAT12 volume data structure.
+     record: record of the entry, as found before it changed.
+   Returns:
+     0 in case of success, or -EIO.
+ */
+static int remove_long_name(fat12volume *volume, const dir_record *record) {
+
+  char raw[DIR_ENTRY_SIZE];
+  unsigned int i;
+  int rv;
+
+  for (i = 1; i <= record->lfn_entries && i <= record->slot; i++) {
+    if ((rv = read_entry(volume, record->dir_cluster, record->slot - i, raw)) < 0)
+      return rv;
+    raw[0] = (char) 0xe5;
+    if ((rv = write_entry(volume, record->dir_cluster, record->slot - i, raw)) < 0)
+      return rv;
+  }
+  return 0;
+}
+
+/* find_name: Finds the entry of a directory with a given name, as
+   stored in the entry (so names that only differ in case match).
+   
+   Parameters:
+     volume: pointer to FAT12 volume data structure.
+     dir: record of the directory.
+     raw: the 11 bytes of the name.
+     slot: out parameter, where the position of the entry is stored.
+   Returns:
+     0 if the entry was found, -ENOENT if it was not, or -EIO.
+ */
+static int find_name(fat12volume *volume, const dir_record *dir, const char *raw,
+		     unsigned int *slot) {
+
+  char space[ARENA_INLINE_SIZE];
+  request_arena arena;
+  const char *data;
+  int length, i, rv = -ENOENT;
+
+  arena_init(&arena, space, sizeof(space));
+  length = scan_directory(volume, dir, &arena, &data);
+  if (length < 0)
+    rv = length;
+  for (i = 0; i < length && data[i] != 0; i += DIR_ENTRY_SIZE) {
+    if ((unsigned char) data[i] != 0xe5 && !(data[i + 11] & ATTR_VOLUME_ID) &&
+	!memcmp(data + i, raw, 11)) {
+      *slot = i / DIR_ENTRY_SIZE;
+      rv = 0;
+      break;
+    }
+  }
+  arena_release(&arena);
+  return rv;
+}
+
+/* find_slot: Finds a free entry in a directory for a new entry,
+   extending the directory if it is full.
+   
+   Parameters:
+     volume: pointer to FAT12 volume data structure.
+     dir: record of the directory.
+     raw: the 11 bytes of the name of the new entry.
+     slot: out parameter, where the position of the free entry is
+           stored.
+     extended: out parameter, set to 1 if the directory was extended
+               (in which case the FAT must be flushed before the new
+               entry is written), or 0 otherwise.
+   Returns:
+     0 in case of success, -EEXIST if the directory already has an
+     entry with that name, -ENOSPC if the directory is full and
+     cannot grow, or -EIO.
+ */
+static int find_slot(fat12volume *volume, const dir_record *dir, const char *raw,
+		     unsigned int *slot, int *extended) {
+
+  static const char zeros[DIR_ENTRY_SIZE];
+  char space[ARENA_INLINE_SIZE];
+  request_arena arena;
+  const char *data;
+  int length, i, free = -1, end = 0, rv = 0;
+
+  *extended = 0;
+  arena_init(&arena, space, sizeof(space));
+  length = scan_directory(volume, dir, &arena, &data);
+  if (length < 0) {
+    arena_release(&arena);
+    return length;
+  }
+
+  for (i = 0; i < length; i += DIR_ENTRY_SIZE) {
+    if (data[i] == 0) {
+      if (free < 0) {
+	free = i;
+	end = 1;
+      }
+      break;
+    }
+    if ((unsigned char) data[i] == 0xe5) {
+      if (free < 0)
+	free = i;
+      continue;
+    }
+    // long file name entries and volume labels are not files
+    if (!(data[i + 11] & ATTR_VOLUME_ID) && !memcmp(data + i, raw, 11)) {
+      rv = -EEXIST;
+      break;
+    }
+  }
+
+  if (rv == 0 && free >= 0) {
+    *slot = free / DIR_ENTRY_SIZE;
+    // using the end marker moves it to the next entry
+    if (end && free + DIR_ENTRY_SIZE < length && data[free + DIR_ENTRY_SIZE] != 0)
+      rv = write_entry(volume, dir->first_cluster, *slot + 1, zeros);
+  } else if (rv == 0 && dir->first_cluster == 0) {
+    rv = -ENOSPC;
+  } else if (rv == 0) {
+    rv = extend_directory(volume, dir->first_cluster, slot);
+    *extended = rv == 0;
+  }
+  arena_release(&arena);
+  return rv;
+}
+
+/* split_path: Splits a path into the path of its parent directory
+   and its last component.
+   
+   Parameters:
+     path: path to split.
+     parent: out parameter, where a newly allocated copy of the path
+             of the parent directory is stored. The caller must free
+             it.
+     name: out parameter, where the last component (within path) is
+           stored.
+   Returns:
+     0 in case of success, -ENOMEM, or -EBUSY for the root directory.
+ */
+static int split_path(const char *path, char **parent, const char **name) {
+
+  const char *slash = strrchr(path, '/');
+
+  if (!slash || slash[1] == '\0')
+    return -EBUSY;
+  *name = slash + 1;
+  *parent = slash == path ? strdup("/") : strndup(path, slash - path);
+  return *parent ? 0 : -ENOMEM;
+}
+
+/* find_node: Finds the open file whose entry is at a given location,
+   ignoring files that were removed while open. */
+static fat12node *find_node(fat12volume *volume, unsigned int dir_cluster, unsigned int slot) {
+
+  fat12node *node;
+
+  for (node = volume->nodes; node; node = node->next)
+    if (!node->removed && node->dir_cluster == dir_cluster && node->slot == slot)
+      return node;
+  return NULL;
+}
+
+/* refresh_record: Updates a record obtained from the directory index
+   of a writable volume with the current state of the file, if it is
+   open (see fat12node). The caller must hold the update lock of the
+   volume.
+   
+   Parameters:
+     volume: pointer to FAT12 volume data structure.
+     record: record to be updated.
+ */
+void refresh_record(fat12volume *volume, dir_record *record) {
+
+  fat12node *node;
+
+  // the root directory has no entry (see record_time)
+  if (!volume->nodes || record->name[0] == '/')
+    return;
+  node = find_node(volume, record->dir_cluster, record->slot);
+  if (node) {
+    record->size = node->record.size;
+    record->first_cluster = node->record.first_cluster;
+    record->date = node->record.date;
+    record->time = node->record.time;
+  }
+}
+
+/* write_node_entry: Writes the directory entry of an open file with
+   its current metadata, once the FAT describes its clusters. */
+static int write_node_entry(fat12volume *volume, fat12node *node) {
+
+  char raw[DIR_ENTRY_SIZE];
+  int rv;
+
+  if ((rv = flush_fat(volume)) < 0 ||
+      (rv = read_entry(volume, node->dir_cluster, node->slot, raw)) < 0)
+    return rv;
+  write_unsigned_le(raw, 20, 2, 0);
+  write_unsigned_le(raw, 26, 2, node->record.first_cluster);
+  write_unsigned_le(raw, 28, 4, node->record.size);
+  write_unsigned_le(raw, 22, 2, node->record.time);
+  write_unsigned_le(raw, 24, 2, node->record.date);
+  write_unsigned_le(raw, 18, 2, node->record.date);
+  raw[11] |= ATTR_ARCHIVE;
+  if ((rv = write_entry(volume, node->dir_cluster, node->slot, raw)) < 0)
+    return rv;
+  node->dirty = 0;
+  return 0;
+}
+
+/* drop_node: Removes a node from the list of open files of its
+   volume and frees it. */
+static void drop_node(fat12volume *volume, fat12node *node) {
+
+  fat12node **p;
+
+  for (p = &volume->nodes; *p != node; p = &(*p)->next);
+  *p = node->next;
+  free(node->clusters);
+  free(node);
+}
+
+/* flush_volume: Writes all pending changes of a writable volume: the
+   dirty clusters, the dirty sectors of the FAT, and then the entries
+   of the files that have changed. Files that were closed before
+   their changes were written are forgotten.
+   
+   Parameters:
+     volume: pointer to FAT12 volume data structure.
+   Returns:
+     0 in case of success, or -EIO.
+ */
+int flush_volume(fat12volume *volume) {
+
+  fat12node *node, *next;
+  int rv, error = 0;
+
+  if (!volume->writable)
+    return 0;
+  lock_volume(volume, 1);
+  if (volume->metadata_loaded) {
+    error = flush_fat(volume);
+    for (node = volume->nodes; node && !error; node = next) {
+      next = node->next;
+      if (node->dirty && !node->removed && (rv = write_node_entry(volume, node)) < 0)
+	error = rv;
+      else if (node->refs == 0 && !node->dirty)
+	drop_node(volume, node);
+    }
+  }
+  unlock_volume(volume);
+  return error;
+}
+
+/* sync_volume: Makes all changes to a writable volume durable, and
+   reports any error found while flushing it in the background since
+   the last call.
+   
+   Parameters:
+     volume: pointer to FAT12 volume data structure.
+   Returns:
+     0 in case of success, or -EIO.
+ */
+int sync_volume(fat12volume *volume) {
+
+  int rv = flush_volume(volume), pending = take_write_error(volume);
+
+  if (rv == 0 && volume->writable && fdatasync(volume->volume_fd))
+    rv = -EIO;
+  stats_add(STATS_BARRIERS, 1);
+  return rv ? rv : pending;
+}
+
+/* take_write_error: Returns the first error found while flushing a
+   volume in the background since the last call (see
+   fat12volume.write_error), or zero if there was none. */
+int take_write_error(fat12volume *volume) {
+  return __atomic_exchange_n(&volume->write_error, 0, __ATOMIC_RELAXED);
+}
+
+/* open_node: Opens a file of a writable volume, sharing the node of
+   the file if it is already open.
+   
+   Parameters:
+     volume: pointer to FAT12 volume data structure.
+     path: path of the file.
+     node: out parameter, where the node of the file is stored. It
+           must be released with close_node.
+   Returns:
+     0 in case of success, or the error returned by
+     find_directory_record, -EISDIR if the path is a directory, -EIO
+     or -ENOMEM.
+ */
+int open_node(fat12volume *volume, const char *path, fat12node **node) {
+
+  fat12extent *extents = NULL;
+  dir_record record;
+  fat12node *n;
+  unsigned int c;
+  int rv, e, num_extents;
+
+  lock_volume(volume, 1);
+  rv = find_directory_record(volume, path, &record);
+  if (!rv && (record.attributes & ATTR_DIRECTORY))
+    rv = -EISDIR;
+  if (rv) {
+    unlock_volume(volume);
+    return rv;
+  }
+
+  n = find_node(volume, record.dir_cluster, record.slot);
+  if (n) {
+    n->refs++;
+    unlock_volume(volume);
+    *node = n;
+    return 0;
+  }
+
+  num_extents = get_file_extents(volume, record.first_cluster, &extents);
+  n = calloc(1, sizeof(fat12node));
+  if (num_extents < 0 || !n) {
+    free(extents);
+    free(n);
+    unlock_volume(volume);
+    return num_extents < 0 ? num_extents : -ENOMEM;
+  }
+  n->capacity = num_extents ?
+    extents[num_extents - 1].file_cluster + extents[num_extents - 1].num_clusters : 0;
+  n->clusters = malloc((n->capacity + 1) * sizeof(unsigned int));
+  if (!n->clusters) {
+    free(extents);
+    free(n);
+    unlock_volume(volume);
+    return -ENOMEM;
+  }
+  for (e = 0; e < num_extents; e++)
+    for (c = 0; c < extents[e].num_clusters; c++)
+      n->clusters[n->num_clusters++] = extents[e].first_cluster + c;
+  free(extents);
+
+  n->dir_cluster = record.dir_cluster;
+  n->slot = record.slot;
+  n->record = record;
+  strcpy(n->name, record.name);
+  n->record.name = n->name;
+  n->refs = 1;
+  n->next = volume->nodes;
+  volume->nodes = n;
+  unlock_volume(volume);
+
+  *node = n;
+  return 0;
+}
+
+/* close_node: Releases a node obtained with open_node. When the last
+   handle of the file is closed, its clusters are freed if it was
+   removed. If it changed, its entry is written, unless the volume
+   uses a write-back engine; the node is then kept until the engine
+   flushes the volume.
+   
+   Parameters:
+     volume: pointer to FAT12 volume data structure.
+     node: node of the file.
+   Returns:
+     0 in case of success, or -EIO if the entry could not be written.
+ */
+int close_node(fat12volume *volume, fat12node *node) {
+
+  int rv = 0;
+
+  lock_volume(volume, 1);
+  if (--node->refs == 0) {
+    if (node->removed)
+      free_clusters(volume, node->clusters, node->num_clusters);
+    else if (node->dirty && volume->writeback)
+      writeback_schedule(volume->writeback, volume);
+    else if (node->dirty)
+      rv = write_node_entry(volume, node);
+    if (node->removed || !node->dirty)
+      drop_node(volume, node);
+  }
+  unlock_volume(volume);
+  return rv;
+}
+
+/* extend_node: Allocates clusters at the end of an open file, as
+   contiguous as possible, and links them to its chain in memory. */
+static int extend_node(fat12volume *volume, fat12node *node, unsigned int count) {
+
+  unsigned int last, start, length, c, capacity, *grown;
+
+  // the array at least doubles, so appending is not quadratic
+  if (node->num_clusters + count > node->capacity) {
+    capacity = node->capacity * 2 > node->num_clusters + count ?
+      node->capacity * 2 : node->num_clusters + count;
+    grown = realloc(node->clusters, capacity * sizeof(unsigned int));
+    if (!grown)
+      return -ENOMEM;
+    node->clusters = grown;
+    node->capacity = capacity;
+  }
+
+  while (count > 0) {
+    last = node->num_clusters ? node->clusters[node->num_clusters - 1] : 0;
+    start = allocate_run(volume, last ? last + 1 : 0, count, &length);
+    if (!start)
+      return -ENOSPC;
+    for (c = start; c < start + length; c++)
+      set_fat_entry(volume, c, c + 1 < start + length ? c + 1 : FAT_END_OF_CHAIN);
+    if (last)
+      set_fat_entry(volume, last, start);
+    else
+      node->record.first_cluster = start;
+    update_runs(volume, start, start + length - 1);
+    if (last)
+      update_runs(volume, last, last);
+    for (c = start; c < start + length; c++)
+      node->clusters[node->num_clusters++] = c;
+    node->dirty = 1;
+    count -= length;
+  }
+  return 0;
+}
+
+/* shrink_node: Drops the clusters at the end of an open file beyond
+   a given number, which no entry on disk may refer to. */
+static void shrink_node(fat12volume *volume, fat12node *node, unsigned int count) {
+
+  if (count >= node->num_clusters)
+    return;
+  if (count > 0) {
+    set_fat_entry(volume, node->clusters[count - 1], FAT_END_OF_CHAIN);
+    update_runs(volume, node->clusters[count - 1], node->clusters[count - 1]);
+  } else {
+    node->record.first_cluster = 0;
+  }
+  free_clusters(volume, node->clusters + count, node->num_clusters - count);
+  node->num_clusters = count;
+}
+
+/* dirty_cluster: Returns the dirty buffer of a cluster of an open
+   file, creating it if needed. A new buffer starts with the current
+   contents of the cluster, or zeros past the end of the file. */
+static char *dirty_cluster(fat12volume *volume, fat12node *node, unsigned int index) {
+
+  unsigned int cluster_bytes = volume->cluster_size * volume->sector_size;
+  unsigned int cluster = node->clusters[index];
+  char *data = volume->dirty[cluster];
+
+  if (data)
+    return data;
+  if (!(data = buffer_pool_get(volume->buffers)))
+    return NULL;
+  if ((uint64_t) index * cluster_bytes < node->record.size) {
+    if (copy_cluster(volume, cluster, 0, cluster_bytes, data) != cluster_bytes) {
+      buffer_pool_put(volume->buffers, data);
+      return NULL;
+    }
+  } else {
+    memset(data, 0, cluster_bytes);
+  }
+  volume->dirty[cluster] = data;
+  volume->dirty_bytes += cluster_bytes;
+  writeback_account(volume->writeback, cluster_bytes);
+  return data;
+}
+
+/* write_clusters: Writes data to the clusters of an open file, which
+   must already be allocated. With a write-back engine the data is
+   only copied to the dirty buffers of the clusters; otherwise a
+   single write is issued for every run of contiguous clusters. */
+static int write_clusters(fat12volume *volume, fat12node *node, const char *buffer, size_t size,
+			  off_t offset) {
+
+  unsigned int cluster_bytes = volume->cluster_size * volume->sector_size;
+  unsigned int index = offset / cluster_bytes, skip = offset % cluster_bytes, run, c, part;
+  size_t done = 0, count, position;
+  char *data;
+
+  if (volume->writeback) {
+    for (; done < size; done += part, skip = 0, index++) {
+      part = cluster_bytes - skip;
+      if (part > size - done)
+	part = size - done;
+      if (!(data = dirty_cluster(volume, node, index)))
+	return -EIO;
+      memcpy(data + skip, buffer + done, part);
+    }
+    return 0;
+  }
+
+  while (done < size) {
+    run = 1;
+    while (index + run < node->num_clusters &&
+	   node->clusters[index + run] == node->clusters[index] + run &&
+	   (size_t) run * cluster_bytes - skip < size - done)
+      run++;
+    count = (size_t) run * cluster_bytes - skip;
+    if (count > size - done)
+      count = size - done;
+
+    if (write_data(volume, cluster_position(volume, node->clusters[index]) + skip, count,
+		   buffer + done) != count)
+      return -EIO;
+    for (c = 0, position = 0; volume->cache && position < count; c++, position += part) {
+      part = c ? cluster_bytes : cluster_bytes - skip;
+      if (part > count - position)
+	part = count - position;
+      cluster_cache_update(volume->cache, volume->volume_id, node->clusters[index + c],
+			   c ? 0 : skip, part, buffer + done + position);
+    }
+
+    done += count;
+    skip = 0;
+    index += run;
+  }
+  return 0;
+}
+
+/* zero_range: Fills a range of an open file with zeros. */
+static int zero_range(fat12volume *volume, fat12node *node, off_t from, off_t to) {
+
+  unsigned int cluster_bytes = volume->cluster_size * volume->sector_size;
+  char *zeros;
+  size_t count;
+  int rv = 0;
+
+  if (from >= to)
+    return 0;
+  zeros = buffer_pool_get(volume->buffers);
+  if (!zeros)
+    return -ENOMEM;
+  memset(zeros, 0, cluster_bytes);
+  for (; from < to && rv == 0; from += count) {
+    count = cluster_bytes - from % cluster_bytes;
+    if (count > to - from)
+      count = to - from;
+    rv = write_clusters(volume, node, zeros, count, from);
+  }
+  buffer_pool_put(volume->buffers, zeros);
+  return rv;
+}
+
+/* write_node: Writes data to an open file, allocating clusters as
+   needed. The data is written to the volume right away, or left to
+   the write-back engine of the volume if it has one, but the
+   directory entry of the file is only updated when the file is
+   flushed or closed. A writer that finds the engine over its memory
+   limit writes the dirty clusters of the volume itself.
+   
+   Parameters:
+     volume: pointer to FAT12 volume data structure.
+     node: node of the file.
+     buffer: data to be written.
+     size: number of bytes to write.
+     offset: byte offset in the file where the data is written. If it
+             is beyond the end of the file, the gap is filled with
+             zeros.
+   Returns:
+     The number of bytes written (size) in case of success. Returns
+     -EFBIG if the file would be too large, -ENOSPC if the volume is
+     full, -EIO or -ENOMEM.
+ */
+int write_node(fat12volume *volume, fat12node *node, const char *buffer, size_t size,
+	       off_t offset) {
+
+  unsigned int cluster_bytes = volume->cluster_size * volume->sector_size;
+  uint64_t end = (uint64_t) offset + size, needed;
+  int rv;
+
+  if (size == 0)
+    return 0;
+  if (end > UINT32_MAX)
+    return -EFBIG;
+
+  lock_volume(volume, 1);
+  needed = (end + cluster_bytes - 1) / cluster_bytes;
+  if ((rv = load_volume_metadata(volume)) < 0 ||
+      (needed > node->num_clusters && (rv = extend_node(volume, node, needed - node->num_clusters)) < 0) ||
+      (rv = zero_range(volume, node, node->record.size, offset)) < 0 ||
+      (rv = write_clusters(volume, node, buffer, size, offset)) < 0) {
+    // clusters allocated for the failed write are given back
+    shrink_node(volume, node, ((uint64_t) node->record.size + cluster_bytes - 1) / cluster_bytes);
+    unlock_volume(volume);
+    return rv;
+  }
+
+  if (end > node->record.size)
+    node->record.size = end;
+  encode_time(time(NULL), &node->record.date, &node->record.time);
+  node->dirty = 1;
+  if (writeback_over_limit(volume->writeback) && write_back(volume) < 0)
+    __atomic_store_n(&volume->write_error, -EIO, __ATOMIC_RELAXED);
+  writeback_schedule(volume->writeback, volume);
+  unlock_volume(volume);
+  return size;
+}
+
+/* truncate_node: Changes the size of an open file. A file that grows
+   is filled with zeros. When a file shrinks, its entry is written
+   right away, before the clusters it no longer needs are freed.
+   
+   Parameters:
+     volume: pointer to FAT12 volume data structure.
+     node: node of the file.
+     size: new size of the file, in bytes.
+   Returns:
+     0 in case of success, -EFBIG if the size is too large, -ENOSPC,
+     -EIO or -ENOMEM.
+ */
+int truncate_node(fat12volume *volume, fat12node *node, off_t size) {
+
+  unsigned int cluster_bytes = volume->cluster_size * volume->sector_size;
+  unsigned int needed;
+  int rv = 0;
+
+  if (size < 0 || (uint64_t) size > UINT32_MAX)
+    return -EFBIG;
+
+  lock_volume(volume, 1);
+  needed = ((uint64_t) size + cluster_bytes - 1) / cluster_bytes;
+  if ((rv = load_volume_metadata(volume)) < 0) {
+    unlock_volume(volume);
+    return rv;
+  }
+
+  if (size > node->record.size) {
+    if ((needed > node->num_clusters &&
+	 (rv = extend_node(volume, node, needed - node->num_clusters)) < 0) ||
+	(rv = zero_range(volume, node, node->record.size, size)) < 0) {
+      shrink_node(volume, node,
+		  ((uint64_t) node->record.size + cluster_bytes - 1) / cluster_bytes);
+      unlock_volume(volume);
+      return rv;
+    }
+  }
+
+  node->record.size = size;
+  encode_time(time(NULL), &node->record.date, &node->record.time);
+  node->dirty = 1;
+
+  if (needed < node->num_clusters) {
+    if (needed == 0)
+      node->record.first_cluster = 0;
+    if (!node->removed)
+      rv = write_node_entry(volume, node);
+    if (rv == 0)
+      shrink_node(volume, node, needed);
+  }
+  writeback_schedule(volume->writeback, volume);
+  unlock_volume(volume);
+  return rv;
+}
+
+/* create_entry: Creates an empty file or directory.
+   
+   Parameters:
+     volume: pointer to FAT12 volume data structure.
+     path: path of the new file or directory.
+     attributes: attributes of the new entry (ATTR_DIRECTORY to create
+                 a directory).
+   Returns:
+     0 in case of success. Returns -EEXIST if the path already exists,
+     -ENOENT or -ENOTDIR if its parent directory does not exist,
+     -EINVAL or -ENAMETOOLONG if the name is not a valid 8.3 name,
+     -ENOSPC if there is no room for it, -EIO or -ENOMEM.
+ */
+int create_entry(fat12volume *volume, const char *path, int attributes) {
+
+  unsigned int cluster_bytes = volume->cluster_size * volume->sector_size;
+  unsigned int slot, cluster = 0, length;
+  char raw[DIR_ENTRY_SIZE], *parent = NULL, *data;
+  unsigned char case_bits;
+  dir_record dir;
+  const char *name;
+  uint16_t date, time_word;
+  int rv, extended;
+
+  if ((rv = split_path(path, &parent, &name)) < 0)
+    return rv == -EBUSY ? -EEXIST : rv;
+
+  lock_volume(volume, 1);
+  if ((rv = load_volume_metadata(volume)) < 0 ||
+      (rv = find_directory_record(volume, parent, &dir)) < 0 ||
+      (rv = (dir.attributes & ATTR_DIRECTORY) ? 0 : -ENOTDIR) < 0 ||
+      (rv = format_name(name, raw, &case_bits)) < 0 ||
+      (rv = find_slot(volume, &dir, raw, &slot, &extended)) < 0)
+    goto out;
+
+  encode_time(time(NULL), &date, &time_word);
+  memset(raw + 11, 0, DIR_ENTRY_SIZE - 11);
+  raw[11] = (attributes & ATTR_DIRECTORY) ? ATTR_DIRECTORY : ATTR_ARCHIVE;
+  raw[12] = case_bits;
+  write_unsigned_le(raw, 14, 2, time_word);
+  write_unsigned_le(raw, 16, 2, date);
+  write_unsigned_le(raw, 18, 2, date);
+  write_unsigned_le(raw, 22, 2, time_word);
+  write_unsigned_le(raw, 24, 2, date);
+
+  // a new directory starts with its . and .. entries
+  if (attributes & ATTR_DIRECTORY) {
+    cluster = allocate_run(volume, 0, 1, &length);
+    if (!cluster) {
+      rv = -ENOSPC;
+      goto out;
+    }
+    data = buffer_pool_get(volume->buffers);
+    if (!data) {
+      release_cluster(volume, cluster);
+      rv = -ENOMEM;
+      goto out;
+    }
+    memset(data, 0, cluster_bytes);
+    memcpy(data, raw, DIR_ENTRY_SIZE);
+    memcpy(data, ".          ", 11);
+    data[12] = 0;
+    write_unsigned_le(data, 26, 2, cluster);
+    memcpy(data + DIR_ENTRY_SIZE, data, DIR_ENTRY_SIZE);
+    memcpy(data + DIR_ENTRY_SIZE, "..         ", 11);
+    write_unsigned_le(data + DIR_ENTRY_SIZE, 26, 2, dir.first_cluster);
+    rv = write_cluster_data(volume, cluster, 0, cluster_bytes, data);
+    buffer_pool_put(volume->buffers, data);
+    if (rv < 0) {
+      release_cluster(volume, cluster);
+      goto out;
+    }
+    set_fat_entry(volume, cluster, FAT_END_OF_CHAIN);
+    update_runs(volume, cluster, cluster);
+    write_unsigned_le(raw, 26, 2, cluster);
+    // an index of an earlier directory with the same cluster is stale
+    dcache_invalidate(volume->dcache, cluster);
+  }
+
+  if ((!extended && !cluster) || (rv = flush_fat(volume)) == 0)
+    rv = write_entry(volume, dir.first_cluster, slot, raw);
+
+ out:
+  unlock_volume(volume);
+  free(parent);
+  return rv;
+}
+
+/* directory_is_empty: Checks that a directory has no entries other
+   than . and .. */
+static int directory_is_empty(fat12volume *volume, const dir_record *dir) {
+
+  const dir_index *index;
+  unsigned int i;
+  int rv;
+
+  if ((rv = get_directory_index(volume, dir, &index)) < 0)
+    return rv;
+  for (i = 0; i < index->num_entries; i++)
+    if (strcmp(index->entries[i].name, ".") && strcmp(index->entries[i].name, ".."))
+      return -ENOTEMPTY;
+  return 0;
+}
+
+/* remove_entry: Removes a file or an empty directory. The entry is
+   deleted before its clusters are freed. A file that is still open
+   keeps its clusters until it is closed.
+   
+   Parameters:
+     volume: pointer to FAT12 volume data structure.
+     path: path of the file or directory.
+     directory: non-zero to remove a directory, zero for a file.
+   Returns:
+     0 in case of success. Returns -ENOENT or -ENOTDIR if the path does
+     not exist, -EISDIR or -ENOTDIR if it is not of the requested
+     type, -ENOTEMPTY if the directory is not empty, -EBUSY for the
+     root directory, or -EIO.
+ */
+int remove_entry(fat12volume *volume, const char *path, int directory) {
+
+  char raw[DIR_ENTRY_SIZE];
+  dir_record record;
+  fat12node *node;
+  int rv;
+
+  lock_volume(volume, 1);
+  if ((rv = load_volume_metadata(volume)) < 0 ||
+      (rv = find_directory_record(volume, path, &record)) < 0)
+    goto out;
+  if (record.name[0] == '/') {
+    rv = -EBUSY;
+    goto out;
+  }
+  if (directory && !(record.attributes & ATTR_DIRECTORY)) {
+    rv = -ENOTDIR;
+    goto out;
+  }
+  if (!directory && (record.attributes & ATTR_DIRECTORY)) {
+    rv = -EISDIR;
+    goto out;
+  }
+  if ((directory && (rv = directory_is_empty(volume, &record)) < 0) ||
+      (rv = read_entry(volume, record.dir_cluster, record.slot, raw)) < 0)
+    goto out;
+
+  raw[0] = (char) 0xe5;
+  if ((rv = write_entry(volume, record.dir_cluster, record.slot, raw)) < 0 ||
+      (rv = remove_long_name(volume, &record)) < 0)
+    goto out;
+
+  node = find_node(volume, record.dir_cluster, record.slot);
+  if (node && node->refs == 0) {
+    // a closed file whose changes were not written yet
+    free_clusters(volume, node->clusters, node->num_clusters);
+    drop_node(volume, node);
+  } else if (node) {
+    node->removed = 1;
+  } else {
+    free_chain(volume, record.first_cluster);
+    if (directory)
+      dcache_invalidate(volume->dcache, record.first_cluster);
+  }
+
+ out:
+  unlock_volume(volume);
+  return rv;
+}
+
+/* is_within: Checks whether a directory is a given directory or lies
+   within it, following the .. entries from the directory up to the
+   root directory.
+   
+   Parameters:
+     volume: pointer to FAT12 volume data structure.
+     dir: record of the directory.
+     ancestor: first cluster of the other directory.
+   Returns:
+     1 if dir is ancestor or lies within it, 0 if not, or -EIO if a
+     directory could not be read or the .. entries form a loop.
+ */
+static int is_within(fat12volume *volume, const dir_record *dir, unsigned int ancestor) {
+
+  char raw[DIR_ENTRY_SIZE];
+  unsigned int cluster = dir->first_cluster, steps;
+  int rv;
+
+  for (steps = 0; cluster >= 2; steps++) {
+    if (cluster == ancestor)
+      return 1;
+    if (steps >= volume->fat_entries)
+      return -EIO;
+    if ((rv = read_entry(volume, cluster, 1, raw)) < 0)
+      return rv;
+    if (memcmp(raw, "..         ", 11))
+      return -EIO;
+    cluster = read_unsigned_le(raw, 26, 2) & 0xfff;
+  }
+  return 0;
+}
+
+/* rename_entry: Renames or moves a file or directory, replacing the
+   destination if it exists. A rename within the same directory
+   rewrites the entry in place. Otherwise the old entry is deleted and
+   made durable before the new one is written, so a crash in between
+   loses the entry (leaving its clusters unreferenced) rather than
+   leaving two entries that share the same clusters.
+   
+   Parameters:
+     volume: pointer to FAT12 volume data structure.
+     from: current path.
+     to: new path.
+   Returns:
+     0 in case of success. Returns -ENOENT or -ENOTDIR if a path does
+     not exist, -EISDIR, -ENOTDIR or -ENOTEMPTY if the destination
+     cannot be replaced, -EINVAL if a directory would be moved into
+     itself or the new name is invalid, -EBUSY for the root directory,
+     -ENOSPC, -EIO or -ENOMEM.
+ */
+int rename_entry(fat12volume *volume, const char *from, const char *to) {
+
+  char raw[DIR_ENTRY_SIZE], old[DIR_ENTRY_SIZE], name_raw[11], *parent = NULL;
+  dir_record record, dir, target;
+  unsigned int slot, dir_cluster;
+  unsigned char case_bits;
+  const char *name;
+  fat12node *node, *replaced = NULL;
+  int rv, exists, extended = 0;
+
+  if ((rv = split_path(to, &parent, &name)) < 0)
+    return rv;
+
+  lock_volume(volume, 1);
+  if ((rv = load_volume_metadata(volume)) < 0 ||
+      (rv = find_directory_record(volume, from, &record)) < 0 ||
+      (rv = record.name[0] == '/' ? -EBUSY : 0) < 0 ||
+      (rv = find_directory_record(volume, parent, &dir)) < 0 ||
+      (rv = (dir.attributes & ATTR_DIRECTORY) ? 0 : -ENOTDIR) < 0 ||
+      (rv = format_name(name, name_raw, &case_bits)) < 0)
+    goto out;
+
+  // a directory cannot be moved into itself; paths cannot tell, as
+  // names are looked up ignoring case and by their 8.3 alias
+  if ((record.attributes & ATTR_DIRECTORY) &&
+      (rv = is_within(volume, &dir, record.first_cluster)) != 0) {
+    if (rv > 0)
+      rv = -EINVAL;
+    goto out;
+  }
+
+  rv = find_directory_record(volume, to, &target);
+  if (rv < 0 && rv != -ENOENT)
+    goto out;
+  exists = rv == 0;
+  if (exists && target.dir_cluster == record.dir_cluster && target.slot == record.slot) {
+    // names are looked up ignoring case, so the destination may be
+    // the entry itself under another name, which it then takes
+    if (!strcmp(from, to)) {
+      rv = 0;
+      goto out;
+    }
+    exists = 0;
+  }
+  if (exists && (record.attributes & ATTR_DIRECTORY) && !(target.attributes & ATTR_DIRECTORY)) {
+    rv = -ENOTDIR;
+    goto out;
+  }
+  if (exists && !(record.attributes & ATTR_DIRECTORY) && (target.attributes & ATTR_DIRECTORY)) {
+    rv = -EISDIR;
+    goto out;
+  }
+  if (exists && (target.attributes & ATTR_DIRECTORY) &&
+      (rv = directory_is_empty(volume, &target)) < 0)
+    goto out;
+
+  // a name that only differs in case from another entry is taken,
+  // unless it is the entry being renamed
+  if (!exists) {
+    rv = find_name(volume, &dir, name_raw, &slot);
+    if (rv == 0 && (dir.first_cluster != record.dir_cluster || slot != record.slot))
+      rv = -EEXIST;
+    if (rv < 0 && rv != -ENOENT)
+      goto out;
+  }
+
+  if ((rv = read_entry(volume, record.dir_cluster, record.slot, raw)) < 0)
+    goto out;
+  memcpy(old, raw, DIR_ENTRY_SIZE);
+  memcpy(raw, name_raw, 11);
+  raw[12] = (raw[12] & ~(CASE_LOWER_BASE | CASE_LOWER_EXT)) | case_bits;
+  node = find_node(volume, record.dir_cluster, record.slot);
+
+  if (!exists && dir.first_cluster == record.dir_cluster) {
+    // same directory: the entry is rewritten in place
+    dir_cluster = record.dir_cluster;
+    slot = record.slot;
+  } else {
+    if (exists)
+      slot = target.slot;
+    else if ((rv = find_slot(volume, &dir, name_raw, &slot, &extended)) < 0)
+      goto out;
+    dir_cluster = dir.first_cluster;
+    if (exists)
+      replaced = find_node(volume, target.dir_cluster, target.slot);
+    // the old entry is gone from the disk before the new one appears
+    old[0] = (char) 0xe5;
+    if ((rv = write_entry(volume, record.dir_cluster, record.slot, old)) < 0 ||
+	(rv = barrier(volume)) < 0)
+      goto out;
+  }
+
+  // the entry of an open file may have changes not written yet
+  if (node) {
+    write_unsigned_le(raw, 26, 2, node->record.first_cluster);
+    write_unsigned_le(raw, 28, 4, node->record.size);
+    write_unsigned_le(raw, 22, 2, node->record.time);
+    write_unsigned_le(raw, 24, 2, node->record.date);
+  }
+  if (((extended || (node && node->dirty)) && (rv = flush_fat(volume)) < 0) ||
+      (rv = write_entry(volume, dir_cluster, slot, raw)) < 0)
+    goto out;
+
+  if (node) {
+    fill_directory_record(raw, &node->record, node->name);
+    node->record.dir_cluster = node->dir_cluster = dir_cluster;
+    node->record.slot = node->slot = slot;
+    node->dirty = 0;
+  }
+  // the long names of both entries no longer match them
+  if ((rv = remove_long_name(volume, &record)) < 0 ||
+      (exists && (rv = remove_long_name(volume, &target)) < 0))
+    goto out;
+
+  // what the destination held is freed once nothing refers to it
+  if (replaced && replaced->refs == 0) {
+    free_clusters(volume, replaced->clusters, replaced->num_clusters);
+    drop_node(volume, replaced);
+  } else if (replaced) {
+    replaced->removed = 1;
+  } else if (exists) {
+    free_chain(volume, target.first_cluster);
+    if (target.attributes & ATTR_DIRECTORY)
+      dcache_invalidate(volume->dcache, target.first_cluster);
+  }
+
+  // a directory that changes parent must point its .. entry to it
+  if ((record.attributes & ATTR_DIRECTORY) && dir_cluster != record.dir_cluster &&
+      read_entry(volume, record.first_cluster, 1, old) == 0 && !memcmp(old, "..         ", 11)) {
+    write_unsigned_le(old, 26, 2, dir.first_cluster);
+    rv = write_entry(volume, record.first_cluster, 1, old);
+  }
+
+ out:
+  unlock_volume(volume);
+  free(parent);
+  return rv;
+}
+
+/* touch_entry: Sets the modification time of a file or directory.
+   
+   Parameters:
+     volume: pointer to FAT12 volume data structure.
+     path: path of the file or directory.
+     mtime: new modification time.
+   Returns:
+     0 in case of success, or the error returned by
+     find_directory_record, or -EIO.
+ */
+int touch_entry(fat12volume *volume, const char *path, time_t mtime) {
+
+  char raw[DIR_ENTRY_SIZE];
+  dir_record record;
+  fat12node *node;
+  uint16_t date, time_word;
+  int rv;
+
+  lock_volume(volume, 1);
+  if ((rv = load_volume_metadata(volume)) < 0 ||
+      (rv = find_directory_record(volume, path, &record)) < 0 ||
+      record.name[0] == '/')
+    goto out;
+
+  encode_time(mtime, &date, &time_word);
+  node = find_node(volume, record.dir_cluster, record.slot);
+  if (node) {
+    node->record.date = date;
+    node->record.time = time_word;
+    node->dirty = 1;
+    writeback_schedule(volume->writeback, volume);
+  } else if ((rv = read_entry(volume, record.dir_cluster, record.slot, raw)) == 0) {
+    write_unsigned_le(raw, 22, 2, time_word);
+    write_unsigned_le(raw, 24, 2, date);
+    write_unsigned_le(raw, 18, 2, date);
+    rv = write_entry(volume, record.dir_cluster, record.slot, raw);
+  }
+
+ out:
+  unlock_volume(volume);
+  return rv;
+}
@@ -0,0 +1,76 @@
+#ifndef _FAT12WRITE_H_
+#define _FAT12WRITE_H_
+
+#include "fat12.h"
+
+#include <time.h>
+
+/* Value stored in the FAT for the last cluster of a chain */
+#define FAT_END_OF_CHAIN 0xfff
+
+/* Maximum number of entries in a directory, so that the position of
+   an entry fits in dir_record.slot */
+#define DIR_MAX_ENTRIES 65536
+
+/* Maximum number of dirty clusters written back with a single call
+   (must not exceed the IOV_MAX of the system) */
+#define WRITE_BACK_MAX_RUN 256
+
+/* Data structure with the current state of an open file of a
+   writable volume, shared by all open handles of the file. Changes
+   to a file are only written to its directory entry when the file is
+   flushed or closed, so the node, and not the entry, has the current
+   size and cluster chain of the file while it is open. Nodes are
+   only modified while holding the update lock of the volume
+   exclusively, and must be read while holding it (shared at
+   least). */
+struct fat12node {
+
+  /* Location of the directory entry of the file (see dir_record) */
+  unsigned int dir_cluster;
+  unsigned int slot;
+  /* Current metadata of the file, whose name is kept in name */
+  dir_record record;
+  char name[NAME_MAX_BYTES + 1];
+  /* Set when the metadata has changed since the entry was written */
+  int dirty;
+  /* Set when the file was removed while open; its clusters are
+     freed when it is closed */
+  int removed;
+  /* Numbers of the clusters of the file, in file order */
+  unsigned int num_clusters;
+  unsigned int capacity;
+  unsigned int *clusters;
+  /* Number of open handles of the file. A closed file whose changes
+     are left to the write-back engine is kept with no handles until
+     the volume is flushed */
+  unsigned int refs;
+  /* Next open file of the volume */
+  struct fat12node *next;
+
+};
+
+int init_free_map(fat12volume *volume);
+void free_free_map(fat12volume *volume);
+unsigned int count_free_clusters(fat12volume *volume);
+
+int write_data(fat12volume *volume, off_t position, size_t length, const char *buffer);
+int flush_fat(fat12volume *volume);
+int flush_volume(fat12volume *volume);
+int sync_volume(fat12volume *volume);
+int take_write_error(fat12volume *volume);
+int cluster_is_dirty(fat12volume *volume, unsigned int cluster);
+
+int open_node(fat12volume *volume, const char *path, fat12node **node);
+int close_node(fat12volume *volume, fat12node *node);
+int write_node(fat12volume *volume, fat12node *node, const char *buffer, size_t size,
+	       off_t offset);
+int truncate_node(fat12volume *volume, fat12node *node, off_t size);
+void refresh_record(fat12volume *volume, dir_record *record);
+
+int create_entry(fat12volume *volume, const char *path, int attributes);
+int remove_entry(fat12volume *volume, const char *path, int directory);
+int rename_entry(fat12volume *volume, const char *from, const char *to);
+int touch_entry(fat12volume *volume, const char *path, time_t mtime);
+
+#endif
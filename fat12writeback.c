@@ -0,0 +1,229 @@
+#include "fat12writeback.h"
+#include "fat12write.h"
+
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+/* Volumes with pending changes are queued in a list linked through
+   their writeback_next field, in the order they were scheduled. The
+   flusher takes volumes from the queue one at a time, and marks the
+   volume it is flushing as active until it is done, so that
+   writeback_forget can wait for it. */
+struct writeback {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_cond_t done;
+  pthread_t thread;
+  int stop;
+  /* Set when the dirty data has grown past half the limit, to flush
+     without waiting for the interval to expire */
+  int urgent;
+  unsigned int interval;
+  size_t dirty_limit;
+  size_t dirty_bytes;
+  fat12volume *head;
+  fat12volume *tail;
+  fat12volume *active;
+};
+
+/* writeback_thread: Main function of the flusher thread. Every
+   interval, or whenever it is woken because memory is running short,
+   it flushes all queued volumes. */
+static void *writeback_thread(void *arg) {
+  writeback *wb = arg;
+  struct timespec deadline;
+  fat12volume *volume;
+  int rv;
+
+  pthread_mutex_lock(&wb->lock);
+  while (1) {
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += wb->interval;
+    while (!wb->stop && !wb->urgent &&
+	   (wb->interval == 0 ? pthread_cond_wait(&wb->cond, &wb->lock) :
+	    pthread_cond_timedwait(&wb->cond, &wb->lock, &deadline)) != ETIMEDOUT);
+    if (wb->stop)
+      break;
+    wb->urgent = 0;
+
+    while (wb->head && !wb->stop) {
+      volume = wb->head;
+      wb->head = volume->writeback_next;
+      if (!wb->head)
+	wb->tail = NULL;
+      volume->writeback_next = NULL;
+      volume->writeback_queued = 0;
+      wb->active = volume;
+      pthread_mutex_unlock(&wb->lock);
+
+      // errors are kept until a process can be told about them
+      rv = flush_volume(volume);
+      if (rv < 0)
+	__atomic_store_n(&volume->write_error, rv, __ATOMIC_RELAXED);
+
+      pthread_mutex_lock(&wb->lock);
+      wb->active = NULL;
+      pthread_cond_broadcast(&wb->done);
+    }
+  }
+  pthread_mutex_unlock(&wb->lock);
+
+  return NULL;
+}
+
+/* writeback_create: Creates a write-back engine and starts its
+   flusher thread. Note that FUSE may fork when going to the
+   background, so the engine must be created after that (e.g., in the
+   init operation).
+   
+   Parameters:
+     interval: time, in seconds, between flushes of the queued
+               volumes (0 to only flush them when memory runs short).
+     dirty_limit: maximum number of bytes of dirty clusters kept in
+                  memory for all volumes using the engine.
+   Returns:
+     A pointer to the new engine, or NULL in case of error.
+ */
+writeback *writeback_create(unsigned int interval, size_t dirty_limit) {
+  writeback *wb = calloc(1, sizeof(writeback));
+
+  if (!wb)
+    return NULL;
+
+  wb->interval = interval;
+  wb->dirty_limit = dirty_limit;
+  pthread_mutex_init(&wb->lock, NULL);
+  pthread_cond_init(&wb->cond, NULL);
+  pthread_cond_init(&wb->done, NULL);
+  if (pthread_create(&wb->thread, NULL, writeback_thread, wb)) {
+    pthread_mutex_destroy(&wb->lock);
+    pthread_cond_destroy(&wb->cond);
+    pthread_cond_destroy(&wb->done);
+    free(wb);
+    return NULL;
+  }
+  return wb;
+}
+
+/* writeback_destroy: Stops the flusher thread and frees the engine.
+   Volumes still queued are not flushed; they must be forgotten and
+   closed (which flushes them) before the engine is destroyed.
+   
+   Parameters:
+     wb: write-back engine. May be NULL.
+ */
+void writeback_destroy(writeback *wb) {
+  if (!wb)
+    return;
+
+  pthread_mutex_lock(&wb->lock);
+  wb->stop = 1;
+  pthread_cond_signal(&wb->cond);
+  pthread_mutex_unlock(&wb->lock);
+  pthread_join(wb->thread, NULL);
+
+  pthread_mutex_destroy(&wb->lock);
+  pthread_cond_destroy(&wb->cond);
+  pthread_cond_destroy(&wb->done);
+  free(wb);
+}
+
+/* writeback_schedule: Queues a volume with pending changes to be
+   flushed by the engine, if it is not queued already.
+   
+   Parameters:
+     wb: write-back engine. May be NULL.
+     volume: pointer to FAT12 volume data structure.
+ */
+void writeback_schedule(writeback *wb, fat12volume *volume) {
+  if (!wb)
+    return;
+
+  pthread_mutex_lock(&wb->lock);
+  if (!volume->writeback_queued) {
+    volume->writeback_queued = 1;
+    volume->writeback_next = NULL;
+    if (wb->tail)
+      wb->tail->writeback_next = volume;
+    else
+      wb->head = volume;
+    wb->tail = volume;
+  }
+  pthread_mutex_unlock(&wb->lock);
+}
+
+/* writeback_forget: Removes a volume from the queue of the engine and
+   waits until the flusher thread is no longer flushing it. Must be
+   called before a volume that has been used with the engine is
+   closed, or its metadata released; its changes are then flushed by
+   release_volume_metadata.
+   
+   Parameters:
+     wb: write-back engine. May be NULL.
+     volume: pointer to FAT12 volume data structure.
+ */
+void writeback_forget(writeback *wb, fat12volume *volume) {
+  fat12volume **p, *previous = NULL;
+
+  if (!wb)
+    return;
+
+  pthread_mutex_lock(&wb->lock);
+  if (volume->writeback_queued) {
+    for (p = &wb->head; *p != volume; p = &(*p)->writeback_next)
+      previous = *p;
+    *p = volume->writeback_next;
+    if (wb->tail == volume)
+      wb->tail = previous;
+    volume->writeback_next = NULL;
+    volume->writeback_queued = 0;
+  }
+  while (wb->active == volume)
+    pthread_cond_wait(&wb->done, &wb->lock);
+  pthread_mutex_unlock(&wb->lock);
+}
+
+/* writeback_account: Updates the number of bytes of dirty clusters
+   of all volumes using the engine, waking the flusher thread once
+   they take more than half of the limit.
+   
+   Parameters:
+     wb: write-back engine. May be NULL.
+     bytes: number of bytes that became dirty (or, if negative, that
+            were written or discarded).
+ */
+void writeback_account(writeback *wb, ssize_t bytes) {
+  size_t total;
+
+  if (!wb)
+    return;
+
+  total = __atomic_add_fetch(&wb->dirty_bytes, bytes, __ATOMIC_RELAXED);
+  if (bytes > 0 && total > wb->dirty_limit / 2 && total - bytes <= wb->dirty_limit / 2) {
+    pthread_mutex_lock(&wb->lock);
+    wb->urgent = 1;
+    pthread_cond_signal(&wb->cond);
+    pthread_mutex_unlock(&wb->lock);
+  }
+}
+
+/* writeback_over_limit: Checks whether the dirty clusters of all
+   volumes using the engine take more memory than allowed, in which
+   case writers must flush their volume themselves.
+   
+   Parameters:
+     wb: write-back engine. May be NULL.
+   Returns:
+     Non-zero if the limit is exceeded, zero otherwise.
+ */
+int writeback_over_limit(writeback *wb) {
+  return wb && __atomic_load_n(&wb->dirty_bytes, __ATOMIC_RELAXED) > wb->dirty_limit;
+}
+
+/* writeback_dirty_bytes: Returns the number of bytes of dirty
+   clusters of all volumes using the engine (zero if wb is NULL). */
+size_t writeback_dirty_bytes(writeback *wb) {
+  return wb ? __atomic_load_n(&wb->dirty_bytes, __ATOMIC_RELAXED) : 0;
+}
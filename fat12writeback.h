@@ -0,0 +1,24 @@
+#ifndef _FAT12WRITEBACK_H_
+#define _FAT12WRITEBACK_H_
+
+#include "fat12.h"
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/* Default limit of the data written to all volumes that may be kept
+   in memory before it is written to the volume files, in bytes */
+#define WRITEBACK_DEFAULT_DIRTY_LIMIT (32 << 20)
+/* Default interval, in seconds, at which volumes with pending changes
+   are flushed */
+#define WRITEBACK_DEFAULT_INTERVAL 5
+
+writeback *writeback_create(unsigned int interval, size_t dirty_limit);
+void writeback_destroy(writeback *wb);
+void writeback_schedule(writeback *wb, fat12volume *volume);
+void writeback_forget(writeback *wb, fat12volume *volume);
+void writeback_account(writeback *wb, ssize_t bytes);
+int writeback_over_limit(writeback *wb);
+size_t writeback_dirty_bytes(writeback *wb);
+
+#endif
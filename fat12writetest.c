@@ -0,0 +1,523 @@
+#include "fat12.h"
+#include "fat12write.h"
+#include "fat12check.h"
+#include "fat12writeback.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+
+/* Size of the buffer used to copy the volume file */
+#define COPY_BUFFER_SIZE (1 << 16)
+/* Maximum time, in tenths of a second, the flusher thread is waited
+   for */
+#define FLUSH_WAIT 100
+
+/* Number of failed expectations */
+static int failures;
+
+/* expect: Compares the result of an operation with the expected one,
+   printing the operation if they differ. */
+static void expect(const char *operation, int rv, int expected) {
+  if (rv != expected) {
+    printf("FAIL: %s returned %d, expected %d\n", operation, rv, expected);
+    failures++;
+  }
+}
+
+/* copy_file: Copies a file into a new temporary file, whose name is
+   stored in scratch. Returns 0, or -1 on failure. */
+static int copy_file(const char *filename, char *scratch) {
+  char buffer[COPY_BUFFER_SIZE];
+  ssize_t length;
+  int in, out, rv = 0;
+
+  in = open(filename, O_RDONLY);
+  if (in < 0)
+    return -1;
+  out = mkstemp(scratch);
+  if (out < 0) {
+    close(in);
+    return -1;
+  }
+  while ((length = read(in, buffer, sizeof(buffer))) > 0)
+    if (write(out, buffer, length) != length)
+      break;
+  if (length != 0)
+    rv = -1;
+  close(in);
+  if (close(out) < 0)
+    rv = -1;
+  return rv;
+}
+
+/* check_scratch: Checks the scratch volume, which must have no errors,
+   the given number of lost clusters more than the original volume,
+   and the given number of files and directories. */
+static void check_scratch(const char *scratch, const char *stage, const check_result *original,
+			  unsigned int files, unsigned int directories, unsigned int lost) {
+  fat12volume *volume;
+  check_result result;
+
+  volume = open_volume_file(scratch);
+  if (!volume || check_volume(volume, 0, &result, NULL, NULL) < 0) {
+    printf("FAIL: %s: the volume could not be checked\n", stage);
+    failures++;
+  } else if (check_has_errors(&result) || result.lost_clusters != original->lost_clusters + lost ||
+	     result.files != files || result.directories != directories) {
+    printf("FAIL: %s: %u files, %u directories, %u errors, %u lost clusters "
+	   "(expected %u files, %u directories, %u lost clusters)\n", stage,
+	   result.files, result.directories,
+	   result.fat_mismatches + result.bad_chains + result.cross_links + result.loops +
+	   result.size_mismatches, result.lost_clusters, files, directories,
+	   original->lost_clusters + lost);
+    failures++;
+  }
+  if (volume)
+    close_volume_file(volume);
+}
+
+/* crash_extending: Extends a file by two clusters in a child process,
+   which stops right after the FAT is written, before the directory
+   entry of the file is, as if the system crashed then. Returns 0, or
+   -1 if the child failed. */
+static int crash_extending(const char *scratch, const char *path) {
+  fat12volume *volume;
+  fat12node *node;
+  char *data;
+  size_t length;
+  pid_t child;
+  int status;
+
+  child = fork();
+  if (child < 0)
+    return -1;
+  if (child == 0) {
+    volume = open_volume_file_flags(scratch, VOLUME_OPEN_WRITE);
+    if (!volume || open_node(volume, path, &node) < 0)
+      _exit(1);
+    length = 2 * volume->cluster_size * volume->sector_size;
+    data = malloc(length);
+    if (!data)
+      _exit(1);
+    memset(data, 'x', length);
+    if (write_node(volume, node, data, length, node->record.size) != (int) length)
+      _exit(1);
+    lock_volume(volume, 1);
+    status = flush_fat(volume);
+    unlock_volume(volume);
+    _exit(status < 0 ? 1 : 0);
+  }
+  if (waitpid(child, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status))
+    return -1;
+  return 0;
+}
+
+/* write_file: Writes some text into an existing file. */
+static int write_file(fat12volume *volume, const char *path, const char *text) {
+  fat12node *node;
+  int rv;
+
+  if ((rv = open_node(volume, path, &node)) < 0)
+    return rv;
+  rv = write_node(volume, node, text, strlen(text), 0);
+  if (close_node(volume, node) < 0 && rv >= 0)
+    rv = -EIO;
+  return rv < 0 ? rv : 0;
+}
+
+/* fill_pattern: Fills a buffer with bytes that depend on their
+   position and a seed, so misplaced clusters are told apart. */
+static void fill_pattern(char *buffer, size_t length, unsigned int seed) {
+  size_t i;
+
+  for (i = 0; i < length; i++)
+    buffer[i] = (char) (i * 31 + i / 251 + seed);
+}
+
+/* read_file: Reads a whole file, cluster by cluster, and compares it
+   with the expected contents. Returns 0 if they are the same, or -1
+   otherwise. */
+static int read_file(fat12volume *volume, const char *path, const char *expected,
+		     size_t size) {
+  unsigned int cluster_bytes = volume->cluster_size * volume->sector_size;
+  fat12extent *extents;
+  dir_record record;
+  size_t done = 0, count;
+  char *data;
+  int num_extents, e, rv = 0;
+  unsigned int c;
+
+  if (find_directory_record(volume, path, &record) < 0 || record.size != size)
+    return -1;
+  num_extents = get_file_extents(volume, record.first_cluster, &extents);
+  if (num_extents < 0)
+    return -1;
+  data = malloc(cluster_bytes);
+  for (e = 0; data && e < num_extents && done < size && rv == 0; e++) {
+    for (c = 0; c < extents[e].num_clusters && done < size; c++, done += count) {
+      count = size - done < cluster_bytes ? size - done : cluster_bytes;
+      if (copy_cluster(volume, extents[e].first_cluster + c, 0, count, data) != (int) count ||
+	  memcmp(data, expected + done, count)) {
+	rv = -1;
+	break;
+      }
+    }
+  }
+  if (!data || done < size)
+    rv = -1;
+  free(data);
+  free(extents);
+  return rv;
+}
+
+/* write_back_stage: Writes two files of several clusters through a
+   write-back engine. The first one is left to the flusher thread, and
+   the second one is flushed while the volume file cannot be written,
+   which must keep its data until it can. Returns 0, or -1 if the
+   stage could not be run. */
+static int write_back_stage(const char *scratch) {
+  fat12volume *volume;
+  fat12node *node;
+  writeback *wb;
+  char *data;
+  size_t cluster_bytes, size;
+  int fd, readonly, wait;
+
+  volume = open_volume_file_flags(scratch, VOLUME_OPEN_WRITE);
+  wb = writeback_create(1, WRITEBACK_DEFAULT_DIRTY_LIMIT);
+  if (!volume || !wb) {
+    if (volume)
+      close_volume_file(volume);
+    writeback_destroy(wb);
+    return -1;
+  }
+  cluster_bytes = volume->cluster_size * volume->sector_size;
+  size = 5 * cluster_bytes + cluster_bytes / 3;
+  data = malloc(size);
+  if (!data) {
+    close_volume_file(volume);
+    writeback_destroy(wb);
+    return -1;
+  }
+  volume->writeback = wb;
+
+  // unaligned writes, so clusters are written in pieces
+  fill_pattern(data, size, 1);
+  expect("create /WB1.BIN", create_entry(volume, "/WB1.BIN", 0), 0);
+  expect("open /WB1.BIN", open_node(volume, "/WB1.BIN", &node), 0);
+  expect("write /WB1.BIN", write_node(volume, node, data, cluster_bytes / 2, 0),
+	 (int) cluster_bytes / 2);
+  expect("write /WB1.BIN", write_node(volume, node, data + cluster_bytes / 2,
+				      size - cluster_bytes / 2, cluster_bytes / 2),
+	 (int) (size - cluster_bytes / 2));
+  expect("close /WB1.BIN", close_node(volume, node), 0);
+  for (wait = 0; writeback_dirty_bytes(wb) && wait < FLUSH_WAIT; wait++)
+    usleep(100000);
+  expect("flusher thread", writeback_dirty_bytes(wb) != 0, 0);
+
+  fill_pattern(data, size, 2);
+  expect("create /WB2.BIN", create_entry(volume, "/WB2.BIN", 0), 0);
+  expect("open /WB2.BIN", open_node(volume, "/WB2.BIN", &node), 0);
+  expect("write /WB2.BIN", write_node(volume, node, data, size, 0), (int) size);
+  expect("close /WB2.BIN", close_node(volume, node), 0);
+  // writes to the volume file fail while it is only open for reading
+  readonly = open(scratch, O_RDONLY);
+  lock_volume(volume, 1);
+  fd = volume->volume_fd;
+  volume->volume_fd = readonly;
+  unlock_volume(volume);
+  expect("sync (failing)", sync_volume(volume), -EIO);
+  expect("release metadata (failing)", release_volume_metadata(volume) != 0, 0);
+  expect("write error", take_write_error(volume), -EIO);
+  lock_volume(volume, 1);
+  volume->volume_fd = fd;
+  unlock_volume(volume);
+  close(readonly);
+  expect("sync", sync_volume(volume), 0);
+  writeback_forget(wb, volume);
+  close_volume_file(volume);
+  writeback_destroy(wb);
+
+  volume = open_volume_file(scratch);
+  if (volume) {
+    fill_pattern(data, size, 1);
+    expect("read /WB1.BIN", read_file(volume, "/WB1.BIN", data, size), 0);
+    fill_pattern(data, size, 2);
+    expect("read /WB2.BIN", read_file(volume, "/WB2.BIN", data, size), 0);
+    close_volume_file(volume);
+  }
+  free(data);
+  return volume ? 0 : -1;
+}
+
+/* resize_stage: Grows a file past its first cluster with writes, then
+   grows and shrinks it with truncate_node, and reads it back once the
+   volume is reopened. Returns 0, or -1 if the stage could not be
+   run. */
+static int resize_stage(const char *scratch) {
+  fat12volume *volume;
+  fat12node *node;
+  char *data;
+  size_t cluster_bytes, size;
+
+  volume = open_volume_file_flags(scratch, VOLUME_OPEN_WRITE);
+  if (!volume)
+    return -1;
+  cluster_bytes = volume->cluster_size * volume->sector_size;
+  size = 4 * cluster_bytes + 3;
+  data = malloc(6 * cluster_bytes);
+  if (!data) {
+    close_volume_file(volume);
+    return -1;
+  }
+  fill_pattern(data, 3 * cluster_bytes, 3);
+  memset(data + 3 * cluster_bytes, 0, 3 * cluster_bytes);
+
+  expect("create /GROW.BIN", create_entry(volume, "/GROW.BIN", 0), 0);
+  expect("open /GROW.BIN", open_node(volume, "/GROW.BIN", &node), 0);
+  expect("write /GROW.BIN", write_node(volume, node, data, cluster_bytes - 10, 0),
+	 (int) cluster_bytes - 10);
+  expect("write /GROW.BIN", write_node(volume, node, data + cluster_bytes - 10,
+				       2 * cluster_bytes + 10, cluster_bytes - 10),
+	 (int) (2 * cluster_bytes + 10));
+  expect("truncate /GROW.BIN (grow)", truncate_node(volume, node, 5 * cluster_bytes + 7), 0);
+  expect("truncate /GROW.BIN (shrink)", truncate_node(volume, node, size), 0);
+  expect("close /GROW.BIN", close_node(volume, node), 0);
+  expect("sync", sync_volume(volume), 0);
+  close_volume_file(volume);
+
+  volume = open_volume_file(scratch);
+  if (volume) {
+    expect("read /GROW.BIN", read_file(volume, "/GROW.BIN", data, size), 0);
+    close_volume_file(volume);
+  }
+  free(data);
+  return volume ? 0 : -1;
+}
+
+/* root_entries: Reads the root directory of a volume file into a
+   newly allocated buffer, storing the number of entries in count.
+   Returns the offset of the root directory in the file, or -1. */
+static off_t root_entries(const char *scratch, char **entries, unsigned int *count) {
+  fat12volume *volume = open_volume_file(scratch);
+  off_t offset = -1;
+  size_t length;
+
+  if (!volume)
+    return -1;
+  length = (size_t) volume->rootdir_entries * DIR_ENTRY_SIZE;
+  *entries = malloc(length);
+  if (*entries && read_data(volume, (off_t) volume->rootdir_offset * volume->sector_size,
+			    length, *entries) == length) {
+    offset = (off_t) volume->rootdir_offset * volume->sector_size;
+    *count = volume->rootdir_entries;
+  } else {
+    free(*entries);
+  }
+  close_volume_file(volume);
+  return offset;
+}
+
+/* long_entries: Counts the long name entries in use in the root
+   directory of a volume file. Returns the count, or -1. */
+static int long_entries(const char *scratch) {
+  unsigned int count, i;
+  char *entries;
+  int found = 0;
+
+  if (root_entries(scratch, &entries, &count) < 0)
+    return -1;
+  for (i = 0; i < count && entries[i * DIR_ENTRY_SIZE]; i++)
+    if ((unsigned char) entries[i * DIR_ENTRY_SIZE] != 0xe5 &&
+	entries[i * DIR_ENTRY_SIZE + 11] == ATTR_LONG_NAME)
+      found++;
+  free(entries);
+  return found;
+}
+
+/* add_long_name: Adds an empty file with a long name (of ASCII
+   characters) and the given 8.3 name, in 11-byte form, to the root
+   directory of a volume file, which must not be open. Returns 0, or
+   -1 if there is no room or the file could not be written. */
+static int add_long_name(const char *scratch, const char *name, const char *raw) {
+  unsigned int parts = (strlen(name) + LONG_NAME_UNITS - 1) / LONG_NAME_UNITS;
+  unsigned int length = strlen(name), count, first, i, j, k, c, at, unit;
+  unsigned char checksum = 0;
+  char *entries, *entry;
+  off_t offset;
+  int fd, rv = -1;
+
+  if ((offset = root_entries(scratch, &entries, &count)) < 0)
+    return -1;
+  // the entries go in the first run of free ones that is long enough
+  for (first = 0, i = 0; i < count && i - first < parts + 1; i++)
+    if (entries[i * DIR_ENTRY_SIZE] && (unsigned char) entries[i * DIR_ENTRY_SIZE] != 0xe5)
+      first = i + 1;
+  if (i - first == parts + 1) {
+    for (k = 0; k < 11; k++)
+      checksum = ((checksum & 1) << 7) + (checksum >> 1) + (unsigned char) raw[k];
+    for (j = 0; j < parts; j++) {
+      // the last part of the name goes first
+      entry = entries + (first + j) * DIR_ENTRY_SIZE;
+      memset(entry, 0, DIR_ENTRY_SIZE);
+      entry[0] = (parts - j) | (j == 0 ? 0x40 : 0);
+      entry[11] = ATTR_LONG_NAME;
+      entry[13] = checksum;
+      // the name is terminated by a zero unit, and padded with 0xffff
+      for (k = 0; k < LONG_NAME_UNITS; k++) {
+	c = (parts - j - 1) * LONG_NAME_UNITS + k;
+	unit = c < length ? (unsigned char) name[c] : c == length ? 0 : 0xffff;
+	at = k < 5 ? 1 + 2 * k : k < 11 ? 14 + 2 * (k - 5) : 28 + 2 * (k - 11);
+	entry[at] = unit & 0xff;
+	entry[at + 1] = unit >> 8;
+      }
+    }
+    entry = entries + (first + parts) * DIR_ENTRY_SIZE;
+    memset(entry, 0, DIR_ENTRY_SIZE);
+    memcpy(entry, raw, 11);
+    entry[11] = ATTR_ARCHIVE;
+
+    fd = open(scratch, O_WRONLY);
+    if (fd >= 0) {
+      if (pwrite(fd, entries + first * DIR_ENTRY_SIZE, (parts + 1) * DIR_ENTRY_SIZE,
+		 offset + first * DIR_ENTRY_SIZE) == (ssize_t) ((parts + 1) * DIR_ENTRY_SIZE))
+	rv = 0;
+      if (close(fd) < 0)
+	rv = -1;
+    }
+  }
+  free(entries);
+  return rv;
+}
+
+int main(int argc, char *argv[]) {
+
+  char scratch[] = "/tmp/fat12writetest.XXXXXX";
+  fat12volume *volume;
+  check_result original;
+  dir_record record;
+  unsigned int files, directories;
+  int long_names;
+
+  if (argc != 2) {
+    fprintf(stderr, "Usage: %s volume_file\n"
+	    "Runs create, rename and unlink operations on a scratch copy of the volume,\n"
+	    "and checks the copy after each stage.\n", argv[0]);
+    return 1;
+  }
+  if (copy_file(argv[1], scratch) < 0) {
+    perror(argv[1]);
+    return 1;
+  }
+
+  volume = open_volume_file(scratch);
+  if (!volume || check_volume(volume, 0, &original, NULL, NULL) < 0 ||
+      check_has_errors(&original)) {
+    fprintf(stderr, "%s: invalid volume file, or one with errors.\n", argv[1]);
+    if (volume)
+      close_volume_file(volume);
+    unlink(scratch);
+    return 1;
+  }
+  files = original.files;
+  directories = original.directories;
+  close_volume_file(volume);
+
+  // create a tree: /D1/A.TXT and /D1/SUB
+  volume = open_volume_file_flags(scratch, VOLUME_OPEN_WRITE);
+  if (!volume) {
+    fprintf(stderr, "%s: the scratch copy could not be opened for writing.\n", scratch);
+    unlink(scratch);
+    return 1;
+  }
+  expect("create /D1", create_entry(volume, "/D1", ATTR_DIRECTORY), 0);
+  expect("create /D1/A.TXT", create_entry(volume, "/D1/A.TXT", 0), 0);
+  expect("write /D1/A.TXT", write_file(volume, "/D1/A.TXT", "hello, world\n"), 0);
+  expect("create /D1/SUB", create_entry(volume, "/D1/SUB", ATTR_DIRECTORY), 0);
+  expect("create /d1/a.txt", create_entry(volume, "/d1/a.txt", 0), -EEXIST);
+  expect("sync", sync_volume(volume), 0);
+  close_volume_file(volume);
+  check_scratch(scratch, "create", &original, files + 1, directories + 2, 0);
+
+  // directories cannot be moved into themselves, whatever the case
+  // of the names in the destination path
+  volume = open_volume_file_flags(scratch, VOLUME_OPEN_WRITE);
+  expect("rename /D1 /D1/LOOP", rename_entry(volume, "/D1", "/D1/LOOP"), -EINVAL);
+  expect("rename /D1 /d1/LOOP", rename_entry(volume, "/D1", "/d1/LOOP"), -EINVAL);
+  expect("rename /D1 /d1/Sub/LOOP", rename_entry(volume, "/D1", "/d1/Sub/LOOP"), -EINVAL);
+  expect("rename /D1 /D1", rename_entry(volume, "/D1", "/D1"), 0);
+  // move the file and the subdirectory out, and then the old parent
+  // into the subdirectory
+  expect("rename /D1/A.TXT /D1/SUB/B.TXT", rename_entry(volume, "/D1/A.TXT", "/D1/SUB/B.TXT"), 0);
+  expect("rename /D1/SUB /S2", rename_entry(volume, "/D1/SUB", "/S2"), 0);
+  expect("rename /D1 /s2/D1", rename_entry(volume, "/D1", "/s2/D1"), 0);
+  expect("rename /S2 /s2/d1/LOOP", rename_entry(volume, "/S2", "/s2/d1/LOOP"), -EINVAL);
+  expect("rename /s2 /S3", rename_entry(volume, "/s2", "/S3"), 0);
+  expect("lookup /S3/D1", find_directory_record(volume, "/S3/D1", &record), 0);
+  expect("lookup /S3/B.TXT", find_directory_record(volume, "/S3/B.TXT", &record), 0);
+  expect("sync", sync_volume(volume), 0);
+  close_volume_file(volume);
+  check_scratch(scratch, "rename", &original, files + 1, directories + 2, 0);
+
+  // remove everything again
+  volume = open_volume_file_flags(scratch, VOLUME_OPEN_WRITE);
+  expect("rmdir /S3", remove_entry(volume, "/S3", 1), -ENOTEMPTY);
+  expect("unlink /S3/B.TXT", remove_entry(volume, "/S3/B.TXT", 0), 0);
+  expect("unlink /S3/D1", remove_entry(volume, "/S3/D1", 0), -EISDIR);
+  expect("rmdir /S3/D1", remove_entry(volume, "/S3/D1", 1), 0);
+  expect("rmdir /s3", remove_entry(volume, "/s3", 1), 0);
+  expect("lookup /S3", find_directory_record(volume, "/S3", &record), -ENOENT);
+  expect("sync", sync_volume(volume), 0);
+  close_volume_file(volume);
+  check_scratch(scratch, "unlink", &original, files, directories, 0);
+
+  expect("write-back", write_back_stage(scratch), 0);
+  check_scratch(scratch, "write-back", &original, files + 2, directories, 0);
+
+  expect("resize", resize_stage(scratch), 0);
+  check_scratch(scratch, "resize", &original, files + 3, directories, 0);
+
+  // the long name entries of a file go away with the file, or with
+  // its old name when it is renamed
+  long_names = long_entries(scratch);
+  expect("add /Long name of a file.txt",
+	 add_long_name(scratch, "Long name of a file.txt", "LONGNA~1TXT"), 0);
+  expect("add /Another long name.txt",
+	 add_long_name(scratch, "Another long name.txt", "ANOTHE~1TXT"), 0);
+  expect("long name entries", long_entries(scratch), long_names + 4);
+  volume = open_volume_file_flags(scratch, VOLUME_OPEN_WRITE);
+  expect("lookup /long name of a FILE.txt",
+	 find_directory_record(volume, "/long name of a FILE.txt", &record), 0);
+  expect("rename /Long name of a file.txt /RENAMED.TXT",
+	 rename_entry(volume, "/Long name of a file.txt", "/RENAMED.TXT"), 0);
+  expect("lookup /Long name of a file.txt",
+	 find_directory_record(volume, "/Long name of a file.txt", &record), -ENOENT);
+  expect("lookup /RENAMED.TXT", find_directory_record(volume, "/RENAMED.TXT", &record), 0);
+  expect("unlink /another long name.txt", remove_entry(volume, "/another long name.txt", 0), 0);
+  expect("lookup /ANOTHE~1.TXT", find_directory_record(volume, "/ANOTHE~1.TXT", &record),
+	 -ENOENT);
+  expect("sync", sync_volume(volume), 0);
+  close_volume_file(volume);
+  expect("long name entries", long_entries(scratch), long_names);
+  check_scratch(scratch, "long names", &original, files + 4, directories, 0);
+
+  // a crash after a file is extended in the FAT, but before its entry
+  // is written, leaves clusters past its size, which are only lost
+  // space
+  volume = open_volume_file_flags(scratch, VOLUME_OPEN_WRITE);
+  expect("create /CRASH.TXT", create_entry(volume, "/CRASH.TXT", 0), 0);
+  expect("write /CRASH.TXT", write_file(volume, "/CRASH.TXT", "hello, world\n"), 0);
+  expect("sync", sync_volume(volume), 0);
+  close_volume_file(volume);
+  expect("extend /CRASH.TXT", crash_extending(scratch, "/CRASH.TXT"), 0);
+  check_scratch(scratch, "crash", &original, files + 5, directories, 2);
+
+  unlink(scratch);
+  printf("%s: %s\n", argv[1], failures ? "FAILED" : "OK");
+  return failures ? 1 : 0;
+}